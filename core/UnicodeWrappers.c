@@ -362,9 +362,82 @@ int32_t	FastRelString( ConstStr255Param str1, ConstStr255Param str2 )
 //		else
 //			return 1;
 //
+//	Both compares first skip the longest common prefix four code units at a time
+//	(UnicodeCommonPrefix).  For FastUnicodeCompare a unit pair belongs to the prefix
+//	when the units are identical, or differ only in ASCII case: either way they fold
+//	to the same character (or are both ignored), so the table walk over the rest gives
+//	the same result as over the whole strings.  Non-ASCII case pairs and ignorable
+//	characters are left to the table walk.
+//
+//	This runs in the kernel, so it works on 64-bit words rather than vector registers.
+//
+
+#define UNI_LANES(x)	((x) * 0x0001000100010001ULL)
+
+/* Fold 'A'..'Z' to 'a'..'z' in each of the four 16-bit lanes of w */
+static inline u_int64_t
+UnicodeFoldASCIILanes(u_int64_t w)
+{
+	/* Work on the low 15 bits of each lane so the adds can't carry into the next one */
+	u_int64_t low = w & UNI_LANES(0x7FFF);
+	u_int64_t ge_A = low + UNI_LANES(0x8000 - 'A');
+	u_int64_t gt_Z = low + UNI_LANES(0x8000 - 'Z' - 1);
+	u_int64_t upper = ge_A & ~gt_Z & ~w & UNI_LANES(0x8000);
+
+	return w | (upper >> 10);	/* 0x8000 >> 10 == 0x20 */
+}
+
+/*
+ * Return the number of leading code units (at most length) that str1 and str2 have
+ * in common, comparing ASCII letters case insensitively if foldASCII is set.
+ */
+static inline ItemCount
+UnicodeCommonPrefix(ConstUniCharArrayPtr str1, ConstUniCharArrayPtr str2, ItemCount length, int foldASCII)
+{
+	ItemCount i = 0;
+
+	for (; i + 4 <= length; i += 4) {
+		u_int64_t w1, w2;
+
+		__builtin_memcpy(&w1, &str1[i], sizeof(w1));
+		__builtin_memcpy(&w2, &str2[i], sizeof(w2));
+		if (foldASCII) {
+			w1 = UnicodeFoldASCIILanes(w1);
+			w2 = UnicodeFoldASCIILanes(w2);
+		}
+		if (w1 != w2)
+			break;	/* the loop below finds the unit */
+	}
+
+	for (; i < length; i++) {
+		u_int16_t c1 = str1[i];
+		u_int16_t c2 = str2[i];
+
+		if (foldASCII) {
+			if (c1 >= 'A' && c1 <= 'Z') c1 |= 0x20;
+			if (c2 >= 'A' && c2 <= 'Z') c2 |= 0x20;
+		}
+		if (c1 != c2)
+			break;
+	}
+
+	return i;
+}
+
+static int32_t FastUnicodeCompareTable(ConstUniCharArrayPtr str1, ItemCount length1,
+							ConstUniCharArrayPtr str2, ItemCount length2);
 
 int32_t FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
 							register ConstUniCharArrayPtr str2, register ItemCount length2)
+{
+	ItemCount prefix = UnicodeCommonPrefix(str1, str2, (length1 < length2) ? length1 : length2, 1);
+
+	return FastUnicodeCompareTable(str1 + prefix, length1 - prefix, str2 + prefix, length2 - prefix);
+}
+
+/* The table walk alone; FastUnicodeCompare must always agree with it. */
+static int32_t FastUnicodeCompareTable ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+							register ConstUniCharArrayPtr str2, register ItemCount length2)
 {
 	register u_int16_t		c1,c2;
 	register u_int16_t		temp;
@@ -442,6 +515,7 @@ int32_t UnicodeBinaryCompare (register ConstUniCharArrayPtr str1, register ItemC
 	uint16_t c1;
 	uint16_t c2;
 	int string_length;
+	int prefix;
 	int32_t result = 0;
 	
 	/* Set default values for the two character pointers */
@@ -461,7 +535,12 @@ int32_t UnicodeBinaryCompare (register ConstUniCharArrayPtr str1, register ItemC
 		string_length = len1;
 	}
 
-	/* now compare the two string pointers */
+	/* skip the common prefix, then compare the two string pointers */
+	prefix = (int)UnicodeCommonPrefix(str1, str2, string_length, 0);
+	str1 += prefix;
+	str2 += prefix;
+	string_length -= prefix;
+
 	while (string_length--) {
 		c1 = *(str1++);
 		c2 = *(str2++);
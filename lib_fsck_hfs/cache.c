@@ -113,6 +113,14 @@ static int LRUDestroy (LRU_t *lru);
  */
 static int LRUHit (LRU_t *lru, LRUNode_t *node, int age);
 
+/*
+ * LRUInsert
+ *
+ *  Inserts a node that is not in the LRU at its end, where it will be the
+ *  next one evicted unless it gets referenced.
+ */
+static void LRUInsert (LRU_t *lru, LRUNode_t *node);
+
 /*
  * LRUEvict
  *
@@ -132,6 +140,20 @@ static int LRUEvict (LRU_t *lru, LRUNode_t *node);
  */
 static int LRURemove (LRU_t *lru, LRUNode_t *node);
 
+/*
+ * CacheHash
+ *
+ *  Returns the hash bucket of a cache block.  Offsets are multiples of the
+ *  block size, so the block number is mixed (Fibonacci hashing) rather than
+ *  just reduced modulo the table size.
+ */
+static inline uint32_t CacheHash (Cache_t *cache, uint64_t off)
+{
+	uint64_t	blkno = off / cache->BlockSize;
+
+	return ((uint32_t)((blkno * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->HashSize - 1));
+}
+
 /*
  * CalculateCacheSizes
  *
@@ -223,8 +245,20 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 	cache->FD_R = fdRead;
 	cache->FD_W = fdWrite;
 	cache->DevBlockSize = devBlockSize;
+	/*
+	 * One hash bucket per cache block, so that chains stay short even
+	 * with the largest caches.  CacheHash needs a power of 2.
+	 */
+	if (hashSize < cacheTotalBlocks)
+		hashSize = cacheTotalBlocks;
+	for (i = CacheHashSize; i < hashSize; i <<= 1)
+		;
+	hashSize = i;
+
 	/* CacheFlush requires cleared cache->Hash  */
 	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
+	if (cache->Hash == NULL)
+		return (ENOMEM);
 	cache->HashSize = hashSize;
 	cache->BlockSize = cacheBlockSize;
 
@@ -332,6 +366,7 @@ int CacheDestroy (Cache_t *cache)
 	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Reads:     %d\n", cache->DiskRead);
 	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Writes:    %d\n", cache->DiskWrite);
 	fsck_print(ctx, LOG_TYPE_INFO, "\tSpans:          %d\n", cache->Span);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tRead Ahead:     %d\n", cache->ReadAhead);
 #endif	
 	/* Shutdown the LRU */
 	LRUDestroy (&cache->LRU);
@@ -767,11 +802,11 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 	if (tag->Prev != NULL)
 		tag->Prev->Next = tag->Next;
 	else
-		cache->Hash[tag->Offset % cache->HashSize] = tag->Next;
+		cache->Hash[CacheHash(cache, tag->Offset)] = tag->Next;
 
 	/* Make sure the head node doesn't have a back pointer */
-	if ((cache->Hash[tag->Offset % cache->HashSize] != NULL) &&
-	    (cache->Hash[tag->Offset % cache->HashSize]->Prev != NULL)) {
+	if ((cache->Hash[CacheHash(cache, tag->Offset)] != NULL) &&
+	    (cache->Hash[CacheHash(cache, tag->Offset)]->Prev != NULL)) {
 #if CACHE_DEBUG
 		fsck_print(ctx, LOG_TYPE_INFO, "ERROR: CacheRemove: Corrupt hash chain\n");
 #endif
@@ -950,8 +985,13 @@ CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove)
 			/* Keep track of the next block, in case we remove the current block */
 			nextTag = currentTag->Next;
 
-			if ( currentTag->Flags & kLazyWrite &&
-				 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
+			if ( !RangeIntersect(currentTag->Offset, cache->BlockSize, start, len) )
+			{
+				currentTag = nextTag;
+				continue;
+			}
+
+			if ( currentTag->Flags & kLazyWrite )
 			{
 				error = CacheRawWrite( cache,
 									   currentTag->Offset,
@@ -965,10 +1005,11 @@ CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove)
 					return error;
 				}
 				currentTag->Flags &= ~kLazyWrite;
-
-				if ( remove && ((currentTag->Flags & kLockWrite) == 0))
-					CacheRemove ( cache, currentTag );
 			}
+
+			/* Clean blocks go too, they may have been read ahead of a direct write */
+			if ( remove && ((currentTag->Flags & kLockWrite) == 0))
+				CacheRemove ( cache, currentTag );
 			
 			currentTag = nextTag;
 		} /* while */
@@ -1229,6 +1270,100 @@ out:
 	return error;
 }
 
+/*
+ * CacheReadAhead
+ *
+ *  Reads the cache block of tag from disk.  If the read continues the previous
+ *  one, as when fsck scans a B-tree or the allocation bitmap, the blocks that
+ *  follow are read in the same I/O, doubling the read-ahead on every sequential
+ *  miss up to CacheReadAheadBlocks.  Read-ahead stops at the first block that
+ *  is already cached, and read-ahead blocks are put at the end of the LRU, so
+ *  they are the first ones evicted if the scan never gets to them.
+ */
+static int CacheReadAhead (Cache_t *cache, Tag_t *tag)
+{
+	struct iovec	iov[CacheReadAheadBlocks + 1];
+	uint64_t		off = tag->Offset;
+	uint64_t		next;
+	uint32_t		count;
+	uint32_t		i;
+	ssize_t			nread;
+	Tag_t *			temp;
+
+	if (off == cache->SeqNext)
+		cache->SeqWindow = (cache->SeqWindow == 0) ? 2 :
+		    ((cache->SeqWindow * 2 > CacheReadAheadBlocks) ? CacheReadAheadBlocks : cache->SeqWindow * 2);
+	else
+		cache->SeqWindow = 0;
+
+	iov[0].iov_base = tag->Buffer;
+	iov[0].iov_len = cache->BlockSize;
+
+	for (count = 1; count <= cache->SeqWindow; count++) {
+		next = off + (uint64_t)count * cache->BlockSize;
+
+		for (temp = cache->Hash[CacheHash(cache, next)]; temp != NULL; temp = temp->Next) {
+			if (temp->Offset == next) break;
+		}
+		if (temp != NULL) break;
+
+		/* Only take blocks that are free, or held by unused read-ahead */
+		iov[count].iov_base = CacheAllocBlock (cache);
+		if (iov[count].iov_base == NULL) {
+			if (LRUEvict (&cache->LRU, (LRUNode_t *)tag) != EOK) break;
+			iov[count].iov_base = CacheAllocBlock (cache);
+			if (iov[count].iov_base == NULL) break;
+		}
+		iov[count].iov_len = cache->BlockSize;
+	}
+
+	if (count > 1 && (off % cache->DevBlockSize) == 0) {
+		nread = preadv (cache->FD_R, iov, count, off);
+	} else {
+		nread = -1;
+	}
+
+	if (nread <= 0) {
+		/* Give the read-ahead blocks back, and read the block alone */
+		for (i = 1; i < count; i++) {
+			cache->FreeBlockPtrs[--cache->ActiveBlocks] = iov[i].iov_base;
+		}
+		if (count > 1)
+			cache->SeqWindow = 0;
+		cache->SeqNext = off + cache->BlockSize;
+		return (CacheRawRead (cache, off, cache->BlockSize, tag->Buffer));
+	}
+	cache->DiskRead++;
+
+	for (i = 1; i < count; i++) {
+		/* Blocks past the end of the device are not cached */
+		if ((uint64_t)nread < (uint64_t)(i + 1) * cache->BlockSize) {
+			cache->FreeBlockPtrs[--cache->ActiveBlocks] = iov[i].iov_base;
+			continue;
+		}
+
+		temp = (Tag_t *)calloc (sizeof (Tag_t), 1);
+		if (temp == NULL) {
+			cache->FreeBlockPtrs[--cache->ActiveBlocks] = iov[i].iov_base;
+			continue;
+		}
+		temp->Offset = off + (uint64_t)i * cache->BlockSize;
+		temp->Buffer = iov[i].iov_base;
+
+		next = CacheHash(cache, temp->Offset);
+		temp->Next = cache->Hash[next];
+		if (temp->Next != NULL)
+			temp->Next->Prev = temp;
+		cache->Hash[next] = temp;
+
+		LRUInsert (&cache->LRU, (LRUNode_t *)temp);
+		cache->ReadAhead++;
+	}
+
+	cache->SeqNext = off + (uint64_t)count * cache->BlockSize;
+	return (EOK);
+}
+
 /*
  * CacheLookup
  *
@@ -1238,7 +1373,7 @@ out:
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 {
 	Tag_t *		temp;
-	uint32_t	hash = off % cache->HashSize;
+	uint32_t	hash = CacheHash(cache, off);
 	int			error;
 
 	*tag = NULL;
@@ -1300,8 +1435,8 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 			}
 		}
 
-		/* Load the block from disk */
-		error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
+		/* Load the block from disk, with the ones that follow if this continues a scan */
+		error = CacheReadAhead (cache, temp);
 		if (error != EOK) return (error);
 	}
 
@@ -1456,6 +1591,20 @@ static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 	return (EOK);
 }
 
+/*
+ * LRUInsert
+ *
+ *  Inserts a node that is not in the LRU at its end.
+ */
+static void LRUInsert (LRU_t *lru, LRUNode_t *node)
+{
+	node->Next = &lru->Head;
+	node->Prev = lru->Head.Prev;
+
+	node->Next->Prev = node;
+	node->Prev->Next = node;
+}
+
 /*
  * LRUEvict
  *
@@ -1515,14 +1664,12 @@ static int LRURemove (__unused LRU_t *lru, LRUNode_t *node)
         return (EBUSY);
 
     /* Detach the node */
-    if (node->Next != NULL) {
+    if ((node->Next != NULL) && (node->Prev != NULL)) {
         node->Next->Prev = node->Prev;
-        node->Next = NULL;
-    }
-    if (node->Prev != NULL) {
         node->Prev->Next = node->Next;
-        node->Prev = NULL;
     }
+    node->Next = NULL;
+    node->Prev = NULL;
 
     return (EOK);
 }
@@ -51,7 +51,10 @@ enum {
 #endif
 	/* MaxCacheSize will be 3G for 64-bit, and 1G for 32-bit */
 	MaxCacheSize			=	((unsigned)MaxCacheBlockSize * MaxCacheBlocks),
-	CacheHashSize			=	257,		/* prime number */
+	CacheHashSize			=	256,		/* minimum, the table is sized to the cache */
+
+	/* Maximum number of cache blocks read ahead of a sequential scan */
+	CacheReadAheadBlocks	=	16,			/* 512K */
 };
 
 /*
@@ -143,7 +146,7 @@ typedef struct Cache_t
 	uint32_t	DevBlockSize;	/* Device block size */
 	
 	Tag_t **	Hash;		/* Lookup hash table (move to front) */
-	uint32_t	HashSize;	/* Size of the hash table */
+	uint32_t	HashSize;	/* Size of the hash table, a power of 2 */
 	uint32_t	BlockSize;	/* Size of the cache page */
 
 	void *		CacheBlocks;/* Allocated space for the cache */
@@ -161,9 +164,13 @@ typedef struct Cache_t
 	uint32_t	DiskWrite;	/* Number of actual disk writes */
 
 	uint32_t	Span;		/* Requests that spanned cache blocks */
+
+	uint64_t	SeqNext;	/* Offset that continues the last disk read */
+	uint32_t	SeqWindow;	/* Current read-ahead, in cache blocks */
+	uint32_t	ReadAhead;	/* Number of cache blocks read ahead */
 } Cache_t;
 
-extern Cache_t fscache;
+extern __thread Cache_t fscache;
 
 /*
  * CalculateCacheSizes
@@ -176,7 +183,8 @@ void CalculateCacheSizes(uint64_t userCacheSize, uint32_t *calcBlockSize, uint32
 /*
  * CacheInit
  *
- *  Initializes the cache for use.
+ *  Initializes the cache for use.  hashSize is the minimum size of the
+ *  lookup hash table, which gets one bucket per cache block.
  */
 int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
                uint32_t cacheBlockSize, uint32_t cacheSize, uint32_t hashSize,
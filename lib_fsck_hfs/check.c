@@ -17,16 +17,16 @@ int     reply __P((char *question));
 static int printStatus;
 static void siginfo(int signo);
 
-Cache_t fscache;
+__thread Cache_t fscache;
 
 /*
  * Variables used to map physical block numbers to file paths
  */
 enum        { BLOCK_LIST_INCREMENT = 512 };
-int         gBlkListEntries = 0;
-u_int64_t*  gBlockList = NULL;
-int         gFoundBlockEntries = 0;
-struct      found_blocks *gFoundBlocksList = NULL;
+__thread int         gBlkListEntries = 0;
+__thread u_int64_t*  gBlockList = NULL;
+__thread int         gFoundBlockEntries = 0;
+__thread struct      found_blocks *gFoundBlocksList = NULL;
 
 int checkfilesys(char * filesys)
 {
@@ -92,8 +92,14 @@ typedef struct fsck_state {
 } fsck_state_t;
 
 
-fsck_state_t state;
-lib_fsck_ctx_t ctx;
+/*
+ * The state of a check, and every other global of the library, is thread
+ * local: each thread that runs fsck_init_state() and checkfilesys() (or
+ * CheckHFS) checks its own volume, so several volumes can be checked in
+ * parallel by one process.
+ */
+extern __thread fsck_state_t state;
+extern __thread lib_fsck_ctx_t ctx;
 
 
 void fsck_print(lib_fsck_ctx_t c, LogMessageType type, const char *fmt, ...);
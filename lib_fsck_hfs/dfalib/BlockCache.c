@@ -27,7 +27,7 @@
 
 
 
-extern Cache_t fscache;
+extern __thread Cache_t fscache;
 
 
 static OSStatus  ReadFragmentedBlock (SFCB *file, UInt32 blockNum, BlockDescriptor *block);
@@ -48,9 +48,9 @@ struct CatalogIterationSummary {
 };
 
 /* Globals used during Catalog record checks */
-struct CatalogIterationSummary gCIS;
+__thread struct CatalogIterationSummary gCIS;
 
-SGlobPtr gScavGlobals;
+__thread SGlobPtr gScavGlobals;
 
 /* Local routines for checking catalog structures */
 static int  CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key,
@@ -338,8 +338,8 @@ struct filelink_hash {
 	struct filelink_hash *next;
 };
 
-struct filelink_hash **filelink_head = NULL;
-UInt32 filelink_entry_count = 0;
+__thread struct filelink_hash **filelink_head = NULL;
+__thread UInt32 filelink_entry_count = 0;
 
 /* Search and return pointer to the entry for given inode ID.
  * If no entry is found, return NULL.
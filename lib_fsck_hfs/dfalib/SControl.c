@@ -61,7 +61,7 @@
  */
 extern const unsigned char fsck_hfsVersionString[];
 
-int gGUIControl;
+__thread int gGUIControl;
 extern char lflag;
 
 
@@ -80,7 +80,7 @@ int cancelProc(UInt16 progress, UInt16 secondsRemaining, Boolean progressChanged
         int base;
         int pct;
         int scale;
-        static int lastPct = -1;
+        static __thread int lastPct = -1;
         if (passno < 0) {
             base = 0;
             scale = 100;
@@ -211,7 +211,7 @@ External
 
 ------------------------------------------------------------------------------*/
 
-static jmp_buf				envBuf;
+static __thread jmp_buf		envBuf;
 int
 CheckHFS( const char *rdevnode, int fsReadRef, int fsWriteRef, int checkLevel, 
 	  int repairLevel, lib_fsck_ctx_t fsckContext, int lostAndFoundMode,
@@ -1422,6 +1422,8 @@ static int ScavTerm( SGlobPtr GPtr )
 	if( GPtr->validFilesList != nil )
 		DisposeHandle( (Handle) GPtr->validFilesList );
 	
+	DisposeOverlapIndex(GPtr);
+
 	if( GPtr->overlappedExtents != nil ) {
  		extentsTableH = GPtr->overlappedExtents;
  	
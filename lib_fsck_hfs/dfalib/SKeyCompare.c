@@ -27,9 +27,17 @@
 #include "BTree.h"
 #include "CaseFolding.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__arm64__)
+#include <arm_neon.h>
+#endif
+
 
 SInt32 FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
 							register ConstUniCharArrayPtr str2, register ItemCount length2);
+static SInt32 FastUnicodeCompareTable ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+									register ConstUniCharArrayPtr str2, register ItemCount length2);
 
 //_______________________________________________________________________
 //
@@ -149,9 +157,84 @@ SInt32	FastRelString( ConstStr255Param str1, ConstStr255Param str2 )
 //		else
 //			return 1;
 //
+//	Both FastUnicodeCompare and CaseSensitiveCatalogKeyCompare first skip the longest
+//	common prefix a block of code units at a time (UnicodeCommonPrefix).  For
+//	FastUnicodeCompare a unit pair belongs to the prefix when the units are identical,
+//	or differ only in ASCII case: either way they fold to the same character (or are
+//	both ignored), so the table walk over the rest gives the same result as over the
+//	whole strings.  Non-ASCII case pairs and ignorable characters are left to the table.
+//
+
+static inline ItemCount
+UnicodeCommonPrefix(ConstUniCharArrayPtr str1, ConstUniCharArrayPtr str2, ItemCount length, Boolean foldASCII)
+{
+	ItemCount i = 0;
+
+#if defined(__SSE2__)
+	const __m128i vA = _mm_set1_epi16(0x0040);
+	const __m128i vZ = _mm_set1_epi16(0x005B);
+	const __m128i vCase = _mm_set1_epi16(0x0020);
+
+	for (; i + 8 <= length; i += 8) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)&str1[i]);
+		__m128i v2 = _mm_loadu_si128((const __m128i *)&str2[i]);
+		UInt32 diff;
+
+		if (foldASCII) {
+			/* Units >= 0x8000 compare negative, so they are never taken for 'A'..'Z' */
+			v1 = _mm_or_si128(v1, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(v1, vA), _mm_cmplt_epi16(v1, vZ)), vCase));
+			v2 = _mm_or_si128(v2, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(v2, vA), _mm_cmplt_epi16(v2, vZ)), vCase));
+		}
+
+		diff = ~(UInt32)_mm_movemask_epi8(_mm_cmpeq_epi16(v1, v2)) & 0xFFFF;
+		if (diff)
+			return i + (__builtin_ctz(diff) >> 1);
+	}
+#elif defined(__ARM_NEON) && defined(__arm64__)
+	const uint16x8_t vA = vdupq_n_u16(0x0041);
+	const uint16x8_t vZ = vdupq_n_u16(0x005A);
+	const uint16x8_t vCase = vdupq_n_u16(0x0020);
+
+	for (; i + 8 <= length; i += 8) {
+		uint16x8_t v1 = vld1q_u16(&str1[i]);
+		uint16x8_t v2 = vld1q_u16(&str2[i]);
+
+		if (foldASCII) {
+			v1 = vorrq_u16(v1, vandq_u16(vandq_u16(vcgeq_u16(v1, vA), vcleq_u16(v1, vZ)), vCase));
+			v2 = vorrq_u16(v2, vandq_u16(vandq_u16(vcgeq_u16(v2, vA), vcleq_u16(v2, vZ)), vCase));
+		}
+
+		if (vminvq_u16(vceqq_u16(v1, v2)) != 0xFFFF)
+			break;	/* the loop below finds the unit */
+	}
+#endif
+
+	for (; i < length; i++) {
+		UInt16 c1 = str1[i];
+		UInt16 c2 = str2[i];
+
+		if (foldASCII) {
+			if (c1 >= 'A' && c1 <= 'Z') c1 |= 0x20;
+			if (c2 >= 'A' && c2 <= 'Z') c2 |= 0x20;
+		}
+		if (c1 != c2)
+			break;
+	}
+
+	return i;
+}
 
 SInt32 FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
 							register ConstUniCharArrayPtr str2, register ItemCount length2)
+{
+	ItemCount prefix = UnicodeCommonPrefix(str1, str2, (length1 < length2) ? length1 : length2, true);
+
+	return FastUnicodeCompareTable(str1 + prefix, length1 - prefix, str2 + prefix, length2 - prefix);
+}
+
+/* The table walk alone; FastUnicodeCompare must always agree with it. */
+static SInt32 FastUnicodeCompareTable ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+									register ConstUniCharArrayPtr str2, register ItemCount length2)
 {
 	register UInt16 c1,c2;
 	register UInt16 temp;
@@ -294,6 +377,7 @@ CaseSensitiveCatalogKeyCompare(HFSPlusCatalogKey *searchKey, HFSPlusCatalogKey *
 		int length2 = trialKey->nodeName.length;
 		UInt16 c1, c2;
 		int length;
+		int prefix;
 	
 		if (length1 < length2) {
 			length = length1;
@@ -304,6 +388,11 @@ CaseSensitiveCatalogKeyCompare(HFSPlusCatalogKey *searchKey, HFSPlusCatalogKey *
 		} else {
 			length = length1;
 		}
+
+		prefix = (int)UnicodeCommonPrefix(str1, str2, length, false);
+		str1 += prefix;
+		str2 += prefix;
+		length -= prefix;
 	
 		while (length--) {
 			c1 = *(str1++);
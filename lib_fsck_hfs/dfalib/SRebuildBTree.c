@@ -43,6 +43,37 @@ extern void MyIndirectLog(const char *);
 #include "Scavenger.h"
 #include "cache.h"
 
+/*
+ * Leaf records of the B-tree being rebuilt.
+ *
+ * BTScanNextRecord returns the records in the physical order of the old
+ * nodes, which is not key order, so they are copied here and sorted before
+ * the new tree is bulk loaded.  Records are packed into kRebuildChunkSize
+ * chunks; each one is a RebuildRecord followed by its key and data.
+ */
+typedef struct RebuildRecord {
+	UInt16		keySize;		/* including the key length field */
+	UInt16		dataSize;
+} RebuildRecord;
+
+#define RebuildRecordKey(r)		((BTreeKeyPtr)((UInt8 *)(r) + sizeof(RebuildRecord)))
+#define RebuildRecordData(r)	((void *)((UInt8 *)(r) + sizeof(RebuildRecord) + (r)->keySize))
+
+typedef struct RebuildRecords {
+	RebuildRecord **	records;
+	UInt32				count;
+	UInt32				capacity;
+	UInt8 **			chunks;
+	UInt32				chunkCount;
+	UInt32				chunkCapacity;
+	UInt32				chunkUsed;		/* bytes used in the last chunk */
+} RebuildRecords;
+
+enum {
+	kRebuildChunkSize		= 1024 * 1024,
+	kRebuildInitialRecords	= 4096
+};
+
 /* internal routine prototypes */
 
 /*static*/ OSErr 	CreateNewBTree( SGlobPtr theSGlobPtr, int FileID );
@@ -60,6 +91,14 @@ static OSErr ValidateExtentRecordLength (SGlobPtr s, ExtentRecord * theRecPtr, U
 static OSErr 	WriteMapNodes(  BTreeControlBlock * theBTreeCBPtr, 
 								UInt32 				theFirstMapNode, 
 								UInt32 				theNodeCount );
+static OSErr	AddRebuildRecord(	RebuildRecords *	theRecordsPtr,
+									BTreeControlBlock *	theBTreeCBPtr,
+									BTreeKeyPtr			theKeyPtr,
+									void *				theDataPtr,
+									UInt32				theDataSize );
+static void		DisposeRebuildRecords( RebuildRecords * theRecordsPtr );
+static OSErr	InsertRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecordsPtr );
+static OSErr	BulkLoadBTree( SFCB * theFCBPtr, RebuildRecords * theRecordsPtr );
 
 #if DEBUG_REBUILD 
 static void PrintBTHeaderRec( BTHeaderRec * thePtr );
@@ -92,6 +131,12 @@ void SETOFFSET ( void *buffer, UInt16 btNodeSize, SInt16 recOffset, SInt16 vecOf
 //				when the index nodes are non-reliable, or the leaf node links
 //				are damaged.
 //
+//				Since the records come back in node order rather than key
+//				order, they are saved and sorted, and the new tree is then
+//				bulk loaded from them (see BulkLoadBTree).  If there is not
+//				enough memory to save them all, the records are inserted one
+//				at a time instead.
+//
 //				The rebuild will be aborted (leaving the existing btree
 //				as it was found) if there are errors retreiving the nodes or
 //				records, or if there are errors inserting the records into
@@ -137,6 +182,8 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	OSErr					myErr;
 	Boolean 				isHFSPlus;
 	UInt32					numRecords = 0;
+	RebuildRecords			myRecords;
+	Boolean					useBulkLoad = true;
 	
 #if SHOW_ELAPSED_TIMES 
 	struct timeval 			myStartTime;
@@ -148,6 +195,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	theSGlobPtr->TarID = FileID;
 	theSGlobPtr->TarBlock = 0;
 	myBlockDescriptor.buffer = NULL;
+	ClearMemory( &myRecords, sizeof(myRecords) );
 	myVCBPtr = theSGlobPtr->calculatedVCB;
 	if (kHFSCatalogFileID == FileID) {
 		oldFCBPtr = theSGlobPtr->calculatedCatalogFCB;
@@ -310,6 +358,38 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 			break;  // this implementation does not handle partial rebuilds (all or none)
 		}
 
+		/* keep the record, the new btree is bulk loaded once all of them are read */
+		if ( useBulkLoad )
+		{
+			myErr = AddRebuildRecord( &myRecords, (BTreeControlBlock *) myFCBPtr->fcbBtree,
+									  myCurrentKeyPtr, myCurrentDataPtr, myDataSize );
+			if ( noErr == myErr )
+			{
+				numRecords++;
+				continue;
+			}
+			if ( memFullErr == myErr )
+			{
+				/* not enough memory to hold all the records, insert them one at a time */
+				useBulkLoad = false;
+				myErr = InsertRebuildRecords( myFCBPtr, &myRecords );
+				DisposeRebuildRecords( &myRecords );
+			}
+			if ( noErr != myErr )
+			{
+#if DEBUG_REBUILD 
+				fsck_print(ctx, LOG_TYPE_INFO, "%s - saving record failed with err %d 0x%02X \n",
+					__FUNCTION__, myErr, myErr );
+#endif
+				if (dskFulErr == myErr)
+				{
+					fsckPrintFormat(theSGlobPtr->context, E_DiskFull);
+				}               
+				myErr = R_RFail;
+				break;  // this implementation does not handle partial rebuilds (all or none)
+			}
+		}
+
 		/* insert this record into the new btree file */
 		myErr = InsertBTreeRecord( myFCBPtr, myCurrentKeyPtr,
 								   myCurrentDataPtr, myDataSize, &myHint );
@@ -352,6 +432,23 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 
 	if ( btNotFound == myErr )
 		myErr = noErr;
+	if ( noErr == myErr && useBulkLoad )
+	{
+		myErr = BulkLoadBTree( myFCBPtr, &myRecords );
+		DisposeRebuildRecords( &myRecords );
+		if ( noErr != myErr )
+		{
+#if DEBUG_REBUILD 
+			fsck_print(ctx, LOG_TYPE_INFO, "%s - BulkLoadBTree failed with err %d 0x%02X \n",
+				__FUNCTION__, myErr, myErr );
+#endif
+			if (dskFulErr == myErr)
+			{
+				fsckPrintFormat(theSGlobPtr->context, E_DiskFull);
+			}
+			myErr = R_RFail;
+		}
+	}
 	if ( noErr != myErr )
 		goto ExitThisRoutine;
 
@@ -427,6 +524,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 ExitThisRoutine:
 	if ( myBlockDescriptor.buffer != NULL )
 		(void) ReleaseVolumeBlock( myVCBPtr, &myBlockDescriptor, kReleaseBlock );
+	DisposeRebuildRecords( &myRecords );
 
 	if ( myErr != noErr && myFCBPtr != NULL ) 
 		(void) DeleteBTree( theSGlobPtr, myFCBPtr );
@@ -760,6 +858,460 @@ ErrorExit:
 } /* WriteMapNodes */
 
 
+/*
+ * AddRebuildRecord
+ *
+ * Copy a leaf record of the old B-tree into the rebuild record store.
+ * The record is checked the way InsertBTreeRecord would check it, so
+ * that the bulk load rejects the same records the insert path would.
+ *
+ * Returns memFullErr when the store can not grow; the caller then falls
+ * back to inserting the records one at a time.
+ */
+
+static OSErr AddRebuildRecord(	RebuildRecords *	theRecordsPtr,
+								BTreeControlBlock *	theBTreeCBPtr,
+								BTreeKeyPtr			theKeyPtr,
+								void *				theDataPtr,
+								UInt32				theDataSize )
+{
+	RebuildRecord *		myRecordPtr;
+	UInt32				myKeyLength;
+	UInt32				myKeySize;
+	UInt32				mySize;
+
+	myKeyLength = KeyLength( theBTreeCBPtr, theKeyPtr );
+	if ( myKeyLength < 6 || myKeyLength > theBTreeCBPtr->maxKeyLength )
+		return( fsBTInvalidKeyLengthErr );
+
+	myKeySize = CalcKeySize( theBTreeCBPtr, theKeyPtr );
+	if ( CalcKeyRecordSize( myKeySize, theDataSize ) > (theBTreeCBPtr->nodeSize >> 1) )
+		return( fsBTRecordTooLargeErr );
+
+	if ( theRecordsPtr->count == theRecordsPtr->capacity )
+	{
+		RebuildRecord **	myRecords;
+		UInt32				myCapacity;
+
+		myCapacity = theRecordsPtr->capacity ? theRecordsPtr->capacity * 2 : kRebuildInitialRecords;
+		myRecords = realloc( theRecordsPtr->records, myCapacity * sizeof(RebuildRecord *) );
+		if ( myRecords == NULL )
+			return( memFullErr );
+		theRecordsPtr->records = myRecords;
+		theRecordsPtr->capacity = myCapacity;
+	}
+
+	/* keep keys 4 byte aligned */
+	mySize = (sizeof(RebuildRecord) + myKeySize + theDataSize + 3) & ~3;
+	if ( theRecordsPtr->chunkCount == 0 || theRecordsPtr->chunkUsed + mySize > kRebuildChunkSize )
+	{
+		UInt8 *		myChunk;
+
+		if ( theRecordsPtr->chunkCount == theRecordsPtr->chunkCapacity )
+		{
+			UInt8 **	myChunks;
+			UInt32		myCapacity;
+
+			myCapacity = theRecordsPtr->chunkCapacity ? theRecordsPtr->chunkCapacity * 2 : 16;
+			myChunks = realloc( theRecordsPtr->chunks, myCapacity * sizeof(UInt8 *) );
+			if ( myChunks == NULL )
+				return( memFullErr );
+			theRecordsPtr->chunks = myChunks;
+			theRecordsPtr->chunkCapacity = myCapacity;
+		}
+		myChunk = malloc( kRebuildChunkSize );
+		if ( myChunk == NULL )
+			return( memFullErr );
+		theRecordsPtr->chunks[ theRecordsPtr->chunkCount++ ] = myChunk;
+		theRecordsPtr->chunkUsed = 0;
+	}
+
+	myRecordPtr = (RebuildRecord *)
+		(theRecordsPtr->chunks[ theRecordsPtr->chunkCount - 1 ] + theRecordsPtr->chunkUsed);
+	theRecordsPtr->chunkUsed += mySize;
+
+	myRecordPtr->keySize = myKeySize;
+	myRecordPtr->dataSize = theDataSize;
+	CopyMemory( theKeyPtr, RebuildRecordKey(myRecordPtr), myKeySize );
+	CopyMemory( theDataPtr, RebuildRecordData(myRecordPtr), theDataSize );
+	theRecordsPtr->records[ theRecordsPtr->count++ ] = myRecordPtr;
+
+	return( noErr );
+
+} /* AddRebuildRecord */
+
+
+/*
+ * DisposeRebuildRecords
+ *
+ * Free the rebuild record store and leave it empty.
+ */
+
+static void DisposeRebuildRecords( RebuildRecords * theRecordsPtr )
+{
+	UInt32		i;
+
+	for ( i = 0; i < theRecordsPtr->chunkCount; i++ )
+		free( theRecordsPtr->chunks[i] );
+	if ( theRecordsPtr->chunks != NULL )
+		free( theRecordsPtr->chunks );
+	if ( theRecordsPtr->records != NULL )
+		free( theRecordsPtr->records );
+	ClearMemory( theRecordsPtr, sizeof(*theRecordsPtr) );
+
+} /* DisposeRebuildRecords */
+
+
+/*
+ * InsertRebuildRecords
+ *
+ * Insert the records of the rebuild record store into the new B-tree one
+ * at a time.  Used when there is not enough memory to hold all the records
+ * of the old B-tree for the bulk load.
+ */
+
+static OSErr InsertRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecordsPtr )
+{
+	RebuildRecord *		myRecordPtr;
+	UInt32				myHint;
+	UInt32				i;
+	OSErr				myErr;
+
+	for ( i = 0; i < theRecordsPtr->count; i++ )
+	{
+		myRecordPtr = theRecordsPtr->records[i];
+		myErr = InsertBTreeRecord( theFCBPtr, RebuildRecordKey(myRecordPtr),
+								   RebuildRecordData(myRecordPtr), myRecordPtr->dataSize, &myHint );
+#if DEBUG_REBUILD
+		if ( myErr == btExists )
+			continue;
+#endif
+		if ( noErr != myErr )
+			return( myErr );
+	}
+
+	return( noErr );
+
+} /* InsertRebuildRecords */
+
+
+/*
+ * Bulk loading
+ *
+ * The new B-tree is built bottom up from the sorted records.  Leaf nodes
+ * are filled in key order to 7/8 of the node size, so later
+ * inserts do not split every node, and each time a node of a level is
+ * started its first key is added to the level above.  Nodes are allocated
+ * in increasing order right after the header and map nodes, so they are
+ * written out sequentially, and the map bits are set once at the end.
+ */
+
+enum {
+	kBulkLoadFillNumerator		= 7,	/* nodes are filled to 7/8 of the node size */
+	kBulkLoadFillDenominator	= 8
+};
+
+typedef struct BulkLoadLevel {
+	BlockDescriptor		node;			/* node being filled, NULL buffer before the first one */
+	UInt32				nodeNum;
+	UInt32				firstNodeNum;
+	BTreeKey			firstKey;		/* key of the first record of the level */
+} BulkLoadLevel;
+
+typedef struct BulkLoad {
+	BTreeControlBlock *	btcb;
+	UInt32				nextNode;		/* next node number to allocate */
+	UInt32				fillSize;		/* bytes a node is filled to */
+	UInt16				depth;
+	BulkLoadLevel		levels[ kMaxTreeDepth + 1 ];	/* indexed by node height */
+} BulkLoad;
+
+static __thread BTreeControlBlock *	gSortBTreeCBPtr;
+
+static OSErr	BulkLoadAppend( BulkLoad * theLoadPtr, UInt16 theHeight, BTreeKeyPtr theKeyPtr,
+								void * theDataPtr, UInt16 theDataSize );
+
+static int CompareRebuildRecords( const void * theFirstPtr, const void * theSecondPtr )
+{
+	RebuildRecord *		myFirstPtr = *(RebuildRecord * const *) theFirstPtr;
+	RebuildRecord *		mySecondPtr = *(RebuildRecord * const *) theSecondPtr;
+	SInt32				myResult;
+
+	myResult = CompareKeys( gSortBTreeCBPtr, RebuildRecordKey(myFirstPtr), RebuildRecordKey(mySecondPtr) );
+
+	return( (myResult > 0) - (myResult < 0) );
+}
+
+/*
+ * Start a new node at theHeight, linking it after the node being filled
+ * and adding its first key (theKeyPtr) to the level above.
+ */
+
+static OSErr BulkLoadNewNode( BulkLoad * theLoadPtr, UInt16 theHeight, BTreeKeyPtr theKeyPtr )
+{
+	BTreeControlBlock *	myBTreeCBPtr = theLoadPtr->btcb;
+	BulkLoadLevel *		myLevelPtr = &theLoadPtr->levels[ theHeight ];
+	NodeDescPtr			myNodePtr;
+	UInt32				myNodeNum;
+	OSErr				myErr;
+
+	if ( theLoadPtr->nextNode >= myBTreeCBPtr->totalNodes )
+		return( fsBTFullErr );
+	myNodeNum = theLoadPtr->nextNode++;
+
+	if ( myLevelPtr->node.buffer != NULL )
+	{
+		((NodeDescPtr) myLevelPtr->node.buffer)->fLink = myNodeNum;
+		myErr = UpdateNode( myBTreeCBPtr, &myLevelPtr->node );
+		myLevelPtr->node.buffer = NULL;
+		if ( noErr != myErr )
+			return( myErr );
+	}
+
+	myErr = GetNewNode( myBTreeCBPtr, myNodeNum, &myLevelPtr->node );
+	if ( noErr != myErr )
+		return( myErr );
+
+	myNodePtr = (NodeDescPtr) myLevelPtr->node.buffer;
+	myNodePtr->kind = (theHeight == 1) ? kBTLeafNode : kBTIndexNode;
+	myNodePtr->height = theHeight;
+	myNodePtr->bLink = myLevelPtr->nodeNum;
+
+	if ( myLevelPtr->nodeNum == 0 )
+	{
+		/* first node of this level */
+		myLevelPtr->firstNodeNum = myNodeNum;
+		CopyMemory( theKeyPtr, &myLevelPtr->firstKey, CalcKeySize(myBTreeCBPtr, theKeyPtr) );
+		myLevelPtr->nodeNum = myNodeNum;
+		return( noErr );
+	}
+	myLevelPtr->nodeNum = myNodeNum;
+
+	/* a second node at the top level needs a parent for both of them */
+	if ( theHeight == theLoadPtr->depth )
+	{
+		if ( theLoadPtr->depth == kMaxTreeDepth )
+			return( fsBTInvalidNodeErr );
+		theLoadPtr->depth++;
+		myErr = BulkLoadAppend( theLoadPtr, theHeight + 1, &myLevelPtr->firstKey,
+								&myLevelPtr->firstNodeNum, sizeof(UInt32) );
+		if ( noErr != myErr )
+			return( myErr );
+	}
+
+	return( BulkLoadAppend( theLoadPtr, theHeight + 1, theKeyPtr, &myNodeNum, sizeof(UInt32) ) );
+}
+
+/*
+ * Append a record to the node being filled at theHeight, starting a new
+ * node once it is filled to theLoadPtr->fillSize.
+ */
+
+static OSErr BulkLoadAppend( BulkLoad * theLoadPtr, UInt16 theHeight, BTreeKeyPtr theKeyPtr,
+							 void * theDataPtr, UInt16 theDataSize )
+{
+	BTreeControlBlock *	myBTreeCBPtr = theLoadPtr->btcb;
+	NodeDescPtr			myNodePtr;
+	UInt16				myKeyLength;
+	UInt16				myKeySize;
+	UInt32				myUsed;
+	OSErr				myErr;
+
+	if ( theHeight == 1 || (myBTreeCBPtr->attributes & kBTVariableIndexKeysMask) )
+		myKeyLength = KeyLength( myBTreeCBPtr, theKeyPtr );
+	else
+		myKeyLength = myBTreeCBPtr->maxKeyLength;
+
+	myKeySize = myKeyLength + ((myBTreeCBPtr->attributes & kBTBigKeysMask) ? sizeof(UInt16) : sizeof(UInt8));
+	if ( M_IsOdd(myKeySize) )
+		++myKeySize;
+
+	myNodePtr = (NodeDescPtr) theLoadPtr->levels[ theHeight ].node.buffer;
+	if ( myNodePtr != NULL && myNodePtr->numRecords > 0 )
+	{
+		myUsed = myBTreeCBPtr->nodeSize - GetNodeFreeSize( myBTreeCBPtr, myNodePtr );
+		if ( myUsed + myKeySize + theDataSize + sizeof(UInt16) > theLoadPtr->fillSize )
+			myNodePtr = NULL;
+	}
+	if ( myNodePtr == NULL )
+	{
+		myErr = BulkLoadNewNode( theLoadPtr, theHeight, theKeyPtr );
+		if ( noErr != myErr )
+			return( myErr );
+		myNodePtr = (NodeDescPtr) theLoadPtr->levels[ theHeight ].node.buffer;
+	}
+
+	if ( !InsertKeyRecord(myBTreeCBPtr, myNodePtr, myNodePtr->numRecords,
+						  theKeyPtr, myKeyLength, theDataPtr, theDataSize) )
+		return( fsBTRecordTooLargeErr );
+
+	return( noErr );
+}
+
+/*
+ * Set the map bits of nodes theFirstNode up to (not including) theEndNode.
+ */
+
+static OSErr BulkLoadMarkNodes( BTreeControlBlock * theBTreeCBPtr, UInt32 theFirstNode, UInt32 theEndNode )
+{
+	BlockDescriptor		myNode;
+	NodeDescPtr			myNodePtr;
+	UInt8 *				myMapPtr;
+	UInt32				myMapStart;
+	UInt32				myMapBits;
+	UInt32				myNextNode;
+	UInt32				i;
+	UInt16				myMapIndex;
+	OSErr				myErr;
+
+	myErr = GetNode( theBTreeCBPtr, kHeaderNodeNum, &myNode );
+	if ( noErr != myErr )
+		return( myErr );
+	myMapIndex = 2;			/* the map record of the header node */
+	myMapStart = 0;
+
+	while ( true )
+	{
+		myNodePtr = (NodeDescPtr) myNode.buffer;
+		myMapPtr = GetRecordAddress( theBTreeCBPtr, myNodePtr, myMapIndex );
+		myMapBits = GetRecordSize( theBTreeCBPtr, myNodePtr, myMapIndex ) * 8;
+
+		i = (theFirstNode > myMapStart) ? theFirstNode : myMapStart;
+		for ( ; i < theEndNode && i < myMapStart + myMapBits; i++ )
+			myMapPtr[ (i - myMapStart) >> 3 ] |= 0x80 >> ((i - myMapStart) & 7);
+		myMapStart += myMapBits;
+
+		myNextNode = myNodePtr->fLink;
+		myErr = UpdateNode( theBTreeCBPtr, &myNode );
+		if ( noErr != myErr )
+			return( myErr );
+		if ( myMapStart >= theEndNode )
+			break;
+		if ( myNextNode == 0 )
+			return( fsBTNoMoreMapNodesErr );
+
+		myErr = GetNode( theBTreeCBPtr, myNextNode, &myNode );
+		if ( noErr != myErr )
+			return( myErr );
+		if ( ((NodeDescPtr) myNode.buffer)->kind != kBTMapNode )
+		{
+			(void) ReleaseNode( theBTreeCBPtr, &myNode );
+			return( fsBTBadNodeType );
+		}
+		myMapIndex = 0;
+	}
+
+	return( noErr );
+}
+
+/*
+ * BulkLoadBTree
+ *
+ * Sort the rebuild records and build the new B-tree from them bottom up.
+ * The new B-tree must be empty, as CreateNewBTree leaves it.
+ */
+
+static OSErr BulkLoadBTree( SFCB * theFCBPtr, RebuildRecords * theRecordsPtr )
+{
+	BTreeControlBlock *	myBTreeCBPtr = (BTreeControlBlock *) theFCBPtr->fcbBtree;
+	BulkLoad *			myLoadPtr;
+	RebuildRecord *		myRecordPtr;
+	UInt32				myFirstNode;
+	UInt32				myCount;
+	UInt32				i;
+	UInt16				myHeight;
+	OSErr				myErr;
+
+	if ( myBTreeCBPtr->rootNode != 0 || myBTreeCBPtr->leafRecords != 0 )
+		return( paramErr );
+	if ( theRecordsPtr->count == 0 )
+		return( noErr );
+
+	gSortBTreeCBPtr = myBTreeCBPtr;
+	qsort( theRecordsPtr->records, theRecordsPtr->count, sizeof(RebuildRecord *), CompareRebuildRecords );
+	gSortBTreeCBPtr = NULL;
+
+	/* the insert path fails on duplicate keys, and so do we */
+	myCount = 1;
+	for ( i = 1; i < theRecordsPtr->count; i++ )
+	{
+		myRecordPtr = theRecordsPtr->records[i];
+		if ( CompareKeys(myBTreeCBPtr, RebuildRecordKey(theRecordsPtr->records[myCount - 1]),
+						 RebuildRecordKey(myRecordPtr)) == 0 )
+		{
+#if DEBUG_REBUILD
+			continue;
+#else
+			return( fsBTDuplicateRecordErr );
+#endif
+		}
+		theRecordsPtr->records[ myCount++ ] = myRecordPtr;
+	}
+	theRecordsPtr->count = myCount;
+
+	myLoadPtr = malloc( sizeof(BulkLoad) );
+	if ( myLoadPtr == NULL )
+		return( memFullErr );
+
+	myFirstNode = myBTreeCBPtr->totalNodes - myBTreeCBPtr->freeNodes;
+	myLoadPtr->fillSize = (myBTreeCBPtr->nodeSize * kBulkLoadFillNumerator) / kBulkLoadFillDenominator;
+
+TryAgain:
+	ClearMemory( myLoadPtr->levels, sizeof(myLoadPtr->levels) );
+	myLoadPtr->btcb = myBTreeCBPtr;
+	myLoadPtr->nextNode = myFirstNode;
+	myLoadPtr->depth = 1;
+
+	for ( i = 0; i < theRecordsPtr->count; i++ )
+	{
+		myRecordPtr = theRecordsPtr->records[i];
+		myErr = BulkLoadAppend( myLoadPtr, 1, RebuildRecordKey(myRecordPtr),
+								RebuildRecordData(myRecordPtr), myRecordPtr->dataSize );
+		M_ExitOnError( myErr );
+	}
+
+	for ( myHeight = 1; myHeight <= myLoadPtr->depth; myHeight++ )
+	{
+		myErr = UpdateNode( myBTreeCBPtr, &myLoadPtr->levels[ myHeight ].node );
+		myLoadPtr->levels[ myHeight ].node.buffer = NULL;
+		M_ExitOnError( myErr );
+	}
+
+	myErr = BulkLoadMarkNodes( myBTreeCBPtr, myFirstNode, myLoadPtr->nextNode );
+	M_ExitOnError( myErr );
+
+	myBTreeCBPtr->treeDepth		= myLoadPtr->depth;
+	myBTreeCBPtr->rootNode		= myLoadPtr->levels[ myLoadPtr->depth ].nodeNum;
+	myBTreeCBPtr->firstLeafNode	= myLoadPtr->levels[1].firstNodeNum;
+	myBTreeCBPtr->lastLeafNode	= myLoadPtr->levels[1].nodeNum;
+	myBTreeCBPtr->leafRecords	= theRecordsPtr->count;
+	myBTreeCBPtr->freeNodes		-= myLoadPtr->nextNode - myFirstNode;
+	myBTreeCBPtr->writeCount++;
+	M_BTreeHeaderDirty( myBTreeCBPtr );
+
+	free( myLoadPtr );
+	return( noErr );
+
+ErrorExit:
+	for ( myHeight = 1; myHeight <= kMaxTreeDepth; myHeight++ )
+	{
+		if ( myLoadPtr->levels[ myHeight ].node.buffer != NULL )
+			(void) ReleaseNode( myBTreeCBPtr, &myLoadPtr->levels[ myHeight ].node );
+	}
+
+	/* the tree did not fit at our fill factor, pack the nodes full */
+	if ( myErr == fsBTFullErr && myLoadPtr->fillSize < myBTreeCBPtr->nodeSize )
+	{
+		myLoadPtr->fillSize = myBTreeCBPtr->nodeSize;
+		goto TryAgain;
+	}
+
+	free( myLoadPtr );
+	return( myErr );
+
+} /* BulkLoadBTree */
+
+
 /*
  * DeleteBTree
  *	
@@ -959,7 +1511,7 @@ static OSErr ValidateExtentRecordLength (SGlobPtr s, ExtentRecord * theRecPtr, U
 static OSErr ValidateAttributeRecordLength (SGlobPtr s, HFSPlusAttrRecord * theRecPtr, UInt32 theRecSize)
 {
 	OSErr retval = noErr;
-	static UInt32 maxInlineSize;
+	static __thread UInt32 maxInlineSize;
 
 	if (maxInlineSize == 0) {
 		/* The maximum size of an inline attribute record is nodesize / 2 minus a bit */
@@ -1077,7 +1077,7 @@ static OSErr FixOrphanInode(SGlobPtr GPtr, RepairOrderPtr p)
 { 
 	int retval;
 	uint32_t lost_found_id;
-	static int msg_display = 0;
+	static __thread int msg_display = 0;
 
 	if (state.embedded == 1 && state.debug == 0) {
 		retval = EPERM;
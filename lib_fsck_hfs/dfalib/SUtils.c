@@ -181,7 +181,7 @@ utf_decodestr(utf8p, utf8len, ucsp, ucslen, ucsplen)
 OSErr GetFBlk( SGlobPtr GPtr, SInt16 fileRefNum, SInt32 blockNumber, void **bufferH );
 
 
-UInt32 gDFAStage;
+__thread UInt32 gDFAStage;
 
 UInt32	GetDFAStage( void )
 {	
@@ -1865,8 +1865,8 @@ Boolean VolumeObjectIsPureHFSPlus( void )
 //******************************************************************************
 VolumeObjectPtr GetVolumeObjectPtr( void )
 {
-	static VolumeObject		myVolumeObject;
-	static int				myInited = 0;
+	static __thread VolumeObject	myVolumeObject;
+	static __thread int			myInited = 0;
 	
 	if ( myInited == 0 ) {
 		myInited++;
@@ -2217,7 +2217,7 @@ pascal short ResolveFileRefNum(SFCB * fileCtrlBlockPtr)
 
 
 
-Ptr gFCBSPtr;
+__thread Ptr gFCBSPtr;
 
 void	SetFCBSPtr( Ptr value )
 {
@@ -3981,6 +3981,321 @@ void	BuildExtentKey( Boolean isHFSPlus, UInt8 forkType, HFSCatalogNodeID fileNum
 
 
 
+/*
+ * Overlap index
+ *
+ * The overlapped extents table is kept in the order extents were found
+ * (and is later sorted by fileID and blockCount to print and repair it), so
+ * finding an extent in it took a linear scan.  Every extent on the volume is
+ * compared against the table in FindOrigOverlapFiles, which made it
+ * quadratic on volumes with many overlapping extents.
+ *
+ * The index is a cache of the table, built from it when first needed and
+ * updated as extents are added.  It keeps:
+ *	1. A hash of the extents in the table, to find duplicates.
+ *	2. The union of the extents in the table as disjoint block ranges
+ *	   sorted by start block, to find overlaps with a binary search.
+ * Ranges added while verifying are appended unsorted.  The first overlap
+ * query sorts them and merges them in one sweep, and the following
+ * additions are merged in place.
+ */
+typedef struct OverlapRange {
+	UInt64	start;
+	UInt64	end;			/* first block after the range */
+} OverlapRange;
+
+typedef struct OverlapHashEntry {
+	HFSCatalogNodeID fileID;
+	UInt32	startBlock;
+	UInt32	blockCount;
+	UInt8	forkType;
+	Boolean	inUse;
+	char *	attrname;		/* owned by the overlapped extents table */
+} OverlapHashEntry;
+
+struct OverlapIndex {
+	OverlapHashEntry *hash;
+	UInt32	hashSize;		/* power of 2 */
+	UInt32	hashCount;
+
+	OverlapRange *ranges;
+	UInt32	rangeCount;
+	UInt32	rangeCapacity;
+	Boolean	rangesMerged;		/* ranges are sorted and disjoint */
+};
+
+enum {
+	kOverlapHashMinSize	= 64,
+	kOverlapRangesMinSize	= 64
+};
+
+static UInt32 OverlapHashSlot(const OverlapIndex *index, HFSCatalogNodeID fileID, UInt32 startBlock, UInt32 blockCount, UInt8 forkType)
+{
+	UInt64 key;
+
+	key = ((UInt64)fileID << 32) ^ ((UInt64)startBlock << 8) ^ ((UInt64)blockCount << 40) ^ forkType;
+	return (UInt32)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (index->hashSize - 1);
+}
+
+/* Two extents are the same if all their fields, including the attribute names, match */
+static Boolean OverlapHashMatch(const OverlapHashEntry *entry, const ExtentInfo *extentInfo)
+{
+	if ((entry->fileID != extentInfo->fileID) ||
+	    (entry->startBlock != extentInfo->startBlock) ||
+	    (entry->blockCount != extentInfo->blockCount) ||
+	    (entry->forkType != extentInfo->forkType)) {
+		return false;
+	}
+
+	if ((entry->attrname == NULL) || (extentInfo->attrname == NULL)) {
+		return (entry->attrname == extentInfo->attrname);
+	}
+
+	return (strcmp(entry->attrname, extentInfo->attrname) == 0);
+}
+
+/* Find the extent in the hash, or the free entry to insert it at */
+static OverlapHashEntry *OverlapHashLookup(const OverlapIndex *index, const ExtentInfo *extentInfo)
+{
+	UInt32 slot;
+	OverlapHashEntry *entry;
+
+	slot = OverlapHashSlot(index, extentInfo->fileID, extentInfo->startBlock, extentInfo->blockCount, extentInfo->forkType);
+	for (;;) {
+		entry = &index->hash[slot];
+		if (!entry->inUse || OverlapHashMatch(entry, extentInfo)) {
+			return entry;
+		}
+		slot = (slot + 1) & (index->hashSize - 1);
+	}
+}
+
+static OSErr OverlapHashInsert(OverlapIndex *index, const ExtentInfo *extentInfo)
+{
+	OverlapHashEntry *entry;
+
+	/* Keep the hash at most half full */
+	if ((index->hashCount + 1) * 2 > index->hashSize) {
+		OverlapHashEntry *oldHash = index->hash;
+		UInt32 oldSize = index->hashSize;
+		UInt32 i;
+
+		index->hashSize = oldSize ? oldSize * 2 : kOverlapHashMinSize;
+		index->hash = calloc(index->hashSize, sizeof(OverlapHashEntry));
+		if (index->hash == NULL) {
+			index->hash = oldHash;
+			index->hashSize = oldSize;
+			return memFullErr;
+		}
+
+		for (i = 0; i < oldSize; i++) {
+			if (!oldHash[i].inUse) {
+				continue;
+			}
+			entry = &index->hash[OverlapHashSlot(index, oldHash[i].fileID, oldHash[i].startBlock, oldHash[i].blockCount, oldHash[i].forkType)];
+			while (entry->inUse) {
+				entry = (entry == &index->hash[index->hashSize - 1]) ? &index->hash[0] : entry + 1;
+			}
+			*entry = oldHash[i];
+		}
+		free(oldHash);
+	}
+
+	entry = OverlapHashLookup(index, extentInfo);
+	if (!entry->inUse) {
+		entry->inUse = true;
+		entry->fileID = extentInfo->fileID;
+		entry->startBlock = extentInfo->startBlock;
+		entry->blockCount = extentInfo->blockCount;
+		entry->forkType = extentInfo->forkType;
+		entry->attrname = extentInfo->attrname;
+		index->hashCount++;
+	}
+
+	return noErr;
+}
+
+static int CompareOverlapRange(const void *first, const void *second)
+{
+	const OverlapRange *a = first;
+	const OverlapRange *b = second;
+
+	if (a->start != b->start) {
+		return (a->start < b->start) ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Sort the ranges by start block and merge the ones that overlap or touch */
+static void MergeOverlapRanges(OverlapIndex *index)
+{
+	UInt32 i, count = 0;
+
+	if (index->rangeCount > 1) {
+		qsort(index->ranges, index->rangeCount, sizeof(OverlapRange), CompareOverlapRange);
+		for (i = 1; i < index->rangeCount; i++) {
+			if (index->ranges[i].start <= index->ranges[count].end) {
+				if (index->ranges[i].end > index->ranges[count].end) {
+					index->ranges[count].end = index->ranges[i].end;
+				}
+			} else {
+				index->ranges[++count] = index->ranges[i];
+			}
+		}
+		index->rangeCount = count + 1;
+	}
+	index->rangesMerged = true;
+}
+
+/* Return the first range that ends after block */
+static UInt32 FindOverlapRange(const OverlapIndex *index, UInt64 block)
+{
+	UInt32 low = 0, high = index->rangeCount;
+
+	while (low < high) {
+		UInt32 mid = low + (high - low) / 2;
+
+		if (index->ranges[mid].end > block) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+static OSErr OverlapRangeInsert(OverlapIndex *index, UInt32 startBlock, UInt32 blockCount)
+{
+	UInt64 start = startBlock;
+	UInt64 end = start + blockCount;
+	UInt32 i, j;
+
+	if (blockCount == 0) {
+		return noErr;
+	}
+
+	if (index->rangesMerged) {
+		/* Extend the first range that overlaps or touches the extent, if any */
+		i = FindOverlapRange(index, start - (start ? 1 : 0));
+		if ((i < index->rangeCount) && (index->ranges[i].start <= end)) {
+			if (start < index->ranges[i].start) {
+				index->ranges[i].start = start;
+			}
+			if (end > index->ranges[i].end) {
+				index->ranges[i].end = end;
+			}
+
+			/* Absorb the ranges it now reaches */
+			for (j = i + 1; (j < index->rangeCount) && (index->ranges[j].start <= index->ranges[i].end); j++) {
+				if (index->ranges[j].end > index->ranges[i].end) {
+					index->ranges[i].end = index->ranges[j].end;
+				}
+			}
+			if (j > i + 1) {
+				memmove(&index->ranges[i + 1], &index->ranges[j], (index->rangeCount - j) * sizeof(OverlapRange));
+				index->rangeCount -= j - (i + 1);
+			}
+			return noErr;
+		}
+	} else {
+		i = index->rangeCount;
+	}
+
+	if (index->rangeCount == index->rangeCapacity) {
+		UInt32 newCapacity = index->rangeCapacity ? index->rangeCapacity * 2 : kOverlapRangesMinSize;
+		OverlapRange *newRanges = realloc(index->ranges, newCapacity * sizeof(OverlapRange));
+
+		if (newRanges == NULL) {
+			return memFullErr;
+		}
+		index->ranges = newRanges;
+		index->rangeCapacity = newCapacity;
+	}
+
+	memmove(&index->ranges[i + 1], &index->ranges[i], (index->rangeCount - i) * sizeof(OverlapRange));
+	index->ranges[i].start = start;
+	index->ranges[i].end = end;
+	index->rangeCount++;
+
+	return noErr;
+}
+
+static OSErr OverlapIndexInsert(OverlapIndex *index, const ExtentInfo *extentInfo)
+{
+	OSErr err;
+
+	err = OverlapHashInsert(index, extentInfo);
+	if (err == noErr) {
+		err = OverlapRangeInsert(index, extentInfo->startBlock, extentInfo->blockCount);
+	}
+	return err;
+}
+
+void DisposeOverlapIndex(SGlobPtr GPtr)
+{
+	OverlapIndex *index = GPtr->overlapIndex;
+
+	if (index != NULL) {
+		free(index->hash);
+		free(index->ranges);
+		free(index);
+		GPtr->overlapIndex = NULL;
+	}
+}
+
+/*
+ * Return the index of the overlapped extents table, building it from the
+ * table if needed.  Returns NULL if there is not enough memory for it, the
+ * callers then scan the table.
+ */
+static OverlapIndex *GetOverlapIndex(SGlobPtr GPtr)
+{
+	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
+	OverlapIndex *index;
+	UInt32 i;
+
+	if ((GPtr->overlapIndex != NULL) || (extentsTableH == NULL)) {
+		return GPtr->overlapIndex;
+	}
+
+	index = calloc(1, sizeof(OverlapIndex));
+	if (index == NULL) {
+		return NULL;
+	}
+	GPtr->overlapIndex = index;
+
+	for (i = 0; i < (**extentsTableH).count; i++) {
+		if (OverlapIndexInsert(index, &((**extentsTableH).extentInfo[i])) != noErr) {
+			DisposeOverlapIndex(GPtr);
+			break;
+		}
+	}
+
+	return GPtr->overlapIndex;
+}
+
+/* Returns true if the given blocks overlap an extent in the overlapped extents table */
+static Boolean OverlapIndexIntersects(OverlapIndex *index, UInt32 startBlock, UInt32 blockCount)
+{
+	UInt32 i;
+
+	if (!index->rangesMerged) {
+		MergeOverlapRanges(index);
+	}
+
+	i = FindOverlapRange(index, startBlock);
+	if (i == index->rangeCount) {
+		return false;
+	}
+
+	/* A range starting before the extent ends after its start */
+	if (index->ranges[i].start < startBlock) {
+		return true;
+	}
+	return (index->ranges[i].start < (UInt64)startBlock + blockCount);
+}
+
+
 //
 //	Adds this extent to our OverlappedExtentList for later repair.
 //
@@ -3989,6 +4304,8 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	size_t			newHandleSize;
 	ExtentInfo		extentInfo;
 	ExtentsTable	**extentsTableH;
+	OverlapIndex	*index;
+	Boolean			exists;
 	size_t attrlen;
 	
 	ClearMemory(&extentInfo, sizeof(extentInfo));
@@ -4018,8 +4335,18 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	{
 		extentsTableH	= GPtr->overlappedExtents;
 
-		if ( ExtentInfoExists( extentsTableH, &extentInfo) == true )
+		index = GetOverlapIndex( GPtr );
+		if ( index != NULL )
+			exists = OverlapHashLookup( index, &extentInfo )->inUse;
+		else
+			exists = ExtentInfoExists( extentsTableH, &extentInfo );
+
+		if ( exists == true )
+		{
+			if ( extentInfo.attrname != NULL )
+				free( extentInfo.attrname );
 			return( noErr );
+		}
 
 		//	Grow the Extents table for a new entry.
 		newHandleSize = ( sizeof(ExtentInfo) ) + ( GetHandleSize( (Handle)extentsTableH ) );
@@ -4034,12 +4361,16 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 
 	//	Update the extent table count
 	(**extentsTableH).count++;
+
+	//	Keep the index in sync, it is rebuilt from the table if this fails
+	if ( (GPtr->overlapIndex != NULL) && (OverlapIndexInsert( GPtr->overlapIndex, &extentInfo ) != noErr) )
+		DisposeOverlapIndex( GPtr );
 	
 	return( noErr );
 }
 
 
-/* Compare if the given extentInfo exsists in the extents table */
+/* Compare if the given extentInfo exsists in the extents table, used if the overlap index can't be built */
 static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo)
 {
 	UInt32		i;
@@ -4112,6 +4443,13 @@ static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, U
 	Boolean isOverlapped = false;
 	ExtentInfo	*curExtentInfo;
 	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
+	OverlapIndex *index;
+
+	index = GetOverlapIndex(GPtr);
+	if (index != NULL) {
+		isOverlapped = OverlapIndexIntersects(index, startBlock, blockCount);
+		goto out;
+	}
 
 	for (i = 0; i < (**extentsTableH).count; i++) {
 		curExtentInfo = &((**extentsTableH).extentInfo[i]);
@@ -4129,6 +4467,7 @@ static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, U
 		}
 	} /* for loop Extents Table */	
 
+out:
 	/* Add this extent to overlap list */
 	if (isOverlapped) {
 		AddExtentToOverlapList(GPtr, fileID, attrname, startBlock, blockCount, forkType);
@@ -490,7 +490,7 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 			// this will print out our leaf node order
 			if ( nodeDescP->kind == kBTLeafNode ) 
 			{
-				static int		myCounter = 0;
+				static __thread int	myCounter = 0;
 				if ( myCounter > 19 )
 				{
 					myCounter = 0;
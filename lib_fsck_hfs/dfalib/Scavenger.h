@@ -411,6 +411,9 @@ struct ExtentsTable {
 };
 typedef struct ExtentsTable ExtentsTable;
 
+/* Lookup index over an ExtentsTable, private to SVerify1.c */
+typedef struct OverlapIndex OverlapIndex;
+
 
 struct FileIdentifier {
 	Boolean 						hasThread;
@@ -706,6 +709,7 @@ typedef struct SGlob {
 	UInt32				**validFilesList;		//	List of valid HFS file IDs
 
 	ExtentsTable		**overlappedExtents;	//	List of overlapped extents
+	OverlapIndex		*overlapIndex;			//	Index of overlappedExtents for lookups
 	FileIdentifierTable	**fileIdentifierTable;	//	List of files for post processing
 
 	UInt32				inputFlags;				//	Caller can specify some DFA behaviors
@@ -1088,6 +1092,8 @@ extern  int FindOrigOverlapFiles(SGlobPtr GPtr);
 
 extern  void PrintOverlapFiles (SGlobPtr GPtr);
 
+extern  void DisposeOverlapIndex(SGlobPtr GPtr);
+
 /* ------------------------------- From SVerify2.c -------------------------------- */
 
 typedef int (* CheckLeafRecordProcPtr)(SGlobPtr GPtr, void *key, void *record, UInt16 recordLen);
@@ -1437,10 +1443,10 @@ struct found_blocks {
 	u_int32_t padding;
 };
 #define FOUND_BLOCKS_QUANTUM	30
-extern int gBlkListEntries;
-extern u_int64_t *gBlockList;
-extern int gFoundBlockEntries;
-extern struct found_blocks *gFoundBlocksList;
+extern __thread int gBlkListEntries;
+extern __thread u_int64_t *gBlockList;
+extern __thread int gFoundBlockEntries;
+extern __thread struct found_blocks *gFoundBlocksList;
 void CheckPhysicalMatch(SVCB *vcb, UInt32 startblk, UInt32 blkcount, UInt32 fileNumber, UInt8 forkType);
 void dumpblocklist(SGlobPtr GPtr);
 
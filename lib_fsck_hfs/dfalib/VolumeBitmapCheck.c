@@ -22,8 +22,8 @@
  */
 
 /* Summary for in-memory volume bitmap:
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
+ * A table indexed by segment number is used to store bitmap segments
+ * that are partially full.  If a segment does not exist in the table, it
  * can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
@@ -49,6 +49,10 @@ enum {
 	kBitsWithinWordMask	= kBitsPerWord-1,
 	kBitsWithinSegmentMask	= kBitsPerSegment-1,
 	
+	kBMS_ChunkShift		= 10,
+	kBMS_SegmentsPerChunk	= 1 << kBMS_ChunkShift,
+	kBMS_SegmentsInChunkMask = kBMS_SegmentsPerChunk-1,
+
 	kBMS_NodesPerPool	= 450,
 	kBMS_PoolMax		= 2000
 };
@@ -66,50 +70,49 @@ enum {
 #define kEmptySegment	0
 #define kFullSegment	1
 
-int gBitMapInited = 0;
+__thread int gBitMapInited = 0;
 
 /*
  * Bitmap segments that are full are marked in
  * the gFullSegmentList (a bit string).
  */
-bitstr_t* gFullSegmentList;
-UInt32    gBitsMarked;
-UInt32    gTotalBits;
-UInt32    gTotalSegments;
-UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
-UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
+__thread bitstr_t* gFullSegmentList;
+__thread UInt32    gBitsMarked;
+__thread UInt32    gTotalBits;
+__thread UInt32    gTotalSegments;
+__thread UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
+__thread UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
 
 /*
- * Bitmap Segment (BMS) Tree node
+ * Bitmap Segment (BMS) node
  * Bitmap segments that are partially full are
- * saved in the BMS Tree.
+ * saved in the BMS Table.
  */
 typedef struct BMS_Node {
-	struct BMS_Node *left;
-	struct BMS_Node *right;
+	struct BMS_Node *next;          /* free list link */
 	UInt32 segment;
 	UInt32 bitmap[kWordsPerSegment];
 } BMS_Node;
 
-BMS_Node *gBMS_Root;           /* root of BMS tree */
-BMS_Node *gBMS_FreeNodes;      /* list of free BMS nodes */
-BMS_Node *gBMS_PoolList[kBMS_PoolMax];  /* list of BMS node pools */
-int gBMS_PoolCount;            /* count of pools allocated */
+__thread BMS_Node ***gBMS_Table;        /* BMS table, chunks of kBMS_SegmentsPerChunk nodes */
+__thread UInt32 gBMS_TableChunks;       /* count of chunk slots in the table */
+__thread BMS_Node *gBMS_FreeNodes;      /* list of free BMS nodes */
+__thread BMS_Node *gBMS_PoolList[kBMS_PoolMax];  /* list of BMS node pools */
+__thread int gBMS_PoolCount;            /* count of pools allocated */
 
 /* Bitmap operations routines */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock);
 
-/* Segment Tree routines (binary search tree) */
-static int        BMS_InitTree(void);
-static int        BMS_DisposeTree(void);
+/* Segment Table routines (two level table indexed by segment number) */
+static int        BMS_InitTable(UInt32 totalSegments);
+static int        BMS_DisposeTable(void);
 static BMS_Node * BMS_Lookup(UInt32 segment);
 static BMS_Node * BMS_Insert(UInt32 segment, int segmentType);
 static BMS_Node * BMS_Delete(UInt32 segment);
 static void	  BMS_GrowNodePool(void);
 
 #if _VBC_DEBUG_
-static void       BMS_PrintTree(BMS_Node * root);
-static void       BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth);
+static int        BMS_CountChunks(void);
 #endif
 
 /*
@@ -138,7 +141,15 @@ int BitMapCheckBegin(SGlobPtr g)
 	gFullSegmentList = bit_alloc(gTotalSegments);
 	bit_nclear(gFullSegmentList, 0, gTotalSegments - 1);
 
-	BMS_InitTree();
+	if (BMS_InitTable(gTotalSegments) != 0) {
+		free(gFullBitmapSegment);
+		gFullBitmapSegment = NULL;
+		free(gEmptyBitmapSegment);
+		gEmptyBitmapSegment = NULL;
+		bit_dealloc(gFullSegmentList);
+		gFullSegmentList = NULL;
+		return (R_NoMem);
+	}
 	gBitMapInited = 1;
 	gBitsMarked = 0;
 
@@ -171,18 +182,15 @@ int BitMapCheckBegin(SGlobPtr g)
 }
 
 /* debugging stats */
-int gFullSegments = 0;
-int gSegmentNodes = 0;
+__thread int gFullSegments = 0;
+__thread int gSegmentNodes = 0;
 
 int BitMapCheckEnd(void)
 {
 	if (gBitMapInited) {
 #if _VBC_DEBUG_
-		int maxdepth = 0;
-
-		BMS_MaxDepth(gBMS_Root, 0, &maxdepth);
-		fsck_print(ctx, LOG_TYPE_INFO, "   %d full segments, %d segment nodes (max depth was %d nodes)\n",
-		       gFullSegments, gSegmentNodes, maxdepth);
+		fsck_print(ctx, LOG_TYPE_INFO, "   %d full segments, %d segment nodes (%d table chunks in use)\n",
+		       gFullSegments, gSegmentNodes, BMS_CountChunks());
 #endif
 		free(gFullBitmapSegment);
 		gFullBitmapSegment = NULL;
@@ -193,7 +201,7 @@ int BitMapCheckEnd(void)
 		bit_dealloc(gFullSegmentList);
 		gFullSegmentList = NULL;
 
-		BMS_DisposeTree();
+		BMS_DisposeTable();
 		gBitMapInited = 0;
 	}
 	return (0);
@@ -207,12 +215,12 @@ int BitMapCheckEnd(void)
  *	2. If the segment exists in full segment list,
  *			If bitOperation is to clear bits, 
  *			a. Remove segment from full segment list.
- *			b. Insert a full segment in the bitmap tree.
+ *			b. Insert a full segment in the bitmap table.
  *			Else return pointer to dummy full segment
- *	3. If segment found in tree, it is partially full.  Return it.
+ *	3. If segment found in table, it is partially full.  Return it.
  *	4. If (2) and (3) are not true, it is a empty segment.
  *			If bitOperation is to set bits,
- *			a. Insert empty segment in the bitmap tree.
+ *			a. Insert empty segment in the bitmap table.
  *			Else return pointer to dummy empty segment.
  *
  * Input:	
@@ -268,8 +276,7 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 #if 0
 	if (segNode) {
 		int i;
-		fsck_print(ctx, LOG_TYPE_INFO, "  segment %d: L=0x%08x, R=0x%08x \n< ",
-			(int)segNode->segment, (int)segNode->left, segNode->right);
+		fsck_print(ctx, LOG_TYPE_INFO, "  segment %d:\n< ", (int)segNode->segment);
 		for (i = 0; i < kWordsPerSegment; ++i) {
 			fsck_print(ctx, LOG_TYPE_INFO, "0x%08x ", segNode->bitmap[i]);
 			if ((i & 0x3) == 0x3)
@@ -668,6 +675,10 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 {
 	UInt8 *vbmBlockP;
 	UInt32 *buffer;
+	const UInt64 *memWords;
+	const UInt64 *diskWords;
+	UInt64 diffBits;
+	UInt64 missingBits;
 	UInt64 bit;		/* 64-bit to avoid wrap around on volumes with 2^32 - 1 blocks */
 	UInt32 bitsWithinFileBlkMask;
 	UInt32 fileBlk;
@@ -677,6 +688,7 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 	SVCB * vcb;
 	Boolean	 isHFSPlus;
 	Boolean foundOverAlloc = false;
+	int indx;
 	int err = 0;
 	
 	vcb = g->calculatedVCB;
@@ -728,15 +740,28 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			g->TarBlock = fileBlk;
 			++fileBlk;
 		}
-		if (memcmp(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment) == 0)
+		/*
+		 * Compare the segment 64 bits at a time, collecting the bits that
+		 * differ and the bits we have marked used that are free on disk in
+		 * the same pass.  The loop has no early exit so that the compiler
+		 * can vectorize it.
+		 */
+		memWords = (const UInt64 *)buffer;
+		diskWords = (const UInt64 *)(vbmBlockP + (bit & bitsWithinFileBlkMask)/8);
+		diffBits = 0;
+		missingBits = 0;
+		for (indx = 0; indx < kBytesPerSegment / sizeof(UInt64); indx++) {
+			diffBits |= memWords[indx] ^ diskWords[indx];
+			missingBits |= memWords[indx] & ~diskWords[indx];
+		}
+		if (diffBits == 0)
 			continue;
 
 		if (repair) {
 			bcopy(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment);
 			relOpt = kForceWriteBlock;
 		} else {
-			int underalloc = 0;
-			int indx;
+			int underalloc = (missingBits != 0);
 #if _VBC_DEBUG_
 			int i, j;
 			UInt32 *disk_buffer;
@@ -792,15 +817,6 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			 * Once we determine we have under-allocated, we can just stop and print out
 			 * the message.
 			 */
-			for (indx = 0; indx < kBytesPerSegment; indx++) {
-				uint8_t *bufp, *diskp;
-				bufp = (uint8_t *)buffer;
-				diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
-				if (bufp[indx] & ~diskp[indx]) {
-					underalloc++;
-					break;
-				}
-			}
 			g->VIStat = g->VIStat | S_VBM;
 			if (underalloc) {
 				fsckPrintFormat(g->context, E_VBMDamaged);
@@ -847,7 +863,6 @@ void UpdateFreeBlockCount(SGlobPtr g)
 	UInt32 newBitsMarked = 0;
 	UInt32 bit;
 	UInt32 *buffer;
-	UInt32 curWord;
 	SVCB * vcb = g->calculatedVCB;
 	
 	/* Loop through all the bitmap segments */
@@ -865,17 +880,9 @@ void UpdateFreeBlockCount(SGlobPtr g)
 			continue;
 		}
 
-		/* Segment is partially full */
+		/* Segment is partially full, the count does not depend on byte order */
 		for (i = 0; i < kWordsPerSegment; i++) {
-			if (buffer[i] == kAllBitsSetInWord) {
-				newBitsMarked += kBitsPerWord;
-			} else {
-				curWord = SWAP_BE32(buffer[i]);
-				while (curWord) {
-					newBitsMarked += curWord & 1;
-					curWord >>= 1;
-				}
-			}
+			newBitsMarked += __builtin_popcount(buffer[i]);
 		} 
 	} 
 	
@@ -1077,8 +1084,8 @@ int AllocateContigBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBl
 }
 
 enum { kMaxTrimExtents = 256 };
-dk_extent_t gTrimExtents[kMaxTrimExtents];
-dk_unmap_t gTrimData;
+__thread dk_extent_t gTrimExtents[kMaxTrimExtents];
+__thread dk_unmap_t gTrimData;
 
 static void TrimInit(void)
 {
@@ -1262,36 +1269,54 @@ int IsTrimSupported(void)
 }
 
 /*
- * BITMAP SEGMENT TREE
+ * BITMAP SEGMENT TABLE
  *
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
+ * A table indexed by segment number is used to store bitmap segments
+ * that are partially full.  If a segment does not exist in the table,
+ * it can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
+ *
+ * The table has two levels so that a volume with few partially full
+ * segments does not pay for a pointer per segment: the first level
+ * has a slot per kBMS_SegmentsPerChunk segments, and the chunk of node
+ * pointers behind a slot is only allocated when a segment in its range
+ * is inserted.  Lookups, insertions and deletions are constant time.
  */
 
 static int
-BMS_InitTree(void)
+BMS_InitTable(UInt32 totalSegments)
 {
+	gBMS_TableChunks = (totalSegments + kBMS_SegmentsPerChunk - 1) >> kBMS_ChunkShift;
+	gBMS_Table = (BMS_Node ***)calloc(gBMS_TableChunks, sizeof(BMS_Node **));
+	if (gBMS_Table == NULL) {
+		gBMS_TableChunks = 0;
+		return (-1);
+	}
+
 	gBMS_PoolCount = 0;
+	gBMS_FreeNodes = NULL;
 	BMS_GrowNodePool();
 
-	gBMS_Root = gBMS_FreeNodes;
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
-	gBMS_Root->right = NULL; 
-
 	return (0);
 }
 
 
 static int
-BMS_DisposeTree(void)
+BMS_DisposeTable(void)
 {
+	UInt32 i;
+
+	for (i = 0; i < gBMS_TableChunks; i++)
+		free(gBMS_Table[i]);
+	free(gBMS_Table);
+	gBMS_Table = NULL;
+	gBMS_TableChunks = 0;
+
 	while(gBMS_PoolCount > 0)
 		free(gBMS_PoolList[--gBMS_PoolCount]);
 
-	gBMS_Root = gBMS_FreeNodes = 0;
+	gBMS_FreeNodes = NULL;
 	return (0);
 }
 
@@ -1299,61 +1324,36 @@ BMS_DisposeTree(void)
 static BMS_Node *
 BMS_Lookup(UInt32 segment)
 {
-	BMS_Node *ptree = gBMS_Root;
+	BMS_Node **chunk;
 
-	while (ptree && ptree->segment != segment) {
-
-		if (segment > ptree->segment)
-			ptree = ptree->right;
-		else
-			ptree = ptree->left;
-	}
-
-	return ((BMS_Node *)ptree);
-}
-
-
-static BMS_Node *
-BMS_InsertTree(BMS_Node *NewEntry)
-{
-	BMS_Node *ptree;
-	register UInt32 segment;
-
-	segment = NewEntry->segment;
-	ptree = gBMS_Root;
-	if (ptree == (BMS_Node *)NULL) {
-		gBMS_Root = NewEntry;
-		return (NewEntry);
-	}
+	if ((segment >> kBMS_ChunkShift) >= gBMS_TableChunks)
+		return ((BMS_Node *)NULL);
 
-	while (ptree) {
-		if (segment > ptree->segment) { /* walk the right sub-tree */
-			if (ptree->right)
-				ptree = ptree->right;
-			else {
-				ptree->right = NewEntry;
-				return (ptree);
-			}
-		}
-		else { /* walk the left sub-tree */
-			if (ptree->left) 
-				ptree = ptree->left;
-			else {
-			    	ptree->left = NewEntry;
-				return (ptree);
-			}
-		}
-	}	
+	chunk = gBMS_Table[segment >> kBMS_ChunkShift];
+	if (chunk == NULL)
+		return ((BMS_Node *)NULL);
 
-	return ((BMS_Node *)NULL);
+	return (chunk[segment & kBMS_SegmentsInChunkMask]);
 }
 
 
-/* insert a new segment into the tree */
+/* insert a new segment into the table */
 static BMS_Node *
 BMS_Insert(UInt32 segment, int segmentType) 
 {
 	BMS_Node *new; 
+	BMS_Node **chunk;
+
+	if ((segment >> kBMS_ChunkShift) >= gBMS_TableChunks)
+		return ((BMS_Node *)NULL);
+
+	chunk = gBMS_Table[segment >> kBMS_ChunkShift];
+	if (chunk == NULL) {
+		chunk = (BMS_Node **)calloc(kBMS_SegmentsPerChunk, sizeof(BMS_Node *));
+		if (chunk == NULL)
+			return ((BMS_Node *)NULL);
+		gBMS_Table[segment >> kBMS_ChunkShift] = chunk;
+	}
 
 	if ((new = gBMS_FreeNodes) == NULL) {
 		BMS_GrowNodePool();
@@ -1361,78 +1361,33 @@ BMS_Insert(UInt32 segment, int segmentType)
 			return ((BMS_Node *)NULL);
 	}
 
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
+	gBMS_FreeNodes = gBMS_FreeNodes->next; 
 
 	++gSegmentNodes;  /* debugging stats */
 
-	new->right = NULL; 
+	new->next = NULL; 
 	new->segment = segment;
 	if (segmentType == kFullSegment)
 		bcopy(gFullBitmapSegment, new->bitmap, kBytesPerSegment);
 	else
 		bzero(new->bitmap, sizeof(new->bitmap));	
 
-	if (BMS_InsertTree(new) != NULL)
-		return (new);
-	else
-		return ((BMS_Node *)NULL);
+	chunk[segment & kBMS_SegmentsInChunkMask] = new;
+	return (new);
 }
 
 
 static BMS_Node *
 BMS_Delete(UInt32 segment)
 {
-	BMS_Node *seg_found, *pprevious, *pnext, *pnextl, *psub;
+	BMS_Node *seg_found;
 
-	pprevious = NULL; 
-	seg_found = gBMS_Root;
-	
-	/* don't allow the root to be deleted! */
-	if (seg_found->segment == segment)
-		return ((BMS_Node *)NULL);
-
-	while (seg_found && seg_found->segment != segment) {
-		pprevious = seg_found;
-		if (segment > seg_found->segment)
-			seg_found = seg_found->right;
-		else
-			seg_found = seg_found->left;
-	}
+	if ((seg_found = BMS_Lookup(segment)) != NULL) {
+		gBMS_Table[segment >> kBMS_ChunkShift][segment & kBMS_SegmentsInChunkMask] = NULL;
 
-	if (seg_found) {
-		/*
-		 * we found the entry, now reorg the sub-trees
-		 * spanning from our node.
-		 */
-		if ((pnext = seg_found->right)) {
-			/*
-			 * Tree pruning: take the left branch of the
-			 * current node and place it at the lowest
-			 * left branch of the current right branch 
-			 */
-			psub = pnext;
-			
-			/* walk the Right/Left sub tree from current node */
-			while ((pnextl = psub->left))
-				psub = pnextl;	
-			
-			/* plug the old left tree to the new ->Right leftmost node */	
-			psub->left = seg_found->left;
-		} else {  /* only left sub-tree, simple case */
-			pnext = seg_found->left;
-		}
-		/* 
-		 * Now, plug the current node sub tree to
-		 * the good pointer of our parent node.
-		 */
-		if (pprevious->left == seg_found)
-			pprevious->left = pnext;
-		else
-			pprevious->right = pnext;	
-		
 		/* add node back to the free-list */
 		bzero(seg_found, sizeof(BMS_Node));
-		seg_found->right = gBMS_FreeNodes; 
+		seg_found->next = gBMS_FreeNodes; 
 		gBMS_FreeNodes = seg_found; 		
 	}
 	
@@ -1453,7 +1408,7 @@ BMS_GrowNodePool(void)
 	if (nodePool != NULL) {
 		bzero(&nodePool[0], sizeof(BMS_Node) * kBMS_NodesPerPool);
 		for (i = 1 ; i < kBMS_NodesPerPool ; i++) {
-			(&nodePool[i-1])->right = &nodePool[i];
+			(&nodePool[i-1])->next = &nodePool[i];
 		}
 	
 		gBMS_FreeNodes = &nodePool[0];
@@ -1463,26 +1418,17 @@ BMS_GrowNodePool(void)
 
 
 #if _VBC_DEBUG_
-static void
-BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth)
+static int
+BMS_CountChunks(void)
 {
-	if (root) {
-		depth++;
-		if (depth > *maxdepth)
-			*maxdepth = depth;
-		BMS_MaxDepth(root->left, depth, maxdepth);
-		BMS_MaxDepth(root->right, depth, maxdepth);
-	}
-}
+	UInt32 i;
+	int count = 0;
 
-static void
-BMS_PrintTree(BMS_Node * root)
-{
-	if (root) {
-		BMS_PrintTree(root->left);
-		fsck_print(ctx, LOG_TYPE_INFO, "seg %d\n", root->segment);
-		BMS_PrintTree(root->right);
+	for (i = 0; i < gBMS_TableChunks; i++) {
+		if (gBMS_Table[i] != NULL)
+			++count;
 	}
+	return (count);
 }
 #endif
 
@@ -45,6 +45,7 @@
 
 #include "check.h"
 #include "fsck_journal.h"
+#include "journal_verify.h"
 
 #define DEBUG_JOURNAL 0
 
@@ -77,22 +78,21 @@ typedef int (^journal_write_block_t)(off_t, void *, size_t);
 //
 // this isn't a great checksum routine but it will do for now.
 // we use it to checksum the journal header and the block list
-// headers that are at the start of each transaction.
+// headers that are at the start of each transaction.  The
+// implementation is shared with the livefiles plugin.
 //
 static uint32_t
 calc_checksum(char *ptr, int len)
 {
-	int i;
-	uint32_t cksum = 0;
-
-	// this is a lame checksum but for now it'll do
-	for(i = 0; i < len; i++, ptr++) {
-		cksum = (cksum << 8) ^ (cksum + *(unsigned char *)ptr);
-	}
-
-	return (~cksum);
+	return jnl_checksum(ptr, len);
 }
 
+/*
+ * The kernel calls block_list_header.pad "flags"; if this flag is set,
+ * binfo[i].next (i > 0) holds the checksum of block i's data.
+ */
+#define BLHDR_CHECK_CHECKSUMS	0x0001
+
 typedef struct JournalIOInfo {
 	int		jfd;	// File descriptor for journal buffer
 	int		wrapCount;	// Incremented when it wraps around.
@@ -244,6 +244,56 @@ getJournalTransaction(JournalIOInfo_t *jinfo, swapper_t *swap)
 	return retval;
 }
 
+/*
+ * Verify the data checksums of a transaction, if it has them.  The blocks
+ * are checksummed in parallel on the verifier's threads (jv may be NULL).
+ * Returns 0 if all the checksums match or there are none, and -1 on a
+ * mismatch or if the block list doesn't describe the buffer.
+ */
+static int
+verifyTransaction(block_list_header *txn, size_t blSize, swapper_t *swap, jnl_verifier_t *jv)
+{
+	uint32_t i, count = 0;
+	uint32_t num_blocks = swap->swap32(txn->num_blocks);
+	uint8_t *endPtr = ((uint8_t*)txn) + swap->swap32(txn->bytes_used);
+	uint8_t *dataPtr = ((uint8_t*)txn) + blSize;
+	jnl_verify_block_t *blocks;
+	int bad;
+
+	if ((swap->swap32(txn->pad) & BLHDR_CHECK_CHECKSUMS) == 0 || num_blocks < 2) {
+		return 0;
+	}
+
+	blocks = calloc(num_blocks, sizeof(*blocks));
+	if (blocks == NULL) {
+		return -1;
+	}
+	for (i = 1; i < num_blocks; i++) {
+		uint32_t bsize = swap->swap32(txn->binfo[i].bsize);
+
+		if (dataPtr > endPtr || (size_t)(endPtr - dataPtr) < bsize) {
+			free(blocks);
+			return -1;
+		}
+		if (swap->swap64(txn->binfo[i].bnum) != ~(uint64_t)0) {
+			blocks[count].data = dataPtr;
+			blocks[count].size = bsize;
+			blocks[count].cksum = swap->swap32(txn->binfo[i].next);
+			count++;
+		}
+		dataPtr += bsize;
+	}
+
+	jnl_verifier_start(jv, blocks, count);
+	bad = jnl_verifier_wait(jv, blocks, count);
+	if (bad >= 0 && state.debug) {
+		fsck_print(ctx, LOG_TYPE_INFO, "\tBlock data checksum mismatch (%#x != %#x)\n", blocks[bad].computed, blocks[bad].cksum);
+	}
+	free(blocks);
+
+	return (bad >= 0) ? -1 : 0;
+}
+
 /*
  * Replay a transaction.
  * Transactions have a blockListSize amount of block_list_header, and
@@ -262,17 +312,23 @@ getJournalTransaction(JournalIOInfo_t *jinfo, swapper_t *swap)
  * blkSize	-- The block size used to convert block numbers to offsets.  This
  *		is defined to be the size of the journal header.
  * swap	-- A pointer to a swapper_t used to swap journal data structure elements.
+ * jv	-- The verifier used to check block checksums (may be NULL).
  * writer	-- A block-of-code that does writing.
  *
  * "writer" should return -1 to stop the replay (this propagates an error up).
  */
 static int
-replayTransaction(block_list_header *txn, size_t blSize, size_t blkSize, swapper_t *swap, journal_write_block_t writer)
+replayTransaction(block_list_header *txn, size_t blSize, size_t blkSize, swapper_t *swap, jnl_verifier_t *jv, journal_write_block_t writer)
 {
 	uint32_t i;
 	uint8_t *endPtr = ((uint8_t*)txn) + swap->swap32(txn->bytes_used);
 	uint8_t *dataPtr = ((uint8_t*)txn) + blSize;
 	int retval = -1;
+
+	// Nothing gets written unless all of the transaction's data is good
+	if (verifyTransaction(txn, blSize, swap, jv) != 0) {
+		return retval;
+	}
 	for (i = 1; i < swap->swap32(txn->num_blocks); i++) {
 #if DEBUG_JOURNAL
         if (state.debug) {
@@ -505,6 +561,7 @@ journal_open(int jfd,
 	const char *jrnlState = "";
 	int bad_journal = 0;
 	block_list_header *txn = NULL;
+	jnl_verifier_t *jv = jnl_verifier_create(0);
 
 	/*
 	 * Loop while getting transactions.  We exit when we hit a checksum
@@ -610,6 +667,7 @@ journal_open(int jfd,
 				       jnlSwap->swap32(jhdr.blhdr_size),
 				       jnlSwap->swap32(jhdr.jhdr_size),
 				       jnlSwap,
+				       jv,
 				       do_write_b);
 
 		if (rv < 0) {
@@ -632,6 +690,7 @@ journal_open(int jfd,
     if (txn) {
         free(txn);
     }
+	jnl_verifier_destroy(jv);
 	if (bad_journal) {
         if (state.debug) {
             fsck_print(ctx, LOG_TYPE_INFO, "Journal was bad, stopped replaying\n");
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "journal_verify.h"
+
+/*
+ * Every byte depends on the checksum of all the bytes before it, so a
+ * single checksum can't be split up.  Loading eight bytes at a time
+ * at least keeps the loop down to the shift/add/xor chain; the real
+ * win comes from checksumming the blocks of a block list in parallel.
+ */
+#define CKSUM_STEP(c, b)	((c) = ((c) << 8) ^ ((c) + (uint8_t)(b)))
+
+uint32_t
+jnl_checksum(const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+	uint32_t cksum = 0;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+
+		memcpy(&w, p, sizeof(w));
+#if __LITTLE_ENDIAN__ || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+		CKSUM_STEP(cksum, w);
+		CKSUM_STEP(cksum, w >> 8);
+		CKSUM_STEP(cksum, w >> 16);
+		CKSUM_STEP(cksum, w >> 24);
+		CKSUM_STEP(cksum, w >> 32);
+		CKSUM_STEP(cksum, w >> 40);
+		CKSUM_STEP(cksum, w >> 48);
+		CKSUM_STEP(cksum, w >> 56);
+#else
+		CKSUM_STEP(cksum, w >> 56);
+		CKSUM_STEP(cksum, w >> 48);
+		CKSUM_STEP(cksum, w >> 40);
+		CKSUM_STEP(cksum, w >> 32);
+		CKSUM_STEP(cksum, w >> 24);
+		CKSUM_STEP(cksum, w >> 16);
+		CKSUM_STEP(cksum, w >> 8);
+		CKSUM_STEP(cksum, w);
+#endif
+	}
+	for (; len > 0; len--, p++) {
+		CKSUM_STEP(cksum, *p);
+	}
+
+	return (~cksum);
+}
+
+struct jnl_verifier {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work_cv;	// Workers wait here for a batch
+	pthread_cond_t		done_cv;	// jnl_verifier_wait() waits here
+	pthread_t		threads[JNL_VERIFY_MAX_THREADS];
+	int			nthreads;
+	int			exiting;
+
+	// The outstanding batch, all protected by lock
+	jnl_verify_block_t	*blocks;
+	int			count;
+	int			next;		// Next block to hand out
+	int			busy;		// Blocks being checksummed right now
+};
+
+static void
+verify_one(jnl_verify_block_t *blk)
+{
+	blk->computed = jnl_checksum(blk->data, blk->size);
+}
+
+/*
+ * Checksum blocks of the current batch until there are none left to
+ * hand out.  Called, and returns, with jv->lock held.
+ */
+static void
+verifier_drain(jnl_verifier_t *jv)
+{
+	while (jv->blocks != NULL && jv->next < jv->count) {
+		int i = jv->next++;
+		jnl_verify_block_t *blk = &jv->blocks[i];
+
+		jv->busy++;
+		pthread_mutex_unlock(&jv->lock);
+
+		verify_one(blk);
+
+		pthread_mutex_lock(&jv->lock);
+		jv->busy--;
+	}
+	if (jv->busy == 0) {
+		pthread_cond_broadcast(&jv->done_cv);
+	}
+}
+
+static void *
+verifier_thread(void *arg)
+{
+	jnl_verifier_t *jv = arg;
+
+	pthread_mutex_lock(&jv->lock);
+	while (!jv->exiting) {
+		if (jv->blocks == NULL || jv->next >= jv->count) {
+			pthread_cond_wait(&jv->work_cv, &jv->lock);
+			continue;
+		}
+		verifier_drain(jv);
+	}
+	pthread_mutex_unlock(&jv->lock);
+
+	return NULL;
+}
+
+jnl_verifier_t *
+jnl_verifier_create(int nthreads)
+{
+	jnl_verifier_t *jv;
+	int i;
+
+	if (nthreads <= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu > 1) ? (int)(ncpu - 1) : 0;	// The caller helps too
+	}
+	if (nthreads > JNL_VERIFY_MAX_THREADS) {
+		nthreads = JNL_VERIFY_MAX_THREADS;
+	}
+	if (nthreads == 0) {
+		return NULL;
+	}
+
+	jv = calloc(1, sizeof(*jv));
+	if (jv == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&jv->lock, NULL);
+	pthread_cond_init(&jv->work_cv, NULL);
+	pthread_cond_init(&jv->done_cv, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&jv->threads[i], NULL, verifier_thread, jv) != 0) {
+			break;
+		}
+		jv->nthreads++;
+	}
+	if (jv->nthreads == 0) {
+		jnl_verifier_destroy(jv);
+		return NULL;
+	}
+
+	return jv;
+}
+
+void
+jnl_verifier_destroy(jnl_verifier_t *jv)
+{
+	int i;
+
+	if (jv == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&jv->lock);
+	verifier_drain(jv);
+	while (jv->busy != 0) {
+		pthread_cond_wait(&jv->done_cv, &jv->lock);
+	}
+	jv->exiting = 1;
+	pthread_cond_broadcast(&jv->work_cv);
+	pthread_mutex_unlock(&jv->lock);
+
+	for (i = 0; i < jv->nthreads; i++) {
+		pthread_join(jv->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&jv->done_cv);
+	pthread_cond_destroy(&jv->work_cv);
+	pthread_mutex_destroy(&jv->lock);
+	free(jv);
+}
+
+void
+jnl_verifier_start(jnl_verifier_t *jv, jnl_verify_block_t *blocks, int count)
+{
+	int i;
+
+	if (jv == NULL) {
+		// No pool, so check them right here
+		for (i = 0; i < count; i++) {
+			verify_one(&blocks[i]);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&jv->lock);
+	jv->blocks = blocks;
+	jv->count = count;
+	jv->next = 0;
+	pthread_cond_broadcast(&jv->work_cv);
+	pthread_mutex_unlock(&jv->lock);
+}
+
+int
+jnl_verifier_wait(jnl_verifier_t *jv, const jnl_verify_block_t *blocks, int count)
+{
+	int i;
+
+	if (jv != NULL) {
+		pthread_mutex_lock(&jv->lock);
+		verifier_drain(jv);
+		while (jv->busy != 0) {
+			pthread_cond_wait(&jv->done_cv, &jv->lock);
+		}
+		jv->blocks = NULL;
+		jv->count = 0;
+		jv->next = 0;
+		pthread_mutex_unlock(&jv->lock);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i].cksum != 0 && blocks[i].computed != blocks[i].cksum) {
+			return i;
+		}
+	}
+
+	return -1;
+}
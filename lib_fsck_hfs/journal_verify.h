@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _JOURNAL_VERIFY_H
+#define _JOURNAL_VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Journal checksum and block verification, shared by the livefiles
+ * plugin journal replay and fsck_hfs journal replay.  Neither
+ * depends on the journal structure layout of its caller.
+ */
+
+/*
+ * The journal checksum.  This is the on-disk format, so it must stay
+ * bit-for-bit identical to the kernel's calc_checksum().
+ */
+uint32_t	jnl_checksum(const void *ptr, size_t len);
+
+/*
+ * One block of a block_list_header to verify.  A block with a 0 cksum
+ * was not checksummed when it was written, and always verifies.
+ */
+typedef struct jnl_verify_block {
+	const void	*data;
+	uint32_t	size;
+	uint32_t	cksum;		// Expected checksum, host byte order
+	uint32_t	computed;	// Filled in by verification
+} jnl_verify_block_t;
+
+#define JNL_VERIFY_MAX_THREADS	4
+
+typedef struct jnl_verifier jnl_verifier_t;
+
+/*
+ * A small pool of worker threads to checksum the blocks of one
+ * block_list_header in parallel.  nthreads <= 0 sizes the pool to the
+ * number of CPUs (at most JNL_VERIFY_MAX_THREADS).  Returns NULL if the
+ * pool could not be set up; all other calls accept a NULL verifier and
+ * then do the work on the calling thread.
+ */
+jnl_verifier_t	*jnl_verifier_create(int nthreads);
+void		jnl_verifier_destroy(jnl_verifier_t *jv);
+
+/*
+ * Start verifying blocks[0 .. count-1] and return without waiting, so
+ * the caller can read the next block list meanwhile.  The blocks must
+ * stay valid until jnl_verifier_wait() returns; only one batch may be
+ * outstanding at a time.
+ */
+void		jnl_verifier_start(jnl_verifier_t *jv, jnl_verify_block_t *blocks, int count);
+
+/*
+ * Wait for the batch started with the same blocks (helping out with
+ * it).  Returns the index of the first block whose checksum did not
+ * match, or -1 if all of them did.
+ */
+int		jnl_verifier_wait(jnl_verifier_t *jv, const jnl_verify_block_t *blocks, int count);
+
+#endif /* !_JOURNAL_VERIFY_H */
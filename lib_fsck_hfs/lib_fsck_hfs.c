@@ -7,6 +7,9 @@
 #include "check.h"
 #include "lib_fsck_hfs.h"
 
+__thread fsck_state_t state;
+__thread lib_fsck_ctx_t ctx;
+
 void fsck_init_state(void) {
     memset(&state, 0, sizeof(state));
     state.chkLev = kAlwaysCheck;
@@ -91,6 +91,10 @@ void fsck_set_context_properties(fsck_hfs_print_msg_type_funct_t print_type,
  *
  * Main routine to run a check on a file system.
  * Client must use call fsck_init_state  and fsck_set_context_properties before running this routine.
+ *
+ * The state set by fsck_init_state and the fsck_set_* routines belongs to the calling
+ * thread, so several volumes may be checked in parallel, each from its own thread.
+ * All the calls for one check must be made from the same thread.
  */
 int     checkfilesys(char * filesys);
 
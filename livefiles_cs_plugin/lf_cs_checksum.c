@@ -7,6 +7,15 @@
 // This implementation is copied from CoreStorage project.
 //
 
+#include <pthread.h>
+#include <sys/sysctl.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__arm64__) || defined(__aarch64__)
+#include <arm_acle.h>
+#endif
+
 #include "lf_cs_checksum.h"
 
 //
@@ -79,6 +88,230 @@ static const uint32_t crc32_table[256] = {
 	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
 };
 
+//
+// Slice-by-8 tables, crc32_slice_table[0] is crc32_table and entry 'k' of
+// crc32_slice_table[n] is the CRC of byte 'k' followed by 'n' zero bytes.
+// Built once by crc32c_dispatch_init.
+//
+static uint32_t crc32_slice_table[8][256];
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t, const uint8_t *, size_t);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_fn_t crc32c_best;
+static bool crc32c_hw_supported;
+
+//
+// crc32c_byte - Reference kernel, one byte per table lookup.
+//
+static uint32_t
+crc32c_byte(uint32_t c32, const uint8_t *data, size_t len)
+{
+	while (len-- > 0) {
+		c32 = crc32_table[(c32 ^ *data++) & 0xff] ^ (c32 >> 8);
+	}
+
+	return c32;
+}
+
+//
+// crc32c_slice8 - Portable kernel consuming 8 bytes per iteration.
+// Assumes a little-endian host, like every host this plugin runs on.
+//
+static uint32_t
+crc32c_slice8(uint32_t c32, const uint8_t *data, size_t len)
+{
+	while (len > 0 && ((uintptr_t)data & 7) != 0) {
+		c32 = crc32_table[(c32 ^ *data++) & 0xff] ^ (c32 >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, data, sizeof(lo));
+		memcpy(&hi, data + 4, sizeof(hi));
+		lo ^= c32;
+
+		c32 = crc32_slice_table[7][lo & 0xff] ^
+		      crc32_slice_table[6][(lo >> 8) & 0xff] ^
+		      crc32_slice_table[5][(lo >> 16) & 0xff] ^
+		      crc32_slice_table[4][lo >> 24] ^
+		      crc32_slice_table[3][hi & 0xff] ^
+		      crc32_slice_table[2][(hi >> 8) & 0xff] ^
+		      crc32_slice_table[1][(hi >> 16) & 0xff] ^
+		      crc32_slice_table[0][hi >> 24];
+
+		data += 8;
+		len -= 8;
+	}
+
+	return crc32c_byte(c32, data, len);
+}
+
+//
+// crc32c_hw - CRC32-C instructions (SSE4.2 crc32 / ARMv8 crc32c*).  Both
+// compute the same reflected CRC as crc32_table without pre/post inversion.
+// Only called after crc32c_dispatch_init found the instructions supported.
+//
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t c32, const uint8_t *data, size_t len)
+{
+	uint64_t c64;
+
+	while (len > 0 && ((uintptr_t)data & 7) != 0) {
+		c32 = _mm_crc32_u8(c32, *data++);
+		len--;
+	}
+
+	c64 = c32;
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, data, sizeof(v));
+		c64 = _mm_crc32_u64(c64, v);
+		data += 8;
+		len -= 8;
+	}
+	c32 = (uint32_t)c64;
+
+	while (len-- > 0) {
+		c32 = _mm_crc32_u8(c32, *data++);
+	}
+
+	return c32;
+}
+#define CRC32C_HW_SYSCTL "hw.optional.sse4_2"
+
+#elif defined(__arm64__) || defined(__aarch64__)
+__attribute__((target("crc")))
+static uint32_t
+crc32c_hw(uint32_t c32, const uint8_t *data, size_t len)
+{
+	while (len > 0 && ((uintptr_t)data & 7) != 0) {
+		c32 = __crc32cb(c32, *data++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, data, sizeof(v));
+		c32 = __crc32cd(c32, v);
+		data += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0) {
+		c32 = __crc32cb(c32, *data++);
+	}
+
+	return c32;
+}
+#define CRC32C_HW_SYSCTL "hw.optional.armv8_crc32"
+
+#else
+#define crc32c_hw crc32c_slice8
+#endif
+
+//
+// Build the slice-by-8 tables and pick the fastest kernel for this CPU.
+//
+static void
+crc32c_dispatch_init(void)
+{
+	int n, k;
+
+	memcpy(crc32_slice_table[0], crc32_table, sizeof(crc32_table));
+	for (n = 1; n < 8; n++) {
+		for (k = 0; k < 256; k++) {
+			uint32_t c32 = crc32_slice_table[n - 1][k];
+
+			crc32_slice_table[n][k] = crc32_table[c32 & 0xff] ^
+				(c32 >> 8);
+		}
+	}
+
+	crc32c_best = crc32c_slice8;
+
+#if defined(CRC32C_HW_SYSCTL)
+	{
+		int supported = 0;
+		size_t size = sizeof(supported);
+
+		if (sysctlbyname(CRC32C_HW_SYSCTL, &supported, &size, NULL, 0) == 0 &&
+		    supported) {
+			crc32c_hw_supported = true;
+			crc32c_best = crc32c_hw;
+		}
+	}
+#endif
+}
+
+bool
+crc32c_impl_supported(crc32c_impl_t impl)
+{
+	pthread_once(&crc32c_once, crc32c_dispatch_init);
+
+	switch (impl) {
+
+	case CRC32C_IMPL_BYTE:
+	case CRC32C_IMPL_SLICE8:
+		return true;
+
+	case CRC32C_IMPL_HW:
+		return crc32c_hw_supported;
+
+	default:
+		return false;
+	}
+}
+
+const char *
+crc32c_impl_name(crc32c_impl_t impl)
+{
+	switch (impl) {
+
+	case CRC32C_IMPL_BYTE:
+		return "byte";
+
+	case CRC32C_IMPL_SLICE8:
+		return "slice-by-8";
+
+	case CRC32C_IMPL_HW:
+#if defined(__x86_64__)
+		return "sse4.2";
+#else
+		return "armv8-crc";
+#endif
+
+	default:
+		return "unknown";
+	}
+}
+
+uint32_t
+crc32c_update(crc32c_impl_t impl, uint32_t c32, const void *data, size_t len)
+{
+	if (!crc32c_impl_supported(impl)) {
+		impl = CRC32C_IMPL_BYTE;
+	}
+
+	switch (impl) {
+
+	case CRC32C_IMPL_SLICE8:
+		return crc32c_slice8(c32, data, len);
+
+	case CRC32C_IMPL_HW:
+		return crc32c_hw(c32, data, len);
+
+	default:
+		return crc32c_byte(c32, data, len);
+	}
+}
+
 //
 // Initialize 'cksum' buffer for the cksum function for a given
 // algorithm 'alg'.  Doubles as alg verification for probe/boot.
@@ -116,7 +349,6 @@ void
 cksum(cksum_alg_t alg, const void *p, size_t len,
       uint8_t cksum[MAX_CKSUM_NBYTES])
 {
-	const uint8_t *data = (const uint8_t *)p;
 	uint32_t c32;
 
 	switch (alg) {
@@ -126,14 +358,11 @@ cksum(cksum_alg_t alg, const void *p, size_t len,
 
 	case CKSUM_ALG_CRC_32:
 
-		c32 = *(uint32_t *)cksum;
-
-		while (len-- > 0) {
-			c32 = crc32_table[(c32 ^ *data++) & 0xff] ^
-				(c32 >> 8);
-		}
+		pthread_once(&crc32c_once, crc32c_dispatch_init);
 
-		*(uint32_t *)cksum = c32;
+		memcpy(&c32, cksum, sizeof(c32));
+		c32 = crc32c_best(c32, (const uint8_t *)p, len);
+		memcpy(cksum, &c32, sizeof(c32));
 		break;
 	}
 }
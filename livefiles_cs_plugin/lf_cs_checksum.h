@@ -61,4 +61,22 @@ bool cksum_init(cksum_alg_t alg, uint8_t cksum[MAX_CKSUM_NBYTES]);
 void cksum(cksum_alg_t alg, const void *data, size_t len,
 		uint8_t cksum[MAX_CKSUM_NBYTES]);
 
+//
+// CRC32-C kernels behind CKSUM_ALG_CRC_32.  cksum() uses the fastest one
+// supported by the CPU; they are exposed for tests and benchmarks.  All of
+// them return the same value for the same input.
+//
+enum crc32c_impl {
+	CRC32C_IMPL_BYTE,	// 256-entry table, one byte at a time
+	CRC32C_IMPL_SLICE8,	// slice-by-8 tables
+	CRC32C_IMPL_HW,		// SSE4.2 crc32 or ARMv8 crc32c instructions
+	CRC32C_IMPL_COUNT,
+};
+typedef enum crc32c_impl crc32c_impl_t;
+
+bool crc32c_impl_supported(crc32c_impl_t impl);
+const char *crc32c_impl_name(crc32c_impl_t impl);
+uint32_t crc32c_update(crc32c_impl_t impl, uint32_t crc, const void *data,
+		size_t len);
+
 #endif /* _LF_CS_CHECKSUM_H */
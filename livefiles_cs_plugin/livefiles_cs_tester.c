@@ -30,9 +30,12 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <UserFS/UserVFS.h>
 
+#include "lf_cs_checksum.h"
+
 extern UVFSFSOps cs_fsops;
 
 //
@@ -89,17 +92,88 @@ is_fstype_valid(const char *fs_name, lf_cspt_fstype_t *fs_type)
 static int
 usage(const char *prog_name)
 {
-	fprintf(stderr, "Usage: %s filesystem-format device-path\n",
-			prog_name);
+	fprintf(stderr, "Usage: %s filesystem-format device-path\n"
+			"       %s CKSUM_BENCH\n", prog_name, prog_name);
 	return EINVAL;
 }
 
+//
+// Micro-benchmark of the CRC32-C kernels on metadata-block-sized inputs.
+// Every kernel must agree with the byte-at-a-time reference.
+//
+static int
+cksum_bench(void)
+{
+	static const size_t sizes[] = { 512, 4096, 8192, 65536 };
+	const size_t total_bytes = 256 * 1024 * 1024;
+	uint8_t *buf;
+	size_t idx;
+	int error = 0;
+
+	buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	for (idx = 0; idx < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; idx++) {
+		buf[idx] = (uint8_t)random();
+	}
+
+	for (idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); idx++) {
+		size_t len = sizes[idx];
+		size_t iters = total_bytes / len;
+		uint32_t expected = crc32c_update(CRC32C_IMPL_BYTE, ~0U, buf, len);
+		crc32c_impl_t impl;
+
+		for (impl = CRC32C_IMPL_BYTE; impl < CRC32C_IMPL_COUNT; impl++) {
+			struct timespec start, end;
+			uint32_t crc = 0;
+			double secs;
+			size_t iter;
+
+			if (!crc32c_impl_supported(impl)) {
+				printf("%6zu bytes %-10s: not supported\n", len,
+						crc32c_impl_name(impl));
+				continue;
+			}
+
+			if (crc32c_update(impl, ~0U, buf, len) != expected) {
+				fprintf(stderr, "%s mismatch on %zu bytes\n",
+						crc32c_impl_name(impl), len);
+				error = EINVAL;
+				continue;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (iter = 0; iter < iters; iter++) {
+				crc += crc32c_update(impl, ~0U, buf, len);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			secs = (double)(end.tv_sec - start.tv_sec) +
+				(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("%6zu bytes %-10s: %8.1f MB/s (%.0f ns/block) [%08x]\n",
+					len, crc32c_impl_name(impl),
+					(double)(iters * len) / secs / 1e6,
+					secs * 1e9 / (double)iters, crc);
+		}
+	}
+
+	free(buf);
+	return error;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int fd, error;
 	lf_cspt_fstype_t fs_type;
 
+	if (argc == 2 && strcmp(argv[1], "CKSUM_BENCH") == 0) {
+		error = cksum_bench();
+		printf("Test result [%d]\n", error);
+		return error ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	if (argc != 3) {
 		return usage(argv[0]);
 	}
@@ -72,6 +72,13 @@ enum {
 
 #define HFS_META_DELAY_TS ((struct timespec){ 0, HFS_META_DELAY * NSEC_PER_USEC })
 
+/*
+ * How often threads had to wait for another thread's directory or B-tree update.
+ */
+typedef struct {
+    uint64_t dirmod_waits;              // Lookups that waited for a C_DIR_MODIFICATION to end
+    uint64_t create_btree_waits;        // Callers that waited for another thread to create the attributes B-tree
+} ContentionStats_S;
 
 /* This structure describes the HFS specific mount structure data. */
 typedef struct hfsmount {
@@ -245,6 +252,10 @@ typedef struct hfsmount {
     size_t         hfs_max_inline_attrsize;
 
     pthread_mutex_t      hfs_mutex;      /* protects access to hfsmount data */
+    pthread_cond_t       hfs_dirmod_cond;        /* signalled when a C_DIR_MODIFICATION ends, uses hfs_mutex */
+    pthread_cond_t       hfs_create_btree_cond;  /* signalled when HFS_CREATING_BTREE is cleared, uses hfs_mutex */
+    uint32_t             hfs_dirmod_waiters;     /* protected by hfs_mutex */
+    ContentionStats_S    hfs_contention;         /* protected by hfs_mutex */
     pthread_mutex_t      sync_mutex;     
     
     enum {
@@ -279,10 +290,11 @@ typedef struct hfsmount {
     /* the full UUID of the volume, not the one stored in finderinfo */
     uuid_t         hfs_full_uuid;
 
-    /* Per mount cnode hash variables: */
-    pthread_mutex_t      hfs_chash_mutex;  /* protects access to cnode hash table */
-    u_long               hfs_cnodehash;    /* size of cnode hash table - 1 */
-    LIST_HEAD(cnodehashhead, cnode) *hfs_cnodehashtbl;    /* base of cnode hash */
+    /* Per mount cnode hash, see lf_hfs_chash.c */
+    struct CNodeHash     *hfs_chash;
+
+    /* Per mount name cache for lookups, see lf_hfs_namecache.c */
+    struct NameCache     *hfs_namecache;
 
     /* Per mount fileid hash variables  (protected by catalog lock!) */
     u_long hfs_idhash; /* size of cnid/fileid hash table -1 */
@@ -315,6 +327,15 @@ typedef struct hfsmount {
     //General counter of link id
     int cur_link_id;
 
+    // Share of the generic buffer cache budget contributed by this mount (bytes)
+    u_int64_t hfs_buf_cache_budget;
+
+    // Write-behind coalescing of small sequential writes, may be changed with LFHFS_FSATTR_WRITE_BEHIND
+    bool                        hfs_write_behind;
+    pthread_mutex_t             hfs_write_behind_mutex;     // Protects the dirty list
+    TAILQ_HEAD(, WriteBehind)   hfs_write_behind_dirty;     // Vnodes holding buffered data
+    u_int64_t                   hfs_write_behind_sync_pass;
+
 } hfsmount_t;
 
 typedef hfsmount_t  ExtendedVCB;
@@ -6,6 +6,7 @@
 #include "lf_hfs_btrees_private.h"
 #include "lf_hfs_btrees_internal.h"
 #include "lf_hfs_btrees_io.h"
+#include "lf_hfs_btree_prefetch.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_vfsops.h"
 #include "lf_hfs_file_extent_mapping.h"
@@ -69,6 +70,7 @@ OSStatus BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
     btreePtr->getBlockProc        = GetBTreeBlock;
     btreePtr->releaseBlockProc    = ReleaseBTreeBlock;
     btreePtr->setEndOfForkProc    = ExtendBTreeFile;
+    btreePtr->prefetchBlockProc   = lf_hfs_btree_prefetch;
     btreePtr->keyCompareProc      = keyCompareProc;
     
     /////////////////////////// Read Header Node ////////////////////////////////
@@ -590,7 +592,7 @@ OSStatus    BTIterateRecord        (FCB                        *filePtr,
     
     // Not called for (operation == kBTreeFirstRecord || operation == kBTreeLastRecord)
     err = FindIteratorPosition (btreePtr, iterator,
-                                &left, &node, &right, &nodeNum, &index, &foundRecord);
+                                &left, &node, &right, &nodeNum, &index, &foundRecord, false);
     M_ExitOnError (err);
     
     
@@ -680,6 +682,7 @@ OSStatus    BTIterateRecord        (FCB                        *filePtr,
             node         = right;
             right.buffer = nil;
             index         = 0;
+            PrefetchSiblingNodes(btreePtr, node.buffer);
         }
     }
     else // operation == kBTreeCurrentRecord
@@ -899,7 +902,7 @@ BTIterateRecords(FCB *filePtr, BTreeIterationOperation operation, BTreeIterator
     
     // Not called for (operation == kBTreeFirstRecord || operation == kBTreeLastRecord)
     err = FindIteratorPosition(btreePtr, iterator, &left, &node, &right,
-                               &nodeNum, &index, &foundRecord);
+                               &nodeNum, &index, &foundRecord, operation == kBTreeNextRecord);
     if (err == fsBTRecordNotFoundErr)
         err = 0;
     M_ExitOnError(err);
@@ -991,6 +994,7 @@ BTIterateRecords(FCB *filePtr, BTreeIterationOperation operation, BTreeIterator
             node         = right;
             right.buffer = nil;
             index         = 0;
+            PrefetchSiblingNodes(btreePtr, node.buffer);
         }
     }
     else // operation == kBTreeCurrentRecord
@@ -1041,6 +1045,7 @@ ProcessData:
             node         = right;
             right.buffer = nil;
             index         = 0;
+            PrefetchSiblingNodes(btreePtr, node.buffer);
         }
         err = GetRecordByIndex(btreePtr, node.buffer, index,
                                &keyPtr, &recordPtr, &len);
@@ -1137,6 +1142,7 @@ OSStatus    BTInsertRecord        (FCB                        *filePtr,
     btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+    M_BTreeModifyStart (btreePtr);
     
     
     ///////////////////////// Find Insert Position //////////////////////////////
@@ -1250,6 +1256,7 @@ Success:
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
     
+    M_BTreeModifyEnd (btreePtr);
     return noErr;
     
     
@@ -1268,6 +1275,7 @@ ErrorExit:
     if (err == fsBTEmptyErr)
         err = fsBTRecordNotFoundErr;
     
+    M_BTreeModifyEnd (btreePtr);
     return err;
 }
 
@@ -1302,6 +1310,7 @@ OSStatus    BTReplaceRecord        (FCB                        *filePtr,
     btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+    M_BTreeModifyStart (btreePtr);
     
     ////////////////////////////// Take A Hint //////////////////////////////////
     
@@ -1399,6 +1408,7 @@ Success:
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
     
+    M_BTreeModifyEnd (btreePtr);
     return noErr;
     
     
@@ -1414,6 +1424,7 @@ ErrorExit:
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
     
+    M_BTreeModifyEnd (btreePtr);
     return err;
 }
 
@@ -1445,6 +1456,7 @@ BTUpdateRecord(FCB *filePtr, BTreeIterator *iterator,
     btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
+    M_BTreeModifyStart (btreePtr);
     
     ////////////////////////////// Take A Hint //////////////////////////////////
     
@@ -1515,6 +1527,7 @@ Success:
     iterator->hint.index        = 0;
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
+    M_BTreeModifyEnd (btreePtr);
     return noErr;
     
     ////////////////////////////// Error Exit ///////////////////////////////////
@@ -1528,6 +1541,7 @@ ErrorExit:
     iterator->hint.index        = 0;
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
+    M_BTreeModifyEnd (btreePtr);
     return err;
 }
 
@@ -1556,13 +1570,10 @@ OSStatus    BTDeleteRecord        (FCB                        *filePtr,
     M_ReturnErrorIf (iterator == nil,    paramErr);
     
     btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
-    if (btreePtr == nil)
-    {
-        err = fsBTInvalidFileErr;
-        goto ErrorExit;
-    }
+    M_ReturnErrorIf (btreePtr == nil,    fsBTInvalidFileErr);
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+    M_BTreeModifyStart (btreePtr);
     
     
     /////////////////////////////// Find Key ////////////////////////////////////
@@ -1604,6 +1615,7 @@ OSStatus    BTDeleteRecord        (FCB                        *filePtr,
     
     iterator->hint.nodeNum    = 0;
     
+    M_BTreeModifyEnd (btreePtr);
     return noErr;
     
     ////////////////////////////// Error Exit ///////////////////////////////////
@@ -1611,6 +1623,7 @@ OSStatus    BTDeleteRecord        (FCB                        *filePtr,
 ErrorExit:
     (void) ReleaseNode (btreePtr, &nodeRec);
     
+    M_BTreeModifyEnd (btreePtr);
     return    err;
 }
 
@@ -1857,6 +1870,57 @@ OSStatus    BTSetLastSync        (FCB                    *filePtr,
     return noErr;
 }
 
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTOptimisticReadStart / BTOptimisticReadValidate
+ 
+ Function:    Let a reader search the b-tree without the b-tree lock.  The reader
+              calls BTOptimisticReadStart, does its BTSearchRecord calls, and
+              trusts the results only if BTOptimisticReadValidate says no record
+              changed in the meantime; otherwise it must redo the search with
+              the b-tree lock held.
+ 
+              Each node is still only ever looked at by one thread at a time (the
+              buffer is owned while it's in use), so a racing reader can only see
+              whole nodes, from either side of a split or merge.  Such a descent
+              may follow a stale child pointer and fail or find the wrong record,
+              which is why its result has to be validated.  The caller must not
+              use this if the b-tree file has overflow extents, since mapping its
+              nodes would then need the extents b-tree.
+ 
+ Input:        filePtr    - pointer file control block
+ 
+ Output:        seq        - value to hand to BTOptimisticReadValidate
+ 
+ Result:        true    - go ahead (Start) / the searches were consistent (Validate)
+                false    - a record change is in progress (Start) / happened (Validate)
+ -------------------------------------------------------------------------------*/
+
+Boolean    BTOptimisticReadStart    (FCB                    *filePtr,
+                                      u_int32_t                *seq)
+{
+    BTreeControlBlockPtr    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    
+    if (btreePtr == nil)
+        return false;
+    
+    *seq = atomic_load_explicit(&btreePtr->modSeq, memory_order_acquire);
+    
+    return M_IsEven(*seq);
+}
+
+Boolean    BTOptimisticReadValidate    (FCB                    *filePtr,
+                                         u_int32_t                seq)
+{
+    BTreeControlBlockPtr    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    
+    // Order our node reads before the re-check
+    atomic_thread_fence(memory_order_acquire);
+    
+    return (atomic_load_explicit(&btreePtr->modSeq, memory_order_relaxed) == seq);
+}
+
 OSStatus    BTHasContiguousNodes    (FCB                     *filePtr)
 {
     BTreeControlBlockPtr    btreePtr;
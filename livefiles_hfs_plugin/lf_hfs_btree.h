@@ -96,6 +96,7 @@ typedef struct BTreeControlBlock {                    // fields specific to BTre
     GetBlockProcPtr                  getBlockProc;
     ReleaseBlockProcPtr             releaseBlockProc;
     SetEndOfForkProcPtr             setEndOfForkProc;
+    PrefetchBlocksProcPtr           prefetchBlockProc;      // May be nil, starts reading nodes in the background
 
     // statistical information
     u_int32_t                     numGetNodes;
@@ -223,7 +224,8 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr     btreePtr,
                                      BlockDescriptor        *right,
                                      u_int32_t                *nodeNum,
                                      u_int16_t                *index,
-                                     Boolean                *foundRecord );
+                                     Boolean                *foundRecord,
+                                     Boolean                prefetch );
 
 OSStatus    CheckInsertParams        (FCB                    *filePtr,
                                       BTreeIterator            *iterator,
@@ -343,6 +345,13 @@ u_int32_t    GetChildNodeNum            (BTreeControlBlockPtr     btreePtr,
                                          NodeDescPtr             nodePtr,
                                          u_int16_t                 index );
 
+void        PrefetchSiblingNodes    (BTreeControlBlockPtr     btreePtr,
+                                     NodeDescPtr             node );
+
+void        PrefetchChildNodes      (BTreeControlBlockPtr     btreePtr,
+                                     u_int32_t               nodeNum,
+                                     u_int16_t               firstIndex );
+
 void        MoveRecordsLeft            (u_int8_t *                 src,
                                         u_int8_t *                 dst,
                                         u_int16_t                 bytesToMove );
@@ -188,6 +188,7 @@ OSStatus UpdateHeader(BTreeControlBlockPtr btreePtr, Boolean forceWrite)
 
  Input:        btreePtr        - description
  iterator        - description
+ prefetch        - if the tree has to be searched, prefetch the leaves after the position
 
 
  Output:        iterator        - description
@@ -210,7 +211,8 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr     btreePtr,
                                      BlockDescriptor        *right,
                                      u_int32_t                *returnNodeNum,
                                      u_int16_t                *returnIndex,
-                                     Boolean                *foundRecord )
+                                     Boolean                *foundRecord,
+                                     Boolean                prefetch )
 {
     OSStatus        err;
     Boolean            foundIt;
@@ -384,6 +386,10 @@ SearchTheTree:
             case fsBTRecordNotFoundErr:                        break;
             default:                goto ErrorExit;
         }
+
+        // The iteration will walk the leaves to the right of this one, start reading them
+        if (prefetch && btreePtr->treeDepth > 1)
+            PrefetchChildNodes (btreePtr, treePathTable[2].node, treePathTable[2].index + 1);
     }
 
     /////////////////////////////// Success! ////////////////////////////////////
@@ -8,6 +8,10 @@
 #include "lf_hfs_btrees_private.h"
 #include "lf_hfs_utils.h"
 #include "lf_hfs_generic_buf.h"
+#include "lf_hfs_catalog.h"
+#include "lf_hfs_file_extent_mapping.h"
+#include "lf_hfs_xattr.h"
+#include "lf_hfs_unicode_wrappers.h"
 
 ///////////////////////// BTree Module Node Operations //////////////////////////
 //
@@ -570,28 +574,20 @@ void        DeleteRecord    (BTreeControlBlockPtr    btreePtr,
 
 /*-------------------------------------------------------------------------------
 
- Routine:    SearchNode    -    Return index for record that matches key.
-
- Function:    Returns the record index for the record that matches the search key.
- If no record was found that matches the search key, the "insert index"
- of where the record should go is returned instead.
-
- Algorithm:    A binary search algorithm is used to find the specified key.
+ Routine:    SearchNodeWith    -    Binary search of a node with a given key compare.
 
- Input:        btreePtr    - pointer to BTree control block
- node        - pointer to node that contains the record
- searchKey    - pointer to the key to match
-
- Output:        index        - pointer to beginning of key for record
-
- Result:        true    - success (index = record index)
- false    - key did not match anything in node (index = insert index)
+ Function:    The search loop shared by every flavour of SearchNode.  It is always
+ inlined, so when compareProc is a known function the comparison
+ is inlined into the loop as well.  Nodes are kept in host byte
+ order in memory, so the offset table is located once per node
+ and read directly on every probe.
  -------------------------------------------------------------------------------*/
-Boolean
-SearchNode( BTreeControlBlockPtr btreePtr,
-           NodeDescPtr node,
-           KeyPtr searchKey,
-           u_int16_t *returnIndex )
+static inline __attribute__((always_inline)) Boolean
+SearchNodeWith( BTreeControlBlockPtr btreePtr,
+               NodeDescPtr node,
+               KeyPtr searchKey,
+               u_int16_t *returnIndex,
+               KeyCompareProcPtr compareProc )
 {
     int32_t        lowerBound;
     int32_t        upperBound;
@@ -599,7 +595,6 @@ SearchNode( BTreeControlBlockPtr btreePtr,
     int32_t        result;
     KeyPtr        trialKey;
     u_int16_t    *offset;
-    KeyCompareProcPtr compareProc = btreePtr->keyCompareProc;
 
     lowerBound = 0;
     upperBound = node->numRecords - 1;
@@ -626,6 +621,126 @@ SearchNode( BTreeControlBlockPtr btreePtr,
     return false;
 }
 
+/*
+ * Inlined versions of the key compare procs of the HFS Plus B-trees.  They must
+ * order keys exactly like CompareExtendedCatalogKeys, cat_binarykeycompare,
+ * CompareExtentKeysPlus and hfs_attrkeycompare respectively.
+ */
+static inline __attribute__((always_inline)) int32_t
+SearchCatalogKeyCompare( void *searchKey, void *trialKey, Boolean bBinaryNames )
+{
+    HFSPlusCatalogKey *psSearchKey = searchKey;
+    HFSPlusCatalogKey *psTrialKey  = trialKey;
+
+    // Most probes of a catalog search land in other directories, settle those on the parentID alone
+    if (psSearchKey->parentID != psTrialKey->parentID)
+        return (psSearchKey->parentID > psTrialKey->parentID) ? 1 : -1;
+
+    if (bBinaryNames)
+        return UnicodeBinaryCompare(&psSearchKey->nodeName.unicode[0], psSearchKey->nodeName.length,
+                                    &psTrialKey->nodeName.unicode[0], psTrialKey->nodeName.length);
+
+    if (psSearchKey->nodeName.length == 0 || psTrialKey->nodeName.length == 0)
+        return psSearchKey->nodeName.length - psTrialKey->nodeName.length;
+
+    return FastUnicodeCompare(&psSearchKey->nodeName.unicode[0], psSearchKey->nodeName.length,
+                              &psTrialKey->nodeName.unicode[0], psTrialKey->nodeName.length);
+}
+
+static inline __attribute__((always_inline)) int32_t
+SearchCatalogKeyCompareFolding( void *searchKey, void *trialKey )
+{
+    return SearchCatalogKeyCompare(searchKey, trialKey, false);
+}
+
+static inline __attribute__((always_inline)) int32_t
+SearchCatalogKeyCompareBinary( void *searchKey, void *trialKey )
+{
+    return SearchCatalogKeyCompare(searchKey, trialKey, true);
+}
+
+static inline __attribute__((always_inline)) int32_t
+SearchExtentKeyCompare( void *searchKey, void *trialKey )
+{
+    HFSPlusExtentKey *psSearchKey = searchKey;
+    HFSPlusExtentKey *psTrialKey  = trialKey;
+
+    // fileID and forkType packed into one integer, in key order
+    u_int64_t uSearchFork = ((u_int64_t) psSearchKey->fileID << 8) | psSearchKey->forkType;
+    u_int64_t uTrialFork  = ((u_int64_t) psTrialKey->fileID << 8) | psTrialKey->forkType;
+
+    if (uSearchFork != uTrialFork)
+        return (uSearchFork > uTrialFork) ? 1 : -1;
+
+    if (psSearchKey->startBlock != psTrialKey->startBlock)
+        return (psSearchKey->startBlock > psTrialKey->startBlock) ? 1 : -1;
+
+    return 0;
+}
+
+static inline __attribute__((always_inline)) int32_t
+SearchAttrKeyCompare( void *searchKey, void *trialKey )
+{
+    HFSPlusAttrKey *psSearchKey = searchKey;
+    HFSPlusAttrKey *psTrialKey  = trialKey;
+    int32_t result;
+
+    if (psSearchKey->fileID != psTrialKey->fileID)
+        return (psSearchKey->fileID > psTrialKey->fileID) ? 1 : -1;
+
+    result = UnicodeBinaryCompare(&psSearchKey->attrName[0], psSearchKey->attrNameLen,
+                                  &psTrialKey->attrName[0], psTrialKey->attrNameLen);
+    if (result != 0)
+        return result;
+
+    if (psSearchKey->startBlock != psTrialKey->startBlock)
+        return (psSearchKey->startBlock > psTrialKey->startBlock) ? 1 : -1;
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------------
+
+ Routine:    SearchNode    -    Return index for record that matches key.
+
+ Function:    Returns the record index for the record that matches the search key.
+ If no record was found that matches the search key, the "insert index"
+ of where the record should go is returned instead.
+
+ Algorithm:    A binary search algorithm is used to find the specified key.
+ The B-trees of HFS Plus (recognized by their key compare proc)
+ get a search with their key comparison inlined, any other tree
+ calls its keyCompareProc for every probe.
+
+ Input:        btreePtr    - pointer to BTree control block
+ node        - pointer to node that contains the record
+ searchKey    - pointer to the key to match
+
+ Output:        index        - pointer to beginning of key for record
+
+ Result:        true    - success (index = record index)
+ false    - key did not match anything in node (index = insert index)
+ -------------------------------------------------------------------------------*/
+Boolean
+SearchNode( BTreeControlBlockPtr btreePtr,
+           NodeDescPtr node,
+           KeyPtr searchKey,
+           u_int16_t *returnIndex )
+{
+    KeyCompareProcPtr compareProc = btreePtr->keyCompareProc;
+
+    if (compareProc == (KeyCompareProcPtr) CompareExtendedCatalogKeys)
+        return SearchNodeWith(btreePtr, node, searchKey, returnIndex, SearchCatalogKeyCompareFolding);
+    if (compareProc == (KeyCompareProcPtr) cat_binarykeycompare)
+        return SearchNodeWith(btreePtr, node, searchKey, returnIndex, SearchCatalogKeyCompareBinary);
+    if (compareProc == (KeyCompareProcPtr) CompareExtentKeysPlus)
+        return SearchNodeWith(btreePtr, node, searchKey, returnIndex, SearchExtentKeyCompare);
+    if (compareProc == (KeyCompareProcPtr) hfs_attrkeycompare)
+        return SearchNodeWith(btreePtr, node, searchKey, returnIndex, SearchAttrKeyCompare);
+
+    return SearchNodeWith(btreePtr, node, searchKey, returnIndex, compareProc);
+}
+
 
 /*-------------------------------------------------------------------------------
 
@@ -870,6 +985,88 @@ u_int32_t    GetChildNodeNum            (BTreeControlBlockPtr     btreePtr,
 
 
 
+enum {
+    kPrefetchSiblingCount   = 8,
+    kPrefetchChildCount     = 16        // Bounded by what the buffer cache can hold on to
+};
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    PrefetchSiblingNodes    -    Start reading the leaves that follow a leaf.
+
+ Function:    Asks the prefetch proc to read the kPrefetchSiblingCount leaves that follow
+ node, so that an iteration moving right finds them in the cache.
+
+ Input:        btreePtr        - pointer to BTree control block
+ node            - leaf node the iteration just moved to
+
+ Result:        none, prefetch is only a hint
+ -------------------------------------------------------------------------------*/
+
+void        PrefetchSiblingNodes    (BTreeControlBlockPtr     btreePtr,
+                                     NodeDescPtr             node )
+{
+    u_int32_t        nodeNum = node->fLink;
+
+    if (btreePtr->prefetchBlockProc == nil || node->kind != kBTLeafNode || nodeNum == 0)
+        return;
+
+    (btreePtr->prefetchBlockProc) (btreePtr->fileRefNum, &nodeNum, 1, kPrefetchSiblingCount - 1);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    PrefetchChildNodes    -    Start reading the children of an index node.
+
+ Function:    Asks the prefetch proc to read the children of index node nodeNum from
+ record firstIndex on, so that an iteration walking its leaves does not have to
+ wait for them one at a time.
+
+ Input:        btreePtr        - pointer to BTree control block
+ nodeNum            - index node
+ firstIndex        - first child record to prefetch
+
+ Result:        none, prefetch is only a hint
+ -------------------------------------------------------------------------------*/
+
+void        PrefetchChildNodes      (BTreeControlBlockPtr     btreePtr,
+                                     u_int32_t               nodeNum,
+                                     u_int16_t               firstIndex )
+{
+    BlockDescriptor    node;
+    NodeDescPtr        nodePtr;
+    u_int32_t        children[kPrefetchChildCount];
+    ItemCount        count = 0;
+
+    if (btreePtr->prefetchBlockProc == nil)
+        return;
+
+    node.buffer            = nil;
+    node.blockHeader    = nil;
+
+    if (GetNode (btreePtr, nodeNum, 0, &node) != noErr)
+        return;
+
+    nodePtr = (NodeDescPtr) node.buffer;
+    if (nodePtr->kind == kBTIndexNode)
+    {
+        for (u_int16_t index = firstIndex; index < nodePtr->numRecords && count < kPrefetchChildCount; ++index)
+        {
+            children[count++] = GetChildNodeNum (btreePtr, nodePtr, index);
+        }
+    }
+
+    (void) ReleaseNode (btreePtr, &node);
+
+    // Keep following the leaves once the last child is in
+    if (count > 0)
+        (btreePtr->prefetchBlockProc) (btreePtr->fileRefNum, children, count, kPrefetchSiblingCount - 1);
+}
+
+
+
 /*-------------------------------------------------------------------------------
  Routine:    InsertOffset    -    Add an offset and adjust existing offsets by delta.
 
@@ -0,0 +1,277 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_btree_prefetch.c
+ *  livefiles_hfs
+ *
+ */
+
+#include <sys/queue.h>
+#include "lf_hfs_btree_prefetch.h"
+#include "lf_hfs.h"
+#include "lf_hfs_locks.h"
+#include "lf_hfs_logger.h"
+#include "lf_hfs_cnode.h"
+#include "lf_hfs_vfsutils.h"
+#include "lf_hfs_btrees_private.h"
+#include "lf_hfs_btrees_io.h"
+
+/*
+ * Asynchronous B-tree node prefetch.
+ *
+ * Iterating a B-tree reads its leaves one at a time, each GetNode waiting for the
+ * previous read to complete.  The B-tree code tells us which nodes it will need next
+ * (the children of the index node it is walking, the leaves following the current one)
+ * and a small pool of worker threads reads them into the buffer cache meanwhile, so the
+ * iteration later finds them there.  A request may also ask to follow the forward link
+ * of a leaf for a number of siblings, which is only known once the leaf is read.
+ *
+ * Prefetch is an optimization only: a worker never waits for the B-tree lock, it skips
+ * the request if a writer holds it, and requests beyond BT_PREFETCH_MAX_QUEUED are
+ * dropped.  The B-tree vnode must be drained with lf_hfs_btree_prefetch_drain before
+ * its B-tree control block goes away.
+ */
+typedef struct BTPrefetch
+{
+    TAILQ_ENTRY(BTPrefetch)     sLink;
+    vnode_t                     psVnode;
+    u_int32_t                   uNode;
+    u_int32_t                   uFollow;        // Leaf siblings to read after uNode
+} BTPrefetch_S;
+
+typedef struct
+{
+    pthread_mutex_t             sLock;
+    pthread_cond_t              sCond;          // Signalled when requests are queued
+    pthread_cond_t              sDoneCond;      // Signalled when a worker completes a request
+    TAILQ_HEAD(, BTPrefetch)    sQueue;
+    TAILQ_HEAD(, BTPrefetch)    sFreeList;
+    BTPrefetch_S                psRequests[BT_PREFETCH_MAX_QUEUED];
+    pthread_t                   psThreads[BT_PREFETCH_THREADS];
+    vnode_t                     psActive[BT_PREFETCH_THREADS];     // B-tree each worker is reading, if any
+    uint32_t                    uThreads;
+    bool                        bShutdown;
+} BTPrefetchPool_S;
+
+static BTPrefetchPool_S gsBTPrefetch = { .sLock = PTHREAD_MUTEX_INITIALIZER, .sCond = PTHREAD_COND_INITIALIZER, .sDoneCond = PTHREAD_COND_INITIALIZER };
+
+static void
+lf_hfs_btree_prefetch_read( vnode_t psVnode, u_int32_t uNode, u_int32_t uFollow )
+{
+    struct cnode* cp        = VTOC(psVnode);
+    struct filefork* fp     = VTOF(psVnode);
+
+    // Skip the request rather than wait for a writer (lf_lck_rw_try_lock returns 0 once locked)
+    if ( lf_lck_rw_try_lock( &cp->c_rwlock, LCK_RW_TYPE_SHARED ) )
+    {
+        return;
+    }
+
+    BTreeControlBlockPtr btreePtr = (BTreeControlBlockPtr) fp->fcbBTCBPtr;
+
+    // Mapping nodes described in the extents overflow file would need the extents B-tree lock
+    if ( btreePtr == NULL || overflow_extents( fp ) )
+    {
+        goto exit;
+    }
+
+    for ( u_int32_t u = 0; u <= uFollow && uNode != 0 && uNode < btreePtr->totalNodes; u++ )
+    {
+        BlockDescriptor sBlock = { .blockSize = btreePtr->nodeSize };
+
+        // The tree may have changed since the request was queued, accept empty nodes
+        if ( GetBTreeBlock( psVnode, uNode, kGetBlockHint, &sBlock ) != E_NONE )
+        {
+            break;
+        }
+
+        NodeDescPtr psNode = (NodeDescPtr) sBlock.buffer;
+        uNode = (psNode->kind == kBTLeafNode) ? psNode->fLink : 0;
+
+        (void) ReleaseBTreeBlock( psVnode, &sBlock, kReleaseBlock );
+    }
+
+exit:
+    lf_lck_rw_unlock_shared( &cp->c_rwlock );
+}
+
+static void*
+lf_hfs_btree_prefetch_thread( void* pvArg )
+{
+    uint32_t uWorker = (uint32_t)(uintptr_t) pvArg;
+
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+    while ( true )
+    {
+        while ( TAILQ_EMPTY(&gsBTPrefetch.sQueue) && !gsBTPrefetch.bShutdown )
+        {
+            pthread_cond_wait( &gsBTPrefetch.sCond, &gsBTPrefetch.sLock );
+        }
+
+        BTPrefetch_S* psReq = TAILQ_FIRST( &gsBTPrefetch.sQueue );
+        if ( psReq == NULL )
+        {
+            break;
+        }
+        TAILQ_REMOVE( &gsBTPrefetch.sQueue, psReq, sLink );
+
+        vnode_t   psVnode = psReq->psVnode;
+        u_int32_t uNode   = psReq->uNode;
+        u_int32_t uFollow = psReq->uFollow;
+        TAILQ_INSERT_HEAD( &gsBTPrefetch.sFreeList, psReq, sLink );
+
+        gsBTPrefetch.psActive[uWorker] = psVnode;
+        lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+
+        lf_hfs_btree_prefetch_read( psVnode, uNode, uFollow );
+
+        lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+        gsBTPrefetch.psActive[uWorker] = NULL;
+        pthread_cond_broadcast( &gsBTPrefetch.sDoneCond );
+    }
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+
+    return NULL;
+}
+
+int
+lf_hfs_btree_prefetch_init( void )
+{
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+    if ( gsBTPrefetch.uThreads == 0 )
+    {
+        TAILQ_INIT( &gsBTPrefetch.sQueue );
+        TAILQ_INIT( &gsBTPrefetch.sFreeList );
+        for ( uint32_t u = 0; u < BT_PREFETCH_MAX_QUEUED; u++ )
+        {
+            TAILQ_INSERT_TAIL( &gsBTPrefetch.sFreeList, &gsBTPrefetch.psRequests[u], sLink );
+        }
+        gsBTPrefetch.bShutdown = false;
+
+        for ( uint32_t u = 0; u < BT_PREFETCH_THREADS; u++ )
+        {
+            int iErr = pthread_create( &gsBTPrefetch.psThreads[u], NULL, lf_hfs_btree_prefetch_thread, (void*)(uintptr_t) u );
+            if ( iErr != 0 )
+            {
+                // Not fatal, we simply prefetch with fewer (or no) workers
+                LFHFS_LOG( LEVEL_ERROR, "lf_hfs_btree_prefetch_init: pthread_create failed [%d]\n", iErr );
+                break;
+            }
+            gsBTPrefetch.uThreads++;
+        }
+    }
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+
+    return 0;
+}
+
+void
+lf_hfs_btree_prefetch_de_init( void )
+{
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+    uint32_t uThreads = gsBTPrefetch.uThreads;
+    gsBTPrefetch.bShutdown = true;
+    pthread_cond_broadcast( &gsBTPrefetch.sCond );
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+
+    for ( uint32_t u = 0; u < uThreads; u++ )
+    {
+        pthread_join( gsBTPrefetch.psThreads[u], NULL );
+    }
+
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+    gsBTPrefetch.uThreads = 0;
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+}
+
+/*
+ * Start reading nodes puNodes[0 .. uCount-1] of the B-tree psVnode, and if the last one
+ * is a leaf, the uFollow leaves that follow it.  Never blocks on I/O, the caller may
+ * hold the B-tree lock and nodes of the tree.
+ */
+void
+lf_hfs_btree_prefetch( FileReference psVnode, const u_int32_t *puNodes, ItemCount uCount, ItemCount uFollow )
+{
+    bool bQueued = false;
+
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+    if ( gsBTPrefetch.uThreads == 0 || gsBTPrefetch.bShutdown )
+    {
+        goto exit;
+    }
+
+    for ( ItemCount u = 0; u < uCount; u++ )
+    {
+        BTPrefetch_S* psReq = NULL;
+
+        // Iterations of the same directory tend to ask for the same nodes
+        TAILQ_FOREACH( psReq, &gsBTPrefetch.sQueue, sLink )
+        {
+            if ( psReq->psVnode == psVnode && psReq->uNode == puNodes[u] )
+            {
+                break;
+            }
+        }
+        if ( psReq != NULL )
+        {
+            continue;
+        }
+
+        psReq = TAILQ_FIRST( &gsBTPrefetch.sFreeList );
+        if ( psReq == NULL )
+        {
+            break;
+        }
+        TAILQ_REMOVE( &gsBTPrefetch.sFreeList, psReq, sLink );
+
+        psReq->psVnode = psVnode;
+        psReq->uNode   = puNodes[u];
+        psReq->uFollow = (u == uCount - 1) ? (u_int32_t) uFollow : 0;
+        TAILQ_INSERT_TAIL( &gsBTPrefetch.sQueue, psReq, sLink );
+        bQueued = true;
+    }
+
+    if ( bQueued )
+    {
+        pthread_cond_broadcast( &gsBTPrefetch.sCond );
+    }
+
+exit:
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+}
+
+/*
+ * Drop the requests queued for psVnode and wait for the ones being read.
+ */
+void
+lf_hfs_btree_prefetch_drain( vnode_t psVnode )
+{
+    lf_lck_mtx_lock( &gsBTPrefetch.sLock );
+
+    BTPrefetch_S* psReq  = TAILQ_FIRST( &gsBTPrefetch.sQueue );
+    while ( psReq != NULL )
+    {
+        BTPrefetch_S* psNext = TAILQ_NEXT( psReq, sLink );
+        if ( psReq->psVnode == psVnode )
+        {
+            TAILQ_REMOVE( &gsBTPrefetch.sQueue, psReq, sLink );
+            TAILQ_INSERT_HEAD( &gsBTPrefetch.sFreeList, psReq, sLink );
+        }
+        psReq = psNext;
+    }
+
+    bool bBusy;
+    do
+    {
+        bBusy = false;
+        for ( uint32_t u = 0; u < BT_PREFETCH_THREADS; u++ )
+        {
+            bBusy |= (gsBTPrefetch.psActive[u] == psVnode);
+        }
+        if ( bBusy )
+        {
+            pthread_cond_wait( &gsBTPrefetch.sDoneCond, &gsBTPrefetch.sLock );
+        }
+    } while ( bBusy );
+
+    lf_lck_mtx_unlock( &gsBTPrefetch.sLock );
+}
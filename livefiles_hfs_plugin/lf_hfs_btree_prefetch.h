@@ -0,0 +1,23 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_btree_prefetch.h
+ *  livefiles_hfs
+ *
+ */
+
+#ifndef lf_hfs_btree_prefetch_h
+#define lf_hfs_btree_prefetch_h
+
+#include "lf_hfs_vnode.h"
+#include "lf_hfs_btrees_internal.h"
+
+#define BT_PREFETCH_THREADS     (4)
+#define BT_PREFETCH_MAX_QUEUED  (64)    // Further requests are dropped until the queue drains
+
+int     lf_hfs_btree_prefetch_init( void );
+void    lf_hfs_btree_prefetch_de_init( void );
+
+void    lf_hfs_btree_prefetch( FileReference psVnode, const u_int32_t *puNodes, ItemCount uCount, ItemCount uFollow );
+void    lf_hfs_btree_prefetch_drain( vnode_t psVnode );
+
+#endif /* lf_hfs_btree_prefetch_h */
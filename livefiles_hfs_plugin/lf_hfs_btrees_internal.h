@@ -104,6 +104,11 @@ typedef    OSStatus    (* SetEndOfForkProcPtr)    (FileReference
                                                    FSSize                       minEOF,
                                                    FSSize                       maxEOF );
 
+typedef    void        (* PrefetchBlocksProcPtr)  (FileReference                fileRefNum,
+                                                   const u_int32_t              *blockNums,
+                                                   ItemCount                    blockCount,
+                                                   ItemCount                    followCount );
+
 typedef    OSStatus    (* SetBlockSizeProcPtr)    (FileReference                fileRefNum,
                                                    ByteCount                    blockSize,
                                                    ItemCount                    minBlockCount );
@@ -317,6 +322,10 @@ OSStatus    BTGetLastSync        (FCB                        *filePtr,
 OSStatus    BTSetLastSync        (FCB                         *filePtr,
                                   u_int32_t                   lastfsync );
 
+Boolean     BTOptimisticReadStart(FCB *filePtr, u_int32_t *seq);
+
+Boolean     BTOptimisticReadValidate(FCB *filePtr, u_int32_t seq);
+
 OSStatus    BTHasContiguousNodes(FCB *filePtr);
 
 OSStatus    BTGetUserData(FCB *filePtr, void * dataPtr, int dataSize);
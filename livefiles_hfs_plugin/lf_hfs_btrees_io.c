@@ -22,6 +22,7 @@
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_vnops.h"
 #include "lf_hfs_journal.h"
+#include "lf_hfs_btree_prefetch.h"
 
 static int ClearBTNodes(struct vnode *vp, int blksize, off_t offset, off_t amount);
 static int btree_journal_modify_block_end(struct hfsmount *hfsmp, GenericLFBuf *bp);
@@ -623,8 +624,11 @@ again:
     hfs_lock_mount (hfsmp);
     if (hfsmp->hfs_flags & HFS_CREATING_BTREE) {
         /* Someone else beat us, wait for them to finish. */
+        hfsmp->hfs_contention.create_btree_waits++;
+        while (hfsmp->hfs_flags & HFS_CREATING_BTREE) {
+            pthread_cond_wait(&hfsmp->hfs_create_btree_cond, &hfsmp->hfs_mutex);
+        }
         hfs_unlock_mount (hfsmp);
-        usleep( 100 );
         if (hfsmp->hfs_attribute_vp) {
             return (0);
         }
@@ -680,6 +684,7 @@ again:
     btcb->getBlockProc      = GetBTreeBlock;
     btcb->releaseBlockProc  = ReleaseBTreeBlock;
     btcb->setEndOfForkProc  = ExtendBTreeFile;
+    btcb->prefetchBlockProc = lf_hfs_btree_prefetch;
     btcb->keyCompareProc    = (KeyCompareProcPtr)hfs_attrkeycompare;
 
     /*
@@ -910,6 +915,7 @@ exit:
      */
     hfs_lock_mount (hfsmp);
     hfsmp->hfs_flags &= ~HFS_CREATING_BTREE;
+    pthread_cond_broadcast(&hfsmp->hfs_create_btree_cond);
     hfs_unlock_mount (hfsmp);
 
     return (result);
@@ -8,6 +8,8 @@
 #ifndef lf_hfs_btrees_private_h
 #define lf_hfs_btrees_private_h
 
+#include <stdatomic.h>
+
 #include "lf_hfs_defs.h"
 #include "lf_hfs_file_mgr_internal.h"
 #include "lf_hfs_btrees_internal.h"
@@ -96,6 +98,7 @@ typedef struct {                    // fields specific to BTree CBs
     GetBlockProcPtr                 getBlockProc;
     ReleaseBlockProcPtr             releaseBlockProc;
     SetEndOfForkProcPtr             setEndOfForkProc;
+    PrefetchBlocksProcPtr           prefetchBlockProc;      // May be nil, starts reading nodes in the background
 
     // statistical information
     u_int32_t                       numGetNodes;
@@ -109,6 +112,8 @@ typedef struct {                    // fields specific to BTree CBs
     u_int32_t                       reservedNodes;
     BTreeIterator                   iterator;               // useable when holding exclusive b-tree lock
 
+    _Atomic u_int32_t               modSeq;                 // odd while a record is being inserted/replaced/updated/deleted
+
 #if DEBUG
     void                        *madeDirtyBy[2];
 #endif
@@ -134,6 +139,18 @@ static inline void M_BTreeHeaderDirty(BTreeControlBlock *bt) {
     bt->flags |= kBTHeaderDirty;
 }
 
+/*
+ * Bracket every change to the tree's records, so that readers without the
+ * b-tree lock (BTOptimisticReadStart) can tell their search raced with one.
+ */
+static inline void M_BTreeModifyStart(BTreeControlBlock *bt) {
+    atomic_fetch_add(&bt->modSeq, 1);
+}
+
+static inline void M_BTreeModifyEnd(BTreeControlBlock *bt) {
+    atomic_fetch_add(&bt->modSeq, 1);
+}
+
 typedef int8_t              *NodeBuffer;
 typedef BlockDescriptor     NodeRec, *NodePtr;        //remove this someday...
 
@@ -219,7 +236,8 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr       btreePtr,
                                      BlockDescriptor            *right,
                                      u_int32_t                  *nodeNum,
                                      u_int16_t                  *index,
-                                     Boolean                    *foundRecord );
+                                     Boolean                    *foundRecord,
+                                     Boolean                    prefetch );
 
 OSStatus    CheckInsertParams        (FCB                       *filePtr,
                                       BTreeIterator             *iterator,
@@ -339,6 +357,13 @@ u_int32_t    GetChildNodeNum            (BTreeControlBlockPtr       btreePtr,
                                          NodeDescPtr                nodePtr,
                                          u_int16_t                  index );
 
+void        PrefetchSiblingNodes    (BTreeControlBlockPtr       btreePtr,
+                                     NodeDescPtr                node );
+
+void        PrefetchChildNodes      (BTreeControlBlockPtr       btreePtr,
+                                     u_int32_t                  nodeNum,
+                                     u_int16_t                  firstIndex );
+
 void        MoveRecordsLeft            (u_int8_t *                  src,
                                         u_int8_t *                  dst,
                                         u_int16_t                   bytesToMove );
@@ -1701,6 +1701,41 @@ exit:
     return (result);
 }
 
+/*
+ * cat_lookup_optimistic - cat_lookup without the catalog b-tree lock
+ *
+ * Runs cat_lookup while no catalog record is being changed and returns
+ * EAGAIN if one was changed meanwhile (or a change was in progress), in
+ * which case the caller must repeat the lookup with the catalog lock held.
+ * Any other result is exactly what cat_lookup would have returned.
+ *
+ * Note: The caller is responsible for releasing the output
+ * catalog descriptor (when supplied outdescp is non-null).
+ */
+int
+cat_lookup_optimistic(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
+                      struct cat_desc *outdescp, struct cat_attr *attrp,
+                      struct cat_fork *forkp, cnid_t *desc_cnid)
+{
+    FCB *fcb = VTOF(HFSTOVCB(hfsmp)->catalogRefNum);
+    u_int32_t seq;
+    int result;
+
+    /* Mapping the catalog's nodes would need the extents b-tree lock */
+    if (overflow_extents(fcb) || !BTOptimisticReadStart(fcb, &seq))
+        return (EAGAIN);
+
+    result = cat_lookup(hfsmp, descp, wantrsrc, outdescp, attrp, forkp, desc_cnid);
+
+    if (!BTOptimisticReadValidate(fcb, seq)) {
+        if (result == 0 && outdescp != NULL)
+            cat_releasedesc(outdescp);
+        return (EAGAIN);
+    }
+
+    return (result);
+}
+
 /*
  * cat_lookupmangled - lookup a catalog node using a mangled name
  */
@@ -254,6 +254,9 @@ void    cat_releasedesc( struct cat_desc *descp );
 int     cat_lookup(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
                    struct cat_desc *outdescp, struct cat_attr *attrp,
                    struct cat_fork *forkp, cnid_t *desc_cnid);
+int     cat_lookup_optimistic(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
+                              struct cat_desc *outdescp, struct cat_attr *attrp,
+                              struct cat_fork *forkp, cnid_t *desc_cnid);
 int     cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wantrsrc,
                      struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp);
 int     cat_lookupmangled(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
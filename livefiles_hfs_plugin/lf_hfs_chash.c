@@ -6,6 +6,7 @@
  *  Created by Or Haimovich on 18/3/18.
  */
 
+#include <stdatomic.h>
 #include "lf_hfs_chash.h"
 #include "lf_hfs_cnode.h"
 #include "lf_hfs_locks.h"
@@ -13,16 +14,187 @@
 #include "lf_hfs_logger.h"
 #include "lf_hfs_vfsutils.h"
 
-#define DESIRED_VNODES (128)        /* number of vnodes desired */
-#define CNODEHASH(hfsmp, inum) (&hfsmp->hfs_cnodehashtbl[(inum) & hfsmp->hfs_cnodehash])
+#define CHASH_STRIPES           (64)        /* Bucket locks, must be a power of 2 */
+#define CHASH_MIN_BUCKETS       (256)       /* Initial table size, must be a power of 2 >= CHASH_STRIPES */
+#define CHASH_MAX_LOAD          (2)         /* Grow once there are more cnodes than this per bucket */
+#define CHASH_MIGRATE_CHUNK     (32)        /* Old buckets moved to the new table per insert while growing */
+
+/*
+ * Per mount cnode hash.
+ *
+ * Bucket b is protected by stripe lock (b & (CHASH_STRIPES - 1)).  Since every table
+ * size is a multiple of CHASH_STRIPES, a cnode is always protected by the stripe lock
+ * selected by its fileid, whatever the table size, and c_hflag and c_cacsh_cond of a
+ * cnode are protected by that lock as well.
+ *
+ * The table doubles once it holds more than CHASH_MAX_LOAD cnodes per bucket.  Growing
+ * only swaps in an empty table (with all stripe locks held); the cnodes are then moved
+ * over incrementally: an operation on a fileid first moves the old bucket of that fileid,
+ * and every insert moves another CHASH_MIGRATE_CHUNK old buckets.  The old table is freed
+ * once all of its buckets were moved.
+ */
+LIST_HEAD(cnodehashhead, cnode);
+
+typedef struct CNodeHashStripe
+{
+    pthread_mutex_t         sLock;
+} __attribute__((aligned(64))) CNodeHashStripe_S;
+
+typedef struct CNodeHash
+{
+    CNodeHashStripe_S       psStripes[CHASH_STRIPES];
+    struct cnodehashhead    *psTable;           /* Protected by all stripe locks, stable while holding one */
+    u_long                  uMask;
+    struct cnodehashhead    *psOldTable;        /* Table being migrated from, or NULL */
+    u_long                  uOldMask;
+    pthread_mutex_t         sResizeLock;        /* Serializes growing and migrating */
+    u_long                  uMigrateNext;       /* Next old bucket to migrate, protected by sResizeLock */
+    _Atomic bool            bMigrating;
+    _Atomic u_long          uCount;             /* Number of cnodes in the hash */
+} CNodeHash_S;
+
+static inline pthread_mutex_t *
+hfs_chash_stripe_lock(CNodeHash_S *psHash, u_long uBucket)
+{
+    return &psHash->psStripes[uBucket & (CHASH_STRIPES - 1)].sLock;
+}
+
+/*
+ * Move the cnodes of old bucket uOldBucket to the current table.
+ * The stripe lock of the bucket should be held by the caller.
+ */
+static void
+hfs_chash_migrate_bucket(CNodeHash_S *psHash, u_long uOldBucket)
+{
+    struct cnodehashhead *psOld = &psHash->psOldTable[uOldBucket];
+    struct cnode *cp;
+
+    while ((cp = LIST_FIRST(psOld)) != NULL)
+    {
+        LIST_REMOVE(cp, c_hash);
+        LIST_INSERT_HEAD(&psHash->psTable[cp->c_fileid & psHash->uMask], cp, c_hash);
+    }
+}
+
+/*
+ * Lock the stripe of inum and return its lock.
+ */
+static inline pthread_mutex_t *
+hfs_chash_lock(struct hfsmount *hfsmp, ino_t inum)
+{
+    pthread_mutex_t *psLock = hfs_chash_stripe_lock(hfsmp->hfs_chash, inum);
+
+    lf_lck_mtx_lock(psLock);
+    return psLock;
+}
+
+/*
+ * Return the bucket of inum, moving it to the current table first if the table is
+ * growing.  The stripe lock of inum should be held by the caller.
+ */
+static inline struct cnodehashhead *
+hfs_chash_bucket(struct hfsmount *hfsmp, ino_t inum)
+{
+    CNodeHash_S *psHash = hfsmp->hfs_chash;
+
+    if (psHash->psOldTable != NULL)
+    {
+        hfs_chash_migrate_bucket(psHash, inum & psHash->uOldMask);
+    }
+    return &psHash->psTable[inum & psHash->uMask];
+}
+
+static void
+hfs_chash_lock_all(CNodeHash_S *psHash)
+{
+    for (int i = 0; i < CHASH_STRIPES; i++)
+    {
+        lf_lck_mtx_lock(&psHash->psStripes[i].sLock);
+    }
+}
+
+static void
+hfs_chash_unlock_all(CNodeHash_S *psHash)
+{
+    for (int i = CHASH_STRIPES - 1; i >= 0; i--)
+    {
+        lf_lck_mtx_unlock(&psHash->psStripes[i].sLock);
+    }
+}
+
+/*
+ * Called after an insert, without any stripe lock held.  Starts growing the table
+ * when it gets too loaded, and moves some buckets over while it is growing.
+ */
+static void
+hfs_chash_grow(CNodeHash_S *psHash)
+{
+    bool bMigrating = atomic_load_explicit(&psHash->bMigrating, memory_order_relaxed);
+    u_long uCount   = atomic_load_explicit(&psHash->uCount, memory_order_relaxed);
+
+    if (!bMigrating && uCount <= CHASH_MAX_LOAD * (__atomic_load_n(&psHash->uMask, __ATOMIC_RELAXED) + 1))
+    {
+        return;
+    }
+
+    // Somebody else is growing the table already, let them do it
+    if (lf_lck_mtx_try_lock(&psHash->sResizeLock))
+    {
+        return;
+    }
+
+    if (psHash->psOldTable == NULL)
+    {
+        u_long uNewMask;
+        struct cnodehashhead *psNewTable;
+
+        if (uCount <= CHASH_MAX_LOAD * (psHash->uMask + 1) ||
+            (psNewTable = hashinit((int)MIN(2 * (psHash->uMask + 1), INT_MAX), &uNewMask)) == NULL)
+        {
+            goto exit;
+        }
+
+        hfs_chash_lock_all(psHash);
+        psHash->psOldTable   = psHash->psTable;
+        psHash->uOldMask     = psHash->uMask;
+        psHash->psTable      = psNewTable;
+        __atomic_store_n(&psHash->uMask, uNewMask, __ATOMIC_RELAXED);
+        psHash->uMigrateNext = 0;
+        atomic_store_explicit(&psHash->bMigrating, true, memory_order_relaxed);
+        hfs_chash_unlock_all(psHash);
+    }
+
+    for (int i = 0; i < CHASH_MIGRATE_CHUNK && psHash->uMigrateNext <= psHash->uOldMask; i++, psHash->uMigrateNext++)
+    {
+        pthread_mutex_t *psLock = hfs_chash_stripe_lock(psHash, psHash->uMigrateNext);
+        lf_lck_mtx_lock(psLock);
+        hfs_chash_migrate_bucket(psHash, psHash->uMigrateNext);
+        lf_lck_mtx_unlock(psLock);
+    }
+
+    if (psHash->uMigrateNext > psHash->uOldMask)
+    {
+        // All old buckets are empty, nobody looks at the old table once we hold all the locks
+        hfs_chash_lock_all(psHash);
+        struct cnodehashhead *psOldTable = psHash->psOldTable;
+        psHash->psOldTable = NULL;
+        atomic_store_explicit(&psHash->bMigrating, false, memory_order_relaxed);
+        hfs_chash_unlock_all(psHash);
+
+        hfs_free(psOldTable);
+    }
+
+exit:
+    lf_lck_mtx_unlock(&psHash->sResizeLock);
+}
 
 static void
-hfs_chash_wait(struct hfsmount *hfsmp, struct cnode  *cp,  bool bUnlock)
+hfs_chash_wait(pthread_mutex_t *psLock, struct cnode  *cp,  bool bUnlock)
 {
     SET(cp->c_hflag, H_WAITING);
-    pthread_cond_wait(&cp->c_cacsh_cond, &hfsmp->hfs_chash_mutex);
+    pthread_cond_wait(&cp->c_cacsh_cond, psLock);
     if (bUnlock)
-        hfs_chash_unlock(hfsmp);
+        lf_lck_mtx_unlock(psLock);
 }
 
 void
@@ -57,35 +229,25 @@ hfs_chashinit()
 {
 }
 
-void hfs_chash_lock(struct hfsmount *hfsmp)
-{
-    lf_lck_mtx_lock(&hfsmp->hfs_chash_mutex);
-}
-
-void hfs_chash_lock_spin(struct hfsmount *hfsmp)
+static void
+hfs_chash_wakeup_locked(struct cnode *cp, int hflags)
 {
-    lf_lck_mtx_lock_spin(&hfsmp->hfs_chash_mutex);
-}
-
+    CLR(cp->c_hflag, hflags);
 
-void hfs_chash_unlock(struct hfsmount *hfsmp)
-{
-    lf_lck_mtx_unlock(&hfsmp->hfs_chash_mutex);
+    if (ISSET(cp->c_hflag, H_WAITING)) {
+        CLR(cp->c_hflag, H_WAITING);
+        pthread_cond_broadcast(&cp->c_cacsh_cond);
+    }
 }
 
 void
 hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 {
-    hfs_chash_lock_spin(hfsmp);
+    pthread_mutex_t *psLock = hfs_chash_lock(hfsmp, cp->c_fileid);
 
-    CLR(cp->c_hflag, hflags);
-
-    if (ISSET(cp->c_hflag, H_WAITING)) {
-        CLR(cp->c_hflag, H_WAITING);
-        pthread_cond_broadcast(&cp->c_cacsh_cond);
-    }
+    hfs_chash_wakeup_locked(cp, hflags);
     
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
 }
 
 /*
@@ -94,11 +256,12 @@ hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 void
 hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    pthread_mutex_t *psLock = hfs_chash_lock(hfsmp, cp->c_fileid);
 
     LIST_REMOVE(cp, c_hash);
     cp->c_hash.le_next = NULL;
     cp->c_hash.le_prev = NULL;
+    atomic_fetch_sub_explicit(&hfsmp->hfs_chash->uCount, 1, memory_order_relaxed);
 
     CLR(cp->c_hflag, H_ATTACH | H_ALLOC);
     if (ISSET(cp->c_hflag, H_WAITING))
@@ -106,35 +269,74 @@ hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
         CLR(cp->c_hflag, H_WAITING);
         pthread_cond_broadcast(&cp->c_cacsh_cond);
     }
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
 }
 
 
 
-void
+int
 hfs_chashinit_finish(struct hfsmount *hfsmp)
 {
-    lf_lck_mtx_init(&hfsmp->hfs_chash_mutex);
-    hfsmp->hfs_cnodehashtbl = hashinit(DESIRED_VNODES / 4, &hfsmp->hfs_cnodehash);
+    CNodeHash_S *psHash = hfs_mallocz(sizeof(CNodeHash_S));
+    if (psHash == NULL)
+    {
+        return ENOMEM;
+    }
+
+    psHash->psTable = hashinit(CHASH_MIN_BUCKETS, &psHash->uMask);
+    if (psHash->psTable == NULL)
+    {
+        hfs_free(psHash);
+        return ENOMEM;
+    }
+
+    for (int i = 0; i < CHASH_STRIPES; i++)
+    {
+        lf_lck_mtx_init(&psHash->psStripes[i].sLock);
+    }
+    lf_lck_mtx_init(&psHash->sResizeLock);
+
+    hfsmp->hfs_chash = psHash;
+    return 0;
 }
 
 void
 hfs_delete_chash(struct hfsmount *hfsmp)
 {
+    CNodeHash_S *psHash = hfsmp->hfs_chash;
     struct cnode  *cp;
-    hfs_chash_lock_spin(hfsmp);
+
+    if (psHash == NULL)
+    {
+        return;
+    }
+
+    hfs_chash_lock_all(psHash);
     
-    for (ino_t inum = 0;  inum < (DESIRED_VNODES/4); inum++)
+    for (int iTable = 0; iTable < 2; iTable++)
     {
-        for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
-            LFHFS_LOG(LEVEL_ERROR, "hfs_delete_chash: Cnode for file [%s], cnid: [%d] with open count [%d] left in the cache \n", cp->c_desc.cd_nameptr, cp->c_desc.cd_cnid, cp->uOpenLookupRefCount);
+        struct cnodehashhead *psTable = (iTable == 0) ? psHash->psTable : psHash->psOldTable;
+        u_long uMask = (iTable == 0) ? psHash->uMask : psHash->uOldMask;
+
+        for (u_long uBucket = 0; psTable != NULL && uBucket <= uMask; uBucket++)
+        {
+            for (cp = psTable[uBucket].lh_first; cp; cp = cp->c_hash.le_next) {
+                LFHFS_LOG(LEVEL_ERROR, "hfs_delete_chash: Cnode for file [%s], cnid: [%d] with open count [%d] left in the cache \n", cp->c_desc.cd_nameptr, cp->c_desc.cd_cnid, cp->uOpenLookupRefCount);
+            }
         }
     }
-    
         
-    hfs_chash_unlock(hfsmp);
-    lf_lck_mtx_destroy(&hfsmp->hfs_chash_mutex);
-    hfs_free(hfsmp->hfs_cnodehashtbl);
+    hfs_chash_unlock_all(psHash);
+
+    for (int i = 0; i < CHASH_STRIPES; i++)
+    {
+        lf_lck_mtx_destroy(&psHash->psStripes[i].sLock);
+    }
+    lf_lck_mtx_destroy(&psHash->sResizeLock);
+    hfs_free(psHash->psOldTable);
+    hfs_free(psHash->psTable);
+    hfs_free(psHash);
+    hfsmp->hfs_chash = NULL;
 }
 
 /*
@@ -158,6 +360,7 @@ hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int w
     struct cnode  *cp;
     struct cnode  *ncp = NULL;
     vnode_t       vp;
+    pthread_mutex_t *psLock;
 
     /*
      * Go through the hash list
@@ -165,9 +368,9 @@ hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int w
      * allocated, wait for it to be finished and then try again.
      */
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    psLock = hfs_chash_lock(hfsmp, inum);
 loop_with_lock:
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next)
+    for (cp = hfs_chash_bucket(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next)
     {
         if (cp->c_fileid != inum)
         {
@@ -178,7 +381,7 @@ loop_with_lock:
          */
         if (ISSET(cp->c_hflag, H_ALLOC | H_ATTACH | H_TRANSIT))
         {
-            hfs_chash_wait(hfsmp, cp, false);
+            hfs_chash_wait(psLock, cp, false);
             goto loop_with_lock;
         }
         
@@ -199,7 +402,7 @@ loop_with_lock:
              * this cnode and add it to the hash
              * just dump our allocation
              */
-            hfs_free(ncp);
+            hfs_zfree(ncp, HFS_CNODE_ZONE);
             ncp = NULL;
         }
 
@@ -222,13 +425,13 @@ loop_with_lock:
                  * vnode_getwithvid().
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                lf_lck_mtx_unlock(psLock);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    lf_lck_mtx_lock(psLock);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                lf_lck_mtx_lock(psLock);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -264,7 +467,8 @@ loop_with_lock:
             }
             else
             {
-                hfs_chashwakeup(hfsmp, cp, H_ATTACH);
+                /* We hold the stripe lock already, hfs_chashwakeup would take it again */
+                hfs_chash_wakeup_locked(cp, H_ATTACH);
                 *hflags &= ~H_ATTACH;
             }
             
@@ -278,7 +482,7 @@ loop_with_lock:
         }
         
         if (cp) hfs_chash_raise_OpenLookupCounter(cp);
-        hfs_chash_unlock(hfsmp);
+        lf_lck_mtx_unlock(psLock);
         *vpp = vp;
         return (cp);
     }
@@ -294,8 +498,8 @@ loop_with_lock:
 
     if (ncp == NULL)
     {
-        hfs_chash_unlock(hfsmp);
-        ncp = hfs_mallocz(sizeof(struct cnode));
+        lf_lck_mtx_unlock(psLock);
+        ncp = hfs_zalloc(HFS_CNODE_ZONE);
         if (ncp == NULL)
         {
             return ncp;
@@ -326,9 +530,12 @@ loop_with_lock:
     }
 
     /* Insert the new cnode with it's H_ALLOC flag set */
-    LIST_INSERT_HEAD(CNODEHASH(hfsmp, inum), ncp, c_hash);
+    LIST_INSERT_HEAD(hfs_chash_bucket(hfsmp, inum), ncp, c_hash);
+    atomic_fetch_add_explicit(&hfsmp->hfs_chash->uCount, 1, memory_order_relaxed);
     hfs_chash_raise_OpenLookupCounter(ncp);
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
+
+    hfs_chash_grow(hfsmp->hfs_chash);
     *vpp = NULL;
     return (ncp);
 }
@@ -343,6 +550,7 @@ hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiploc
 {
     struct cnode *cp = NULL;
     struct vnode *vp = NULL;
+    pthread_mutex_t *psLock;
 
     /*
      * Go through the hash list
@@ -350,14 +558,14 @@ hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiploc
      * allocated, wait for it to be finished and then try again.
      */
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    psLock = hfs_chash_lock(hfsmp, inum);
 loop_with_lock:
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
+    for (cp = hfs_chash_bucket(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
         if (cp->c_fileid != inum)
             continue;
         /* Wait if cnode is being created or reclaimed. */
         if (ISSET(cp->c_hflag, H_ALLOC | H_TRANSIT | H_ATTACH)) {
-            hfs_chash_wait(hfsmp, cp, true);
+            hfs_chash_wait(psLock, cp, true);
             goto loop;
         }
         /* Obtain the desired vnode. */
@@ -376,13 +584,13 @@ loop_with_lock:
                  * on here.
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                lf_lck_mtx_unlock(psLock);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    lf_lck_mtx_lock(psLock);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                lf_lck_mtx_lock(psLock);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -408,7 +616,7 @@ loop_with_lock:
     }
 
 exit:
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
     return vp;
 }
 
@@ -418,15 +626,16 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
 {
     struct cnode *cp;
     int result = ENOENT;
+    pthread_mutex_t *psLock;
 
     /*
      * Go through the hash list
      * If a cnode is in the process of being cleaned out or being
      * allocated, wait for it to be finished and then try again.
      */
-    hfs_chash_lock(hfsmp);
+    psLock = hfs_chash_lock(hfsmp, inum);
 
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
+    for (cp = hfs_chash_bucket(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
         if (cp->c_fileid != inum)
             continue;
 
@@ -461,14 +670,14 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
         }
         break;
     }
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
 
     return (result);
 }
 
 /* Search a cnode in the hash.  This function does not return cnode which
  * are getting created, destroyed or in transition.  Note that this function
- * does not acquire the cnode hash mutex, and expects the caller to acquire it.
+ * does not acquire the cnode hash lock, and expects the caller to acquire it.
  * On success, returns pointer to the cnode found.  On failure, returns NULL.
  */
 static
@@ -477,7 +686,7 @@ hfs_chash_search_cnid(struct hfsmount *hfsmp, cnid_t cnid)
 {
     struct cnode *cp;
 
-    for (cp = CNODEHASH(hfsmp, cnid)->lh_first; cp; cp = cp->c_hash.le_next) {
+    for (cp = hfs_chash_bucket(hfsmp, cnid)->lh_first; cp; cp = cp->c_hash.le_next) {
         if (cp->c_fileid == cnid) {
             break;
         }
@@ -506,8 +715,7 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
 {
     int retval = -1;
     struct cnode *cp;
-
-    hfs_chash_lock_spin(hfsmp);
+    pthread_mutex_t *psLock = hfs_chash_lock(hfsmp, cnid);
 
     cp = hfs_chash_search_cnid(hfsmp, cnid);
     if (cp) {
@@ -519,7 +727,7 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
         }
     }
 
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
     return retval;
 }
 
@@ -530,23 +738,24 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
 int
 hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    pthread_mutex_t *psLock = hfs_chash_lock(hfsmp, cp->c_fileid);
 
     /*
      * Check if a vnode is getting attached or if the cnode is in the middle
      * of a "get".
      */
     if (ISSET(cp->c_hflag, (H_ATTACH | H_GETTING))) {
-        hfs_chash_unlock(hfsmp);
+        lf_lck_mtx_unlock(psLock);
         return (EBUSY);
     }
     if (cp->c_hash.le_next || cp->c_hash.le_prev) {
         LIST_REMOVE(cp, c_hash);
         cp->c_hash.le_next = NULL;
         cp->c_hash.le_prev = NULL;
+        atomic_fetch_sub_explicit(&hfsmp->hfs_chash->uCount, 1, memory_order_relaxed);
     }
 
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
     return (0);
 }
 
@@ -556,7 +765,7 @@ hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 void
 hfs_chash_mark_in_transit(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    pthread_mutex_t *psLock = hfs_chash_lock(hfsmp, cp->c_fileid);
     SET(cp->c_hflag, H_TRANSIT);
-    hfs_chash_unlock(hfsmp);
+    lf_lck_mtx_unlock(psLock);
 }
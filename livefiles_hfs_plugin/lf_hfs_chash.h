@@ -12,10 +12,6 @@
 #include "lf_hfs.h"
 
 struct cnode* hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int wantrsrc, int skiplock, int *out_flags, int *hflags);
-void hfs_chash_lock(struct hfsmount *hfsmp);
-void hfs_chash_lock_spin(struct hfsmount *hfsmp);
-void hfs_chash_lock_convert(struct hfsmount *hfsmp);
-void hfs_chash_unlock(struct hfsmount *hfsmp);
 void hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags);
 void hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp);
 struct vnode* hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiplock, int allow_deleted);
@@ -21,6 +21,9 @@
 #include "lf_hfs_xattr.h"
 #include "lf_hfs_link.h"
 #include "lf_hfs_generic_buf.h"
+#include "lf_hfs_file_extent_mapping.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_writebehind.h"
 
 static void
 hfs_reclaim_cnode(struct cnode *cp)
@@ -48,7 +51,7 @@ hfs_reclaim_cnode(struct cnode *cp)
     lf_cond_destroy(&cp->c_cacsh_cond);
     lf_lck_rw_destroy(&cp->c_truncatelock);
 
-    hfs_free(cp);
+    hfs_zfree(cp, HFS_CNODE_ZONE);
 }
 
 /*
@@ -217,7 +220,7 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
                  */
                 if (*vpp != NULL)
                 {
-                    hfs_free(*vpp);
+                    hfs_zfree(*vpp, HFS_VNODE_ZONE);
                     *vpp = NULL;
                 }
 
@@ -404,7 +407,7 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
         /*
          * Allocate and initialize a file fork...
          */
-        fp = hfs_malloc(sizeof(struct filefork));
+        fp = hfs_zalloc(HFS_FILEFORK_ZONE);
         if (fp == NULL)
         {
             retval = ENOMEM;
@@ -423,6 +426,7 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
         }
         rl_init(&fp->ff_invalidranges);
         fp->ff_sysfileinfo = 0;
+        FileExtentMapAlloc(fp);
 
         if (wantrsrc)
         {
@@ -483,7 +487,8 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
             {
                 if (fp)
                 {
-                    hfs_free(fp);
+                    FileExtentMapFree(fp);
+                    hfs_zfree(fp, HFS_FILEFORK_ZONE);
                 }
                 retval = ENOMEM;
                 goto gnv_exit;
@@ -497,7 +502,10 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
             if (cp && cp->c_desc.cd_nameptr) {
                 vfsp.vnfs_cnp = hfs_malloc(sizeof(struct componentname));
                 if (vfsp.vnfs_cnp == NULL) {
-                    if (fp) hfs_free(fp);
+                    if (fp) {
+                        FileExtentMapFree(fp);
+                        hfs_zfree(fp, HFS_FILEFORK_ZONE);
+                    }
                     retval = ENOMEM;
                     goto gnv_exit;
                 }
@@ -585,7 +593,8 @@ hfs_getnewvnode(struct hfsmount *hfsmp, struct vnode *dvp, struct componentname
             else
                 cp->c_rsrcfork = NULL;
 
-            hfs_free(fp);
+            FileExtentMapFree(fp);
+            hfs_zfree(fp, HFS_FILEFORK_ZONE);
         }
         /*
          * If this is a newly created cnode or a vnode reclaim
@@ -1199,6 +1208,42 @@ hfs_unlockpair(struct cnode *cp1, struct cnode *cp2)
         hfs_unlock(cp2);
 }
 
+/*
+ * Clear C_DIR_MODIFICATION and wake up lookups waiting for it.
+ * The cnode must be locked exclusively by the caller.
+ */
+void
+hfs_dir_modification_end(struct hfsmount *hfsmp, struct cnode *dcp)
+{
+    dcp->c_flag &= ~C_DIR_MODIFICATION;
+
+    hfs_lock_mount(hfsmp);
+    if (hfsmp->hfs_dirmod_waiters)
+        pthread_cond_broadcast(&hfsmp->hfs_dirmod_cond);
+    hfs_unlock_mount(hfsmp);
+}
+
+/*
+ * Wait until the C_DIR_MODIFICATION in progress on dcp ends.  Called without
+ * the cnode lock; the caller relocks and checks the flag again, since another
+ * modification may have started in between.
+ *
+ * The flag is cleared before hfs_dir_modification_end takes the mount lock, so
+ * checking it under the mount lock can't miss the wakeup.
+ */
+void
+hfs_dir_modification_wait(struct hfsmount *hfsmp, struct cnode *dcp)
+{
+    hfs_lock_mount(hfsmp);
+    hfsmp->hfs_contention.dirmod_waits++;
+    hfsmp->hfs_dirmod_waiters++;
+    while (dcp->c_flag & C_DIR_MODIFICATION) {
+        pthread_cond_wait(&hfsmp->hfs_dirmod_cond, &hfsmp->hfs_mutex);
+    }
+    hfsmp->hfs_dirmod_waiters--;
+    hfs_unlock_mount(hfsmp);
+}
+
 /*
  * Increase the gen count by 1; if it wraps around to 0, increment by
  * two.  The cnode *must* be locked exclusively by the caller.
@@ -1934,7 +1979,8 @@ hfs_fork_release(struct cnode* cp, struct vnode *vp, bool bIsRsc, int* piErr)
             hfs_free(fp->ff_symlinkptr);
         }
         rl_remove_all(&fp->ff_invalidranges);
-        hfs_free(fp);
+        FileExtentMapFree(fp);
+        hfs_zfree(fp, HFS_FILEFORK_ZONE);
     }
     
     return reclaim_cnode;
@@ -1960,10 +2006,34 @@ hfs_vnop_reclaim(struct vnode *vp)
      * all dirty pages have been synced and nobody should be competing
      * with us for this thread.
      */
+    // Let any prefetch still touching this vnode finish first
+    lf_hfs_readahead_quiesce(vp);
+
     hfs_chash_mark_in_transit(hfsmp, cp);
 
     hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS);
 
+    /*
+     * Buffered data must reach the media while the forks still exist; the other
+     * fork's vnode may be released below as well.  The sync leaves cnodes in
+     * transit to us, so if this fails keep the vnode and its data, and let a
+     * later sync retry and report the error.
+     */
+    err = lf_hfs_writebehind_flush(vp);
+    if (!err) {
+        altvp = (cp->c_vp == vp) ? cp->c_rsrc_vp : cp->c_vp;
+        if (altvp != NULL) {
+            err = lf_hfs_writebehind_flush(altvp);
+        }
+        altvp = NULL;
+    }
+    if (err) {
+        LFHFS_LOG(LEVEL_ERROR, "hfs_vnop_reclaim: failed to write buffered data [%d], keeping vnode %p\n", err, vp);
+        hfs_chashwakeup(hfsmp, cp, H_TRANSIT);
+        hfs_unlock(cp);
+        return err;
+    }
+
     /*
 	 * If C_NOEXISTS is set on the cnode, then there's nothing teardown needs to do
 	 * because the catalog entry for this cnode is already gone.
@@ -2004,6 +2074,7 @@ hfs_vnop_reclaim(struct vnode *vp)
         if (!reclaim_cnode && cp->c_rsrc_vp != NULL)
         {
             altvp = cp->c_rsrc_vp;
+            lf_hfs_readahead_quiesce(altvp);
             reclaim_cnode = hfs_fork_release(cp, altvp, true, &err);
             if (err) return err;
         }
@@ -2014,6 +2085,7 @@ hfs_vnop_reclaim(struct vnode *vp)
         if (!reclaim_cnode && cp->c_vp != NULL)
         {
             altvp = cp->c_vp;
+            lf_hfs_readahead_quiesce(altvp);
             reclaim_cnode = hfs_fork_release(cp, altvp, false, &err);
             if (err) return err;
         }
@@ -2022,27 +2094,31 @@ hfs_vnop_reclaim(struct vnode *vp)
         hfs_assert(0);
     }
 
+    hfs_unlock(cp);
+
+    // A sync may still hold these vnodes; wait for it before their cnode can go away
+    lf_hfs_writebehind_destroy(vp);
+    if (altvp) {
+        lf_hfs_writebehind_destroy(altvp);
+    }
+
     /*
      * If there was only one active fork then we can release the cnode.
+     * Otherwise the cnode is in use.  If it is a directory, it could have
+     * no live forks.
      */
     if (reclaim_cnode) {
-        hfs_unlock(cp);
         hfs_chashwakeup(hfsmp, cp, H_ALLOC);
         hfs_reclaim_cnode(cp);
     }
-    else
-    {
-        /*
-         * cnode in use.  If it is a directory, it could have
-         * no live forks. Just release the lock.
-         */
-        hfs_unlock(cp);
+
+    lf_hfs_readahead_destroy(vp);
+    hfs_zfree(vp, HFS_VNODE_ZONE);
+    if (altvp) {
+        lf_hfs_readahead_destroy(altvp);
+        hfs_zfree(altvp, HFS_VNODE_ZONE);
     }
     
-    hfs_free(vp);
-    if (altvp)
-        hfs_free(altvp);
-    
     vp = NULL;
     return (0);
 }
@@ -14,6 +14,7 @@
 #include "lf_hfs_rangelist.h"
 #include "lf_hfs_vnode.h"
 #include <sys/stat.h>
+#include <stdatomic.h>
 
 enum hfs_locktype {
     HFS_SHARED_LOCK = 1,
@@ -52,6 +53,7 @@ struct filefork {
         char        *ffu_symlinkptr;        /* symbolic link pathname */
     } ff_union;
     struct cat_fork ff_data;                /* fork data (size, extents) */
+    struct ff_extent_map *ff_extmap;        /* cached extent map, see MapFileBlockC */
 };
 typedef struct filefork filefork_t;
 
@@ -108,7 +110,7 @@ struct cnode {
     
     LIST_ENTRY(cnode)               c_hash;                     /* cnode's hash chain */
     u_int32_t                       c_flag;                     /* cnode's runtime flags */
-    u_int32_t                       c_hflag;                    /* cnode's flags for maintaining hash - protected by global hash lock */
+    u_int32_t                       c_hflag;                    /* cnode's flags for maintaining hash - protected by its hash stripe lock */
     struct vnode                    *c_vp;                      /* vnode for data fork or dir */
     struct vnode                    *c_rsrc_vp;                 /* vnode for resource fork */
     u_int32_t                       c_childhint;                /* catalog hint for children (small dirs only) */
@@ -123,6 +125,7 @@ struct cnode {
         int16_t                     cu_syslockcount;            /* system file use only */
     } c_union;
     u_int32_t                       c_dirchangecnt;             /* changes each insert/delete (in-core only) */
+    _Atomic uint32_t                c_nc_gen;                   /* name cache generation, 0 if none (read without c_lock) */
     struct filefork                 *c_datafork;                /* cnode's data fork */
     struct filefork                 *c_rsrcfork;                /* cnode's rsrc fork */
     atomicflag_t                    c_touch_acctime;
@@ -177,7 +180,7 @@ typedef struct cnode cnode_t;
 #define c_dirhintcnt    c_union.cu_dirhintcnt
 #define c_syslockcount  c_union.cu_syslockcount
 
-/* hash maintenance flags kept in c_hflag and protected by hfs_chash_mutex */
+/* hash maintenance flags kept in c_hflag and protected by the cnode hash stripe lock */
 #define H_ALLOC      0x00001    /* CNode is being allocated */
 #define H_ATTACH     0x00002    /* CNode is being attached to by another vnode */
 #define H_TRANSIT    0x00004    /* CNode is getting recycled  */
@@ -271,7 +274,7 @@ enum { kFinderInvisibleMask = 1 << 14 };
  * HFS cnode hash functions.
  */
 void  hfs_chashinit(void);
-void  hfs_chashinit_finish(struct hfsmount *hfsmp);
+int   hfs_chashinit_finish(struct hfsmount *hfsmp);
 void  hfs_delete_chash(struct hfsmount *hfsmp);
 
 /* Get new default vnode */
@@ -359,6 +362,8 @@ void hfs_unlockpair(struct cnode *cp1, struct cnode *cp2);
 int  hfs_lockfour(struct cnode *cp1, struct cnode *cp2, struct cnode *cp3, struct cnode *cp4, enum hfs_locktype locktype, struct cnode **error_cnode);
 void hfs_unlockfour(struct cnode *cp1, struct cnode *cp2, struct cnode *cp3, struct cnode *cp4);
 uint32_t hfs_incr_gencount (struct cnode *cp);
+void hfs_dir_modification_end(struct hfsmount *hfsmp, struct cnode *dcp);
+void hfs_dir_modification_wait(struct hfsmount *hfsmp, struct cnode *dcp);
 void hfs_clear_might_be_dirty_flag(cnode_t *cp);
 void hfs_write_dateadded (struct cat_attr *attrp, uint64_t dateadded);
 u_int32_t hfs_get_dateadded(struct cnode *cp);
@@ -271,6 +271,206 @@ static OSErr DeleteExtentRecord(
 
 
 
+//_________________________________________________________________________________
+//
+// Per-fork extent map
+//
+// A sorted, in-memory copy of the fork's extents, filled lazily with every extent
+// record MapFileBlockC has to look up.  Lookups are answered with a binary search
+// instead of going through SearchExtentFile and the extents BTree.
+// The map is dropped whenever the fork's extents change (ExtendFileC, TruncateFileC,
+// HeadTruncateFile, AddFileExtent).  Forks created outside hfs_getnewvnode have no
+// map and always take the slow path.
+//_________________________________________________________________________________
+
+#define FILE_EXTENT_MAP_INITIAL_ENTRIES (32)
+#define FILE_EXTENT_MAP_MAX_ENTRIES     (8192)
+
+typedef struct
+{
+    u_int32_t   uFABN;          // First file allocation block covered by the extent
+    u_int32_t   uStartBlock;    // First volume allocation block of the extent
+    u_int32_t   uBlockCount;
+} FileExtentMapEntry_S;
+
+struct ff_extent_map
+{
+    pthread_mutex_t         sLock;
+    u_int64_t               uGen;       // Bumped on every invalidation
+    FileExtentMapEntry_S*   psEntries;  // Sorted by uFABN, non overlapping
+    u_int32_t               uCount;
+    u_int32_t               uCapacity;
+};
+
+void
+FileExtentMapAlloc(FCB *fcb)
+{
+    struct ff_extent_map* psMap = hfs_mallocz(sizeof(struct ff_extent_map));
+    if (psMap == NULL)
+        return;
+
+    lf_lck_mtx_init(&psMap->sLock);
+    fcb->ff_extmap = psMap;
+}
+
+void
+FileExtentMapFree(FCB *fcb)
+{
+    struct ff_extent_map* psMap = fcb->ff_extmap;
+    if (psMap == NULL)
+        return;
+
+    fcb->ff_extmap = NULL;
+    lf_lck_mtx_destroy(&psMap->sLock);
+    if (psMap->psEntries)
+        hfs_free(psMap->psEntries);
+    hfs_free(psMap);
+}
+
+void
+FileExtentMapInvalidate(FCB *fcb)
+{
+    struct ff_extent_map* psMap = fcb->ff_extmap;
+    if (psMap == NULL)
+        return;
+
+    lf_lck_mtx_lock(&psMap->sLock);
+    psMap->uCount = 0;
+    psMap->uGen++;
+    lf_lck_mtx_unlock(&psMap->sLock);
+}
+
+// Returns the index of the last entry with uFABN <= uFABN, or -1 if there is none
+static int32_t
+FileExtentMapSearch(struct ff_extent_map* psMap, u_int32_t uFABN)
+{
+    int32_t iLow  = 0;
+    int32_t iHigh = (int32_t)psMap->uCount - 1;
+    int32_t iFound = -1;
+
+    while (iLow <= iHigh)
+    {
+        int32_t iMid = iLow + (iHigh - iLow) / 2;
+        if (psMap->psEntries[iMid].uFABN <= uFABN)
+        {
+            iFound = iMid;
+            iLow = iMid + 1;
+        }
+        else
+        {
+            iHigh = iMid - 1;
+        }
+    }
+
+    return iFound;
+}
+
+static Boolean
+FileExtentMapLookup(const FCB *fcb, u_int32_t uFABN, u_int32_t *puStartBlock, u_int32_t *puFirstFABN, u_int32_t *puNextFABN)
+{
+    struct ff_extent_map* psMap = fcb->ff_extmap;
+    Boolean bFound = false;
+
+    if (psMap == NULL)
+        return false;
+
+    lf_lck_mtx_lock(&psMap->sLock);
+    int32_t iIndex = FileExtentMapSearch(psMap, uFABN);
+    if (iIndex >= 0)
+    {
+        FileExtentMapEntry_S* psEntry = &psMap->psEntries[iIndex];
+        if (uFABN - psEntry->uFABN < psEntry->uBlockCount)
+        {
+            *puStartBlock = psEntry->uStartBlock;
+            *puFirstFABN  = psEntry->uFABN;
+            *puNextFABN   = psEntry->uFABN + psEntry->uBlockCount;
+            bFound = true;
+        }
+    }
+    lf_lck_mtx_unlock(&psMap->sLock);
+
+    return bFound;
+}
+
+static u_int64_t
+FileExtentMapGeneration(const FCB *fcb)
+{
+    struct ff_extent_map* psMap = fcb->ff_extmap;
+    u_int64_t uGen = 0;
+
+    if (psMap == NULL)
+        return 0;
+
+    lf_lck_mtx_lock(&psMap->sLock);
+    uGen = psMap->uGen;
+    lf_lck_mtx_unlock(&psMap->sLock);
+
+    return uGen;
+}
+
+/*
+ * Add the extents of a record starting at file allocation block uRecordFABN.
+ * The record is dropped if the map was invalidated since uGen was sampled,
+ * since it may describe extents that no longer exist.
+ */
+static void
+FileExtentMapInsert(const FCB *fcb, u_int64_t uGen, u_int32_t uRecordFABN, const HFSPlusExtentRecord extents)
+{
+    struct ff_extent_map* psMap = fcb->ff_extmap;
+    u_int32_t uFABN = uRecordFABN;
+
+    if (psMap == NULL)
+        return;
+
+    lf_lck_mtx_lock(&psMap->sLock);
+    if (psMap->uGen != uGen)
+        goto exit;
+
+    for (int i = 0; i < kHFSPlusExtentDensity && extents[i].blockCount != 0; ++i)
+    {
+        int32_t iIndex = FileExtentMapSearch(psMap, uFABN);
+        if (iIndex >= 0 && psMap->psEntries[iIndex].uFABN == uFABN)
+        {
+            // Already mapped
+            uFABN += extents[i].blockCount;
+            continue;
+        }
+
+        if (psMap->uCount == psMap->uCapacity)
+        {
+            if (psMap->uCapacity >= FILE_EXTENT_MAP_MAX_ENTRIES)
+                goto exit;
+
+            u_int32_t uNewCapacity = psMap->uCapacity ? psMap->uCapacity * 2 : FILE_EXTENT_MAP_INITIAL_ENTRIES;
+            FileExtentMapEntry_S* psNewEntries = hfs_malloc(uNewCapacity * sizeof(FileExtentMapEntry_S));
+            if (psNewEntries == NULL)
+                goto exit;
+
+            if (psMap->psEntries)
+            {
+                memcpy(psNewEntries, psMap->psEntries, psMap->uCount * sizeof(FileExtentMapEntry_S));
+                hfs_free(psMap->psEntries);
+            }
+            psMap->psEntries = psNewEntries;
+            psMap->uCapacity = uNewCapacity;
+        }
+
+        // Sequential access appends at the tail, so the move is usually empty
+        u_int32_t uInsert = (u_int32_t)(iIndex + 1);
+        memmove(&psMap->psEntries[uInsert + 1], &psMap->psEntries[uInsert], (psMap->uCount - uInsert) * sizeof(FileExtentMapEntry_S));
+        psMap->psEntries[uInsert].uFABN       = uFABN;
+        psMap->psEntries[uInsert].uStartBlock = extents[i].startBlock;
+        psMap->psEntries[uInsert].uBlockCount = extents[i].blockCount;
+        psMap->uCount++;
+
+        uFABN += extents[i].blockCount;
+    }
+
+exit:
+    lf_lck_mtx_unlock(&psMap->sLock);
+}
+
+
 //_________________________________________________________________________________
 //
 // Routine:        MapFileBlock
@@ -305,15 +505,23 @@ OSErr MapFileBlockC (
     allocBlockSize = vcb->blockSize;
     sectorSize = VCBTOHFS(vcb)->hfs_logical_block_size;
 
-    err = SearchExtentFile(vcb, fcb, offset, &foundKey, foundData, &foundIndex, &hint, &nextFABN);
-    if (err == noErr) {
-        startBlock = foundData[foundIndex].startBlock;
-        firstFABN = nextFABN - foundData[foundIndex].blockCount;
-    }
-
-    if (err != noErr)
+    //    Try the fork's extent map first, it saves the walk through the extents BTree
+    if (!FileExtentMapLookup(fcb, (u_int32_t)(offset / (off_t)allocBlockSize), &startBlock, &firstFABN, &nextFABN))
     {
-        return err;
+        u_int64_t uMapGen = FileExtentMapGeneration(fcb);
+
+        err = SearchExtentFile(vcb, fcb, offset, &foundKey, foundData, &foundIndex, &hint, &nextFABN);
+        if (err == noErr) {
+            startBlock = foundData[foundIndex].startBlock;
+            firstFABN = nextFABN - foundData[foundIndex].blockCount;
+
+            FileExtentMapInsert(fcb, uMapGen, (foundKey.keyLength == 0) ? 0 : foundKey.startBlock, foundData);
+        }
+
+        if (err != noErr)
+        {
+            return err;
+        }
     }
 
     //
@@ -665,6 +873,8 @@ AddFileExtent(ExtendedVCB *vcb, FCB *fcb, u_int32_t startBlock, u_int32_t blockC
     }
     (void) FlushExtentFile(vcb);
 
+    FileExtentMapInvalidate(fcb);
+
     return (error);
 }
 
@@ -1028,6 +1238,8 @@ Exit:
     if (needsFlush)
         (void) FlushExtentFile(vcb);
 
+    FileExtentMapInvalidate(fcb);
+
     return err;
 }
 
@@ -1220,6 +1432,8 @@ ErrorExit:
     if (recordDeleted)
         (void) FlushExtentFile(vcb);
 
+    FileExtentMapInvalidate(fcb);
+
     return err;
 }
 
@@ -1363,6 +1577,8 @@ CopyExtents:
     }
 
 ErrorExit:
+    FileExtentMapInvalidate(fcb);
+
     return MacToVFSError(error);
 }
 
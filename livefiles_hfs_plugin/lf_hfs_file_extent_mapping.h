@@ -53,6 +53,10 @@ int AddFileExtent(  ExtendedVCB     *vcb,
                   u_int32_t       startBlock,
                   u_int32_t       blockCount );
 
+void FileExtentMapAlloc( FCB *fcb );
+void FileExtentMapFree( FCB *fcb );
+void FileExtentMapInvalidate( FCB *fcb );
+
 Boolean NodesAreContiguous( ExtendedVCB     *vcb,
                            FCB             *fcb,
                            u_int32_t       nodeSize );
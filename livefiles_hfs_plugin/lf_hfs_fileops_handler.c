@@ -21,6 +21,8 @@
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_readwrite_ops.h"
 #include "lf_hfs_file_mgr_internal.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_writebehind.h"
 
 
 int LFHFS_Read ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, void *pvBuf, size_t *iActuallyRead )
@@ -68,8 +70,32 @@ int LFHFS_Read ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, void *pv
         iLength = filesize - uOffset;
     }
 
-    uint64_t uReadStartCluster;
-    retval = raw_readwrite_read( vp, uOffset, pvBuf, iLength, iActuallyRead, &uReadStartCluster );
+    uint64_t uWriteBehindGen;
+    do
+    {
+        // Data flushed from the write-behind buffer while we read may have been missed, retry
+        uWriteBehindGen = lf_hfs_writebehind_generation( vp );
+        *iActuallyRead  = 0;
+
+        // Serve what we can from the read-ahead buffer, and read the rest from the device
+        size_t uCachedRead = lf_hfs_readahead_read( vp, uOffset, pvBuf, iLength );
+        if ( uCachedRead < iLength )
+        {
+            uint64_t uReadStartCluster;
+            retval = raw_readwrite_read( vp, uOffset + uCachedRead, (uint8_t*)pvBuf + uCachedRead, iLength - uCachedRead, iActuallyRead, &uReadStartCluster );
+        }
+        *iActuallyRead += uCachedRead;
+
+        if ( retval != 0 )
+        {
+            break;
+        }
+    } while ( !lf_hfs_writebehind_overlay( vp, uOffset, pvBuf, *iActuallyRead, uWriteBehindGen ) );
+
+    if ( retval == 0 )
+    {
+        lf_hfs_readahead_update( vp, uOffset, *iActuallyRead, filesize );
+    }
 
     cp->c_touch_acctime = TRUE;
 
@@ -161,6 +187,14 @@ int LFHFS_Write ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, const v
     }
     cnode_locked = 1;
 
+    /*
+     * With write-behind the data of small appends reaches the media later in large
+     * chunks, so let the file grow in clump sized steps instead of one block at a time.
+     */
+    if (lf_hfs_writebehind_enabled(vp)) {
+        eflags &= ~kEFNoClumpMask;
+    }
+
     filebytes = blk_to_bytes(fp->ff_blocks, hfsmp->blockSize);
 
     if ((off_t)uOffset > filebytes
@@ -246,6 +280,11 @@ sizeok:
         // Fill last cluster with zeros.
         if ( origFileSize < (off_t)uOffset )
         {
+            // Buffered data in the last cluster has to reach the media first
+            retval = lf_hfs_writebehind_flush(vp);
+            if (retval) {
+                goto ioerr_exit;
+            }
             raw_readwrite_zero_fill_last_block_suffix(vp);
         }
 
@@ -253,9 +292,18 @@ sizeok:
             fp->ff_new_size = filesize;
         }
 
-        uint64_t uActuallyWritten;
-        retval = raw_readwrite_write(vp, uOffset, (void*)pvBuf, iActualLengthToWrite, &uActuallyWritten);
+        uint64_t uActuallyWritten = 0;
+        bool bBuffered = false;
+        retval = lf_hfs_writebehind_write(vp, uOffset, pvBuf, iActualLengthToWrite, &bBuffered);
+        if (retval == 0) {
+            if (bBuffered) {
+                uActuallyWritten = iActualLengthToWrite;
+            } else {
+                retval = raw_readwrite_write(vp, uOffset, (void*)pvBuf, iActualLengthToWrite, &uActuallyWritten);
+            }
+        }
         *iActuallyWrite = uActuallyWritten;
+        lf_hfs_readahead_invalidate(vp);
         if (retval) {
             fp->ff_new_size = 0;    /* no longer extending; use ff_size */
             goto ioerr_exit;
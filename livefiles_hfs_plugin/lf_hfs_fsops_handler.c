@@ -19,6 +19,9 @@
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_btree_prefetch.h"
+#include "lf_hfs_writebehind.h"
 #include "lf_hfs_journal.h"
 #include "lf_hfs_vfsops.h"
 #include "lf_hfs_mount.h"
@@ -255,6 +258,24 @@ LFHFS_Init ( void )
         goto exit;
     }
 
+    iErr = raw_readwrite_io_init();
+    if ( iErr != 0 )
+    {
+        goto exit;
+    }
+
+    iErr = lf_hfs_readahead_init();
+    if ( iErr != 0 )
+    {
+        goto exit;
+    }
+
+    iErr = lf_hfs_btree_prefetch_init();
+    if ( iErr != 0 )
+    {
+        goto exit;
+    }
+
     hfs_chashinit();
 
     // Initializing Buffer cache
@@ -275,6 +296,12 @@ LFHFS_Fini ( void )
 
     raw_readwrite_zero_fill_de_init();
 
+    lf_hfs_readahead_de_init();
+
+    lf_hfs_btree_prefetch_de_init();
+
+    raw_readwrite_io_de_init();
+
     // De-Initializing Buffer cache
     lf_hfs_generic_buf_cache_deinit();
 }
@@ -287,9 +314,9 @@ LFHFS_Mount ( int iFd, UVFSVolumeId puVolId, UVFSMountFlags puMountFlags,
     int iError = 0;
 
     struct mount* psMount            = hfs_mallocz(sizeof(struct mount));
-    struct vnode* psDevVnode         = hfs_mallocz(sizeof(struct vnode));
-    struct cnode* psDevCnode         = hfs_mallocz(sizeof(struct cnode));
-    struct filefork* psDevFileFork   = hfs_mallocz(sizeof(struct filefork));
+    struct vnode* psDevVnode         = hfs_zallocz(HFS_VNODE_ZONE);
+    struct cnode* psDevCnode         = hfs_zallocz(HFS_CNODE_ZONE);
+    struct filefork* psDevFileFork   = hfs_zallocz(HFS_FILEFORK_ZONE);
     FileSystemRecord_s *psFSRecord   = hfs_mallocz(sizeof(FileSystemRecord_s));
 
     if ( psMount == NULL || psDevVnode == NULL || psDevCnode == NULL || psDevFileFork == NULL || psFSRecord == NULL )
@@ -335,6 +362,9 @@ LFHFS_Mount ( int iFd, UVFSVolumeId puVolId, UVFSMountFlags puMountFlags,
         goto fail;
     *ppsRootNode = (UVFSFileNode) psRootVnode;
 
+    psMount->psHfsmount->hfs_buf_cache_budget = GEN_BUF_CACHE_DEFAULT_MOUNT_BUDGET;
+    lf_hfs_generic_buf_cache_adjust_budget(GEN_BUF_CACHE_DEFAULT_MOUNT_BUDGET);
+
     goto end;
 
 fail:
@@ -343,11 +373,11 @@ fail:
     if (psMount)
         hfs_free(psMount);
     if (psDevVnode)
-        hfs_free(psDevVnode);
+        hfs_zfree(psDevVnode, HFS_VNODE_ZONE);
     if (psDevCnode)
-        hfs_free(psDevCnode);
+        hfs_zfree(psDevCnode, HFS_CNODE_ZONE);
     if (psDevFileFork)
-        hfs_free(psDevFileFork);
+        hfs_zfree(psDevFileFork, HFS_FILEFORK_ZONE);
 end:
     return iError;
 }
@@ -376,12 +406,14 @@ LFHFS_Unmount ( UVFSFileNode psRootNode, UVFSUnmountHint hint )
         hfs_flushvolumeheader(psHfsMp, HFS_FVH_SKIP_TRANSACTION | HFS_FVH_MARK_UNMOUNT);
     }
 
+    lf_hfs_generic_buf_cache_adjust_budget(-(int64_t)psHfsMp->hfs_buf_cache_budget);
+
     hfs_unmount(psMount);
 
     hfs_free(psFSRecord);
     hfs_free(psMount);
-    hfs_free(psDevCnode->c_datafork);
-    hfs_free(psDevCnode);
+    hfs_zfree(psDevCnode->c_datafork, HFS_FILEFORK_ZONE);
+    hfs_zfree(psDevCnode, HFS_CNODE_ZONE);
 
     return iError;
 }
@@ -419,6 +451,71 @@ LFHFS_SetFSAttr ( UVFSFileNode psNode, const char *pcAttr, const UVFSFSAttribute
         return hfs_rename_volume(rootVnode, psAttrVal->fsa_string);
 //        (void) vnode_put(root_vp);
     }
+    else if (strcmp(pcAttr, LFHFS_FSATTR_BUF_CACHE_BUDGET) == 0)
+    {
+        if (uLen < sizeof(uint64_t) || uOutLen < sizeof(uint64_t))
+            return EINVAL;
+
+        uint64_t uBudget = psAttrVal->fsa_number;
+        if (uBudget < GEN_BUF_CACHE_MIN_MOUNT_BUDGET || uBudget > INT64_MAX)
+            return EINVAL;
+
+        struct hfsmount *hfsmp = VTOHFS(psVnode);
+        hfs_lock_mount(hfsmp);
+        int64_t iDelta = (int64_t)uBudget - (int64_t)hfsmp->hfs_buf_cache_budget;
+        hfsmp->hfs_buf_cache_budget = uBudget;
+        hfs_unlock_mount(hfsmp);
+
+        lf_hfs_generic_buf_cache_adjust_budget(iDelta);
+        psOutAttrVal->fsa_number = uBudget;
+        return 0;
+    }
+    else if (strcmp(pcAttr, LFHFS_FSATTR_WRITE_BEHIND) == 0)
+    {
+        if (uLen < sizeof(uint64_t) || uOutLen < sizeof(uint64_t))
+            return EINVAL;
+
+        if (psAttrVal->fsa_number > 1)
+            return EINVAL;
+
+        struct hfsmount *hfsmp = VTOHFS(psVnode);
+        int iErr = 0;
+
+        lf_lck_mtx_lock(&hfsmp->sync_mutex);
+        hfsmp->hfs_write_behind = (psAttrVal->fsa_number != 0);
+        if (!hfsmp->hfs_write_behind)
+        {
+            // Nothing may stay buffered once write-behind is off
+            iErr = lf_hfs_writebehind_flush_mount(hfsmp);
+        }
+        lf_lck_mtx_unlock(&hfsmp->sync_mutex);
+
+        psOutAttrVal->fsa_number = hfsmp->hfs_write_behind;
+        return iErr;
+    }
+    else if (strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_INTERVAL) == 0 || strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_SIZE) == 0)
+    {
+        if (uLen < sizeof(uint64_t) || uOutLen < sizeof(uint64_t))
+            return EINVAL;
+
+        struct hfsmount *hfsmp = VTOHFS(psVnode);
+        if (hfsmp->jnl == NULL)
+            return ENOTSUP;
+
+        if (psAttrVal->fsa_number > UINT32_MAX)
+            return EINVAL;
+
+        uint32_t uInterval, uSize;
+        journal_get_commit_params(hfsmp->jnl, &uInterval, &uSize);
+        if (strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_INTERVAL) == 0)
+            uInterval = (uint32_t)psAttrVal->fsa_number;
+        else
+            uSize = (uint32_t)psAttrVal->fsa_number;
+        journal_set_commit_params(hfsmp->jnl, uInterval, uSize);
+
+        psOutAttrVal->fsa_number = psAttrVal->fsa_number;
+        return 0;
+    }
 
     return ENOTSUP;
 }
@@ -768,6 +865,99 @@ LFHFS_GetFSAttr ( UVFSFileNode psNode, const char *pcAttr, UVFSFSAttributeValue
         goto end;
     }
 
+    if (strcmp(pcAttr, LFHFS_FSATTR_BUF_CACHE_BUDGET)==0)
+    {
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        psAttrVal->fsa_number = psMount->hfs_buf_cache_budget;
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_BUF_CACHE_STATS)==0)
+    {
+        // Hit/miss/eviction counters of the buffer cache, shared by all mounts
+        *puRetLen = sizeof(CacheStats_S);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        lf_hfs_generic_buf_cache_get_stats((CacheStats_S *) ((void *) psAttrVal->fsa_opaque));
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_ZONE_STATS)==0)
+    {
+        // Usage of the cnode/vnode/filefork/dirhint/buffer pools, shared by all mounts
+        *puRetLen = HFS_NUM_ZONES * sizeof(ZoneStats_S);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        hfs_zone_get_stats((ZoneStats_S *) ((void *) psAttrVal->fsa_opaque));
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_WRITE_BEHIND)==0)
+    {
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        psAttrVal->fsa_number = psMount->hfs_write_behind;
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_INTERVAL)==0 || strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_SIZE)==0)
+    {
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        if (psMount->jnl == NULL)
+        {
+            return ENOTSUP;
+        }
+        uint32_t uInterval, uSize;
+        journal_get_commit_params(psMount->jnl, &uInterval, &uSize);
+        psAttrVal->fsa_number = (strcmp(pcAttr, LFHFS_FSATTR_JNL_COMMIT_INTERVAL)==0) ? uInterval : uSize;
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_JNL_STATS)==0)
+    {
+        // Journal occupancy and the time commits spent waiting for space
+        *puRetLen = sizeof(JournalStats_S);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        if (psMount->jnl == NULL)
+        {
+            return ENOTSUP;
+        }
+        journal_get_stats(psMount->jnl, (JournalStats_S *) ((void *) psAttrVal->fsa_opaque));
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_CONTENTION_STATS)==0)
+    {
+        // How often lookups and B-tree creation had to wait for another thread
+        *puRetLen = sizeof(ContentionStats_S);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        hfs_lock_mount(psMount);
+        *(ContentionStats_S *) ((void *) psAttrVal->fsa_opaque) = psMount->hfs_contention;
+        hfs_unlock_mount(psMount);
+        goto end;
+    }
+
     iError = ENOTSUP;
 end:
     return iError;
@@ -790,7 +980,10 @@ int LFHFS_Sync(UVFSFileNode psNode) {
 
     lf_lck_mtx_lock(&psMount->sync_mutex);
     psMount->hfs_syncer_thread = pthread_self();
-    
+
+    // File data buffered by write-behind goes out before the metadata describing it
+    iErr = lf_hfs_writebehind_flush_mount(psMount);
+
     if (psMount->jnl) {
         
         hfs_flush(psMount, HFS_FLUSH_JOURNAL_META);
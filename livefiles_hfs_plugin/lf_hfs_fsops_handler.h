@@ -14,6 +14,16 @@
 
 #define PATH_TO_FSCK FS_BUNDLE_BIN_PATH "/fsck_hfs"
 
+// Private FS attributes
+#define LFHFS_FSATTR_BUF_CACHE_BUDGET   "_N_lfhfs_buf_cache_budget"  // Number (get/set): buffer cache budget of the mount, in bytes
+#define LFHFS_FSATTR_BUF_CACHE_STATS    "_S_lfhfs_buf_cache_stats"   // Opaque (get): CacheStats_S of the whole buffer cache
+#define LFHFS_FSATTR_ZONE_STATS         "_S_lfhfs_zone_stats"        // Opaque (get): ZoneStats_S[HFS_NUM_ZONES] of the object pools
+#define LFHFS_FSATTR_WRITE_BEHIND       "_N_lfhfs_write_behind"      // Number (get/set): 1 to coalesce small sequential writes, 0 (default) to write through
+#define LFHFS_FSATTR_JNL_COMMIT_INTERVAL "_N_lfhfs_jnl_commit_interval" // Number (get/set): max time in ms a journal group waits for more transactions, 0 (default) to wait until full or synced
+#define LFHFS_FSATTR_JNL_COMMIT_SIZE    "_N_lfhfs_jnl_commit_size"   // Number (get/set): journal group size in bytes that triggers a commit, 0 (default) for the transaction buffer limit
+#define LFHFS_FSATTR_JNL_STATS          "_S_lfhfs_jnl_stats"         // Opaque (get): JournalStats_S of the mount's journal
+#define LFHFS_FSATTR_CONTENTION_STATS   "_S_lfhfs_contention_stats"  // Opaque (get): ContentionStats_S of the mount
+
 uint64_t FSOPS_GetOffsetFromClusterNum(vnode_t vp, uint64_t uClusterNum);
 int      LFHFS_Mount   (int iFd, UVFSVolumeId puVolId, __unused UVFSMountFlags puMountFlags,
 	__unused UVFSVolumeCredential *psVolumeCreds, UVFSFileNode *ppsRootNode);
@@ -17,15 +17,62 @@
 #define GEN_BUF_ALLOC_DEBUG 0
 
 TAILQ_HEAD(buf_cache_head, buf_cache_entry);
+LIST_HEAD(buf_cache_bucket, buf_cache_entry);
+TAILQ_HEAD(buf_ghost_head, buf_ghost_entry);
+LIST_HEAD(buf_ghost_bucket, buf_ghost_entry);
 
 struct buf_cache_entry {
-    TAILQ_ENTRY(buf_cache_entry) buf_cache_link;
+    TAILQ_ENTRY(buf_cache_entry) buf_cache_link;    // Shard A1in/Am list
+    LIST_ENTRY(buf_cache_entry)  buf_phy_link;      // Shard hash chain keyed by (iFD, uPhyCluster)
+    LIST_ENTRY(buf_cache_entry)  buf_vnode_link;    // Shard hash chain keyed by psVnode
+    int                          iFD;
+    bool                         bInAm;             // Set when the entry lives on the Am (frequently used) list
     GenericLFBuf sBuf;
 };
 
+// Cache entries and non-cached buffers share HFS_GENBUF_ZONE
+_Static_assert(sizeof(struct buf_cache_entry) <= GEN_BUF_ZONE_ELEM_SIZE, "buf_cache_entry does not fit HFS_GENBUF_ZONE");
+
+// Remembers the key of a buffer recently evicted from the A1in list
+struct buf_ghost_entry {
+    TAILQ_ENTRY(buf_ghost_entry) buf_ghost_link;
+    LIST_ENTRY(buf_ghost_entry)  buf_ghost_hash_link;
+    int                          iFD;
+    uint64_t                     uPhyCluster;
+};
+
+/*
+ * The buffer cache is split into BUF_CACHE_SHARD_COUNT lock-striped shards.
+ * A buffer lives in the shard selected by its (iFD, uPhyCluster) key, so two
+ * vnodes sharing the same physical block always meet in the same shard.
+ * Each shard keeps its own replacement lists, its own hash index and its own
+ * statistics, and is protected by its own mutex.
+ *
+ * Replacement follows the 2Q policy: a buffer enters the FIFO A1in list on its
+ * first reference and is only promoted to the LRU Am list when it is referenced
+ * again after having been evicted from A1in (tracked by the A1out ghost list).
+ * One-time sweeps (e.g. LFHFS_ReadDir over a large directory) therefore cycle
+ * through A1in without flushing the frequently used B-tree nodes kept in Am.
+ */
+#define BUF_CACHE_SHARD_COUNT           (8)     // Must be a power of 2
+#define BUF_CACHE_SHARD_MIN_HASH_BUCKETS (64)   // Must be a power of 2
+
+typedef struct {
+    pthread_mutex_t          sLock;            /* protects access to the shard data */
+    struct buf_cache_head    sA1inList;        /* Referenced once, newest first */
+    struct buf_cache_head    sAmList;          /* Referenced again, most recently used first */
+    struct buf_ghost_head    sA1outList;       /* Keys evicted from sA1inList, newest first */
+    struct buf_cache_bucket *psPhyHash;
+    struct buf_cache_bucket *psVnodeHash;
+    struct buf_ghost_bucket *psGhostHash;
+    uint32_t                 uHashMask;
+    uint32_t                 uA1outCnt;
+    uint64_t                 uA1inSize;        /* Data bytes held by sA1inList */
+    CacheStats_S             sStat;
+} BufCacheShard_S;
+
 boolean_t buf_cache_state = false;
-struct buf_cache_head buf_cache_list;
-pthread_mutex_t buf_cache_mutex;      /* protects access to buffer cache data */
+BufCacheShard_S buf_cache_shards[BUF_CACHE_SHARD_COUNT];
 
 
 #define BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT   (140)
@@ -33,16 +80,35 @@ pthread_mutex_t buf_cache_mutex;      /* protects access to buffer cache data */
 #define BUF_CACHE_MAX_DATA_UPPER_LIMIT (1536*1024)
 #define BUF_CACHE_MAX_DATA_LOWER_LIMIT (1024*1024)
 
+/*
+ * The limits above describe the default budget (BUF_CACHE_DEFAULT_BUDGET).
+ * The actual budget is the sum of the budgets of the mounted volumes, but never
+ * less than the default; all the limits scale linearly with it and every shard
+ * gets an equal share.
+ */
+#define BUF_CACHE_DEFAULT_BUDGET            BUF_CACHE_MAX_DATA_UPPER_LIMIT
+#define BUF_CACHE_SHARD_DATA_UPPER_LIMIT()      (buf_cache_budget / BUF_CACHE_SHARD_COUNT)
+#define BUF_CACHE_SHARD_DATA_LOWER_LIMIT()      (BUF_CACHE_SHARD_DATA_UPPER_LIMIT() * BUF_CACHE_MAX_DATA_LOWER_LIMIT / BUF_CACHE_MAX_DATA_UPPER_LIMIT)
+#define BUF_CACHE_SHARD_ENTRIES_UPPER_LIMIT()   (BUF_CACHE_SHARD_DATA_UPPER_LIMIT() * BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT / BUF_CACHE_MAX_DATA_UPPER_LIMIT)
+#define BUF_CACHE_SHARD_ENTRIES_LOWER_LIMIT()   (BUF_CACHE_SHARD_DATA_UPPER_LIMIT() * BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT / BUF_CACHE_MAX_DATA_UPPER_LIMIT)
+// 2Q tuning, as suggested by Johnson & Shasha: Kin = 25% of the data, Kout = 50% of the entries
+#define BUF_CACHE_SHARD_A1IN_LIMIT()            (BUF_CACHE_SHARD_DATA_UPPER_LIMIT() / 4)
+#define BUF_CACHE_SHARD_A1OUT_LIMIT()           (BUF_CACHE_SHARD_ENTRIES_UPPER_LIMIT() / 2)
+
+uint64_t buf_cache_budget         = BUF_CACHE_DEFAULT_BUDGET;
+uint64_t buf_cache_mounted_budget = 0;    // Sum of the budgets of the mounted volumes
+
+// Holds the counters of non-cached buffers. Cached buffers are accounted per shard.
 CacheStats_S gCacheStat = {0};
 
 #define IGNORE_MOUNT_FD         (INT_MAX)
 
 void lf_hfs_generic_buf_cache_init( void );
 void lf_hfs_generic_buf_cache_deinit( void );
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf );
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize);
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf);
-GenericLFBuf           *lf_hfs_generic_buf_cache_add( GenericLFBuf *psBuf );
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find( BufCacheShard_S *psShard, GenericLFBufPtr psBuf );
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster, uint64_t uBlockSize);
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(BufCacheShard_S *psShard, GenericLFBufPtr psBuf);
+GenericLFBuf           *lf_hfs_generic_buf_cache_add( BufCacheShard_S *psShard, int iFD, GenericLFBuf *psBuf );
 void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
 void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, GenericLFBufPtr psBuf );
 void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry );
@@ -50,6 +116,49 @@ void lf_hfs_generic_buf_cache_remove_all( int iFD );
 void lf_hfs_generic_buf_ref(GenericLFBuf *psBuf);
 void lf_hfs_generic_buf_rele(GenericLFBuf *psBuf);
 
+static inline uint64_t lf_hfs_generic_buf_cache_hash_phy(int iFD, uint64_t uPhyCluster) {
+    // 64-bit multiplicative (Fibonacci) hashing, spreads consecutive clusters across shards
+    return (((uint64_t)(uint32_t)iFD << 48) ^ uPhyCluster) * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline uint64_t lf_hfs_generic_buf_cache_hash_vnode(vnode_t psVnode) {
+    return ((uint64_t)(uintptr_t)psVnode >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline BufCacheShard_S *lf_hfs_generic_buf_cache_shard(int iFD, uint64_t uPhyCluster) {
+    return &buf_cache_shards[lf_hfs_generic_buf_cache_hash_phy(iFD, uPhyCluster) >> 61 & (BUF_CACHE_SHARD_COUNT - 1)];
+}
+
+static inline struct buf_cache_bucket *lf_hfs_generic_buf_cache_phy_bucket(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster) {
+    return &psShard->psPhyHash[(lf_hfs_generic_buf_cache_hash_phy(iFD, uPhyCluster) >> 32) & psShard->uHashMask];
+}
+
+static inline struct buf_cache_bucket *lf_hfs_generic_buf_cache_vnode_bucket(BufCacheShard_S *psShard, vnode_t psVnode) {
+    return &psShard->psVnodeHash[(lf_hfs_generic_buf_cache_hash_vnode(psVnode) >> 32) & psShard->uHashMask];
+}
+
+static inline struct buf_ghost_bucket *lf_hfs_generic_buf_cache_ghost_bucket(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster) {
+    return &psShard->psGhostHash[(lf_hfs_generic_buf_cache_hash_phy(iFD, uPhyCluster) >> 32) & psShard->uHashMask];
+}
+
+static inline BufCacheShard_S *lf_hfs_generic_buf_cache_shard_of(GenericLFBufPtr psBuf) {
+    return lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster);
+}
+
+static inline struct buf_cache_head *lf_hfs_generic_buf_cache_list_of(BufCacheShard_S *psShard, struct buf_cache_entry *entry) {
+    return (entry->bInAm)? &psShard->sAmList : &psShard->sA1inList;
+}
+
+// Records a reference to a cached entry. The shard lock should be held by the caller.
+// Entries on A1in are deliberately left in place, a repeated reference while still on
+// A1in is considered correlated with the first one.
+static inline void lf_hfs_generic_buf_cache_touch(BufCacheShard_S *psShard, struct buf_cache_entry *entry) {
+    if (entry->bInAm) {
+        TAILQ_REMOVE(&psShard->sAmList, entry, buf_cache_link);
+        TAILQ_INSERT_HEAD(&psShard->sAmList, entry, buf_cache_link);
+    }
+}
+
 // lf_hfs_generic_buf_take_ownership
 // Take ownership on this buff.
 // When the function returns zero, we own the buffer it is locked by our thread.
@@ -101,6 +210,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
     GenericLFBufPtr psBuf  = NULL;
     GenericLFBuf     sBuf  = {0};
     struct buf_cache_entry *psCacheEntry = NULL;
+    BufCacheShard_S *psShard = NULL;
 
     assert(psVnode);
     
@@ -131,20 +241,21 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
 
     // Check buffer cache, if a memory buffer already allocated for this physical block
     if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
+        psShard = lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(psVnode), uPhyCluster);
     retry:
-        lf_lck_mtx_lock(&buf_cache_mutex);
+        lf_lck_mtx_lock(&psShard->sLock);
 
-        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(VNODE_TO_IFD(psVnode), uPhyCluster, uBlockSize);
+        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(psShard, VNODE_TO_IFD(psVnode), uPhyCluster, uBlockSize);
         if (psCacheEntry) {
             // buffer exists, share.
-            TAILQ_REMOVE(&buf_cache_list, psCacheEntry, buf_cache_link);
-            TAILQ_INSERT_HEAD(&buf_cache_list, psCacheEntry, buf_cache_link);
+            ++psShard->sStat.buf_cache_hit;
+            lf_hfs_generic_buf_cache_touch(psShard, psCacheEntry);
 
             psBuf = &psCacheEntry->sBuf;
             #if GEN_BUF_ALLOC_DEBUG
                 printf("Already in cache: %p (UseCnt %u uCacheFlags 0x%llx)\n", psBuf, psBuf->uUseCnt, psBuf->uCacheFlags);
             #endif
-            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &buf_cache_mutex);
+            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &psShard->sLock);
             if (iRet == EAGAIN) {
                 goto retry;
             } else if (iRet) {
@@ -153,11 +264,13 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
             } 
             
             lf_hfs_generic_buf_unlock(psBuf);
-            lf_lck_mtx_unlock(&buf_cache_mutex);
+            lf_lck_mtx_unlock(&psShard->sLock);
             return(psBuf);
         }
 
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        ++psShard->sStat.buf_cache_miss;
+        // The shard stays locked until the new buffer is added, so that threads missing on
+        // the same block at the same time (e.g. B-tree prefetch) can't add it twice
     }
 
     // Not found in cache, need to create a GenBuf
@@ -172,12 +285,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
     if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
         
         // Add to cache
-        lf_lck_mtx_lock(&buf_cache_mutex);
-        
-        GenericLFBufPtr psCachedBuf = lf_hfs_generic_buf_cache_add(&sBuf);
-        
-        lf_cond_init(&psCachedBuf->sOwnerCond);
-        lf_lck_mtx_init(&psCachedBuf->sLock);
+        GenericLFBufPtr psCachedBuf = lf_hfs_generic_buf_cache_add(psShard, VNODE_TO_IFD(psVnode), &sBuf);
 
         if (psCachedBuf) {
             if (uFlags & (GEN_BUF_IS_UPTODATE | GEN_BUF_LITTLE_ENDIAN)) {
@@ -187,7 +295,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
             }
         }
         
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sLock);
         #if GEN_BUF_ALLOC_DEBUG
             printf("Added to cache %p\n", psCachedBuf);
         #endif
@@ -195,7 +303,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
         
     } else {
         // Alloc memomry for a non-cached buffer
-        psBuf  = hfs_mallocz(sizeof(GenericLFBuf));
+        psBuf  = hfs_zalloc(HFS_GENBUF_ZONE);
         if (!psBuf) {
             goto error;
         }
@@ -229,7 +337,7 @@ error:
         hfs_free(psBuf->pvData);
     }
     if (psBuf) {
-        hfs_free(psBuf);
+        hfs_zfree(psBuf, HFS_GENBUF_ZONE);
     }
     return(NULL);
 }
@@ -251,9 +359,7 @@ errno_t lf_hfs_generic_buf_read( GenericLFBufPtr psBuf )
     
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED))
     {
-        lf_lck_mtx_lock(&buf_cache_mutex);
         lf_hfs_generic_buf_cache_update(psBuf);
-        lf_lck_mtx_unlock(&buf_cache_mutex);
     }
 
     lf_hfs_generic_buf_lock(psBuf);
@@ -331,6 +437,7 @@ void lf_hfs_generic_buf_clear( GenericLFBufPtr psBuf ) {
 
 void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
     struct buf_cache_entry *psCacheEntry;
+    BufCacheShard_S *psShard;
 
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_invalidate: psBuf %p, psVnode %p, uBlockN %llu, uDataSize %u, uFlags 0x%llx, uPhyCluster %llu, uUseCnt %u\n",
@@ -346,8 +453,9 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
     // Check buffer cache, if a memory buffer already allocated for this physical block
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
         
-        lf_lck_mtx_lock(&buf_cache_mutex);
-        psCacheEntry = lf_hfs_generic_buf_cache_find_gen_buf(psBuf);
+        psShard = lf_hfs_generic_buf_cache_shard_of(psBuf);
+        lf_lck_mtx_lock(&psShard->sLock);
+        psCacheEntry = lf_hfs_generic_buf_cache_find_gen_buf(psShard, psBuf);
 
         if (psCacheEntry) {
             lf_hfs_generic_buf_cache_remove(psCacheEntry);
@@ -355,7 +463,7 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
             panic("A buffer is marked Cached, but was not found in Cache");
         }
         
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sLock);
 
     } else {
         // This is a non-cached buffer
@@ -364,7 +472,7 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
         lf_cond_destroy(&psBuf->sOwnerCond);
         lf_lck_mtx_destroy(&psBuf->sLock);
         hfs_free(psBuf->pvData);
-        hfs_free(psBuf);
+        hfs_zfree(psBuf, HFS_GENBUF_ZONE);
     }
 }
 
@@ -392,6 +500,17 @@ void  lf_hfs_generic_buf_rele(GenericLFBuf *psBuf) {
     lf_hfs_generic_buf_unlock(psBuf);
 }
 
+// Hand a buffer we own and hold locked over to another thread.
+// The buffer is unlocked on return; the new owner locks it again before using it.
+void lf_hfs_generic_buf_transfer_ownership(GenericLFBufPtr psBuf, pthread_t sNewOwner) {
+    assert(psBuf->sOwnerThread == pthread_self());
+    assert(psBuf->pLockingThread == pthread_self());
+    assert(psBuf->uLockCnt == 1);
+
+    psBuf->sOwnerThread = sNewOwner;
+    lf_hfs_generic_buf_unlock(psBuf);
+}
+
 void lf_hfs_generic_buf_lock(GenericLFBufPtr psBuf) {
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_lock: psBuf %p, psVnode %p, uBlockN %llu, uDataSize %u, uFlags 0x%llx, uPhyCluster %llu, uUseCnt %u\n",
@@ -436,30 +555,103 @@ void lf_hfs_generic_buf_clear_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheF
     lf_hfs_generic_buf_unlock(psBuf);
 }
 
-static void lf_hfs_buf_free_unused()
+// Drops the oldest ghost entries until the A1out list fits its limit. The shard lock should be held by the caller.
+static void lf_hfs_buf_ghost_trim(BufCacheShard_S *psShard, uint32_t uLimit)
+{
+    while (psShard->uA1outCnt > uLimit) {
+        struct buf_ghost_entry *psGhost = TAILQ_LAST(&psShard->sA1outList, buf_ghost_head);
+
+        TAILQ_REMOVE(&psShard->sA1outList, psGhost, buf_ghost_link);
+        LIST_REMOVE(psGhost, buf_ghost_hash_link);
+        psShard->uA1outCnt--;
+        hfs_free(psGhost);
+    }
+}
+
+static void lf_hfs_buf_ghost_add(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster)
+{
+    uint32_t uLimit = (uint32_t)BUF_CACHE_SHARD_A1OUT_LIMIT();
+    if (uLimit == 0) {
+        return;
+    }
+
+    struct buf_ghost_entry *psGhost = hfs_malloc(sizeof(*psGhost));
+    if (!psGhost) {
+        // The ghost list is only a hint, losing an entry is harmless
+        return;
+    }
+    psGhost->iFD         = iFD;
+    psGhost->uPhyCluster = uPhyCluster;
+
+    TAILQ_INSERT_HEAD(&psShard->sA1outList, psGhost, buf_ghost_link);
+    LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_ghost_bucket(psShard, iFD, uPhyCluster), psGhost, buf_ghost_hash_link);
+    psShard->uA1outCnt++;
+
+    lf_hfs_buf_ghost_trim(psShard, uLimit);
+}
+
+// Returns true, and forgets the ghost, if (iFD, uPhyCluster) was recently evicted from A1in.
+static bool lf_hfs_buf_ghost_take(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster)
+{
+    struct buf_ghost_entry *psGhost;
+
+    LIST_FOREACH(psGhost, lf_hfs_generic_buf_cache_ghost_bucket(psShard, iFD, uPhyCluster), buf_ghost_hash_link) {
+        if ((psGhost->uPhyCluster == uPhyCluster) && (psGhost->iFD == iFD)) {
+            TAILQ_REMOVE(&psShard->sA1outList, psGhost, buf_ghost_link);
+            LIST_REMOVE(psGhost, buf_ghost_hash_link);
+            psShard->uA1outCnt--;
+            hfs_free(psGhost);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void lf_hfs_buf_free_unused(BufCacheShard_S *psShard)
 {
     //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    while ( gCacheStat.buf_cache_size > BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT ||
-           gCacheStat.buf_total_allocated_size > BUF_CACHE_MAX_DATA_LOWER_LIMIT)
+    while ( psShard->sStat.buf_cache_size > BUF_CACHE_SHARD_ENTRIES_LOWER_LIMIT() ||
+           psShard->sStat.buf_total_allocated_size > BUF_CACHE_SHARD_DATA_LOWER_LIMIT())
     {
-        struct buf_cache_entry *last;
-        
-        last = TAILQ_LAST(&buf_cache_list, buf_cache_head);
-        
-        if (!last) {
+        struct buf_cache_entry *last = NULL;
+        struct buf_cache_head  *apsLists[2];
+
+        // Reclaim from A1in while it is over its share, otherwise from the Am LRU end
+        if (psShard->uA1inSize > BUF_CACHE_SHARD_A1IN_LIMIT() || TAILQ_EMPTY(&psShard->sAmList)) {
+            apsLists[0] = &psShard->sA1inList;
+            apsLists[1] = &psShard->sAmList;
+        } else {
+            apsLists[0] = &psShard->sAmList;
+            apsLists[1] = &psShard->sA1inList;
+        }
+
+        for (int iList = 0; iList < 2; iList++) {
+            last = TAILQ_LAST(apsLists[iList], buf_cache_head);
+            if (!last) {
+                continue;
+            }
+
+            lf_hfs_generic_buf_lock(&last->sBuf);
+
+            if ((last->sBuf.uUseCnt) || (last->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+                // Last buffer of this list is in use.
+                lf_hfs_generic_buf_unlock(&last->sBuf);
+                last = NULL;
+                continue;
+            }
             break;
         }
-        
-        lf_hfs_generic_buf_lock(&last->sBuf);
-        
-        if ((last->sBuf.uUseCnt) || (last->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-            // Last buffer in buffer cache is in use.
+
+        if (!last) {
             // Nothing more to free
-            lf_hfs_generic_buf_unlock(&last->sBuf);
             break;
         }
-        
-        ++gCacheStat.buf_cache_cleanup;
+
+        if (!last->bInAm) {
+            lf_hfs_buf_ghost_add(psShard, last->iFD, last->sBuf.uPhyCluster);
+        }
+
+        ++psShard->sStat.buf_cache_cleanup;
         lf_hfs_generic_buf_cache_remove(last);
     }
 }
@@ -474,7 +666,13 @@ void lf_hfs_generic_buf_release( GenericLFBufPtr psBuf )
     if (!psBuf) {
         return;
     }
-    
+
+    // Resolve the shard before dropping our reference, the buffer may get evicted right after
+    BufCacheShard_S *psShard = NULL;
+    if (!(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
+        psShard = lf_hfs_generic_buf_cache_shard_of(psBuf);
+    }
+
     lf_hfs_generic_buf_rele(psBuf);
 
     // If Unused and UnCached, free.
@@ -484,19 +682,23 @@ void lf_hfs_generic_buf_release( GenericLFBufPtr psBuf )
         lf_cond_destroy(&psBuf->sOwnerCond);
         lf_lck_mtx_destroy(&psBuf->sLock);
         hfs_free(psBuf->pvData);
-        hfs_free(psBuf);
+        hfs_zfree(psBuf, HFS_GENBUF_ZONE);
+        return;
+    }
+
+    if (!psShard) {
         return;
     }
 
     // Cleanup unused entries in the cache
-    int iTry = lf_lck_mtx_try_lock(&buf_cache_mutex);
+    int iTry = lf_lck_mtx_try_lock(&psShard->sLock);
     if (iTry) {
         return;
     }
 
     //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    lf_hfs_buf_free_unused();
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    lf_hfs_buf_free_unused(psShard);
+    lf_lck_mtx_unlock(&psShard->sLock);
 }
 
 //  Buffer Cache functions
@@ -505,8 +707,33 @@ void lf_hfs_generic_buf_cache_init( void ) {
     gCacheStat.buf_cache_size       = 0;
     gCacheStat.max_gen_buf_uncached = 0;
     gCacheStat.gen_buf_uncached     = 0;
-    lf_lck_mtx_init(&buf_cache_mutex);
-    TAILQ_INIT(&buf_cache_list);
+
+    buf_cache_budget         = BUF_CACHE_DEFAULT_BUDGET;
+    buf_cache_mounted_budget = 0;
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        memset(&psShard->sStat, 0, sizeof(psShard->sStat));
+        lf_lck_mtx_init(&psShard->sLock);
+        TAILQ_INIT(&psShard->sA1inList);
+        TAILQ_INIT(&psShard->sAmList);
+        TAILQ_INIT(&psShard->sA1outList);
+        psShard->uA1inSize = 0;
+        psShard->uA1outCnt = 0;
+        psShard->uHashMask = BUF_CACHE_SHARD_MIN_HASH_BUCKETS - 1;
+        psShard->psPhyHash   = hfs_malloc(BUF_CACHE_SHARD_MIN_HASH_BUCKETS * sizeof(struct buf_cache_bucket));
+        psShard->psVnodeHash = hfs_malloc(BUF_CACHE_SHARD_MIN_HASH_BUCKETS * sizeof(struct buf_cache_bucket));
+        psShard->psGhostHash = hfs_malloc(BUF_CACHE_SHARD_MIN_HASH_BUCKETS * sizeof(struct buf_ghost_bucket));
+        if (!psShard->psPhyHash || !psShard->psVnodeHash || !psShard->psGhostHash) {
+            panic("lf_hfs_generic_buf_cache_init: failed to allocate the hash tables");
+        }
+        for (uint32_t uBucket = 0; uBucket < BUF_CACHE_SHARD_MIN_HASH_BUCKETS; uBucket++) {
+            LIST_INIT(&psShard->psPhyHash[uBucket]);
+            LIST_INIT(&psShard->psVnodeHash[uBucket]);
+            LIST_INIT(&psShard->psGhostHash[uBucket]);
+        }
+    }
     buf_cache_state = true;
 }
 
@@ -514,11 +741,24 @@ void lf_hfs_generic_buf_cache_deinit( void )
 {
     lf_hfs_generic_buf_cache_remove_all(IGNORE_MOUNT_FD);
 
-    assert(gCacheStat.buf_cache_size   == 0);
-    assert(gCacheStat.gen_buf_uncached == 0);
+    CacheStats_S sStat;
+    lf_hfs_generic_buf_cache_get_stats(&sStat);
+    assert(sStat.buf_cache_size   == 0);
+    assert(sStat.gen_buf_uncached == 0);
 
     buf_cache_state = false;
-    lf_lck_mtx_destroy(&buf_cache_mutex);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        lf_hfs_buf_ghost_trim(psShard, 0);
+        hfs_free(psShard->psPhyHash);
+        hfs_free(psShard->psVnodeHash);
+        hfs_free(psShard->psGhostHash);
+        psShard->psPhyHash   = NULL;
+        psShard->psVnodeHash = NULL;
+        psShard->psGhostHash = NULL;
+        lf_lck_mtx_destroy(&psShard->sLock);
+    }
 }
 
 void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
@@ -526,6 +766,98 @@ void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
     lf_hfs_generic_buf_cache_remove_all(iFD);
 }
 
+// Sums the per-shard counters together with the non-cached buffer counters.
+// Peak values are the sum of the per-shard peaks.
+void lf_hfs_generic_buf_cache_get_stats( CacheStats_S *psStat )
+{
+    memset(psStat, 0, sizeof(*psStat));
+    psStat->max_gen_buf_uncached = gCacheStat.max_gen_buf_uncached;
+    psStat->gen_buf_uncached     = gCacheStat.gen_buf_uncached;
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        lf_lck_mtx_lock(&psShard->sLock);
+        psStat->buf_cache_size           += psShard->sStat.buf_cache_size;
+        psStat->max_buf_cache_size       += psShard->sStat.max_buf_cache_size;
+        psStat->buf_cache_remove         += psShard->sStat.buf_cache_remove;
+        psStat->buf_cache_cleanup        += psShard->sStat.buf_cache_cleanup;
+        psStat->buf_total_allocated_size += psShard->sStat.buf_total_allocated_size;
+        psStat->buf_cache_hit            += psShard->sStat.buf_cache_hit;
+        psStat->buf_cache_miss           += psShard->sStat.buf_cache_miss;
+        psStat->buf_cache_ghost_hit      += psShard->sStat.buf_cache_ghost_hit;
+        lf_lck_mtx_unlock(&psShard->sLock);
+    }
+    psStat->buf_cache_budget = buf_cache_budget;
+}
+
+// Adds (or, with a negative iDelta, removes) a mounted volume's share of the cache budget.
+// Shards that end up over the new budget are trimmed right away.
+void lf_hfs_generic_buf_cache_adjust_budget( int64_t iDelta )
+{
+    lf_hfs_generic_buf_cache_LockBufCache();
+
+    assert(iDelta >= 0 || (uint64_t)(-iDelta) <= buf_cache_mounted_budget);
+    buf_cache_mounted_budget += iDelta;
+    buf_cache_budget = MAX(buf_cache_mounted_budget, BUF_CACHE_DEFAULT_BUDGET);
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+        lf_hfs_buf_free_unused(psShard);
+        lf_hfs_buf_ghost_trim(psShard, (uint32_t)BUF_CACHE_SHARD_A1OUT_LIMIT());
+    }
+
+    lf_hfs_generic_buf_cache_UnLockBufCache();
+}
+
+// Doubles the shard hash tables once they average more than 2 entries per bucket.
+// The shard lock should be held by the caller. On allocation failure the tables are kept as is.
+static void lf_hfs_generic_buf_cache_grow_hash( BufCacheShard_S *psShard )
+{
+    uint32_t uBuckets = psShard->uHashMask + 1;
+    if (psShard->sStat.buf_cache_size + psShard->uA1outCnt <= 2 * uBuckets) {
+        return;
+    }
+
+    uint32_t uNewBuckets = 2 * uBuckets;
+    struct buf_cache_bucket *psPhyHash   = hfs_malloc(uNewBuckets * sizeof(struct buf_cache_bucket));
+    struct buf_cache_bucket *psVnodeHash = hfs_malloc(uNewBuckets * sizeof(struct buf_cache_bucket));
+    struct buf_ghost_bucket *psGhostHash = hfs_malloc(uNewBuckets * sizeof(struct buf_ghost_bucket));
+    if (!psPhyHash || !psVnodeHash || !psGhostHash) {
+        hfs_free(psPhyHash);
+        hfs_free(psVnodeHash);
+        hfs_free(psGhostHash);
+        return;
+    }
+    for (uint32_t uBucket = 0; uBucket < uNewBuckets; uBucket++) {
+        LIST_INIT(&psPhyHash[uBucket]);
+        LIST_INIT(&psVnodeHash[uBucket]);
+        LIST_INIT(&psGhostHash[uBucket]);
+    }
+
+    hfs_free(psShard->psPhyHash);
+    hfs_free(psShard->psVnodeHash);
+    hfs_free(psShard->psGhostHash);
+    psShard->psPhyHash   = psPhyHash;
+    psShard->psVnodeHash = psVnodeHash;
+    psShard->psGhostHash = psGhostHash;
+    psShard->uHashMask   = uNewBuckets - 1;
+
+    // Re-link everything, the lists hold all the members of the hash chains
+    struct buf_cache_head *apsLists[] = {&psShard->sA1inList, &psShard->sAmList};
+    for (uint32_t uList = 0; uList < sizeof(apsLists)/sizeof(apsLists[0]); uList++) {
+        struct buf_cache_entry *entry;
+        TAILQ_FOREACH(entry, apsLists[uList], buf_cache_link) {
+            LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_phy_bucket(psShard, entry->iFD, entry->sBuf.uPhyCluster), entry, buf_phy_link);
+            LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_vnode_bucket(psShard, entry->sBuf.psVnode), entry, buf_vnode_link);
+        }
+    }
+    struct buf_ghost_entry *psGhost;
+    TAILQ_FOREACH(psGhost, &psShard->sA1outList, buf_ghost_link) {
+        LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_ghost_bucket(psShard, psGhost->iFD, psGhost->uPhyCluster), psGhost, buf_ghost_hash_link);
+    }
+}
+
 boolean_t lf_hfs_generic_buf_match_range( struct buf_cache_entry *entry, GenericLFBufPtr psBuf )
 {
     if ( VTOF(entry->sBuf.psVnode) != VTOF(psBuf->psVnode) )
@@ -563,13 +895,16 @@ boolean_t lf_hfs_generic_buf_match_range( struct buf_cache_entry *entry, Generic
     }
 }
 
-struct buf_cache_entry * lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf )
+// A cached buffer of the same vnode and block range maps to the same physical cluster,
+// so only the (iFD, uPhyCluster) chain needs to be scanned.
+struct buf_cache_entry * lf_hfs_generic_buf_cache_find( BufCacheShard_S *psShard, GenericLFBufPtr psBuf )
 {
-    struct buf_cache_entry *entry, *entry_next;
+    struct buf_cache_entry *entry;
+    int iFD = VNODE_TO_IFD(psBuf->psVnode);
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
+    LIST_FOREACH(entry, lf_hfs_generic_buf_cache_phy_bucket(psShard, iFD, psBuf->uPhyCluster), buf_phy_link)
     {
-        if ( lf_hfs_generic_buf_match_range(entry, psBuf) )
+        if ( (entry->iFD == iFD) && lf_hfs_generic_buf_match_range(entry, psBuf) )
         {
             break;
         }
@@ -584,33 +919,35 @@ int lf_hfs_generic_buf_write_iterate(vnode_t psVnode, IterateCallback pfCallback
     struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
     int iFD = VNODE_TO_IFD(psVnode);
 
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
-        int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
-        
-        if ( (iFD == iEntryFD) && (psCacheEntry->sBuf.psVnode == psVnode)) {
-            if ((uFlags & BUF_SKIP_LOCKED) && (psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
-            }
-            if ((uFlags & BUF_SKIP_NONLOCKED) && !(psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        LIST_FOREACH_SAFE(psCacheEntry, lf_hfs_generic_buf_cache_vnode_bucket(psShard, psVnode), buf_vnode_link, psNextCacheEntry) {
+
+            if ( (iFD == psCacheEntry->iFD) && (psCacheEntry->sBuf.psVnode == psVnode)) {
+                if ((uFlags & BUF_SKIP_LOCKED) && (psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+                    continue;
+                }
+                if ((uFlags & BUF_SKIP_NONLOCKED) && !(psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+                    continue;
+                }
+                pfCallback(&psCacheEntry->sBuf, pvArgs);
             }
-            pfCallback(&psCacheEntry->sBuf, pvArgs);
         }
     }
     return(0);
 }
 
 
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize) {
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(BufCacheShard_S *psShard, int iFD, uint64_t uPhyCluster, uint64_t uBlockSize) {
 
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
+    struct buf_cache_entry *psCacheEntry;
     
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_phy_bucket(psShard, iFD, uPhyCluster), buf_phy_link) {
         if (psCacheEntry->sBuf.psVnode)
         {
-            int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
             if ( (psCacheEntry->sBuf.uPhyCluster == uPhyCluster) &&
-                 (iEntryFD                       == iFD        ) &&
+                 (psCacheEntry->iFD              == iFD        ) &&
                  (psCacheEntry->sBuf.uDataSize   >= uBlockSize )  ) {
                 break;
             }
@@ -625,11 +962,11 @@ struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, ui
     return psCacheEntry;
 }
 
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf) {
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(BufCacheShard_S *psShard, GenericLFBufPtr psBuf) {
     
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
+    struct buf_cache_entry *psCacheEntry;
     
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_phy_bucket(psShard, VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster), buf_phy_link) {
         if ( &psCacheEntry->sBuf == psBuf ) {
             break;
         }
@@ -637,37 +974,54 @@ struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr ps
     return psCacheEntry;
 }
 
-GenericLFBufPtr lf_hfs_generic_buf_cache_add( GenericLFBufPtr psBuf )
+GenericLFBufPtr lf_hfs_generic_buf_cache_add( BufCacheShard_S *psShard, int iFD, GenericLFBufPtr psBuf )
 {
     struct buf_cache_entry *entry;
 
     //Check if we have enough space to alloc this buffer, unless need to evict something
-    if (gCacheStat.buf_total_allocated_size + psBuf->uDataSize > BUF_CACHE_MAX_DATA_UPPER_LIMIT ||
-        gCacheStat.buf_cache_size + 1 == BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT)
+    if (psShard->sStat.buf_total_allocated_size + psBuf->uDataSize > BUF_CACHE_SHARD_DATA_UPPER_LIMIT() ||
+        psShard->sStat.buf_cache_size + 1 >= BUF_CACHE_SHARD_ENTRIES_UPPER_LIMIT())
     {
-        lf_hfs_buf_free_unused();
+        lf_hfs_buf_free_unused(psShard);
     }
 
-    entry = hfs_mallocz(sizeof(*entry));
+    lf_hfs_generic_buf_cache_grow_hash(psShard);
+
+    entry = hfs_zallocz(HFS_GENBUF_ZONE);
     if (!entry) {
         goto error;
     }
 
     memcpy(&entry->sBuf, (void*)psBuf, sizeof(*psBuf));
     entry->sBuf.uCacheFlags &= ~GEN_BUF_NON_CACHED;
+    entry->iFD = iFD;
     
     entry->sBuf.pvData = hfs_mallocz(psBuf->uDataSize);
     if (!entry->sBuf.pvData) {
         goto error;
     }
 
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_cond_init(&entry->sBuf.sOwnerCond);
+    lf_lck_mtx_init(&entry->sBuf.sLock);
+
+    // A buffer referenced again shortly after leaving A1in goes straight to Am
+    if (lf_hfs_buf_ghost_take(psShard, iFD, psBuf->uPhyCluster)) {
+        ++psShard->sStat.buf_cache_ghost_hit;
+        entry->bInAm = true;
+        TAILQ_INSERT_HEAD(&psShard->sAmList, entry, buf_cache_link);
+    } else {
+        entry->bInAm = false;
+        TAILQ_INSERT_HEAD(&psShard->sA1inList, entry, buf_cache_link);
+        psShard->uA1inSize += psBuf->uDataSize;
+    }
+    LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_phy_bucket(psShard, iFD, psBuf->uPhyCluster), entry, buf_phy_link);
+    LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_vnode_bucket(psShard, psBuf->psVnode), entry, buf_vnode_link);
 
-    gCacheStat.buf_cache_size++;
-    gCacheStat.buf_total_allocated_size+=psBuf->uDataSize;
+    psShard->sStat.buf_cache_size++;
+    psShard->sStat.buf_total_allocated_size+=psBuf->uDataSize;
     
-    if (gCacheStat.buf_cache_size > gCacheStat.max_buf_cache_size) {
-        gCacheStat.max_buf_cache_size = gCacheStat.buf_cache_size;
+    if (psShard->sStat.buf_cache_size > psShard->sStat.max_buf_cache_size) {
+        psShard->sStat.max_buf_cache_size = psShard->sStat.buf_cache_size;
     }
 
     return(&entry->sBuf);
@@ -677,7 +1031,7 @@ error:
         if (entry->sBuf.pvData) {
             hfs_free(entry->sBuf.pvData);
         }
-        hfs_free(entry);
+        hfs_zfree(entry, HFS_GENBUF_ZONE);
     }
     return(NULL);
 }
@@ -685,29 +1039,46 @@ error:
 void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf )
 {
     struct buf_cache_entry *entry;
+    BufCacheShard_S *psShard = lf_hfs_generic_buf_cache_shard_of(psBuf);
 
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_cache_update: psBuf %p\n", psBuf);
     #endif
 
+    lf_lck_mtx_lock(&psShard->sLock);
+
     // Check that cache entry still exists and hasn't thrown away
-    entry = lf_hfs_generic_buf_cache_find(psBuf);
-    if (!entry) {
-        return;
+    entry = lf_hfs_generic_buf_cache_find(psShard, psBuf);
+    if (entry) {
+        lf_hfs_generic_buf_cache_touch(psShard, entry);
     }
 
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_lck_mtx_unlock(&psShard->sLock);
 }
 
 void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, __unused GenericLFBufPtr psBuf )
 {
+    BufCacheShard_S *psShard = lf_hfs_generic_buf_cache_shard(entry->iFD, entry->sBuf.uPhyCluster);
+
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_cache_copy: psBuf %p\n", psBuf);
     #endif
 
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_hfs_generic_buf_cache_touch(psShard, entry);
+}
+
+// Unlinks the entry from its shard. The shard lock should be held by the caller.
+static void lf_hfs_generic_buf_cache_unlink( BufCacheShard_S *psShard, struct buf_cache_entry *entry ) {
+
+    TAILQ_REMOVE(lf_hfs_generic_buf_cache_list_of(psShard, entry), entry, buf_cache_link);
+    if (!entry->bInAm) {
+        psShard->uA1inSize -= entry->sBuf.uDataSize;
+    }
+    LIST_REMOVE(entry, buf_phy_link);
+    LIST_REMOVE(entry, buf_vnode_link);
+    --psShard->sStat.buf_cache_size;
+    ++psShard->sStat.buf_cache_remove;
+    psShard->sStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
 }
 
 void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
@@ -722,10 +1093,7 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
                psBuf, psBuf->psVnode, psBuf->uBlockN, psBuf->uDataSize, psBuf->uCacheFlags, psBuf->uPhyCluster, psBuf->uUseCnt);
     #endif
     
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    --gCacheStat.buf_cache_size;
-    ++gCacheStat.buf_cache_remove;
-    gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
+    lf_hfs_generic_buf_cache_unlink(lf_hfs_generic_buf_cache_shard(entry->iFD, entry->sBuf.uPhyCluster), entry);
 
     assert(entry->sBuf.uLockCnt == 1);
     
@@ -734,35 +1102,50 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
     lf_lck_mtx_destroy(&entry->sBuf.sLock);
     
     hfs_free(entry->sBuf.pvData);
-    hfs_free(entry);
+    hfs_zfree(entry, HFS_GENBUF_ZONE);
 }
 
 void lf_hfs_generic_buf_cache_remove_all( int iFD ) {
     struct buf_cache_entry *entry, *entry_next;
 
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        lf_lck_mtx_lock(&psShard->sLock);
+
+        struct buf_cache_head *apsLists[] = {&psShard->sA1inList, &psShard->sAmList};
+        for (uint32_t uList = 0; uList < sizeof(apsLists)/sizeof(apsLists[0]); uList++) {
+            TAILQ_FOREACH_SAFE(entry, apsLists[uList], buf_cache_link, entry_next)
+            {
+                if ( (iFD == IGNORE_MOUNT_FD) || ( entry->iFD == iFD ) )
+                {
+                    if (iFD == IGNORE_MOUNT_FD) {
+                        // Media no longer available, force remove all
+                        lf_hfs_generic_buf_cache_unlink(psShard, entry);
+                    } else {
+                        lf_hfs_generic_buf_lock(&entry->sBuf);
+                        lf_hfs_generic_buf_cache_remove(entry);
+                    }
+                }
+            }
+        }
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
-    {
-        if ( (iFD == IGNORE_MOUNT_FD) || ( VNODE_TO_IFD(entry->sBuf.psVnode) == iFD ) )
-        {
-            if (iFD == IGNORE_MOUNT_FD) {
-                // Media no longer available, force remove all
-                TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-                --gCacheStat.buf_cache_size;
-                ++gCacheStat.buf_cache_remove;
-                gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
-            } else {
-                lf_hfs_generic_buf_lock(&entry->sBuf);
-                lf_hfs_generic_buf_cache_remove(entry);
+        // The file descriptor may get reused by another mount, forget its ghosts
+        struct buf_ghost_entry *psGhost, *psNextGhost;
+        TAILQ_FOREACH_SAFE(psGhost, &psShard->sA1outList, buf_ghost_link, psNextGhost) {
+            if ( (iFD == IGNORE_MOUNT_FD) || (psGhost->iFD == iFD) ) {
+                TAILQ_REMOVE(&psShard->sA1outList, psGhost, buf_ghost_link);
+                LIST_REMOVE(psGhost, buf_ghost_hash_link);
+                psShard->uA1outCnt--;
+                hfs_free(psGhost);
             }
         }
-    }
 
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sLock);
+    }
 }
 
-/* buf_cache_mutex Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
+/* The shards Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
 void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
 
     struct buf_cache_entry *entry, *entry_next;
@@ -770,17 +1153,21 @@ void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_cache_remove_vnode: vp %p: ", vp);
     #endif
-    
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next) {
-        
-        if ( entry->sBuf.psVnode == vp ) {
-            
-            #if GEN_BUF_ALLOC_DEBUG
-                printf("&sBuf %p, ", &entry->sBuf);
-            #endif
-            
-            lf_hfs_generic_buf_lock(&entry->sBuf);
-            lf_hfs_generic_buf_cache_remove(entry);
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        BufCacheShard_S *psShard = &buf_cache_shards[uShard];
+
+        LIST_FOREACH_SAFE(entry, lf_hfs_generic_buf_cache_vnode_bucket(psShard, vp), buf_vnode_link, entry_next) {
+
+            if ( entry->sBuf.psVnode == vp ) {
+
+                #if GEN_BUF_ALLOC_DEBUG
+                    printf("&sBuf %p, ", &entry->sBuf);
+                #endif
+
+                lf_hfs_generic_buf_lock(&entry->sBuf);
+                lf_hfs_generic_buf_cache_remove(entry);
+            }
         }
     }
 
@@ -789,12 +1176,17 @@ void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
     #endif
 }
 
+// Locks all the shards, in ascending order
 void lf_hfs_generic_buf_cache_LockBufCache(void)
 {
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_SHARD_COUNT; uShard++) {
+        lf_lck_mtx_lock(&buf_cache_shards[uShard].sLock);
+    }
 }
 
 void lf_hfs_generic_buf_cache_UnLockBufCache(void)
 {
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    for (uint32_t uShard = BUF_CACHE_SHARD_COUNT; uShard > 0; uShard--) {
+        lf_lck_mtx_unlock(&buf_cache_shards[uShard - 1].sLock);
+    }
 }
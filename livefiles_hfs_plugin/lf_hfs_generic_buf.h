@@ -43,6 +43,9 @@ typedef struct GenericBuffer {
     void            *pvCallbackArgs;                                    // pfFunc args
 } GenericLFBuf, *GenericLFBufPtr;
 
+// Element size of HFS_GENBUF_ZONE, which also holds the buffer cache entries wrapping a GenericLFBuf
+#define GEN_BUF_ZONE_ELEM_SIZE  (sizeof(GenericLFBuf) + 64)
+
 typedef struct {
     uint32_t buf_cache_size;
     uint32_t max_buf_cache_size;
@@ -52,10 +55,19 @@ typedef struct {
     uint32_t buf_cache_cleanup;
 
     uint64_t buf_total_allocated_size;
+
+    uint64_t buf_cache_hit;         // Lookups served from the cache
+    uint64_t buf_cache_miss;        // Lookups that had to allocate a new buffer
+    uint64_t buf_cache_ghost_hit;   // Misses on a buffer recently evicted from A1in (promoted to Am)
+    uint64_t buf_cache_budget;      // Current data budget in bytes
 } CacheStats_S;
 
 extern CacheStats_S gCacheStat;
 
+// Buffer cache budget contributed by every mount, may be changed with LFHFS_FSATTR_BUF_CACHE_BUDGET
+#define GEN_BUF_CACHE_DEFAULT_MOUNT_BUDGET  (1536*1024)
+#define GEN_BUF_CACHE_MIN_MOUNT_BUDGET      (256*1024)
+
 
 GenericLFBufPtr     lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN, uint32_t uBlockSize, uint64_t uFlags );
 int                 lf_hfs_generic_buf_take_ownership(GenericLFBuf *psBuf, pthread_mutex_t *pSem);
@@ -70,11 +82,14 @@ void                lf_hfs_generic_buf_clear( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_set_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheFlags);
 void                lf_hfs_generic_buf_clear_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheFlags);
 void                lf_hfs_generic_buf_override_owner(GenericLFBufPtr psBuf);
+void                lf_hfs_generic_buf_transfer_ownership(GenericLFBufPtr psBuf, pthread_t sNewOwner);
 void                lf_hfs_generic_buf_lock(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_unlock(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_cache_init( void );
 void                lf_hfs_generic_buf_cache_deinit( void );
 void                lf_hfs_generic_buf_cache_clear_by_iFD( int iFD );
+void                lf_hfs_generic_buf_cache_get_stats( CacheStats_S *psStat );
+void                lf_hfs_generic_buf_cache_adjust_budget( int64_t iDelta );
 void                lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp);
 void                lf_hfs_generic_buf_cache_UnLockBufCache(void);
@@ -57,6 +57,8 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_logger.h"
 #include "lf_hfs_vfsops.h"
+#include "lf_hfs_utils.h"
+#include "../lib_fsck_hfs/journal_verify.h"
 
 // ************************** Function Definitions ***********************
 // number of bytes to checksum in a block_list_header
@@ -169,6 +171,15 @@ static void   unlock_condition(journal *jnl, ConditionalFlag_S *psCondFlag);
 static int    write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num);
 static size_t read_journal_data(journal *jnl, off_t *offset, void *data, size_t len);
 static size_t write_journal_data(journal *jnl, off_t *offset, void *data, size_t len);
+static void   journal_start_commit_thread(journal *jnl);
+static void   journal_stop_commit_thread(journal *jnl);
+static void   journal_start_checkpoint_thread(journal *jnl);
+static void   journal_stop_checkpoint_thread(journal *jnl);
+static off_t  free_space(journal *jnl);
+static uint64_t journal_used_space(journal *jnl);
+static int    wait_old_start(journal *jnl);
+static uint64_t journal_now_us(void);
+static boolean_t journal_commit_async(journal *jnl, transaction *tr);
         
 
 static __inline__ void lock_oldstart(journal *jnl) {
@@ -293,6 +304,7 @@ journal *journal_open(struct vnode *jvp,
     jnl->flush_arg    = arg;
     jnl->flags        = (flags & JOURNAL_OPTION_FLAGS_MASK);
     lf_lck_mtx_init(&jnl->old_start_lock);
+    lf_cond_init(&jnl->old_start_cond);
     lf_cond_init(&jnl->flushing.sCond);
     lf_cond_init(&jnl->asyncIO.sCond);
     lf_cond_init(&jnl->writing_header.sCond);
@@ -485,6 +497,9 @@ journal *journal_open(struct vnode *jvp,
     lf_lck_mtx_init(&jnl->jlock);
     lf_lck_mtx_init(&jnl->flock);
     lf_lck_rw_init(&jnl->trim_lock);
+
+    journal_start_commit_thread(jnl);
+    journal_start_checkpoint_thread(jnl);
     
     goto journal_open_complete;
     
@@ -566,6 +581,7 @@ journal *journal_create(struct vnode *jvp,
     jnl->flush_arg    = arg;
     jnl->flags        = (flags & JOURNAL_OPTION_FLAGS_MASK);
     lf_lck_mtx_init(&jnl->old_start_lock);
+    lf_cond_init(&jnl->old_start_cond);
     
     // Keep a point to the mount around for use in IO throttling.
     jnl->fsmount      = fsmount;
@@ -637,6 +653,9 @@ journal *journal_create(struct vnode *jvp,
         LFHFS_LOG(LEVEL_ERROR, "jnl: journal_create: failed to write journal header.\n");
         goto bad_write;
     }
+
+    journal_start_commit_thread(jnl);
+    journal_start_checkpoint_thread(jnl);
     
     goto journal_create_complete;
     
@@ -698,6 +717,9 @@ bool is_journaled(UVFSFileNode *psRootNode) {
 
 // Media no longer available, clear all memory occupied by the journal
 void journal_release(journal *jnl) {
+    journal_stop_commit_thread(jnl);
+    journal_stop_checkpoint_thread(jnl);
+
     if (jnl->owner != pthread_self()) {
         journal_lock(jnl);
     }
@@ -716,6 +738,7 @@ void journal_release(journal *jnl) {
     jnl->jhdr = (void *)0xbeefbabe;
     
     journal_unlock(jnl);
+    lf_cond_destroy(&jnl->old_start_cond);
     lf_lck_mtx_destroy(&jnl->old_start_lock);
     lf_lck_mtx_destroy(&jnl->jlock);
     lf_lck_mtx_destroy(&jnl->flock);
@@ -733,6 +756,9 @@ void journal_close(journal *jnl) {
     // we start tearing things down properly.
     //
     jnl->flags |= JOURNAL_CLOSE_PENDING;
+
+    journal_stop_commit_thread(jnl);
+    journal_stop_checkpoint_thread(jnl);
     
     if (jnl->owner != pthread_self()) {
         journal_lock(jnl);
@@ -773,13 +799,22 @@ void journal_close(journal *jnl) {
         start = &jnl->active_start;
         end   = &jnl->jhdr->end;
         
-        while (*start != *end && counter++ < 5000) {
+        lock_oldstart(jnl);
+        while (*start != *end && counter < 5000) {
             //printf("jnl: close: flushing the buffer cache (start 0x%llx end 0x%llx)\n", *start, *end);
             if (jnl->flush) {
+                unlock_oldstart(jnl);
                 jnl->flush(jnl->flush_arg);
+                lock_oldstart(jnl);
+                if (*start == *end) {
+                    break;
+                }
+            }
+            if (wait_old_start(jnl) == ETIMEDOUT) {
+                counter++;
             }
-            usleep(10000);
         }
+        unlock_oldstart(jnl);
         
         if (*start != *end) {
             LFHFS_LOG(LEVEL_ERROR, "jnl: close: buffer flushing didn't seem to flush out all the transactions! (0x%llx - 0x%llx)\n",
@@ -820,6 +855,7 @@ void journal_close(journal *jnl) {
     jnl->jhdr = (void *)0xbeefbabe;
     
     journal_unlock(jnl);
+    lf_cond_destroy(&jnl->old_start_cond);
     lf_lck_mtx_destroy(&jnl->old_start_lock);
     lf_lck_mtx_destroy(&jnl->jlock);
     lf_lck_mtx_destroy(&jnl->flock);
@@ -1361,6 +1397,169 @@ exit:
     return iRet;
 }
 
+/*
+ * Replay writes the coalesced buckets straight to their home blocks.
+ *
+ * A bucket always carries the complete new contents of the blocks it covers,
+ * so unless it ends in the middle of a physical block there is nothing to read
+ * back first.  Buckets whose home blocks are adjacent on the device are
+ * gathered into one buffer (their journal copies read with as few reads as
+ * possible) and go out as a single write.  Runs never overlap, so up to
+ * REPLAY_WRITERS of them are written at the same time.
+ */
+#define REPLAY_MAX_RUN_SIZE (1024 * 1024)
+#define REPLAY_WRITERS      4
+
+typedef struct replay_run {
+    int     first;      // index of the first bucket in co_buf
+    int     count;
+    size_t  size;
+} replay_run;
+
+typedef struct replay_writer {
+    journal        *jnl;
+    struct bucket  *co_buf;
+    replay_run     *runs;
+    int             num_runs;
+    size_t          max_run_size;
+    pthread_mutex_t lock;
+    int             next;       // next run to hand out, protected by lock
+    int             error;      // first failure, protected by lock
+} replay_writer;
+
+static int replay_bucket_cmp(const void *a, const void *b) {
+    off_t num_a = ((const struct bucket *)a)->block_num;
+    off_t num_b = ((const struct bucket *)b)->block_num;
+
+    return (num_a < num_b) ? -1 : (num_a > num_b);
+}
+
+static int replay_write_run(journal *jnl, struct bucket *co_buf, replay_run *run, char *buf) {
+    struct bucket *b       = &co_buf[run->first];
+    size_t        phys_blksz = jnl->fsmount->psHfsmount->hfs_physical_block_size;
+    size_t        done     = 0;
+    int           i, j;
+
+    for (i = 0; i < run->count; i = j) {
+        off_t  jnl_offset = (off_t)b[i].jnl_offset;
+        size_t len        = b[i].block_size;
+
+        // journal copies that sit back to back are read in one go
+        for (j = i + 1; j < run->count && (off_t)b[j].jnl_offset == (off_t)b[j-1].jnl_offset + b[j-1].block_size; j++) {
+            len += b[j].block_size;
+        }
+
+        if (read_journal_data(jnl, &jnl_offset, buf + done, len) != len) {
+            LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%x!\n", b[i].jnl_offset);
+            return -1;
+        }
+        done += len;
+    }
+
+    if (run->size % phys_blksz) {
+        // the tail of the last physical block has to come from the disk
+        return update_fs_block(jnl, buf, b[0].block_num, run->size);
+    }
+
+    int iErr = raw_readwrite_write_mount(jnl->fsmount->psHfsmount->hfs_devvp, b[0].block_num, phys_blksz,
+                                         buf, run->size, NULL, NULL);
+    if (iErr) {
+        LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: failed to write blocks %lld - %lld (ret %d)\n",
+                  b[0].block_num, b[0].block_num + (off_t)(run->size / phys_blksz) - 1, iErr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *replay_writer_thread(void *arg) {
+    replay_writer *rw  = arg;
+    char          *buf = hfs_malloc(rw->max_run_size);
+
+    lf_lck_mtx_lock(&rw->lock);
+    while (buf != NULL && rw->error == 0 && rw->next < rw->num_runs) {
+        replay_run *run = &rw->runs[rw->next++];
+        lf_lck_mtx_unlock(&rw->lock);
+
+        int iErr = replay_write_run(rw->jnl, rw->co_buf, run, buf);
+
+        lf_lck_mtx_lock(&rw->lock);
+        if (iErr && rw->error == 0) {
+            rw->error = iErr;
+        }
+    }
+    if (buf == NULL && rw->error == 0) {
+        rw->error = ENOMEM;
+    }
+    lf_lck_mtx_unlock(&rw->lock);
+
+    hfs_free(buf);
+    return NULL;
+}
+
+static int replay_write_buckets(journal *jnl, struct bucket *co_buf, int num_full) {
+    size_t        phys_blksz = jnl->fsmount->psHfsmount->hfs_physical_block_size;
+    replay_writer rw = {0};
+    pthread_t     threads[REPLAY_WRITERS - 1];
+    int           num_threads = 0;
+    int           i;
+
+    // killed buckets (block_num -1) sort to the front and are skipped
+    qsort(co_buf, num_full, sizeof(struct bucket), replay_bucket_cmp);
+    for (i = 0; i < num_full && co_buf[i].block_num == (off_t)-1; i++)
+        ;
+
+    rw.jnl    = jnl;
+    rw.co_buf = co_buf;
+    rw.runs   = hfs_malloc(MAX(num_full - i, 1) * sizeof(replay_run));
+    if (rw.runs == NULL) {
+        return -1;
+    }
+
+    for (; i < num_full; i++) {
+        replay_run *run = (rw.num_runs > 0) ? &rw.runs[rw.num_runs - 1] : NULL;
+
+        if (run != NULL &&
+            run->size % phys_blksz == 0 &&
+            co_buf[run->first].block_num * (off_t)phys_blksz + (off_t)run->size == co_buf[i].block_num * (off_t)phys_blksz &&
+            run->size + co_buf[i].block_size <= REPLAY_MAX_RUN_SIZE) {
+            run->count++;
+            run->size += co_buf[i].block_size;
+        } else {
+            run = &rw.runs[rw.num_runs++];
+            run->first = i;
+            run->count = 1;
+            run->size  = co_buf[i].block_size;
+        }
+        rw.max_run_size = MAX(rw.max_run_size, run->size);
+    }
+
+    if (rw.num_runs == 0) {
+        hfs_free(rw.runs);
+        return 0;
+    }
+
+    lf_lck_mtx_init(&rw.lock);
+    for (i = 0; i < MIN(rw.num_runs, REPLAY_WRITERS) - 1; i++) {
+        if (pthread_create(&threads[num_threads], NULL, replay_writer_thread, &rw) != 0) {
+            // fewer writers only makes it slower
+            break;
+        }
+        num_threads++;
+    }
+
+    // this thread is a writer too
+    replay_writer_thread(&rw);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    lf_lck_mtx_destroy(&rw.lock);
+    hfs_free(rw.runs);
+
+    return rw.error ? -1 : 0;
+}
+
 
 static int grow_table(struct bucket **buf_ptr, int num_buckets, int new_size) {
     struct bucket *newBuf;
@@ -1656,18 +1855,128 @@ static void swap_block_list_header(journal *jnl, block_list_header *blhdr) {
     }
 }
 
+//
+// The per-block checksums of one block list.  replay_journal reads the
+// data of a block list in one go and hands it to a jnl_verifier, then
+// goes on to read the next block list header while the checksums are
+// being computed.  The result is collected before that header is used.
+//
+typedef struct replay_verify {
+    char               *data;              // Data of all the blocks of the block list
+    jnl_verify_block_t *blocks;
+    off_t              *bnums;             // Per verified block, for logging
+    int                *indexes;           // binfo index per verified block, for logging
+    int                 count;
+    off_t               blhdr_offset;
+    off_t               txn_start_offset;
+} replay_verify;
+
+static void replay_verify_free(replay_verify *rv) {
+    hfs_free(rv->data);
+    hfs_free(rv->blocks);
+    hfs_free(rv->bnums);
+    hfs_free(rv->indexes);
+    memset(rv, 0, sizeof(*rv));
+}
+
+// Read the data of the block list at data_offset (just past its header) and start
+// verifying it.  Returns -1 if the data could not be read.
+static int replay_verify_start(journal *jnl, jnl_verifier_t *jv, replay_verify *rv, block_list_header *blhdr,
+                               off_t data_offset, off_t blhdr_offset, off_t txn_start_offset) {
+    size_t  data_size = 0, ret;
+    int     i;
+
+    for (i = 1; i < blhdr->num_blocks; i++) {
+        if (blhdr->binfo[i].u.bi.bsize <= 0) {
+            LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: invalid bsize\n");
+            return -1;
+        }
+        data_size += blhdr->binfo[i].u.bi.bsize;
+    }
+    if (data_size > (size_t)(jnl->jhdr->size - jnl->jhdr->jhdr_size)) {
+        LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: block list data too large (%zu)\n", data_size);
+        return -1;
+    }
+
+    rv->data    = hfs_malloc(data_size);
+    rv->blocks  = hfs_malloc(blhdr->num_blocks * sizeof(*rv->blocks));
+    rv->bnums   = hfs_malloc(blhdr->num_blocks * sizeof(*rv->bnums));
+    rv->indexes = hfs_malloc(blhdr->num_blocks * sizeof(*rv->indexes));
+    if (!rv->data || !rv->blocks || !rv->bnums || !rv->indexes) {
+        replay_verify_free(rv);
+        return -1;
+    }
+
+    ret = read_journal_data(jnl, &data_offset, rv->data, data_size);
+    if (ret != data_size) {
+        LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", data_offset);
+        replay_verify_free(rv);
+        return -1;
+    }
+
+    size_t pos = 0;
+    for (i = 1; i < blhdr->num_blocks; i++) {
+        // "killed" blocks don't get replayed, so there is nothing to check
+        if (blhdr->binfo[i].bnum != (off_t)-1) {
+            jnl_verify_block_t *blk = &rv->blocks[rv->count];
+            blk->data     = rv->data + pos;
+            blk->size     = blhdr->binfo[i].u.bi.bsize;
+            // there is no need to swap the checksum from disk because
+            // it got swapped when the blhdr was read in.
+            blk->cksum    = blhdr->binfo[i].u.bi.b.cksum;
+            blk->computed = 0;
+            rv->bnums[rv->count]   = blhdr->binfo[i].bnum;
+            rv->indexes[rv->count] = i;
+            rv->count++;
+        }
+        pos += blhdr->binfo[i].u.bi.bsize;
+    }
+    rv->blhdr_offset     = blhdr_offset;
+    rv->txn_start_offset = txn_start_offset;
+
+    jnl_verifier_start(jv, rv->blocks, rv->count);
+    return 0;
+}
+
+// Collect the result of replay_verify_start, if one is outstanding.
+// Returns -1 if a block's checksum did not match.
+static int replay_verify_wait(jnl_verifier_t *jv, replay_verify *rv) {
+    int bad;
+
+    if (rv->blocks == NULL) {
+        return 0;
+    }
+
+    bad = jnl_verifier_wait(jv, rv->blocks, rv->count);
+    if (bad >= 0) {
+        const jnl_verify_block_t *blk = &rv->blocks[bad];
+        const int *data = (const int *)blk->data;
+
+        LFHFS_LOG(LEVEL_ERROR, "jnl: txn starting at %lld (%lld) @ index %3d bnum %lld (%d) with disk cksum != blhdr cksum (0x%.8x 0x%.8x)\n",
+               rv->txn_start_offset, rv->blhdr_offset, rv->indexes[bad], rv->bnums[bad], blk->size, blk->computed, blk->cksum);
+        if (blk->size >= 8*sizeof(int)) {
+            LFHFS_LOG(LEVEL_ERROR, "jnl: 0x%.8x 0x%.8x 0x%.8x 0x%.8x  0x%.8x 0x%.8x 0x%.8x 0x%.8x\n",
+                   data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
+        }
+    }
+
+    replay_verify_free(rv);
+    return (bad >= 0) ? -1 : 0;
+}
+
 static int replay_journal(journal *jnl) {
     int          i, bad_blocks=0;
-    unsigned int   orig_checksum, checksum, check_block_checksums = 0;
+    unsigned int   orig_checksum, checksum;
     size_t         ret;
-    size_t         max_bsize = 0;        /* protected by block_ptr */
     block_list_header *blhdr;
     off_t          offset, txn_start_offset=0, blhdr_offset, orig_jnl_start;
-    char          *buff, *block_ptr=NULL;
+    char          *buff;
     struct bucket *co_buf;
     int           num_buckets = STARTING_BUCKETS, num_full, check_past_jnl_end = 1, in_uncharted_territory = 0;
     uint32_t      last_sequence_num = 0;
     int           replay_retry_count = 0;
+    jnl_verifier_t *jv = NULL;
+    replay_verify  rv = {0};
     
     LFHFS_LOG(LEVEL_DEFAULT, "replay_journal: start.\n");
 
@@ -1693,6 +2002,9 @@ static int replay_journal(journal *jnl) {
     // allocate memory for the coalesce buffer
     co_buf = hfs_malloc(num_buckets*sizeof(struct bucket));
     
+    // block checksums are verified in parallel; without a pool it's done inline
+    jv = jnl_verifier_create(0);
+    
 restart_replay:
     
     // initialize entries
@@ -1705,6 +2017,12 @@ restart_replay:
     while (check_past_jnl_end || jnl->jhdr->start != jnl->jhdr->end) {
         offset = blhdr_offset = jnl->jhdr->start;
         ret = read_journal_data(jnl, &offset, buff, jnl->jhdr->blhdr_size);
+        
+        // the previous block list was being verified while we read this header
+        if (replay_verify_wait(jv, &rv) != 0) {
+            goto bad_txn_handling;
+        }
+        
         if (ret != (size_t)jnl->jhdr->blhdr_size) {
             LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read block list header block @ 0x%llx!\n", offset);
             goto bad_txn_handling;
@@ -1794,29 +2112,23 @@ restart_replay:
             goto bad_txn_handling;
         }
         
-        max_bsize = 0;
         for (i = 1; i < blhdr->num_blocks; i++) {
             if (blhdr->binfo[i].bnum < 0 && blhdr->binfo[i].bnum != (off_t)-1) {
                 LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: bogus block number 0x%llx\n", blhdr->binfo[i].bnum);
                 goto bad_txn_handling;
             }
-            
-            if ((size_t)blhdr->binfo[i].u.bi.bsize > max_bsize) {
-                max_bsize = blhdr->binfo[i].u.bi.bsize;
-            }
-        }
-        
-        if (blhdr->flags & BLHDR_CHECK_CHECKSUMS) {
-            check_block_checksums = 1;
-            block_ptr = hfs_malloc(max_bsize);
-        } else {
-            block_ptr = NULL;
         }
         
         if (blhdr->flags & BLHDR_FIRST_HEADER) {
             txn_start_offset = blhdr_offset;
         }
         
+        if (blhdr->flags & BLHDR_CHECK_CHECKSUMS) {
+            if (replay_verify_start(jnl, jv, &rv, blhdr, offset, blhdr_offset, txn_start_offset) != 0) {
+                goto bad_txn_handling;
+            }
+        }
+        
         //printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_buf\n",
         //       blhdr->num_blocks-1, jnl->jhdr->start);
         bad_blocks = 0;
@@ -1837,35 +2149,6 @@ restart_replay:
                 //printf("jnl: replay_journal: skipping killed fs block (index %d)\n", i);
             } else {
                 
-                if (check_block_checksums) {
-                    int32_t disk_cksum;
-                    off_t block_offset;
-                    
-                    block_offset = offset;
-                    
-                    // read the block so we can check the checksum
-                    ret = read_journal_data(jnl, &block_offset, block_ptr, size);
-                    if (ret != (size_t)size) {
-                        LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", offset);
-                        goto bad_txn_handling;
-                    }
-                    
-                    disk_cksum = calc_checksum(block_ptr, size);
-                    
-                    // there is no need to swap the checksum from disk because
-                    // it got swapped when the blhdr was read in.
-                    if (blhdr->binfo[i].u.bi.b.cksum != 0 && disk_cksum != blhdr->binfo[i].u.bi.b.cksum) {
-                        LFHFS_LOG(LEVEL_ERROR, "jnl: txn starting at %lld (%lld) @ index %3d bnum %lld (%d) with disk cksum != blhdr cksum (0x%.8x 0x%.8x)\n",
-                               txn_start_offset, blhdr_offset, i, number, size, disk_cksum, blhdr->binfo[i].u.bi.b.cksum);
-                        LFHFS_LOG(LEVEL_ERROR, "jnl: 0x%.8x 0x%.8x 0x%.8x 0x%.8x  0x%.8x 0x%.8x 0x%.8x 0x%.8x\n",
-                               *(int *)&block_ptr[0*sizeof(int)], *(int *)&block_ptr[1*sizeof(int)], *(int *)&block_ptr[2*sizeof(int)], *(int *)&block_ptr[3*sizeof(int)],
-                               *(int *)&block_ptr[4*sizeof(int)], *(int *)&block_ptr[5*sizeof(int)], *(int *)&block_ptr[6*sizeof(int)], *(int *)&block_ptr[7*sizeof(int)]);
-                        
-                        goto bad_txn_handling;
-                    }
-                }
-                
-                
                 // add this bucket to co_buf, coalescing where possible
                 // printf("jnl: replay_journal: adding block 0x%llx\n", number);
                 ret_val = add_block(jnl, &co_buf, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum, &num_buckets, &num_full);
@@ -1888,13 +2171,11 @@ restart_replay:
             }
         }
         
-        if (block_ptr) {
-            hfs_free(block_ptr);
-            block_ptr = NULL;
-        }
-        
         if (bad_blocks) {
         bad_txn_handling:
+            // forget about a block list that may still be under verification
+            replay_verify_wait(jv, &rv);
+            
             /* Journal replay got error before it found any valid
              *  transations, abort replay */
             if (txn_start_offset == 0) {
@@ -1933,6 +2214,13 @@ restart_replay:
         }
     }
     
+    // the last block list is still being verified
+    if (replay_verify_wait(jv, &rv) != 0) {
+        goto bad_txn_handling;
+    }
+    jnl_verifier_destroy(jv);
+    jv = NULL;
+    
     if (jnl->jhdr->start != jnl->jhdr->end) {
         LFHFS_LOG(LEVEL_ERROR, "jnl: start %lld != end %lld.  resetting end.\n", jnl->jhdr->start, jnl->jhdr->end);
         jnl->jhdr->end = jnl->jhdr->start;
@@ -1940,52 +2228,9 @@ restart_replay:
     
     //printf("jnl: replay_journal: replaying %d blocks\n", num_full);
     
-    /*
-     * make sure it's at least one page in size, so
-     * start max_bsize at PAGE_SIZE
-     */
-    for (i = 0, max_bsize = PAGE_SIZE; i < num_full; i++) {
-        
-        if (co_buf[i].block_num == (off_t)-1)
-            continue;
-        
-        if (co_buf[i].block_size > max_bsize)
-            max_bsize = co_buf[i].block_size;
-    }
-    /*
-     * round max_bsize up to the nearest PAGE_SIZE multiple
-     */
-    if (max_bsize & (PAGE_SIZE - 1)) {
-        max_bsize = (max_bsize + PAGE_SIZE) & ~(PAGE_SIZE - 1);
-    }
-    
-    block_ptr = hfs_malloc(max_bsize);
-    
     // Replay the coalesced entries in the co-buf
-    for(i = 0; i < num_full; i++) {
-        size_t size = co_buf[i].block_size;
-        off_t jnl_offset = (off_t) co_buf[i].jnl_offset;
-        off_t number = co_buf[i].block_num;
-        
-        
-        // printf("replaying co_buf[%d]: block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", i, co_buf[i].block_num,
-        //      co_buf[i].block_size, co_buf[i].jnl_offset);
-        
-        if (number == (off_t)-1) {
-            // printf("jnl: replay_journal: skipping killed fs block\n");
-        } else {
-            
-            // do journal read, and set the phys. block
-            ret = read_journal_data(jnl, &jnl_offset, block_ptr, size);
-            if (ret != size) {
-                LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", jnl_offset);
-                goto bad_replay;
-            }
-            
-            if (update_fs_block(jnl, block_ptr, number, size) != 0) {
-                goto bad_replay;
-            }
-        }
+    if (replay_write_buckets(jnl, co_buf, num_full) != 0) {
+        goto bad_replay;
     }
     
     
@@ -1994,12 +2239,6 @@ restart_replay:
         goto bad_replay;
     }
     
-    // free block_ptr
-    if (block_ptr) {
-        hfs_free(block_ptr);
-        block_ptr = NULL;
-    }
-    
     // free the coalesce buffer
     hfs_free(co_buf);
     co_buf = NULL;
@@ -2011,7 +2250,8 @@ success:
     return 0;
     
 bad_replay:
-    hfs_free(block_ptr);
+    replay_verify_wait(jv, &rv);
+    jnl_verifier_destroy(jv);
     hfs_free(co_buf);
     hfs_free(buff);
     
@@ -2186,6 +2426,8 @@ static void buffer_written(transaction *tr, GenericLFBuf *bp) {
         jnl->tr_freeme = tr;
     }
 transaction_done:
+    // wake up commits waiting for journal space, and the checkpoint thread
+    pthread_cond_broadcast(&jnl->old_start_cond);
     unlock_oldstart(jnl);
     
     unlock_condition(jnl, &jnl->asyncIO);
@@ -2664,6 +2906,22 @@ static void dump_journal(journal *jnl) {
     }
 }
 
+// Bytes of the journal held by transactions that were not reclaimed yet
+static uint64_t journal_used_space(journal *jnl) {
+    return (uint64_t)(jnl->jhdr->size - jnl->jhdr->jhdr_size - free_space(jnl));
+}
+
+// Wait (with old_start_lock held) until buffer_written() finishes a transaction,
+// or for at most 10 milliseconds. Returns ETIMEDOUT if nothing completed.
+static int wait_old_start(journal *jnl) {
+    struct timespec sWaitTime = {
+        .tv_sec  = 0,
+        .tv_nsec = 10 * 1000000,
+    };
+
+    return lf_cond_wait_relative(&jnl->old_start_cond, &jnl->old_start_lock, &sWaitTime);
+}
+
 // The journal must be locked on entry to this function.
 // The "desired_size" is in bytes.
 static int check_free_space( journal *jnl,
@@ -2673,6 +2931,7 @@ static int check_free_space( journal *jnl,
 
     size_t    i;
     int    counter=0;
+    uint64_t stall_start_us = 0;
     
     //printf("jnl: check free space (desired 0x%x, avail 0x%Lx)\n",
     //       desired_size, free_space(jnl));
@@ -2707,17 +2966,26 @@ static int check_free_space( journal *jnl,
             
             lcl_counter = 0;
             while (jnl->old_start[i] & 0x8000000000000000LL) {
-                if (lcl_counter++ > 10000) {
+                if (lcl_counter > 10000) {
                     panic("jnl: check_free_space: tr starting @ 0x%llx not flushing (jnl %p).\n",
                           jnl->old_start[i], jnl);
                 }
                 
-                unlock_oldstart(jnl);
                 if (jnl->flush) {
+                    unlock_oldstart(jnl);
                     jnl->flush(jnl->flush_arg);
+                    lock_oldstart(jnl);
+                    if ((jnl->old_start[i] & 0x8000000000000000LL) == 0) {
+                        break;
+                    }
+                }
+                // buffer_written() wakes us up as soon as the transaction is done
+                if (stall_start_us == 0) {
+                    stall_start_us = journal_now_us();
+                }
+                if (wait_old_start(jnl) == ETIMEDOUT) {
+                    lcl_counter++;
                 }
-                usleep(10000);
-                lock_oldstart(jnl);
             }
             
             if (jnl->old_start[i] == 0) {
@@ -2772,9 +3040,16 @@ static int check_free_space( journal *jnl,
             jnl->flush(jnl->flush_arg);
         }
         
-        // wait for a while to avoid being cpu-bound (this will
-        // put us to sleep for 10 milliseconds)
-        usleep(10000);
+        // there is no need to sleep here: we waited above for every
+        // transaction in old_start[] to complete, so the next pass
+        // reclaims the rest of the journal
+    }
+
+    if (stall_start_us != 0) {
+        lock_oldstart(jnl);
+        jnl->stats.jnl_stalls++;
+        jnl->stats.jnl_stall_usec += journal_now_us() - stall_start_us;
+        unlock_oldstart(jnl);
     }
 
     return 0;
@@ -2815,6 +3090,312 @@ static void unlock_condition(journal *jnl, ConditionalFlag_S *psCondFlag) {
     unlock_flush(jnl);
 }
 
+static uint64_t journal_now_ms(void) {
+    return journal_now_us() / 1000;
+}
+
+static uint64_t journal_now_us(void) {
+    struct timeval tv;
+
+    microuptime(&tv);
+    return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/*
+ * Hand a transaction whose blocks were already copied into its tbuffer over to
+ * the commit thread. Called from end_transaction with the journal lock and the
+ * 'flushing' condition held; the condition is released by finish_end_transaction
+ * on the commit thread. Returns FALSE if the caller has to commit it itself.
+ */
+static boolean_t journal_commit_async(journal *jnl, transaction *tr) {
+    block_list_header *blhdr;
+    int                i;
+
+    lock_flush(jnl);
+
+    if (!jnl->commit_thread_running || jnl->commit_thread_exit || pthread_equal(jnl->commit_thread, pthread_self())) {
+        unlock_flush(jnl);
+        return FALSE;
+    }
+
+    if (jnl->commit_tr != NULL) {
+        panic("jnl: commit_async: commit thread already has tr %p, new tr %p\n", jnl->commit_tr, tr);
+    }
+
+    // The buffers stay owned (so nobody modifies them) but by the commit thread
+    for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
+        for (i = 1; i < blhdr->num_blocks; i++) {
+            if (blhdr->binfo[i].bnum != (off_t)-1) {
+                lf_hfs_generic_buf_transfer_ownership((GenericLFBuf*)blhdr->binfo[i].u.bp, jnl->commit_thread);
+            }
+        }
+    }
+
+    jnl->commit_tr = tr;
+    lf_cond_wakeup(&jnl->commit_cond);
+    unlock_flush(jnl);
+
+    return TRUE;
+}
+
+/*
+ * Commit the parked group if it has been waiting for longer than commit_interval_ms.
+ * Never blocks on the journal lock: if a transaction is in progress, its end will
+ * take care of the group, or we will try again on the next tick.
+ */
+static void journal_commit_expired(journal *jnl) {
+
+    if (lf_lck_mtx_try_lock(&jnl->jlock) != 0) {
+        return;
+    }
+    if (jnl->owner) {
+        panic("jnl: owner is %p, expected NULL\n", jnl->owner);
+    }
+    jnl->owner = pthread_self();
+
+    transaction *tr = jnl->cur_tr;
+    if ((jnl->flags & (JOURNAL_INVALID | JOURNAL_CLOSE_PENDING)) || jnl->active_tr != NULL || tr == NULL || tr->group_start_ms == 0
+        || journal_now_ms() - tr->group_start_ms < jnl->commit_interval_ms) {
+        journal_unlock(jnl);
+        return;
+    }
+    jnl->cur_tr = NULL;
+
+    // Same as journal_flush: committing changes the metadata content (endianity)
+    int lockflags = hfs_systemfile_lock(jnl->fsmount->psHfsmount, SFL_CATALOG | SFL_ATTRIBUTE | SFL_EXTENTS | SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+    end_transaction(tr, 1, NULL, NULL, TRUE);
+    hfs_systemfile_unlock(jnl->fsmount->psHfsmount, lockflags);
+}
+
+static void *journal_commit_thread(void *pvArg) {
+    journal *jnl = pvArg;
+
+    lock_flush(jnl);
+    while (!jnl->commit_thread_exit) {
+
+        transaction *tr = jnl->commit_tr;
+        if (tr != NULL) {
+            block_list_header *blhdr;
+            int                i;
+
+            jnl->commit_tr = NULL;
+            unlock_flush(jnl);
+
+            // finish_end_transaction expects the buffers locked by the committing thread
+            for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
+                for (i = 1; i < blhdr->num_blocks; i++) {
+                    if (blhdr->binfo[i].bnum != (off_t)-1) {
+                        lf_hfs_generic_buf_lock((GenericLFBuf*)blhdr->binfo[i].u.bp);
+                    }
+                }
+            }
+            (void) finish_end_transaction(tr, NULL, NULL);
+
+            lock_flush(jnl);
+            continue;
+        }
+
+        if (jnl->commit_interval_ms == 0) {
+            pthread_cond_wait(&jnl->commit_cond, &jnl->flock);
+            continue;
+        }
+
+        struct timespec sWaitTime = {
+            .tv_sec  = jnl->commit_interval_ms / 1000,
+            .tv_nsec = (jnl->commit_interval_ms % 1000) * 1000000,
+        };
+        if (lf_cond_wait_relative(&jnl->commit_cond, &jnl->flock, &sWaitTime) == ETIMEDOUT
+            && jnl->commit_tr == NULL && !jnl->commit_thread_exit) {
+            unlock_flush(jnl);
+            journal_commit_expired(jnl);
+            lock_flush(jnl);
+        }
+    }
+    unlock_flush(jnl);
+
+    return NULL;
+}
+
+static void journal_start_commit_thread(journal *jnl) {
+
+    lf_cond_init(&jnl->commit_cond);
+    jnl->commit_tr             = NULL;
+    jnl->commit_thread_exit    = FALSE;
+    jnl->commit_thread_running = FALSE;
+
+    int iErr = pthread_create(&jnl->commit_thread, NULL, journal_commit_thread, jnl);
+    if (iErr) {
+        // Not fatal, transactions are committed by the thread ending them
+        LFHFS_LOG(LEVEL_ERROR, "jnl: failed to create the commit thread [%d]\n", iErr);
+        return;
+    }
+    jnl->commit_thread_running = TRUE;
+}
+
+// Wait for an in-flight commit and stop the commit thread. Must not hold the 'flushing' condition.
+static void journal_stop_commit_thread(journal *jnl) {
+
+    if (!jnl->commit_thread_running) {
+        return;
+    }
+
+    wait_condition(jnl, &jnl->flushing, "journal_stop_commit_thread");
+
+    lock_flush(jnl);
+    jnl->commit_thread_exit = TRUE;
+    lf_cond_wakeup(&jnl->commit_cond);
+    unlock_flush(jnl);
+
+    pthread_join(jnl->commit_thread, NULL);
+
+    lock_flush(jnl);
+    jnl->commit_thread_running = FALSE;
+    unlock_flush(jnl);
+    lf_cond_destroy(&jnl->commit_cond);
+}
+
+/*
+ * Checkpointing: once a transaction's blocks reached their home location
+ * (buffer_written), its journal space can be reclaimed by moving the journal
+ * start past it. check_free_space does that when a commit runs out of space;
+ * the checkpoint thread does it ahead of time, as soon as the journal is more
+ * than JOURNAL_CHECKPOINT_LOW_WATER_PCT full, so commits rarely have to.
+ */
+
+// Called with old_start_lock held
+static boolean_t journal_checkpoint_needed(journal *jnl) {
+    size_t i;
+
+    if (jnl->flags & (JOURNAL_INVALID | JOURNAL_CLOSE_PENDING)) {
+        return FALSE;
+    }
+    if (journal_used_space(jnl) * 100 < (uint64_t)(jnl->jhdr->size - jnl->jhdr->jhdr_size) * JOURNAL_CHECKPOINT_LOW_WATER_PCT) {
+        return FALSE;
+    }
+
+    // the oldest transaction must be done for the start to move
+    for (i = 0; i < sizeof(jnl->old_start)/sizeof(jnl->old_start[0]); i++) {
+        if (jnl->old_start[i] != 0) {
+            return (jnl->old_start[i] & 0x8000000000000000LL) == 0;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Reclaim the space of completed transactions and write the journal header.
+ * Like journal_commit_expired, never blocks: the journal lock keeps out
+ * check_free_space, and the 'flushing' condition keeps out the commit
+ * thread, which also writes the journal header. Returns FALSE if either
+ * was busy.
+ */
+static boolean_t journal_checkpoint(journal *jnl) {
+    boolean_t moved = FALSE;
+    size_t    i;
+
+    if (lf_lck_mtx_try_lock(&jnl->jlock) != 0) {
+        return FALSE;
+    }
+    if (jnl->owner) {
+        panic("jnl: owner is %p, expected NULL\n", jnl->owner);
+    }
+    jnl->owner = pthread_self();
+
+    lock_flush(jnl);
+    if (jnl->flushing.uFlag || (jnl->flags & (JOURNAL_INVALID | JOURNAL_CLOSE_PENDING))) {
+        unlock_flush(jnl);
+        journal_unlock(jnl);
+        return FALSE;
+    }
+    jnl->flushing.uFlag = TRUE;
+    unlock_flush(jnl);
+
+    lock_oldstart(jnl);
+    for (i = 0; i < sizeof(jnl->old_start)/sizeof(jnl->old_start[0]); i++) {
+        if (jnl->old_start[i] == 0) {
+            continue;
+        }
+        if (jnl->old_start[i] & 0x8000000000000000LL) {
+            break;
+        }
+        jnl->jhdr->start  = jnl->old_start[i];
+        jnl->old_start[i] = 0;
+        moved = TRUE;
+    }
+    // nothing is in flight any more, so everything up to active_start is free
+    if (i == sizeof(jnl->old_start)/sizeof(jnl->old_start[0]) && jnl->jhdr->start != jnl->active_start) {
+        jnl->jhdr->start = jnl->active_start;
+        moved = TRUE;
+    }
+    if (moved) {
+        jnl->stats.jnl_checkpoints++;
+    }
+    unlock_oldstart(jnl);
+
+    if (moved) {
+        write_journal_header(jnl, 1, jnl->jhdr->sequence_num);
+    }
+
+    unlock_condition(jnl, &jnl->flushing);
+    journal_unlock(jnl);
+
+    return TRUE;
+}
+
+static void *journal_checkpoint_thread(void *pvArg) {
+    journal *jnl = pvArg;
+
+    lock_oldstart(jnl);
+    while (!jnl->checkpoint_thread_exit) {
+
+        if (!journal_checkpoint_needed(jnl)) {
+            pthread_cond_wait(&jnl->old_start_cond, &jnl->old_start_lock);
+            continue;
+        }
+
+        unlock_oldstart(jnl);
+        boolean_t done = journal_checkpoint(jnl);
+        lock_oldstart(jnl);
+
+        if (!done && !jnl->checkpoint_thread_exit) {
+            // whoever holds the journal will be done with it shortly
+            wait_old_start(jnl);
+        }
+    }
+    unlock_oldstart(jnl);
+
+    return NULL;
+}
+
+static void journal_start_checkpoint_thread(journal *jnl) {
+
+    jnl->checkpoint_thread_exit    = FALSE;
+    jnl->checkpoint_thread_running = FALSE;
+
+    int iErr = pthread_create(&jnl->checkpoint_thread, NULL, journal_checkpoint_thread, jnl);
+    if (iErr) {
+        // Not fatal, check_free_space reclaims space when a commit needs it
+        LFHFS_LOG(LEVEL_ERROR, "jnl: failed to create the checkpoint thread [%d]\n", iErr);
+        return;
+    }
+    jnl->checkpoint_thread_running = TRUE;
+}
+
+static void journal_stop_checkpoint_thread(journal *jnl) {
+
+    if (!jnl->checkpoint_thread_running) {
+        return;
+    }
+
+    lock_oldstart(jnl);
+    jnl->checkpoint_thread_exit = TRUE;
+    pthread_cond_broadcast(&jnl->old_start_cond);
+    unlock_oldstart(jnl);
+
+    pthread_join(jnl->checkpoint_thread, NULL);
+    jnl->checkpoint_thread_running = FALSE;
+}
+
 /*
  * End a transaction:
  * 1) Determine if it is time to commit the transaction or not:
@@ -2888,8 +3469,13 @@ static int end_transaction(transaction *tr, int force_it, errno_t (*callback)(vo
         && (jnl->flags & JOURNAL_NO_GROUP_COMMIT) == 0
         && tr->num_blhdrs < 3
         && (tr->total_bytes <= ((tr->tbuffer_size*tr->num_blhdrs) - tr->tbuffer_size/8))
+        && (jnl->commit_max_bytes == 0 || tr->total_bytes < (int)jnl->commit_max_bytes)
         && (!(jnl->flags & JOURNAL_USE_UNMAP) || (tr->trim.extent_count < jnl_trim_flush_limit))) {
 
+        // remember when this group started so the commit thread can bound its latency
+        if (tr->group_start_ms == 0) {
+            tr->group_start_ms = journal_now_ms();
+        }
         jnl->cur_tr = tr;
         goto done;
     }
@@ -2964,6 +3550,11 @@ static int end_transaction(transaction *tr, int force_it, errno_t (*callback)(vo
     memmove(__CAST_AWAY_QUALIFIER(&jnl->old_start[0], volatile, void *), __CAST_AWAY_QUALIFIER(&jnl->old_start[1], volatile, void *), sizeof(jnl->old_start)-sizeof(jnl->old_start[0]));
     jnl->old_start[sizeof(jnl->old_start)/sizeof(jnl->old_start[0]) - 1] = tr->journal_start | 0x8000000000000000LL;
     
+    uint64_t used = journal_used_space(jnl) + tr->total_bytes;
+    if (used > jnl->stats.jnl_used_max) {
+        jnl->stats.jnl_used_max = used;
+    }
+    
     unlock_oldstart(jnl);
     
     // go over the blocks in the transaction.
@@ -3032,7 +3623,14 @@ static int end_transaction(transaction *tr, int force_it, errno_t (*callback)(vo
         CRASH_ABORT(CRASH_ABORT_JOURNAL_BEFORE_FINISH, jnl->fsmount->psHfsmount, NULL);
     #endif
 
-    ret_val = finish_end_transaction(tr, callback, callback_arg);
+    /*
+     * Unless the caller needs the transaction on disk before returning, let the
+     * commit thread write it out. We drop the journal lock right away, so the next
+     * transactions can accumulate in a new group while this one is being written.
+     */
+    if (force_it || callback != NULL || !journal_commit_async(jnl, tr)) {
+        ret_val = finish_end_transaction(tr, callback, callback_arg);
+    }
 
 done:
     if (drop_lock == TRUE) {
@@ -3110,15 +3708,8 @@ static void swap_journal_header(journal *jnl) {
 // we use it to checksum the journal header and the block list
 // headers that are at the start of each transaction.
 static unsigned int calc_checksum(const char *ptr, int len) {
-    int i;
-    unsigned int cksum=0;
-
-    // this is a lame checksum but for now it'll do
-    for(i = 0; i < len; i++, ptr++) {
-        cksum = (cksum << 8) ^ (cksum + *(unsigned char *)ptr);
-    }
-
-    return (~cksum);
+    // shared with fsck_hfs, see journal_verify.c
+    return jnl_checksum(ptr, len);
 }
 
 static size_t do_journal_io(journal *jnl, off_t *offset, void *data, size_t len, int direction) {
@@ -3509,6 +4100,38 @@ cleanup_jdev_name:
     return ret;
 }
 
+void journal_set_commit_params(journal *jnl, uint32_t commit_interval_ms, uint32_t commit_max_bytes) {
+    CHECK_JOURNAL(jnl);
+
+    lock_flush(jnl);
+    jnl->commit_interval_ms = commit_interval_ms;
+    jnl->commit_max_bytes   = commit_max_bytes;
+    // Let the commit thread pick up the new interval
+    if (jnl->commit_thread_running) {
+        lf_cond_wakeup(&jnl->commit_cond);
+    }
+    unlock_flush(jnl);
+}
+
+void journal_get_commit_params(journal *jnl, uint32_t *commit_interval_ms, uint32_t *commit_max_bytes) {
+    CHECK_JOURNAL(jnl);
+
+    lock_flush(jnl);
+    *commit_interval_ms = jnl->commit_interval_ms;
+    *commit_max_bytes   = jnl->commit_max_bytes;
+    unlock_flush(jnl);
+}
+
+void journal_get_stats(journal *jnl, JournalStats_S *psStats) {
+    CHECK_JOURNAL(jnl);
+
+    lock_oldstart(jnl);
+    *psStats          = jnl->stats;
+    psStats->jnl_size = jnl->jhdr->size - jnl->jhdr->jhdr_size;
+    psStats->jnl_used = journal_used_space(jnl);
+    unlock_oldstart(jnl);
+}
+
 uint32_t journal_current_txn(journal *jnl) {
     return jnl->sequence_num + (jnl->active_tr || jnl->cur_tr ? 0 : 1);
 }
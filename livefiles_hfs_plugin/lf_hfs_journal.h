@@ -68,6 +68,7 @@ typedef struct transaction {
     struct jnl_trim_list trim;
     boolean_t            delayed_header_write;
     boolean_t            flush_on_completion; //flush transaction immediately upon txn end.
+    uint64_t             group_start_ms; // when the first modified block was parked for group commit (0: none yet)
 } transaction;
 
 
@@ -105,6 +106,24 @@ typedef struct {
     uint32_t       uFlag;
 } ConditionalFlag_S;
 
+/*
+ * Journal space statistics, see LFHFS_FSATTR_JNL_STATS.
+ */
+typedef struct JournalStats {
+    uint64_t jnl_size;                  // Bytes of the journal available to transactions
+    uint64_t jnl_used;                  // Bytes held by transactions that were not checkpointed yet
+    uint64_t jnl_used_max;              // High-water mark of jnl_used
+    uint64_t jnl_checkpoints;           // Journal start updates done by the checkpoint thread
+    uint64_t jnl_stalls;                // Commits that had to wait for journal space
+    uint64_t jnl_stall_usec;            // Total time commits spent waiting for journal space
+} JournalStats_S;
+
+/*
+ * The checkpoint thread reclaims the space of transactions that reached their
+ * home location once the journal is this full (percent of jnl_size).
+ */
+#define JOURNAL_CHECKPOINT_LOW_WATER_PCT    25
+
 /*
  * In memory structure about the journal.
  */
@@ -157,9 +176,25 @@ typedef struct journal {
     volatile off_t      active_start;      // the active start that we only keep in memory
     pthread_mutex_t     old_start_lock;    // protects the old_start
     volatile off_t      old_start[16];     // this is how we do lazy start update
+    pthread_cond_t      old_start_cond;    // broadcast when a transaction has been written to its home location
     
     int                 last_flush_err;    // last error from flushing the cache
     uint32_t            flush_counter;     // a monotonically increasing value assigned on track cache flush
+
+    // group commit thread, the fields below are protected by flock
+    pthread_t           commit_thread;
+    boolean_t           commit_thread_running;
+    boolean_t           commit_thread_exit;
+    pthread_cond_t      commit_cond;       // signalled when commit_tr is queued or the thread should exit
+    transaction        *commit_tr;         // transaction handed over to the commit thread
+    uint32_t            commit_interval_ms;// commit a parked group after this long (0: only when full or flushed)
+    uint32_t            commit_max_bytes;  // commit a group once it holds this many bytes (0: tbuffer based only)
+
+    // checkpoint thread, the fields below are protected by old_start_lock
+    pthread_t           checkpoint_thread;
+    boolean_t           checkpoint_thread_running;
+    boolean_t           checkpoint_thread_exit;
+    JournalStats_S      stats;
 } journal;
 
 /* internal-only journal flags (top 16 bits) */
@@ -283,6 +318,16 @@ int journal_is_clean(struct vnode *jvp,
  */
 void journal_release(journal *jnl);
 
+/*
+ * Group commit tuning. Transactions are accumulated until the group holds
+ * commit_max_bytes (or the transaction buffers fill up), or until it has been
+ * waiting for commit_interval_ms. Zero disables the corresponding trigger.
+ */
+void journal_set_commit_params(journal *jnl, uint32_t commit_interval_ms, uint32_t commit_max_bytes);
+void journal_get_commit_params(journal *jnl, uint32_t *commit_interval_ms, uint32_t *commit_max_bytes);
+
+void journal_get_stats(journal *jnl, JournalStats_S *psStats);
+
 /*
  * Call journal_close() just before your file system is unmounted.
  * It flushes any outstanding transactions and makes sure the
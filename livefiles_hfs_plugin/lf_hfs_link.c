@@ -17,6 +17,7 @@
 #include "lf_hfs_endian.h"
 #include "lf_hfs_format.h"
 #include "lf_hfs_defs.h"
+#include "lf_hfs_namecache.h"
 
 /*
  * Private directories where hardlink inodes reside.
@@ -275,6 +276,7 @@ hfs_unlink(struct hfsmount *hfsmp, struct vnode *dvp, struct vnode *vp, struct c
     }
     dcp->c_dirchangecnt++;
     hfs_incr_gencount(dcp);
+    hfs_namecache_purge(dcp);
 
     struct timeval tv;
     microtime(&tv);
@@ -418,9 +420,7 @@ out:
         hfs_end_transaction(hfsmp);
     }
 
-    dcp->c_flag &= ~C_DIR_MODIFICATION;
-    //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-    //wakeup((caddr_t)&dcp->c_flag);
+    hfs_dir_modification_end(hfsmp, dcp);
 
     return (error);
 }
@@ -573,6 +573,7 @@ hfs_privatedir_init(struct hfsmount * hfsmp, enum privdirtype type)
         INC_FOLDERCOUNT(hfsmp, dcp->c_attr);
         dcp->c_dirchangecnt++;
         hfs_incr_gencount(dcp);
+        hfs_namecache_purge(dcp);
         microtime(&tv);
         dcp->c_ctime = tv.tv_sec;
         dcp->c_mtime = tv.tv_sec;
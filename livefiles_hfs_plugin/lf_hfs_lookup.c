@@ -10,6 +10,66 @@
 #include "lf_hfs_cnode.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_link.h"
+#include "lf_hfs_chash.h"
+#include "lf_hfs_namecache.h"
+
+/*
+ * Try to resolve the component from the name cache without locking the parent.
+ * Returns EAGAIN if the catalog has to be consulted.
+ */
+static int
+hfs_lookup_cached(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int *cnode_locked)
+{
+    struct hfsmount *hfsmp = VTOHFS(dvp);
+    struct cnode *dcp = VTOC(dvp);
+    struct vnode *tvp;
+    struct cnode *cp;
+    cnid_t cnid = 0;
+    int flags = cnp->cn_flags;
+    int nameiop = cnp->cn_nameiop;
+
+    /* Let the slow path wait for the modification to finish */
+    if (dcp->c_flag & C_DIR_MODIFICATION) {
+        return EAGAIN;
+    }
+
+    switch (hfs_namecache_lookup(hfsmp, dcp, cnp->cn_nameptr, cnp->cn_namelen, &cnid)) {
+        case NAMECACHE_NEGATIVE:
+            if (ISSET(dcp->c_flag, C_DELETED | C_NOEXISTS)) {
+                return EAGAIN;
+            }
+            if ((nameiop == CREATE || nameiop == RENAME) && (flags & ISLASTCN)) {
+                return EJUSTRETURN;
+            }
+            return ENOENT;
+
+        case NAMECACHE_HIT:
+            break;
+
+        default:
+            return EAGAIN;
+    }
+
+    /* Only names whose cnode is in core are served from the cache. */
+    tvp = hfs_chash_getvnode(hfsmp, cnid, 0, 0, 0);
+    if (tvp == NULL) {
+        return EAGAIN;
+    }
+    cp = VTOC(tvp);
+
+    /* Hardlinks need hfs_getnewvnode to pick up the descriptor of this link. */
+    int type = (cp->c_mode & S_IFMT);
+    if (ISSET(cp->c_flag, C_HARDLINK) || cp->c_parentcnid != dcp->c_fileid ||
+        (!(flags & ISLASTCN) && (type != S_IFDIR) && (type != S_IFLNK))) {
+        hfs_unlock(cp);
+        hfs_chash_lower_OpenLookupCounter(cp);
+        return EAGAIN;
+    }
+
+    *cnode_locked = 1;
+    *vpp = tvp;
+    return 0;
+}
 
 static int
 hfs_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int *cnode_locked)
@@ -26,7 +86,20 @@ hfs_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int
     struct cat_fork fork;
     int lockflags;
     int newvnode_flags = 0;
-    
+    uint32_t nc_gen = 0;
+
+    /*
+     * namei would set MAKEENTRY for every component; the UVFS entry points don't.
+     * The cases below that must not be cached clear it again.
+     */
+    cnp->cn_flags |= MAKEENTRY;
+
+    retval = hfs_lookup_cached(dvp, vpp, cnp, cnode_locked);
+    if (retval != EAGAIN) {
+        return (retval);
+    }
+    retval = 0;
+
 retry:
     newvnode_flags = 0;
     dcp = NULL;
@@ -38,18 +111,23 @@ retry:
     flags = cnp->cn_flags;
     bzero(&desc, sizeof(desc));
 
-    if (hfs_lock(VTOC(dvp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT) != 0) {
+    /*
+     * Shared is enough: everything that changes the directory's entries holds
+     * it exclusive, and the child hint below is only a hint.
+     */
+    if (hfs_lock(VTOC(dvp), HFS_SHARED_LOCK, HFS_LOCK_DEFAULT) != 0) {
         retval = ENOENT;  /* The parent no longer exists ? */
         goto exit;
     }
     dcp = VTOC(dvp);
 
     /*
-     * Need to understand if we need this check.. as we took exclusive lock..
+     * A create/remove/rename in this directory drops the lock midway; wait for it
+     * to finish rather than look at a half-updated directory.
      */
     if (dcp->c_flag & C_DIR_MODIFICATION){
         hfs_unlock(dcp);
-        usleep( 1000 );
+        hfs_dir_modification_wait(hfsmp, dcp);
         goto retry;
     }
 
@@ -68,9 +146,16 @@ retry:
     cndesc.cd_parentcnid = dcp->c_fileid;
     cndesc.cd_hint = dcp->c_childhint;
 
-    lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
-    retval = cat_lookup(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
-    hfs_systemfile_unlock(hfsmp, lockflags);
+    /* Taken before the catalog lookup, so a change to the directory after it voids the entry */
+    nc_gen = hfs_namecache_dir_gen(hfsmp, dcp);
+
+    /* Don't queue behind catalog writers unless one actually got in our way */
+    retval = cat_lookup_optimistic(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
+    if (retval == EAGAIN) {
+        lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+        retval = cat_lookup(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
+        hfs_systemfile_unlock(hfsmp, lockflags);
+    }
 
     if (retval == 0) {
         dcp->c_childhint = desc.cd_hint;
@@ -112,6 +197,10 @@ retry:
     }
     if (retval != ENOENT)
         goto exit;
+
+    if (cnp->cn_flags & MAKEENTRY)
+        hfs_namecache_enter(hfsmp, dcp->c_fileid, nc_gen, cnp->cn_nameptr, cnp->cn_namelen, 0);
+
     /*
      * This is a non-existing entry
      *
@@ -225,6 +314,8 @@ found:
      */
     if (ISSET(VTOC(tvp)->c_flag, C_HARDLINK))
         hfs_savelinkorigin(VTOC(tvp), VTOC(dvp)->c_fileid);
+    else if ((cnp->cn_flags & MAKEENTRY) && bcmp(cnp->cn_nameptr, desc.cd_nameptr, desc.cd_namelen) == 0)
+        hfs_namecache_enter(hfsmp, VTOC(dvp)->c_fileid, nc_gen, cnp->cn_nameptr, cnp->cn_namelen, VTOC(tvp)->c_fileid);
 
     *cnode_locked = 1;
     *vpp = tvp;
@@ -0,0 +1,188 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_namecache.c
+ *  livefiles_hfs
+ *
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include "lf_hfs_namecache.h"
+#include "lf_hfs_vfsutils.h"
+#include "lf_hfs_logger.h"
+
+/*
+ * Per mount (parent cnid, name) -> cnid cache for hfs_lookup, with negative entries.
+ *
+ * The cache is a direct mapped table of seqlocked slots, so lookups never take a lock:
+ * a reader that finds a slot changing underneath it doesn't retry, it treats the slot
+ * as a miss and goes to the catalog.  A writer that finds the slot busy drops its entry.
+ *
+ * Invalidation is per directory.  Every entry carries the generation its parent
+ * directory had when the catalog was looked up, and is only valid while the parent's
+ * c_nc_gen still has that value.  Any insert/delete/rename in a directory resets its
+ * c_nc_gen to 0 (hfs_namecache_purge), and the next lookup assigns it a new generation
+ * from the mount wide counter, which also covers a directory cnode that was recycled.
+ */
+typedef struct NameCacheSlot
+{
+    _Atomic uint32_t    uSeq;           // Odd while a writer is updating the slot
+    cnid_t              uParentCnid;
+    cnid_t              uCnid;          // 0 for a negative entry
+    uint32_t            uGen;
+    uint8_t             uNameLen;
+    char                pcName[NAMECACHE_NAME_MAX];
+} NameCacheSlot_S;
+
+typedef struct NameCache
+{
+    _Atomic uint32_t    uGen;           // Last generation handed out to a directory
+    NameCacheSlot_S     psSlots[NAMECACHE_SLOTS];
+} NameCache_S;
+
+static inline NameCacheSlot_S *
+hfs_namecache_slot(NameCache_S *psNC, cnid_t parentcnid, const char *name, size_t namelen)
+{
+    // FNV-1a over the parent and the name bytes
+    uint32_t uHash = 2166136261u ^ parentcnid;
+    uHash *= 16777619u;
+    for (size_t u = 0; u < namelen; u++) {
+        uHash ^= (uint8_t)name[u];
+        uHash *= 16777619u;
+    }
+
+    return &psNC->psSlots[uHash & (NAMECACHE_SLOTS - 1)];
+}
+
+int
+hfs_namecache_init(struct hfsmount *hfsmp)
+{
+    NameCache_S *psNC = hfs_mallocz(sizeof(NameCache_S));
+    if (psNC == NULL) {
+        // Lookups simply always miss
+        LFHFS_LOG(LEVEL_ERROR, "hfs_namecache_init: failed to allocate the name cache\n");
+        return ENOMEM;
+    }
+
+    hfsmp->hfs_namecache = psNC;
+    return 0;
+}
+
+void
+hfs_namecache_destroy(struct hfsmount *hfsmp)
+{
+    hfs_free(hfsmp->hfs_namecache);
+    hfsmp->hfs_namecache = NULL;
+}
+
+/*
+ * Look up name in the directory dcp.  The caller holds an iocount on the directory,
+ * but does not need its cnode lock.
+ */
+NameCacheResult_e
+hfs_namecache_lookup(struct hfsmount *hfsmp, struct cnode *dcp, const char *name, size_t namelen, cnid_t *pcnid)
+{
+    NameCache_S *psNC = hfsmp->hfs_namecache;
+
+    if (psNC == NULL || namelen == 0 || namelen > NAMECACHE_NAME_MAX) {
+        return NAMECACHE_MISS;
+    }
+
+    uint32_t uGen = atomic_load_explicit(&dcp->c_nc_gen, memory_order_acquire);
+    if (uGen == 0) {
+        return NAMECACHE_MISS;
+    }
+
+    cnid_t parentcnid = dcp->c_fileid;
+    NameCacheSlot_S *psSlot = hfs_namecache_slot(psNC, parentcnid, name, namelen);
+
+    uint32_t uSeq = atomic_load_explicit(&psSlot->uSeq, memory_order_acquire);
+    if (uSeq & 1) {
+        return NAMECACHE_MISS;
+    }
+
+    bool bMatch = (psSlot->uGen == uGen && psSlot->uParentCnid == parentcnid &&
+                   psSlot->uNameLen == namelen && memcmp(psSlot->pcName, name, namelen) == 0);
+    cnid_t cnid = psSlot->uCnid;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (!bMatch || atomic_load_explicit(&psSlot->uSeq, memory_order_relaxed) != uSeq) {
+        return NAMECACHE_MISS;
+    }
+
+    if (cnid == 0) {
+        return NAMECACHE_NEGATIVE;
+    }
+
+    *pcnid = cnid;
+    return NAMECACHE_HIT;
+}
+
+/*
+ * Return the generation to enter names of dcp with, assigning a new one if the
+ * directory has none.  Must be called with the cnode lock held (shared is enough,
+ * concurrent callers end up with the same generation), before the catalog is
+ * consulted, so that a concurrent change to the directory invalidates the entry.
+ */
+uint32_t
+hfs_namecache_dir_gen(struct hfsmount *hfsmp, struct cnode *dcp)
+{
+    NameCache_S *psNC = hfsmp->hfs_namecache;
+    uint32_t uGen = atomic_load_explicit(&dcp->c_nc_gen, memory_order_acquire);
+
+    if (uGen != 0 || psNC == NULL) {
+        return uGen;
+    }
+
+    uint32_t uNewGen;
+    do {
+        uNewGen = atomic_fetch_add_explicit(&psNC->uGen, 1, memory_order_relaxed) + 1;
+    } while (uNewGen == 0);
+
+    // Another lookup may have beaten us to it; either generation is fine
+    if (atomic_compare_exchange_strong(&dcp->c_nc_gen, &uGen, uNewGen)) {
+        uGen = uNewGen;
+    }
+
+    return uGen;
+}
+
+/*
+ * Remember that name in parentcnid refers to cnid, or does not exist if cnid is 0.
+ */
+void
+hfs_namecache_enter(struct hfsmount *hfsmp, cnid_t parentcnid, uint32_t gen, const char *name, size_t namelen, cnid_t cnid)
+{
+    NameCache_S *psNC = hfsmp->hfs_namecache;
+
+    if (psNC == NULL || gen == 0 || namelen == 0 || namelen > NAMECACHE_NAME_MAX) {
+        return;
+    }
+
+    NameCacheSlot_S *psSlot = hfs_namecache_slot(psNC, parentcnid, name, namelen);
+
+    uint32_t uSeq = atomic_load_explicit(&psSlot->uSeq, memory_order_relaxed);
+    if ((uSeq & 1) || !atomic_compare_exchange_strong(&psSlot->uSeq, &uSeq, uSeq + 1)) {
+        // Somebody else is filling this slot
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    psSlot->uParentCnid = parentcnid;
+    psSlot->uCnid       = cnid;
+    psSlot->uGen        = gen;
+    psSlot->uNameLen    = (uint8_t)namelen;
+    memcpy(psSlot->pcName, name, namelen);
+
+    atomic_store_explicit(&psSlot->uSeq, uSeq + 2, memory_order_release);
+}
+
+/*
+ * Forget every name in the directory.  Called with the directory's cnode lock held
+ * exclusive, after its catalog entries changed.
+ */
+void
+hfs_namecache_purge(struct cnode *dcp)
+{
+    atomic_store_explicit(&dcp->c_nc_gen, 0, memory_order_release);
+}
@@ -0,0 +1,31 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_namecache.h
+ *  livefiles_hfs
+ *
+ */
+
+#ifndef lf_hfs_namecache_h
+#define lf_hfs_namecache_h
+
+#include "lf_hfs.h"
+#include "lf_hfs_cnode.h"
+
+#define NAMECACHE_SLOTS     (4096)      // Per mount, must be a power of two
+#define NAMECACHE_NAME_MAX  (47)        // Longer names are never cached
+
+typedef enum {
+    NAMECACHE_MISS,
+    NAMECACHE_HIT,                      // *pcnid holds the cnid of the name
+    NAMECACHE_NEGATIVE,                 // The name is known not to exist
+} NameCacheResult_e;
+
+int                 hfs_namecache_init(struct hfsmount *hfsmp);
+void                hfs_namecache_destroy(struct hfsmount *hfsmp);
+
+NameCacheResult_e   hfs_namecache_lookup(struct hfsmount *hfsmp, struct cnode *dcp, const char *name, size_t namelen, cnid_t *pcnid);
+uint32_t            hfs_namecache_dir_gen(struct hfsmount *hfsmp, struct cnode *dcp);
+void                hfs_namecache_enter(struct hfsmount *hfsmp, cnid_t parentcnid, uint32_t gen, const char *name, size_t namelen, cnid_t cnid);
+void                hfs_namecache_purge(struct cnode *dcp);
+
+#endif /* lf_hfs_namecache_h */
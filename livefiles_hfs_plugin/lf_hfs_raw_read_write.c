@@ -13,6 +13,9 @@
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_vfsutils.h"
 #include <UserFS/UserVFS.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/queue.h>
 
 #define MAX_READ_WRITE_LENGTH (0x7ffff000)
 
@@ -20,6 +23,115 @@
 
 static void* gpvZeroBuf = NULL;
 
+/*
+ * Per-thread bounce buffer used for the unaligned head/tail sectors of a request.
+ * It is allocated on first use, grown on demand and released when the thread exits.
+ */
+typedef struct
+{
+    uint64_t uSize;
+    uint8_t  puData[];
+} RawIOBounce_S;
+
+static pthread_key_t  gsBounceKey;
+static pthread_once_t gsBounceKeyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Layout of a single contiguous device transfer:
+ * [ head sector (bounce) ][ sector aligned body (in place) ][ tail sector (bounce) ]
+ */
+typedef struct
+{
+    uint64_t uDevOffset;    // Sector aligned device offset of the transfer
+    uint64_t uDevLength;    // Total bytes transferred on the device
+    uint64_t uLength;       // User bytes covered by the transfer
+    uint64_t uHeadSkip;     // Offset of the user data inside the head sector
+    uint64_t uHeadBytes;    // User bytes in the head sector, 0 if the request starts aligned
+    uint64_t uBodyBytes;    // Sector aligned user bytes transferred directly to/from the user buffer
+    uint64_t uTailBytes;    // User bytes in the tail sector, 0 if the request ends aligned
+} RawIOPlan_S;
+
+static void
+raw_readwrite_bounce_free( void* pvBounce )
+{
+    hfs_free( pvBounce );
+}
+
+static void
+raw_readwrite_bounce_key_init( void )
+{
+    pthread_key_create( &gsBounceKey, raw_readwrite_bounce_free );
+}
+
+static uint8_t*
+raw_readwrite_get_bounce( uint64_t uSize )
+{
+    pthread_once( &gsBounceKeyOnce, raw_readwrite_bounce_key_init );
+
+    RawIOBounce_S* psBounce = pthread_getspecific( gsBounceKey );
+    if ( psBounce && psBounce->uSize >= uSize )
+    {
+        return psBounce->puData;
+    }
+
+    if ( psBounce )
+    {
+        hfs_free( psBounce );
+        pthread_setspecific( gsBounceKey, NULL );
+    }
+
+    psBounce = hfs_malloc( sizeof(RawIOBounce_S) + uSize );
+    if ( psBounce == NULL )
+    {
+        return NULL;
+    }
+    psBounce->uSize = uSize;
+    pthread_setspecific( gsBounceKey, psBounce );
+
+    return psBounce->puData;
+}
+
+static void
+raw_readwrite_plan( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
+                    uint64_t uOffset, uint64_t uBytes, RawIOPlan_S* psPlan )
+{
+    struct hfsmount *hfsmp  = VTOHFS(psVnode);
+    uint64_t uClusterSize   = hfsmp->blockSize;
+    uint64_t uSectorSize    = hfsmp->hfs_logical_block_size;
+
+    // Leave room for the rounding of the head and tail sectors
+    uint64_t uLength = MIN( uBytes, uContigousClustersInBytes );
+    uLength = MIN( uLength, MAX_READ_WRITE_LENGTH - 2 * uSectorSize );
+
+    memset( psPlan, 0, sizeof(*psPlan) );
+    psPlan->uLength    = uLength;
+    psPlan->uHeadSkip  = uOffset % uSectorSize;
+    // Calculate offset - offset by sector and need to add the offset by sector
+    psPlan->uDevOffset = FSOPS_GetOffsetFromClusterNum( psVnode, uCluster ) + ( ROUND_DOWN(uOffset, uSectorSize) % uClusterSize );
+
+    if ( (psPlan->uHeadSkip != 0) || (uLength < uSectorSize) )
+    {
+        psPlan->uHeadBytes = MIN( uLength, uSectorSize - psPlan->uHeadSkip );
+        psPlan->uDevLength = uSectorSize;
+    }
+
+    uint64_t uRemaining = uLength - psPlan->uHeadBytes;
+    psPlan->uBodyBytes  = ROUND_DOWN( uRemaining, uSectorSize );
+    psPlan->uTailBytes  = uRemaining - psPlan->uBodyBytes;
+    psPlan->uDevLength += psPlan->uBodyBytes + (psPlan->uTailBytes ? uSectorSize : 0);
+}
+
+static errno_t
+raw_readwrite_pread_sectors( int iFD, void* pvBuf, uint64_t uLength, uint64_t uDevOffset )
+{
+    ssize_t iReadBytes = pread( iFD, pvBuf, uLength, uDevOffset );
+    if ( iReadBytes != (ssize_t)uLength )
+    {
+        return ((iReadBytes < 0) ? errno : EIO);
+    }
+    return 0;
+}
+
 
 int
 raw_readwrite_get_cluster_from_offset( vnode_t psVnode, uint64_t uWantedOffset, uint64_t* puStartCluster, uint64_t* puInClusterOffset, uint64_t* puContigousClustersInBytes )
@@ -98,322 +210,567 @@ errno_t raw_readwrite_write_mount( vnode_t psMountVnode, uint64_t uBlockN, uint6
 }
 
 errno_t
-raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster )
+raw_readwrite_read_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
+                            uint64_t uOffset, uint64_t uBytesToRead, void* pvBuf, uint64_t *piActuallyRead )
 {
     errno_t iErr                    = 0;
-    uint64_t uClusterSize           = psVnode->sFSParams.vnfs_mp->psHfsmount->blockSize;
-    uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
-    uint64_t uActuallyRead          = 0;
-    bool bFirstLoop                 = true;
+    int iFD                         = VNODE_TO_IFD(psVnode);
+    uint64_t uSectorSize            = VTOHFS(psVnode)->hfs_logical_block_size;
+    RawIOPlan_S sPlan;
+    struct iovec psIov[3];
+    int iIovCnt                     = 0;
+    uint8_t* puBounce               = NULL;
 
     *piActuallyRead = 0;
-    while ( *piActuallyRead < uLength )
-    {
-        uint64_t uCurrentCluster            = 0;
-        uint64_t uInClusterOffset           = 0;
-        uint64_t uContigousClustersInBytes  = 0;
 
-        // Look for the location to read
-        iErr = raw_readwrite_get_cluster_from_offset( psVnode, uOffset, &uCurrentCluster, &uInClusterOffset, &uContigousClustersInBytes );
-        if ( iErr != 0 )
-        {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
-            return iErr;
-        }
+    raw_readwrite_plan( psVnode, uCluster, uContigousClustersInBytes, uOffset, uBytesToRead, &sPlan );
+    if ( sPlan.uLength == 0 )
+    {
+        return 0;
+    }
 
-        if ( bFirstLoop )
+    // Head and tail sectors land in the bounce buffer, the body is read in place
+    if ( sPlan.uHeadBytes || sPlan.uTailBytes )
+    {
+        puBounce = raw_readwrite_get_bounce( 2 * uSectorSize );
+        if ( puBounce == NULL )
         {
-            bFirstLoop = false;
-            if (puReadStartCluster)
-                *puReadStartCluster = uCurrentCluster;
+            return ENOMEM;
         }
+    }
 
-        // Stop reading if we've reached the end of the file
-        if ( (uContigousClustersInBytes == 0) || (uOffset >= uFileSize) )
-        {
-            break;
-        }
+    if ( sPlan.uHeadBytes )
+    {
+        psIov[iIovCnt].iov_base = puBounce;
+        psIov[iIovCnt].iov_len  = uSectorSize;
+        iIovCnt++;
+    }
+    if ( sPlan.uBodyBytes )
+    {
+        psIov[iIovCnt].iov_base = (uint8_t*)pvBuf + sPlan.uHeadBytes;
+        psIov[iIovCnt].iov_len  = sPlan.uBodyBytes;
+        iIovCnt++;
+    }
+    if ( sPlan.uTailBytes )
+    {
+        psIov[iIovCnt].iov_base = puBounce + uSectorSize;
+        psIov[iIovCnt].iov_len  = uSectorSize;
+        iIovCnt++;
+    }
 
-        uint64_t uBytesToRead = MIN(uFileSize - uOffset, uLength - *piActuallyRead);
+    assert( (sPlan.uDevOffset % uSectorSize) == 0 );
 
-        // Read data
-        iErr = raw_readwrite_read_internal( psVnode, uCurrentCluster, uContigousClustersInBytes, uOffset, uBytesToRead, pvBuf, &uActuallyRead );
-        if ( iErr != 0 )
-        {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_internal: raw_readwrite_read_internal failed [%d]\n", iErr );
-            return iErr;
-        }
+    ssize_t iReadBytes = preadv( iFD, psIov, iIovCnt, sPlan.uDevOffset );
+    if ( iReadBytes != (ssize_t)sPlan.uDevLength )
+    {
+        iErr = ((iReadBytes < 0) ? errno : EIO);
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: preadv failed to read wanted length\n" );
+        return iErr;
+    }
 
-        // Update the amount of bytes alreay read
-        *piActuallyRead += uActuallyRead;
-        // Update file offset
-        uOffset += uActuallyRead;
-        // Update buffer offset
-        pvBuf = (uint8_t*)pvBuf + uActuallyRead;
+    if ( sPlan.uHeadBytes )
+    {
+        memcpy( (uint8_t *)pvBuf, puBounce + sPlan.uHeadSkip, sPlan.uHeadBytes );
+    }
+    if ( sPlan.uTailBytes )
+    {
+        memcpy( (uint8_t *)pvBuf + sPlan.uHeadBytes + sPlan.uBodyBytes, puBounce + uSectorSize, sPlan.uTailBytes );
     }
 
+    // Update the amount of bytes alreay read
+    *piActuallyRead = sPlan.uLength;
+
     return iErr;
 }
 
-errno_t
-raw_readwrite_read_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
-                            uint64_t uOffset, uint64_t uBytesToRead, void* pvBuf, uint64_t *piActuallyRead )
+/*
+ * Write one contiguous run of the file.
+ * Partially covered head/tail sectors are read-modify-written through the bounce buffer,
+ * unless the sector starts at or beyond uValidEnd, in which case its old content is
+ * meaningless and it is zero filled instead of read.
+ */
+static errno_t
+raw_readwrite_write_run( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
+                         uint64_t uOffset, uint64_t uBytesToWrite, void* pvBuf, uint64_t uValidEnd, uint64_t *piActuallyWritten )
 {
     errno_t iErr                    = 0;
     int iFD                         = VNODE_TO_IFD(psVnode);
-    struct hfsmount *hfsmp          = VTOHFS(psVnode);
-    uint64_t uClusterSize           = hfsmp->blockSize;
-    uint64_t uSectorSize            = hfsmp->hfs_logical_block_size;
-    uint64_t uBytesToCopy           = 0;
+    uint64_t uSectorSize            = VTOHFS(psVnode)->hfs_logical_block_size;
+    RawIOPlan_S sPlan;
+    struct iovec psIov[3];
+    int iIovCnt                     = 0;
+    uint8_t* puBounce               = NULL;
 
-    // Calculate offset - offset by sector and need to add the offset by sector
-    uint64_t uReadOffset = FSOPS_GetOffsetFromClusterNum( psVnode, uCluster ) + ( ROUND_DOWN(uOffset, uSectorSize)  % uClusterSize );
+    *piActuallyWritten = 0;
+
+    raw_readwrite_plan( psVnode, uCluster, uContigousClustersInBytes, uOffset, uBytesToWrite, &sPlan );
+    if ( sPlan.uLength == 0 )
+    {
+        return 0;
+    }
 
-    // If offset not align to sector size, need to read only 1 sector and memcpy its end
-    if ( (uOffset % uSectorSize) != 0 )
+    assert( (sPlan.uDevOffset % uSectorSize) == 0 );
+
+    if ( sPlan.uHeadBytes || sPlan.uTailBytes )
     {
-        void* pvBuffer = hfs_malloc(uSectorSize);
-        if (pvBuffer == NULL)
+        puBounce = raw_readwrite_get_bounce( 2 * uSectorSize );
+        if ( puBounce == NULL )
         {
             return ENOMEM;
         }
 
-        uint64_t uInSectorOffset = uOffset % uSectorSize;
-        uBytesToCopy = MIN(uSectorSize - uInSectorOffset, uBytesToRead);
+        uint64_t uHeadFileOffset = uOffset - sPlan.uHeadSkip;
+        uint64_t uTailFileOffset = uOffset + sPlan.uHeadBytes + sPlan.uBodyBytes;
+        uint64_t uTailDevOffset  = sPlan.uDevOffset + (sPlan.uHeadBytes ? uSectorSize : 0) + sPlan.uBodyBytes;
+        bool bReadHead           = sPlan.uHeadBytes && (uHeadFileOffset < uValidEnd);
+        bool bReadTail           = sPlan.uTailBytes && (uTailFileOffset < uValidEnd);
 
-        // Read the content of the file
-        ssize_t iReadBytes = pread( iFD, pvBuffer, uSectorSize, uReadOffset );
-        if ( iReadBytes != (ssize_t)uSectorSize )
+        if ( sPlan.uHeadBytes && !bReadHead )
         {
-            iErr = ((iReadBytes < 0) ? errno : EIO);
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: pread failed to read wanted length\n" );
-            hfs_free(pvBuffer);
-            return iErr;
+            memset( puBounce, 0, uSectorSize );
         }
-        memcpy( (uint8_t *)pvBuf, (uint8_t *)pvBuffer+uInSectorOffset, uBytesToCopy );
-        hfs_free(pvBuffer);
-    }
-    // If uBytesToRead < uClusterSize, need to read 1 sector and memcpy the begining
-    else if (uBytesToRead < uSectorSize)
-    {
-        void* pvBuffer = hfs_malloc(uSectorSize);
-        if (pvBuffer == NULL)
+        if ( sPlan.uTailBytes && !bReadTail )
         {
-            return ENOMEM;
+            memset( puBounce + uSectorSize, 0, uSectorSize );
         }
 
-        uBytesToCopy = uBytesToRead;
-
-        // Read the content of the file
-        ssize_t iReadBytes = pread( iFD, pvBuffer, uSectorSize, uReadOffset );
-        if ( iReadBytes != (ssize_t)uSectorSize )
+        // Head and tail are adjacent on the device, fetch both with a single read
+        if ( bReadHead && bReadTail && (sPlan.uBodyBytes == 0) )
+        {
+            iErr = raw_readwrite_pread_sectors( iFD, puBounce, 2 * uSectorSize, sPlan.uDevOffset );
+        }
+        else
+        {
+            if ( bReadHead )
+            {
+                iErr = raw_readwrite_pread_sectors( iFD, puBounce, uSectorSize, sPlan.uDevOffset );
+            }
+            if ( !iErr && bReadTail )
+            {
+                iErr = raw_readwrite_pread_sectors( iFD, puBounce + uSectorSize, uSectorSize, uTailDevOffset );
+            }
+        }
+        if ( iErr )
         {
-            iErr = ((iReadBytes < 0) ? errno : EIO);
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: pread failed to read wanted length\n" );
-            hfs_free(pvBuffer);
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pread failed to read wanted length\n" );
             return iErr;
         }
 
-        memcpy((uint8_t *)pvBuf, pvBuffer, uBytesToCopy);
-        hfs_free(pvBuffer);
+        // memcpy the data from the given buffer
+        if ( sPlan.uHeadBytes )
+        {
+            memcpy( puBounce + sPlan.uHeadSkip, pvBuf, sPlan.uHeadBytes );
+            psIov[iIovCnt].iov_base = puBounce;
+            psIov[iIovCnt].iov_len  = uSectorSize;
+            iIovCnt++;
+        }
+    }
+
+    if ( sPlan.uBodyBytes )
+    {
+        psIov[iIovCnt].iov_base = (uint8_t*)pvBuf + sPlan.uHeadBytes;
+        psIov[iIovCnt].iov_len  = sPlan.uBodyBytes;
+        iIovCnt++;
+    }
+    if ( sPlan.uTailBytes )
+    {
+        memcpy( puBounce + uSectorSize, (uint8_t*)pvBuf + sPlan.uHeadBytes + sPlan.uBodyBytes, sPlan.uTailBytes );
+        psIov[iIovCnt].iov_base = puBounce + uSectorSize;
+        psIov[iIovCnt].iov_len  = uSectorSize;
+        iIovCnt++;
+    }
+
+    // Write the data into the device
+    ssize_t iWriteBytes = pwritev( iFD, psIov, iIovCnt, sPlan.uDevOffset );
+    if ( iWriteBytes != (ssize_t)sPlan.uDevLength )
+    {
+        iErr = (iWriteBytes < 0) ? errno : EIO;
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pwritev failed to write wanted length\n" );
+        return iErr;
+    }
+
+    // Update the amount of bytes alreay written
+    *piActuallyWritten = sPlan.uLength;
+
+    return iErr;
+}
+
+/*
+ * I/O submission layer.
+ *
+ * raw_readwrite_read/raw_readwrite_write first resolve every contiguous run of the
+ * request, then hand all runs but the first to a small pool of I/O threads, execute
+ * the first one on the caller's thread and wait once for the whole batch.
+ * Runs never share a device sector, so they may complete in any order.
+ */
+#define RAW_IO_WORKERS      (4)
+#define RAW_IO_INLINE_RUNS  (8)
+
+struct RawIOBatch;
+
+typedef struct RawIORun
+{
+    TAILQ_ENTRY(RawIORun)   sLink;
+    struct RawIOBatch*      psBatch;
+    vnode_t                 psVnode;
+    bool                    bWrite;
+    uint64_t                uCluster;
+    uint64_t                uContigousClustersInBytes;
+    uint64_t                uOffset;
+    uint64_t                uLength;
+    void*                   pvBuf;
+    uint64_t                uValidEnd;      // Writes only, see raw_readwrite_write_run
+    uint64_t                uDone;
+    errno_t                 iErr;
+} RawIORun_S;
+
+typedef struct RawIOBatch
+{
+    pthread_mutex_t         sLock;
+    pthread_cond_t          sCond;
+    uint32_t                uPending;
+} RawIOBatch_S;
+
+typedef struct
+{
+    pthread_mutex_t         sLock;
+    pthread_cond_t          sCond;
+    TAILQ_HEAD(, RawIORun)  sQueue;
+    pthread_t               psThreads[RAW_IO_WORKERS];
+    uint32_t                uThreads;
+    bool                    bShutdown;
+} RawIOPool_S;
+
+static RawIOPool_S gsRawIOPool = { .sLock = PTHREAD_MUTEX_INITIALIZER, .sCond = PTHREAD_COND_INITIALIZER };
+
+static void
+raw_readwrite_run_exec( RawIORun_S* psRun )
+{
+    if ( psRun->bWrite )
+    {
+        psRun->iErr = raw_readwrite_write_run( psRun->psVnode, psRun->uCluster, psRun->uContigousClustersInBytes, psRun->uOffset,
+                                               psRun->uLength, psRun->pvBuf, psRun->uValidEnd, &psRun->uDone );
     }
-    // Can read buffer size chunk
     else
     {
-        uint64_t uAvailSectors     = uContigousClustersInBytes / uSectorSize;
-        uint64_t uRemainingSectors = uBytesToRead              / uSectorSize;
+        psRun->iErr = raw_readwrite_read_internal( psRun->psVnode, psRun->uCluster, psRun->uContigousClustersInBytes, psRun->uOffset,
+                                                   psRun->uLength, psRun->pvBuf, &psRun->uDone );
+    }
+}
+
+static void*
+raw_readwrite_io_worker( __unused void* pvArg )
+{
+    lf_lck_mtx_lock( &gsRawIOPool.sLock );
+    while ( true )
+    {
+        while ( TAILQ_EMPTY(&gsRawIOPool.sQueue) && !gsRawIOPool.bShutdown )
+        {
+            pthread_cond_wait( &gsRawIOPool.sCond, &gsRawIOPool.sLock );
+        }
 
-        uBytesToCopy = MIN(uAvailSectors, uRemainingSectors) * uSectorSize;
-        uBytesToCopy = MIN( uBytesToCopy, MAX_READ_WRITE_LENGTH );
+        RawIORun_S* psRun = TAILQ_FIRST( &gsRawIOPool.sQueue );
+        if ( psRun == NULL )
+        {
+            break;
+        }
+        TAILQ_REMOVE( &gsRawIOPool.sQueue, psRun, sLink );
+        lf_lck_mtx_unlock( &gsRawIOPool.sLock );
 
-        assert( (uBytesToCopy % uSectorSize) == 0 );
-        assert( (uReadOffset  % uSectorSize) == 0 );
+        raw_readwrite_run_exec( psRun );
 
-        ssize_t iReadBytes = pread( iFD,(uint8_t *)pvBuf, (size_t)uBytesToCopy, uReadOffset ) ;
-        if ( iReadBytes != (ssize_t)uBytesToCopy )
+        RawIOBatch_S* psBatch = psRun->psBatch;
+        lf_lck_mtx_lock( &psBatch->sLock );
+        if ( --psBatch->uPending == 0 )
         {
-            iErr = ((iReadBytes < 0) ? errno : EIO);
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: pread failed to read wanted length\n" );
-            return iErr;
+            lf_cond_wakeup( &psBatch->sCond );
         }
+        lf_lck_mtx_unlock( &psBatch->sLock );
+
+        lf_lck_mtx_lock( &gsRawIOPool.sLock );
     }
+    lf_lck_mtx_unlock( &gsRawIOPool.sLock );
 
-    // Update the amount of bytes alreay read
-    *piActuallyRead = uBytesToCopy;
+    return NULL;
+}
+
+int
+raw_readwrite_io_init( void )
+{
+    int iErr = 0;
+
+    lf_lck_mtx_lock( &gsRawIOPool.sLock );
+    if ( gsRawIOPool.uThreads != 0 )
+    {
+        goto exit;
+    }
+
+    TAILQ_INIT( &gsRawIOPool.sQueue );
+    gsRawIOPool.bShutdown = false;
+
+    for ( uint32_t u = 0; u < RAW_IO_WORKERS; u++ )
+    {
+        iErr = pthread_create( &gsRawIOPool.psThreads[u], NULL, raw_readwrite_io_worker, NULL );
+        if ( iErr != 0 )
+        {
+            // Running with fewer workers is fine, without any we simply do the I/O inline
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_io_init: pthread_create failed [%d]\n", iErr );
+            iErr = 0;
+            break;
+        }
+        gsRawIOPool.uThreads++;
+    }
 
+exit:
+    lf_lck_mtx_unlock( &gsRawIOPool.sLock );
     return iErr;
 }
 
-errno_t
-raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten )
+void
+raw_readwrite_io_de_init( void )
 {
-    errno_t iErr                    = 0;
-    uint64_t uClusterSize           = psVnode->sFSParams.vnfs_mp->psHfsmount->blockSize;
-    uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
-    uint64_t uActuallyWritten       = 0;
+    lf_lck_mtx_lock( &gsRawIOPool.sLock );
+    uint32_t uThreads = gsRawIOPool.uThreads;
+    gsRawIOPool.bShutdown = true;
+    pthread_cond_broadcast( &gsRawIOPool.sCond );
+    lf_lck_mtx_unlock( &gsRawIOPool.sLock );
 
-    *piActuallyWritten = 0;
+    for ( uint32_t u = 0; u < uThreads; u++ )
+    {
+        pthread_join( gsRawIOPool.psThreads[u], NULL );
+    }
+
+    lf_lck_mtx_lock( &gsRawIOPool.sLock );
+    gsRawIOPool.uThreads = 0;
+    lf_lck_mtx_unlock( &gsRawIOPool.sLock );
+}
+
+/*
+ * Split [uOffset, uOffset + uLength) into device-contiguous runs, stopping at the physical end of the file.
+ * *ppsRuns initially points to an array of *puMaxRuns entries owned by the caller;
+ * if more runs are needed, a larger array is allocated and must be released with hfs_free.
+ */
+static errno_t
+raw_readwrite_resolve_runs( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, bool bWrite, uint64_t uValidEnd,
+                            RawIORun_S** ppsRuns, uint32_t* puMaxRuns, uint32_t* puRuns )
+{
+    struct hfsmount *hfsmp          = VTOHFS(psVnode);
+    uint64_t uClusterSize           = hfsmp->blockSize;
+    uint64_t uSectorSize            = hfsmp->hfs_logical_block_size;
+    uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
+    uint64_t uMaxRun                = MAX_READ_WRITE_LENGTH - 2 * uSectorSize;
+    uint64_t uResolved              = 0;
+    RawIORun_S* psRuns              = *ppsRuns;
 
-    // Fill the buffer until the buffer is full or till the end of the file
-    while ( *piActuallyWritten < uLength )
+    *puRuns = 0;
+    while ( uResolved < uLength )
     {
         uint64_t uCurrentCluster            = 0;
         uint64_t uInClusterOffset           = 0;
         uint64_t uContigousClustersInBytes  = 0;
 
-        iErr = raw_readwrite_get_cluster_from_offset(psVnode, uOffset, &uCurrentCluster, &uInClusterOffset, &uContigousClustersInBytes );
+        // Look for the location of the data
+        int iErr = raw_readwrite_get_cluster_from_offset( psVnode, uOffset, &uCurrentCluster, &uInClusterOffset, &uContigousClustersInBytes );
         if ( iErr != 0 )
         {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_resolve_runs: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
             return iErr;
         }
 
-        // Stop writing if we've reached the end of the file
+        // Stop if we've reached the end of the file
         if ( (uContigousClustersInBytes == 0) || (uOffset >= uFileSize) )
         {
             break;
         }
 
-        /* Calculate how many bytes are still missing to add to the device
-         * If offset near end of file need to set only (uFileSize - uOffset)
-         * else need to write as much as left (uLength - uAcctuallyRead)
-         */
-        uint64_t uBytesToWrite = MIN(uFileSize - uOffset, uLength - *piActuallyWritten);
+        uint64_t uRunLength = MIN( uFileSize - uOffset, uLength - uResolved );
+        uRunLength = MIN( uRunLength, uContigousClustersInBytes );
+        if ( uRunLength > uMaxRun )
+        {
+            // Split on a sector boundary so two runs never read-modify-write the same sector
+            uRunLength = ROUND_DOWN( uOffset + uMaxRun, uSectorSize ) - uOffset;
+        }
 
-        // Write data
-        iErr = raw_readwrite_write_internal( psVnode, uCurrentCluster, uContigousClustersInBytes, uOffset, uBytesToWrite, pvBuf, &uActuallyWritten );
-        if ( iErr != 0 )
+        if ( *puRuns == *puMaxRuns )
         {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_internal: raw_readwrite_read_internal failed [%d]\n", iErr );
-            return iErr;
+            RawIORun_S* psNewRuns = hfs_malloc( 2 * (*puMaxRuns) * sizeof(RawIORun_S) );
+            if ( psNewRuns == NULL )
+            {
+                return ENOMEM;
+            }
+            memcpy( psNewRuns, psRuns, (*puRuns) * sizeof(RawIORun_S) );
+            if ( psRuns != *ppsRuns )
+            {
+                hfs_free( psRuns );
+            }
+            psRuns = psNewRuns;
+            *puMaxRuns *= 2;
         }
 
-        // Update the amount of bytes alreay written
-        *piActuallyWritten += uActuallyWritten;
-        // Update file offset
-        uOffset += uActuallyWritten;
-        // Update buffer offset
-        pvBuf = (uint8_t*)pvBuf + uActuallyWritten;
+        RawIORun_S* psRun = &psRuns[(*puRuns)++];
+        memset( psRun, 0, sizeof(*psRun) );
+        psRun->psVnode                      = psVnode;
+        psRun->bWrite                       = bWrite;
+        psRun->uCluster                     = uCurrentCluster;
+        psRun->uContigousClustersInBytes    = uContigousClustersInBytes;
+        psRun->uOffset                      = uOffset;
+        psRun->uLength                      = uRunLength;
+        psRun->pvBuf                        = pvBuf;
+        psRun->uValidEnd                    = uValidEnd;
+
+        uResolved += uRunLength;
+        uOffset   += uRunLength;
+        pvBuf      = (uint8_t*)pvBuf + uRunLength;
     }
 
-    return iErr;
+    *ppsRuns = psRuns;
+    return 0;
 }
 
-errno_t
-raw_readwrite_write_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
-                              uint64_t uOffset, uint64_t uBytesToWrite, void* pvBuf, uint64_t *piActuallyWritten )
+/*
+ * Execute all runs and wait for them.
+ * *puDone is the number of bytes transferred up to the first failed run.
+ */
+static errno_t
+raw_readwrite_submit_runs( RawIORun_S* psRuns, uint32_t uRuns, uint64_t* puDone )
 {
-    errno_t iErr                    = 0;
-    int iFD                         = VNODE_TO_IFD(psVnode);
-    struct hfsmount *hfsmp          = VTOHFS(psVnode);
-    uint64_t uClusterSize           = hfsmp->blockSize;
-    uint64_t uSectorSize            = hfsmp->hfs_logical_block_size;
-    uint64_t uBytesToCopy           = 0;
+    errno_t iErr = 0;
+    RawIOBatch_S sBatch;
+    bool bBatched = false;
 
-    // Calculate offset - offset by sector and need to add the offset by sector
-    uint64_t uWriteOffset = FSOPS_GetOffsetFromClusterNum( psVnode, uCluster ) + ( ROUND_DOWN(uOffset, uSectorSize)  % uClusterSize );
+    *puDone = 0;
+    if ( uRuns == 0 )
+    {
+        return 0;
+    }
 
-    // If offset not align to sector size, need to read the existing data
-    //  memcpy it's beginning and write back to the device
-    if ( (uOffset % uSectorSize) != 0 )
+    if ( uRuns > 1 )
     {
-        void* pvBuffer = hfs_malloc(uSectorSize);
-        if (pvBuffer == NULL)
+        lf_lck_mtx_lock( &gsRawIOPool.sLock );
+        if ( gsRawIOPool.uThreads != 0 && !gsRawIOPool.bShutdown )
         {
-            return ENOMEM;
+            bBatched = true;
+            lf_lck_mtx_init( &sBatch.sLock );
+            lf_cond_init( &sBatch.sCond );
+            sBatch.uPending = uRuns - 1;
+
+            for ( uint32_t u = 1; u < uRuns; u++ )
+            {
+                psRuns[u].psBatch = &sBatch;
+                TAILQ_INSERT_TAIL( &gsRawIOPool.sQueue, &psRuns[u], sLink );
+            }
+            pthread_cond_broadcast( &gsRawIOPool.sCond );
         }
+        lf_lck_mtx_unlock( &gsRawIOPool.sLock );
+    }
 
-        uint64_t uInSectorOffset = uOffset % uSectorSize;
-        uBytesToCopy             = MIN( uBytesToWrite, uSectorSize - uInSectorOffset );
+    if ( bBatched )
+    {
+        raw_readwrite_run_exec( &psRuns[0] );
 
-        // Read the content of the existing file
-        ssize_t iReadBytes = pread(iFD, pvBuffer, uSectorSize, uWriteOffset);
-        if ( iReadBytes != (ssize_t)uSectorSize )
+        lf_lck_mtx_lock( &sBatch.sLock );
+        while ( sBatch.uPending != 0 )
         {
-            iErr = (iReadBytes < 0) ? errno : EIO;
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pread failed to read wanted length\n" );
-            hfs_free(pvBuffer);
-            return iErr;
+            pthread_cond_wait( &sBatch.sCond, &sBatch.sLock );
         }
+        lf_lck_mtx_unlock( &sBatch.sLock );
 
-        // memcpy the data from the given buffer
-        memcpy((uint8_t *)pvBuffer+uInSectorOffset, pvBuf, uBytesToCopy);
-
-        // Write the data into the device
-        ssize_t iWriteBytes = pwrite(iFD, pvBuffer, uSectorSize, uWriteOffset);
-        if ( iWriteBytes != (ssize_t)uSectorSize )
+        lf_cond_destroy( &sBatch.sCond );
+        lf_lck_mtx_destroy( &sBatch.sLock );
+    }
+    else
+    {
+        for ( uint32_t u = 0; u < uRuns; u++ )
         {
-            iErr = (iWriteBytes < 0) ? errno : EIO;
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pwrite failed to write wanted length\n" );
-            hfs_free(pvBuffer);
-            return iErr;
+            raw_readwrite_run_exec( &psRuns[u] );
+            if ( psRuns[u].iErr != 0 )
+            {
+                uRuns = u + 1;
+                break;
+            }
         }
-
-        hfs_free(pvBuffer);
     }
-    // If uBytesToWrite < uSectorSize, need to R/M/W 1 sector.
-    else if ( uBytesToWrite < uSectorSize )
+
+    for ( uint32_t u = 0; u < uRuns; u++ )
     {
-        void* pvBuffer = hfs_malloc(uSectorSize);
-        if (pvBuffer == NULL)
+        *puDone += psRuns[u].uDone;
+        if ( psRuns[u].iErr != 0 )
         {
-            return ENOMEM;
+            iErr = psRuns[u].iErr;
+            break;
         }
+    }
 
-        uBytesToCopy = uBytesToWrite;
+    return iErr;
+}
 
-        // Read the content of the existing file
-        ssize_t iReadBytes = pread(iFD, pvBuffer, uSectorSize, uWriteOffset);
-        if ( iReadBytes != (ssize_t)uSectorSize )
-        {
-            iErr = (iReadBytes < 0) ? errno : EIO;
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pread failed to read wanted length\n" );
-            hfs_free(pvBuffer);
-            return iErr;
-        }
+static errno_t
+raw_readwrite_batch( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, bool bWrite, uint64_t uValidEnd,
+                     uint64_t* puDone, uint64_t* puStartCluster )
+{
+    RawIORun_S  psInlineRuns[RAW_IO_INLINE_RUNS];
+    RawIORun_S* psRuns      = psInlineRuns;
+    uint32_t    uMaxRuns    = RAW_IO_INLINE_RUNS;
+    uint32_t    uRuns       = 0;
 
-        // memcpy the last data
-        memcpy(pvBuffer, (uint8_t *)pvBuf, uBytesToCopy);
+    *puDone = 0;
 
-        // Write the content to the file
-        ssize_t iWriteBytes = pwrite(iFD, pvBuffer, uSectorSize, uWriteOffset);
-        if ( iWriteBytes != (ssize_t)uSectorSize)
+    errno_t iErr = raw_readwrite_resolve_runs( psVnode, uOffset, pvBuf, uLength, bWrite, uValidEnd, &psRuns, &uMaxRuns, &uRuns );
+    if ( iErr == 0 )
+    {
+        if ( puStartCluster && uRuns )
         {
-            iErr = (iWriteBytes < 0) ? errno : EIO;
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pwrite failed to write wanted length\n" );
-            hfs_free(pvBuffer);
-            return iErr;
+            *puStartCluster = psRuns[0].uCluster;
         }
 
-        hfs_free(pvBuffer);
+        iErr = raw_readwrite_submit_runs( psRuns, uRuns, puDone );
     }
-    // Can write buffer size chunk
-    else
+
+    if ( psRuns != psInlineRuns )
     {
-        uint64_t uAvailSectors     = uContigousClustersInBytes / uSectorSize;
-        uint64_t uRemainingSectors = uBytesToWrite             / uSectorSize;
+        hfs_free( psRuns );
+    }
 
-        uBytesToCopy = MIN(uAvailSectors, uRemainingSectors) * uSectorSize;
-        uBytesToCopy = MIN( uBytesToCopy, MAX_READ_WRITE_LENGTH );
+    return iErr;
+}
 
-        assert( (uBytesToCopy % uSectorSize) == 0 );
-        assert( (uWriteOffset % uSectorSize) == 0 );
+errno_t
+raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster )
+{
+    uint64_t uActuallyRead = 0;
 
-        ssize_t iWriteBytes = pwrite(iFD, (uint8_t *)pvBuf, uBytesToCopy, uWriteOffset) ;
-        if ( iWriteBytes != (ssize_t) uBytesToCopy)
-        {
-            iErr = (iWriteBytes < 0) ? errno : EIO;
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pwrite failed to write wanted length\n" );
-            return iErr;
-        }
+    errno_t iErr = raw_readwrite_batch( psVnode, uOffset, pvBuf, uLength, false, 0, &uActuallyRead, puReadStartCluster );
+    if ( iErr != 0 )
+    {
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: failed [%d]\n", iErr );
     }
 
-    // Update the amount of bytes alreay written
-    *piActuallyWritten = uBytesToCopy;
+    *piActuallyRead = uActuallyRead;
+    return iErr;
+}
+
+errno_t
+raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten )
+{
+    // Data past the current EOF has not been written yet, no need to preserve it on RMW
+    uint64_t uValidEnd = ((struct filefork *)VTOF(psVnode))->ff_size;
+
+    errno_t iErr = raw_readwrite_batch( psVnode, uOffset, pvBuf, uLength, true, uValidEnd, piActuallyWritten, NULL );
+    if ( iErr != 0 )
+    {
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: failed [%d]\n", iErr );
+    }
 
     return iErr;
 }
 
+errno_t
+raw_readwrite_write_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
+                              uint64_t uOffset, uint64_t uBytesToWrite, void* pvBuf, uint64_t *piActuallyWritten )
+{
+    return raw_readwrite_write_run( psVnode, uCluster, uContigousClustersInBytes, uOffset, uBytesToWrite, pvBuf, UINT64_MAX, piActuallyWritten );
+}
+
 int
 raw_readwrite_zero_fill_init()
 {
@@ -23,6 +23,9 @@ errno_t  raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uin
 errno_t  raw_readwrite_read_internal( vnode_t psVnode, uint64_t uStartCluster, uint64_t uContigousClustersInBytes,
                                       uint64_t Offset, uint64_t uBytesToRead, void* pvBuf, uint64_t *piActuallyRead );
 
+int         raw_readwrite_io_init( void );
+void        raw_readwrite_io_de_init( void );
+
 int         raw_readwrite_zero_fill_init( void );
 void        raw_readwrite_zero_fill_de_init( void );
 int         raw_readwrite_zero_fill_fill( hfsmount_t* psMount, uint64_t uOffset, uint32_t uLength );
@@ -0,0 +1,416 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_readahead.c
+ *  livefiles_hfs
+ *
+ */
+
+#include <sys/queue.h>
+#include "lf_hfs_readahead.h"
+#include "lf_hfs.h"
+#include "lf_hfs_utils.h"
+#include "lf_hfs_vfsutils.h"
+#include "lf_hfs_cnode.h"
+#include "lf_hfs_raw_read_write.h"
+
+/*
+ * Sequential read-ahead for regular file vnodes.
+ *
+ * Every regular file vnode carries a ReadAhead_S.  A read that starts where the previous
+ * one ended is sequential.  The read-ahead buffers are used in turns: once the reader has
+ * consumed half of the window it is reading from, the window that follows it is prefetched
+ * into the other buffer, so it is normally complete before the reader gets there.
+ * Only the first window of a stream is read while the reader waits for it.
+ * The window starts at READ_AHEAD_MIN_WINDOW, doubles on every refill up to
+ * READ_AHEAD_MAX_WINDOW and drops back to zero on the first non sequential read.
+ *
+ * A buffer is owned by the read-ahead thread while a prefetch into it is in flight.
+ * Writes and truncates bump uGen, which makes an in-flight prefetch drop its data.
+ * The read-ahead thread only try-locks the truncate lock, so a reader waiting for a
+ * prefetch while holding the lock shared can never deadlock against a queued writer.
+ */
+#define READ_AHEAD_NUM_BUFS     (2)
+
+typedef struct
+{
+    void*                   pvBuf;          // READ_AHEAD_MAX_WINDOW bytes, allocated on first prefetch
+    uint64_t                uOffset;        // File offset of the buffer content
+    uint64_t                uValid;         // Valid bytes in the buffer, 0 while being filled
+} ReadAheadBuf_S;
+
+typedef struct ReadAhead
+{
+    TAILQ_ENTRY(ReadAhead)  sLink;          // Read-ahead thread queue
+    vnode_t                 psVnode;
+    pthread_mutex_t         sLock;
+    pthread_cond_t          sCond;          // Signalled when a prefetch completes
+    uint64_t                uGen;           // Bumped on invalidation
+    uint64_t                uNextOffset;    // Where a sequential read would start
+    uint64_t                uWindow;        // Current read-ahead window, 0 when not streaming
+    ReadAheadBuf_S          asBuf[READ_AHEAD_NUM_BUFS];
+    bool                    bInFlight;
+    uint32_t                uPendBuf;       // Buffer being filled by the in-flight prefetch
+    uint64_t                uPendOffset;    // Range of the in-flight prefetch
+    uint64_t                uPendLength;
+} ReadAhead_S;
+
+typedef struct
+{
+    pthread_mutex_t         sLock;
+    pthread_cond_t          sCond;
+    TAILQ_HEAD(, ReadAhead) sQueue;
+    pthread_t               sThread;
+    bool                    bRunning;
+    bool                    bShutdown;
+} ReadAheadThread_S;
+
+static ReadAheadThread_S gsReadAhead = { .sLock = PTHREAD_MUTEX_INITIALIZER, .sCond = PTHREAD_COND_INITIALIZER };
+
+/*
+ * Return the buffer holding uOffset, or NULL.  Called with psRA->sLock held.
+ */
+static ReadAheadBuf_S*
+lf_hfs_readahead_lookup( ReadAhead_S* psRA, uint64_t uOffset )
+{
+    for ( uint32_t uIdx = 0; uIdx < READ_AHEAD_NUM_BUFS; uIdx++ )
+    {
+        ReadAheadBuf_S* psBuf = &psRA->asBuf[uIdx];
+        if ( (uOffset >= psBuf->uOffset) && (uOffset < psBuf->uOffset + psBuf->uValid) )
+        {
+            return psBuf;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+lf_hfs_readahead_fill( ReadAhead_S* psRA )
+{
+    vnode_t psVnode     = psRA->psVnode;
+    struct cnode* cp    = VTOC(psVnode);
+    size_t uRead        = 0;
+    errno_t iErr        = EAGAIN;
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    uint64_t uGen       = psRA->uGen;
+    uint64_t uOffset    = psRA->uPendOffset;
+    uint64_t uLength    = psRA->uPendLength;
+    ReadAheadBuf_S* psBuf = &psRA->asBuf[psRA->uPendBuf];
+    lf_lck_mtx_unlock( &psRA->sLock );
+
+    // Protect against a size change, but never wait for the lock (lf_lck_rw_try_lock returns 0 once locked)
+    if ( !lf_lck_rw_try_lock( &cp->c_truncatelock, LCK_RW_TYPE_SHARED ) )
+    {
+        cp->c_truncatelockowner = HFS_SHARED_OWNER;
+
+        uint64_t uFileSize = VTOF(psVnode)->ff_size;
+        if ( uOffset < uFileSize )
+        {
+            uLength = MIN( uLength, uFileSize - uOffset );
+            iErr = raw_readwrite_read( psVnode, uOffset, psBuf->pvBuf, uLength, &uRead, NULL );
+        }
+
+        hfs_unlock_truncate( cp, HFS_LOCK_DEFAULT );
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    if ( (iErr == 0) && (uGen == psRA->uGen) )
+    {
+        psBuf->uOffset  = uOffset;
+        psBuf->uValid   = uRead;
+    }
+    else
+    {
+        psBuf->uValid   = 0;
+    }
+    psRA->bInFlight = false;
+    pthread_cond_broadcast( &psRA->sCond );
+    lf_lck_mtx_unlock( &psRA->sLock );
+}
+
+static void*
+lf_hfs_readahead_thread( __unused void* pvArg )
+{
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    while ( true )
+    {
+        while ( TAILQ_EMPTY(&gsReadAhead.sQueue) && !gsReadAhead.bShutdown )
+        {
+            pthread_cond_wait( &gsReadAhead.sCond, &gsReadAhead.sLock );
+        }
+
+        ReadAhead_S* psRA = TAILQ_FIRST( &gsReadAhead.sQueue );
+        if ( psRA == NULL )
+        {
+            break;
+        }
+        TAILQ_REMOVE( &gsReadAhead.sQueue, psRA, sLink );
+        lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+        lf_hfs_readahead_fill( psRA );
+
+        lf_lck_mtx_lock( &gsReadAhead.sLock );
+    }
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+    return NULL;
+}
+
+int
+lf_hfs_readahead_init( void )
+{
+    int iErr = 0;
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    if ( !gsReadAhead.bRunning )
+    {
+        TAILQ_INIT( &gsReadAhead.sQueue );
+        gsReadAhead.bShutdown = false;
+
+        iErr = pthread_create( &gsReadAhead.sThread, NULL, lf_hfs_readahead_thread, NULL );
+        if ( iErr == 0 )
+        {
+            gsReadAhead.bRunning = true;
+        }
+        else
+        {
+            // Not fatal, reads are simply not prefetched
+            LFHFS_LOG( LEVEL_ERROR, "lf_hfs_readahead_init: pthread_create failed [%d]\n", iErr );
+            iErr = 0;
+        }
+    }
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+    return iErr;
+}
+
+void
+lf_hfs_readahead_de_init( void )
+{
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    bool bRunning = gsReadAhead.bRunning;
+    gsReadAhead.bShutdown = true;
+    pthread_cond_broadcast( &gsReadAhead.sCond );
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+    if ( bRunning )
+    {
+        pthread_join( gsReadAhead.sThread, NULL );
+    }
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    gsReadAhead.bRunning = false;
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+}
+
+void
+lf_hfs_readahead_create( vnode_t psVnode )
+{
+    ReadAhead_S* psRA = hfs_mallocz( sizeof(ReadAhead_S) );
+    if ( psRA == NULL )
+    {
+        // Read-ahead is an optimization only
+        return;
+    }
+
+    psRA->psVnode = psVnode;
+    lf_lck_mtx_init( &psRA->sLock );
+    lf_cond_init( &psRA->sCond );
+
+    psVnode->psReadAhead = psRA;
+}
+
+void
+lf_hfs_readahead_quiesce( vnode_t psVnode )
+{
+    ReadAhead_S* psRA = psVnode->psReadAhead;
+    if ( psRA == NULL )
+    {
+        return;
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    while ( psRA->bInFlight )
+    {
+        pthread_cond_wait( &psRA->sCond, &psRA->sLock );
+    }
+    lf_lck_mtx_unlock( &psRA->sLock );
+}
+
+void
+lf_hfs_readahead_destroy( vnode_t psVnode )
+{
+    ReadAhead_S* psRA = psVnode->psReadAhead;
+    if ( psRA == NULL )
+    {
+        return;
+    }
+
+    lf_hfs_readahead_quiesce( psVnode );
+    psVnode->psReadAhead = NULL;
+
+    for ( uint32_t uIdx = 0; uIdx < READ_AHEAD_NUM_BUFS; uIdx++ )
+    {
+        if ( psRA->asBuf[uIdx].pvBuf )
+        {
+            hfs_free( psRA->asBuf[uIdx].pvBuf );
+        }
+    }
+    lf_cond_destroy( &psRA->sCond );
+    lf_lck_mtx_destroy( &psRA->sLock );
+    hfs_free( psRA );
+}
+
+void
+lf_hfs_readahead_invalidate( vnode_t psVnode )
+{
+    ReadAhead_S* psRA = psVnode->psReadAhead;
+    if ( psRA == NULL )
+    {
+        return;
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    psRA->uGen++;
+    // The buffer of an in-flight prefetch is already empty, the prefetch drops its data
+    for ( uint32_t uIdx = 0; uIdx < READ_AHEAD_NUM_BUFS; uIdx++ )
+    {
+        psRA->asBuf[uIdx].uValid = 0;
+    }
+    lf_lck_mtx_unlock( &psRA->sLock );
+}
+
+/*
+ * Copy the prefix of [uOffset, uOffset + uLength) found in the read-ahead buffers.
+ * Waits for an in-flight prefetch that covers uOffset.
+ * Returns the number of bytes copied.
+ */
+size_t
+lf_hfs_readahead_read( vnode_t psVnode, uint64_t uOffset, void *pvBuf, size_t uLength )
+{
+    ReadAhead_S* psRA = psVnode->psReadAhead;
+    size_t uCopied = 0;
+
+    if ( psRA == NULL || uLength == 0 )
+    {
+        return 0;
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    while ( psRA->bInFlight && (uOffset >= psRA->uPendOffset) && (uOffset < psRA->uPendOffset + psRA->uPendLength) )
+    {
+        pthread_cond_wait( &psRA->sCond, &psRA->sLock );
+    }
+
+    // The range may continue from one buffer into the next
+    while ( uCopied < uLength )
+    {
+        ReadAheadBuf_S* psBuf = lf_hfs_readahead_lookup( psRA, uOffset + uCopied );
+        if ( psBuf == NULL )
+        {
+            break;
+        }
+
+        uint64_t uInBufOffset = uOffset + uCopied - psBuf->uOffset;
+        size_t uChunk = (size_t) MIN( (uint64_t)(uLength - uCopied), psBuf->uValid - uInBufOffset );
+        memcpy( (uint8_t*)pvBuf + uCopied, (uint8_t*)psBuf->pvBuf + uInBufOffset, uChunk );
+        uCopied += uChunk;
+    }
+    lf_lck_mtx_unlock( &psRA->sLock );
+
+    return uCopied;
+}
+
+/*
+ * Account a completed read of [uOffset, uOffset + uLength) and start the next prefetch
+ * if the access pattern is sequential and the reader is past the middle of its window.
+ */
+void
+lf_hfs_readahead_update( vnode_t psVnode, uint64_t uOffset, size_t uLength, uint64_t uFileSize )
+{
+    ReadAhead_S* psRA = psVnode->psReadAhead;
+    bool bQueue = false;
+    uint64_t uStart;
+    uint32_t uFillBuf;
+
+    if ( psRA == NULL || uLength == 0 )
+    {
+        return;
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+
+    uint64_t uEnd = uOffset + uLength;
+    bool bSequential = (uOffset == psRA->uNextOffset);
+    psRA->uNextOffset = uEnd;
+
+    if ( !bSequential )
+    {
+        // Random access, stop prefetching until the reader streams again
+        psRA->uWindow = 0;
+        goto exit;
+    }
+
+    // Only one prefetch at a time per vnode
+    if ( psRA->bInFlight || (uEnd >= uFileSize) )
+    {
+        goto exit;
+    }
+
+    ReadAheadBuf_S* psCur = lf_hfs_readahead_lookup( psRA, uEnd );
+    if ( psCur == NULL )
+    {
+        // Nothing buffered ahead of the reader, start a new stream at its next read
+        uStart   = uEnd;
+        uFillBuf = 0;
+    }
+    else
+    {
+        uFillBuf = (psCur == &psRA->asBuf[0]) ? 1 : 0;
+        ReadAheadBuf_S* psNext = &psRA->asBuf[uFillBuf];
+        uStart = psCur->uOffset + psCur->uValid;
+
+        // Wait for the half-window marker, unless the next window is already buffered
+        if ( (uEnd - psCur->uOffset < psCur->uValid / 2) || (uStart >= uFileSize) ||
+             ((psNext->uValid != 0) && (psNext->uOffset == uStart)) )
+        {
+            goto exit;
+        }
+    }
+
+    ReadAheadBuf_S* psFill = &psRA->asBuf[uFillBuf];
+    if ( psFill->pvBuf == NULL )
+    {
+        psFill->pvBuf = hfs_malloc( READ_AHEAD_MAX_WINDOW );
+        if ( psFill->pvBuf == NULL )
+        {
+            goto exit;
+        }
+    }
+
+    psRA->uWindow = (psRA->uWindow == 0) ? READ_AHEAD_MIN_WINDOW : MIN( 2 * psRA->uWindow, READ_AHEAD_MAX_WINDOW );
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    if ( gsReadAhead.bRunning && !gsReadAhead.bShutdown )
+    {
+        psRA->bInFlight     = true;
+        psRA->uPendBuf      = uFillBuf;
+        psRA->uPendOffset   = uStart;
+        psRA->uPendLength   = MIN( psRA->uWindow, uFileSize - uStart );
+        psFill->uValid      = 0;
+        TAILQ_INSERT_TAIL( &gsReadAhead.sQueue, psRA, sLink );
+        bQueue = true;
+    }
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+exit:
+    lf_lck_mtx_unlock( &psRA->sLock );
+
+    if ( bQueue )
+    {
+        lf_lck_mtx_lock( &gsReadAhead.sLock );
+        lf_cond_wakeup( &gsReadAhead.sCond );
+        lf_lck_mtx_unlock( &gsReadAhead.sLock );
+    }
+}
@@ -0,0 +1,27 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_readahead.h
+ *  livefiles_hfs
+ *
+ */
+
+#ifndef lf_hfs_readahead_h
+#define lf_hfs_readahead_h
+
+#include "lf_hfs_vnode.h"
+
+#define READ_AHEAD_MIN_WINDOW   (128*1024)
+#define READ_AHEAD_MAX_WINDOW   (1024*1024)     // Also the size of each per-vnode read-ahead buffer
+
+int     lf_hfs_readahead_init( void );
+void    lf_hfs_readahead_de_init( void );
+
+void    lf_hfs_readahead_create( vnode_t psVnode );
+void    lf_hfs_readahead_destroy( vnode_t psVnode );
+void    lf_hfs_readahead_quiesce( vnode_t psVnode );
+void    lf_hfs_readahead_invalidate( vnode_t psVnode );
+
+size_t  lf_hfs_readahead_read( vnode_t psVnode, uint64_t uOffset, void *pvBuf, size_t uLength );
+void    lf_hfs_readahead_update( vnode_t psVnode, uint64_t uOffset, size_t uLength, uint64_t uFileSize );
+
+#endif /* lf_hfs_readahead_h */
@@ -15,6 +15,8 @@
 #include "lf_hfs_utils.h"
 #include "lf_hfs_vnops.h"
 #include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_writebehind.h"
 
 #include <assert.h>
 
@@ -703,6 +705,14 @@ hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags)
             return error;
     }
 
+    // Buffered writes must land before the blocks backing them can change
+    error = lf_hfs_writebehind_flush(vp);
+    if (error) {
+        if (!caller_has_cnode_lock)
+            hfs_unlock(cp);
+        return error;
+    }
+
     if (vnode_islnk(vp) && cp->c_datafork->ff_symlinkptr) {
         hfs_free(cp->c_datafork->ff_symlinkptr);
         cp->c_datafork->ff_symlinkptr = NULL;
@@ -748,6 +758,9 @@ hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags)
         error = do_hfs_truncate(vp, length, flags, truncateflags);
     }
 
+    // Whatever was prefetched may no longer reflect the file content
+    lf_hfs_readahead_invalidate(vp);
+
     if (!caller_has_cnode_lock)
         hfs_unlock(cp);
 
@@ -9,6 +9,12 @@
 #include "lf_hfs_ucs_string_cmp_data.h"
 #include "lf_hfs_sbunicode.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__arm64__)
+#include <arm_neon.h>
+#endif
+
 
 
 enum {
@@ -143,9 +149,91 @@ GetFilenameExtension(ItemCount length, ConstUniCharArrayPtr unicodeStr, char * e
 //        else
 //            return 1;
 //
+//    Both compares first skip the longest common prefix a block of code units at a time
+//    (UnicodeCommonPrefix).  For FastUnicodeCompare a unit pair belongs to the prefix
+//    when the units are identical, or differ only in ASCII case: either way they fold to
+//    the same character (or are both ignored), so the folded strings still share that
+//    prefix and the table walk over the rest gives the same result as over the whole.
+//    Non-ASCII case pairs and ignorable characters are left to the table walk.
+//
+
+/*
+ * Return the number of leading code units (at most length) that str1 and str2 have
+ * in common, comparing ASCII letters case insensitively if foldASCII is set.
+ */
+static inline ItemCount
+UnicodeCommonPrefix(ConstUniCharArrayPtr str1, ConstUniCharArrayPtr str2, ItemCount length, bool foldASCII)
+{
+    ItemCount i = 0;
+
+#if defined(__SSE2__)
+    const __m128i vA    = _mm_set1_epi16(0x0040);
+    const __m128i vZ    = _mm_set1_epi16(0x005B);
+    const __m128i vCase = _mm_set1_epi16(0x0020);
+
+    for (; i + 8 <= length; i += 8) {
+        __m128i v1 = _mm_loadu_si128((const __m128i *)&str1[i]);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)&str2[i]);
+
+        if (foldASCII) {
+            /* Units >= 0x8000 compare negative, so they are never taken for 'A'..'Z' */
+            v1 = _mm_or_si128(v1, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(v1, vA), _mm_cmplt_epi16(v1, vZ)), vCase));
+            v2 = _mm_or_si128(v2, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(v2, vA), _mm_cmplt_epi16(v2, vZ)), vCase));
+        }
+
+        u_int32_t uDiff = ~(u_int32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(v1, v2)) & 0xFFFF;
+        if (uDiff) {
+            return i + (__builtin_ctz(uDiff) >> 1);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__arm64__)
+    const uint16x8_t vA    = vdupq_n_u16(0x0041);
+    const uint16x8_t vZ    = vdupq_n_u16(0x005A);
+    const uint16x8_t vCase = vdupq_n_u16(0x0020);
+
+    for (; i + 8 <= length; i += 8) {
+        uint16x8_t v1 = vld1q_u16(&str1[i]);
+        uint16x8_t v2 = vld1q_u16(&str2[i]);
+
+        if (foldASCII) {
+            v1 = vorrq_u16(v1, vandq_u16(vandq_u16(vcgeq_u16(v1, vA), vcleq_u16(v1, vZ)), vCase));
+            v2 = vorrq_u16(v2, vandq_u16(vandq_u16(vcgeq_u16(v2, vA), vcleq_u16(v2, vZ)), vCase));
+        }
+
+        if (vminvq_u16(vceqq_u16(v1, v2)) != 0xFFFF) {
+            break;  /* the loop below finds the unit */
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        u_int16_t c1 = str1[i];
+        u_int16_t c2 = str2[i];
+
+        if (foldASCII) {
+            if (c1 >= 'A' && c1 <= 'Z') c1 |= 0x20;
+            if (c2 >= 'A' && c2 <= 'Z') c2 |= 0x20;
+        }
+        if (c1 != c2)
+            break;
+    }
+
+    return i;
+}
 
 int32_t FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
                             register ConstUniCharArrayPtr str2, register ItemCount length2)
+{
+    ItemCount prefix = UnicodeCommonPrefix(str1, str2, (length1 < length2) ? length1 : length2, true);
+
+    return FastUnicodeCompareTable(str1 + prefix, length1 - prefix, str2 + prefix, length2 - prefix);
+}
+
+/*
+ * The table walk alone; FastUnicodeCompare must always agree with it.
+ */
+int32_t FastUnicodeCompareTable ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+                                 register ConstUniCharArrayPtr str2, register ItemCount length2)
 {
     register u_int16_t     c1,c2;
     register u_int16_t     temp;
@@ -239,7 +327,12 @@ int32_t UnicodeBinaryCompare (register ConstUniCharArrayPtr str1, register ItemC
         string_length = len1;
     }
 
-    /* now compare the two string pointers */
+    /* skip the common prefix, then compare the two string pointers */
+    ItemCount prefix = UnicodeCommonPrefix(str1, str2, string_length, false);
+    str1 += prefix;
+    str2 += prefix;
+    string_length -= prefix;
+
     while (string_length--) {
         c1 = *(str1++);
         c2 = *(str2++);
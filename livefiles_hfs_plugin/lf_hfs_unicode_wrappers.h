@@ -14,6 +14,8 @@
 
 int32_t FastUnicodeCompare      ( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2);
 
+int32_t FastUnicodeCompareTable ( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2);
+
 int32_t UnicodeBinaryCompare    ( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2 );
 
 HFSCatalogNodeID GetEmbeddedFileID( ConstStr31Param filename, u_int32_t length, u_int32_t *prefixLength );
@@ -20,6 +20,7 @@
 #include "lf_hfs_catalog.h"
 #include "lf_hfs_cnode.h"
 #include "lf_hfs_chash.h"
+#include "lf_hfs_namecache.h"
 #include "lf_hfs_format.h"
 #include "lf_hfs_locks.h"
 #include "lf_hfs_endian.h"
@@ -437,7 +438,12 @@ static int hfs_InitialMount(struct vnode *devvp, struct mount *mp, struct hfs_mo
     //Copy read only flag
     if (mp->mnt_flag == MNT_RDONLY) (*hfsmp)->hfs_flags = HFS_READ_ONLY;
 
-    hfs_chashinit_finish(*hfsmp);
+    retval = hfs_chashinit_finish(*hfsmp);
+    if (retval)
+    {
+        goto error_exit;
+    }
+    hfs_namecache_init(*hfsmp);
 
     /* Init the ID lookup hashtable */
     hfs_idhash_init (*hfsmp);
@@ -465,7 +471,11 @@ static int hfs_InitialMount(struct vnode *devvp, struct mount *mp, struct hfs_mo
      *  Init the volume information structure
      */
     lf_lck_mtx_init(&(*hfsmp)->hfs_mutex);
+    lf_cond_init(&(*hfsmp)->hfs_dirmod_cond);
+    lf_cond_init(&(*hfsmp)->hfs_create_btree_cond);
     lf_lck_mtx_init(&(*hfsmp)->sync_mutex);
+    lf_lck_mtx_init(&(*hfsmp)->hfs_write_behind_mutex);
+    TAILQ_INIT(&(*hfsmp)->hfs_write_behind_dirty);
     lf_lck_rw_init(&(*hfsmp)->hfs_global_lock);
     lf_lck_spin_init(&(*hfsmp)->vcbFreeExtLock);
 
@@ -751,6 +761,7 @@ error_exit:
     {
         hfs_locks_destroy(*hfsmp);
         hfs_delete_chash(*hfsmp);
+        hfs_namecache_destroy(*hfsmp);
         hfs_idhash_destroy (*hfsmp);
 
         hfs_free(*hfsmp);
@@ -768,9 +779,9 @@ int hfs_ScanVolGetVolName(int iFd, char* pcVolumeName)
     off_t embeddedOffset;
     struct hfsmount *hfsmp;
     struct mount* psMount            = hfs_mallocz(sizeof(struct mount));
-    struct vnode* psDevVnode         = hfs_mallocz(sizeof(struct vnode));
-    struct cnode* psDevCnode         = hfs_mallocz(sizeof(struct cnode));
-    struct filefork* psDevFileFork   = hfs_mallocz(sizeof(struct filefork));
+    struct vnode* psDevVnode         = hfs_zallocz(HFS_VNODE_ZONE);
+    struct cnode* psDevCnode         = hfs_zallocz(HFS_CNODE_ZONE);
+    struct filefork* psDevFileFork   = hfs_zallocz(HFS_FILEFORK_ZONE);
     FileSystemRecord_s *psFSRecord   = hfs_mallocz(sizeof(FileSystemRecord_s));
 
     if ( psMount == NULL || psDevVnode == NULL || psDevCnode == NULL || psDevFileFork == NULL || psFSRecord == NULL )
@@ -819,6 +830,7 @@ int hfs_ScanVolGetVolName(int iFd, char* pcVolumeName)
 
         hfs_locks_destroy(hfsmp);
         hfs_delete_chash(hfsmp);
+        hfs_namecache_destroy(hfsmp);
         hfs_idhash_destroy (hfsmp);
         
         hfs_free(hfsmp);
@@ -832,9 +844,9 @@ exit:
     }
     
     if (psMount) free (psMount);
-    if (psDevVnode) free (psDevVnode);
-    if (psDevCnode) free (psDevCnode);
-    if (psDevFileFork) free (psDevFileFork);
+    hfs_zfree(psDevVnode, HFS_VNODE_ZONE);
+    hfs_zfree(psDevCnode, HFS_CNODE_ZONE);
+    hfs_zfree(psDevFileFork, HFS_FILEFORK_ZONE);
     if (psFSRecord) free (psFSRecord);
 
     return 0;
@@ -893,6 +905,7 @@ error_exit:
 
         hfs_locks_destroy(hfsmp);
         hfs_delete_chash(hfsmp);
+        hfs_namecache_destroy(hfsmp);
         hfs_idhash_destroy (hfsmp);
 
         hfs_free(hfsmp);
@@ -909,7 +922,10 @@ hfs_locks_destroy(struct hfsmount *hfsmp)
 {
 
     lf_lck_mtx_destroy(&hfsmp->hfs_mutex);
+    lf_cond_destroy(&hfsmp->hfs_dirmod_cond);
+    lf_cond_destroy(&hfsmp->hfs_create_btree_cond);
     lf_lck_mtx_destroy(&hfsmp->sync_mutex);
+    lf_lck_mtx_destroy(&hfsmp->hfs_write_behind_mutex);
     lf_lck_rw_destroy(&hfsmp->hfs_global_lock);
     lf_lck_spin_destroy(&hfsmp->vcbFreeExtLock);
 
@@ -1885,6 +1901,7 @@ int hfs_unmount(struct mount *mp)
     
     hfs_locks_destroy(hfsmp);
     hfs_delete_chash(hfsmp);
+    hfs_namecache_destroy(hfsmp);
     hfs_idhash_destroy(hfsmp);
 
     hfs_assert(TAILQ_EMPTY(&hfsmp->hfs_reserved_ranges[HFS_TENTATIVE_BLOCKS]) && TAILQ_EMPTY(&hfsmp->hfs_reserved_ranges[HFS_LOCKED_BLOCKS]));
@@ -35,6 +35,8 @@
 #include "lf_hfs_link.h"
 #include "lf_hfs_btree.h"
 #include "lf_hfs_journal.h"
+#include "lf_hfs_btree_prefetch.h"
+#include "lf_hfs_generic_buf.h"
 
 static int hfs_late_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp, void *_args);
 u_int32_t GetFileInfo(ExtendedVCB *vcb, const char *name,
@@ -1176,6 +1178,258 @@ hfs_mallocz(size_t size)
     return ptr;
 }
 
+/*
+ * Zone allocator.
+ *
+ * Every zone hands out objects of one size, carved from HFS_ZONE_SLAB_SIZE slabs.
+ * Each thread keeps up to HFS_ZONE_CACHE_MAX free objects per zone, so the common
+ * allocation and free take no lock at all; the thread cache is refilled from, and
+ * overflows into, the zone's global free list HFS_ZONE_CACHE_BATCH objects at a time.
+ * Slabs are never returned to malloc: objects cached by threads that are still alive
+ * may point into any of them.
+ *
+ * With MALLOC_TRACER set, zones fall back to hfs_malloc/hfs_free per object so the
+ * tracer still sees (and checks) every one of them.
+ */
+#define HFS_ZONE_SLAB_SIZE      (64*1024)
+#define HFS_ZONE_CACHE_MAX      (64)
+#define HFS_ZONE_CACHE_BATCH    (HFS_ZONE_CACHE_MAX / 2)
+
+typedef struct ZoneFree {
+    struct ZoneFree     *psNext;
+} ZoneFree_S;
+
+typedef struct {
+    const char          *pcName;
+    size_t              uElemSize;
+    pthread_mutex_t     sLock;          // Protects psFreeList
+    ZoneFree_S          *psFreeList;
+    _Atomic uint64_t    uInUse;
+    _Atomic uint64_t    uMaxInUse;
+    _Atomic uint64_t    uAllocs;
+    _Atomic uint64_t    uSlabs;
+} Zone_S;
+
+typedef struct {
+    ZoneFree_S          *psFree;
+    uint32_t            uCount;
+} ZoneCache_S;
+
+#define HFS_ZONE(kind, name, size) [kind] = { .pcName = name, .uElemSize = (size), .sLock = PTHREAD_MUTEX_INITIALIZER }
+
+static Zone_S gsZones[HFS_NUM_ZONES] = {
+    HFS_ZONE(HFS_CNODE_ZONE,    "cnode",        sizeof(struct cnode)),
+    HFS_ZONE(HFS_VNODE_ZONE,    "vnode",        sizeof(struct vnode)),
+    HFS_ZONE(HFS_FILEFORK_ZONE, "filefork",     sizeof(struct filefork)),
+    HFS_ZONE(HFS_DIRHINT_ZONE,  "directoryhint", sizeof(struct directoryhint)),
+    HFS_ZONE(HFS_GENBUF_ZONE,   "GenericLFBuf", GEN_BUF_ZONE_ELEM_SIZE),
+};
+
+#if !MALLOC_TRACER
+static pthread_key_t  gsZoneCacheKey;
+static pthread_once_t gsZoneCacheOnce = PTHREAD_ONCE_INIT;
+
+// Puts a chain of uCount free objects, psFirst .. psLast, on the zone's global free list
+static void
+hfs_zone_put(Zone_S *psZone, ZoneFree_S *psFirst, ZoneFree_S *psLast)
+{
+    lf_lck_mtx_lock(&psZone->sLock);
+    psLast->psNext = psZone->psFreeList;
+    psZone->psFreeList = psFirst;
+    lf_lck_mtx_unlock(&psZone->sLock);
+}
+
+// Thread exit: give the thread's cached objects back to the zones
+static void
+hfs_zone_cache_destroy(void *pvCaches)
+{
+    ZoneCache_S *psCaches = pvCaches;
+
+    for (uint32_t uZone = 0; uZone < HFS_NUM_ZONES; uZone++) {
+        ZoneFree_S *psFirst = psCaches[uZone].psFree;
+        if (psFirst == NULL) {
+            continue;
+        }
+        ZoneFree_S *psLast = psFirst;
+        while (psLast->psNext != NULL) {
+            psLast = psLast->psNext;
+        }
+        hfs_zone_put(&gsZones[uZone], psFirst, psLast);
+    }
+    free(psCaches);
+}
+
+static void
+hfs_zone_cache_key_init(void)
+{
+    if (pthread_key_create(&gsZoneCacheKey, hfs_zone_cache_destroy)) {
+        panic("hfs_zone_cache_key_init: pthread_key_create failed");
+    }
+}
+
+// Returns the calling thread's caches, NULL if they could not be allocated
+static ZoneCache_S *
+hfs_zone_caches(void)
+{
+    pthread_once(&gsZoneCacheOnce, hfs_zone_cache_key_init);
+
+    ZoneCache_S *psCaches = pthread_getspecific(gsZoneCacheKey);
+    if (psCaches == NULL) {
+        psCaches = calloc(HFS_NUM_ZONES, sizeof(ZoneCache_S));
+        if (psCaches != NULL && pthread_setspecific(gsZoneCacheKey, psCaches)) {
+            free(psCaches);
+            psCaches = NULL;
+        }
+    }
+    return psCaches;
+}
+
+// Moves up to HFS_ZONE_CACHE_BATCH objects from the zone to psCache, carving a new slab if the zone has none
+static void
+hfs_zone_refill(Zone_S *psZone, ZoneCache_S *psCache)
+{
+    lf_lck_mtx_lock(&psZone->sLock);
+
+    if (psZone->psFreeList == NULL) {
+        size_t uElemSize = (psZone->uElemSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        uint8_t *puSlab = hfs_malloc(HFS_ZONE_SLAB_SIZE);
+        if (puSlab == NULL) {
+            LFHFS_LOG(LEVEL_ERROR, "hfs_zone_refill: failed to allocate a %s slab\n", psZone->pcName);
+            lf_lck_mtx_unlock(&psZone->sLock);
+            return;
+        }
+        atomic_fetch_add_explicit(&psZone->uSlabs, 1, memory_order_relaxed);
+
+        for (size_t uOff = 0; uOff + uElemSize <= HFS_ZONE_SLAB_SIZE; uOff += uElemSize) {
+            ZoneFree_S *psElem = (ZoneFree_S *)(void *)(puSlab + uOff);
+            psElem->psNext = psZone->psFreeList;
+            psZone->psFreeList = psElem;
+        }
+    }
+
+    while (psZone->psFreeList != NULL && psCache->uCount < HFS_ZONE_CACHE_BATCH) {
+        ZoneFree_S *psElem = psZone->psFreeList;
+        psZone->psFreeList = psElem->psNext;
+        psElem->psNext = psCache->psFree;
+        psCache->psFree = psElem;
+        psCache->uCount++;
+    }
+
+    lf_lck_mtx_unlock(&psZone->sLock);
+}
+#endif /* !MALLOC_TRACER */
+
+static void
+hfs_zone_account_alloc(Zone_S *psZone)
+{
+    atomic_fetch_add_explicit(&psZone->uAllocs, 1, memory_order_relaxed);
+    uint64_t uInUse = atomic_fetch_add_explicit(&psZone->uInUse, 1, memory_order_relaxed) + 1;
+    uint64_t uMax   = atomic_load_explicit(&psZone->uMaxInUse, memory_order_relaxed);
+    while (uInUse > uMax &&
+           !atomic_compare_exchange_weak_explicit(&psZone->uMaxInUse, &uMax, uInUse, memory_order_relaxed, memory_order_relaxed));
+}
+
+void*
+hfs_zalloc(hfs_zone_kind_t eZone)
+{
+    Zone_S *psZone = &gsZones[eZone];
+    void   *pv     = NULL;
+
+#if MALLOC_TRACER
+    pv = hfs_malloc(psZone->uElemSize);
+#else
+    ZoneCache_S *psCaches = hfs_zone_caches();
+    if (psCaches == NULL) {
+        return NULL;
+    }
+
+    ZoneCache_S *psCache = &psCaches[eZone];
+    if (psCache->psFree == NULL) {
+        hfs_zone_refill(psZone, psCache);
+    }
+
+    ZoneFree_S *psElem = psCache->psFree;
+    if (psElem != NULL) {
+        psCache->psFree = psElem->psNext;
+        psCache->uCount--;
+        pv = psElem;
+    }
+#endif
+
+    if (pv != NULL) {
+        hfs_zone_account_alloc(psZone);
+    }
+    return pv;
+}
+
+void*
+hfs_zallocz(hfs_zone_kind_t eZone)
+{
+    void *ptr = hfs_zalloc(eZone);
+    if ( ptr == NULL )
+        return ptr;
+    bzero(ptr, gsZones[eZone].uElemSize);
+    return ptr;
+}
+
+void
+hfs_zfree(void *ptr, hfs_zone_kind_t eZone)
+{
+    if (!ptr)
+        return;
+
+    Zone_S *psZone = &gsZones[eZone];
+    atomic_fetch_sub_explicit(&psZone->uInUse, 1, memory_order_relaxed);
+
+#if MALLOC_TRACER
+    hfs_free(ptr);
+#else
+    ZoneFree_S  *psElem   = ptr;
+    ZoneCache_S *psCaches = hfs_zone_caches();
+    if (psCaches == NULL) {
+        // No thread cache, give the object straight back to the zone
+        hfs_zone_put(psZone, psElem, psElem);
+        return;
+    }
+
+    ZoneCache_S *psCache = &psCaches[eZone];
+    psElem->psNext  = psCache->psFree;
+    psCache->psFree = psElem;
+    psCache->uCount++;
+
+    if (psCache->uCount > HFS_ZONE_CACHE_MAX) {
+        // Keep the most recently freed (cache warm) objects, return the rest
+        ZoneFree_S *psLast = psCache->psFree;
+        for (uint32_t u = 1; u < HFS_ZONE_CACHE_MAX - HFS_ZONE_CACHE_BATCH; u++) {
+            psLast = psLast->psNext;
+        }
+        ZoneFree_S *psFirst = psLast->psNext;
+        psLast->psNext  = NULL;
+        psCache->uCount = HFS_ZONE_CACHE_MAX - HFS_ZONE_CACHE_BATCH;
+
+        psLast = psFirst;
+        while (psLast->psNext != NULL) {
+            psLast = psLast->psNext;
+        }
+        hfs_zone_put(psZone, psFirst, psLast);
+    }
+#endif
+}
+
+void
+hfs_zone_get_stats(ZoneStats_S psStats[HFS_NUM_ZONES])
+{
+    for (uint32_t uZone = 0; uZone < HFS_NUM_ZONES; uZone++) {
+        Zone_S *psZone = &gsZones[uZone];
+
+        psStats[uZone].uElemSize = psZone->uElemSize;
+        psStats[uZone].uInUse    = atomic_load_explicit(&psZone->uInUse,    memory_order_relaxed);
+        psStats[uZone].uMaxInUse = atomic_load_explicit(&psZone->uMaxInUse, memory_order_relaxed);
+        psStats[uZone].uAllocs   = atomic_load_explicit(&psZone->uAllocs,   memory_order_relaxed);
+        psStats[uZone].uSlabs    = atomic_load_explicit(&psZone->uSlabs,    memory_order_relaxed);
+    }
+}
+
 /*
  * Lock the HFS mount lock
  *
@@ -1210,6 +1464,9 @@ static void ReleaseMetaFileVNode(struct vnode *vp)
     {
         if (fp->fcbBTCBPtr != NULL)
         {
+            /* No node prefetch may use the B-tree once it is closed */
+            lf_hfs_btree_prefetch_drain(vp);
+
             (void)hfs_lock(VTOC(vp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
             (void) BTClosePath(fp);
             hfs_unlock(VTOC(vp));
@@ -1649,7 +1906,7 @@ hfs_getdirhint(struct cnode *dcp, int index, int detach)
         if (dcp->c_dirhintcnt < HFS_MAXDIRHINTS)
         { /* we don't need recycling */
             /* Create a default directory hint */
-            hint = hfs_malloc(sizeof(struct directoryhint));
+            hint = hfs_zalloc(HFS_DIRHINT_ZONE);
             ++dcp->c_dirhintcnt;
             need_remove = false;
         }
@@ -1743,7 +2000,7 @@ hfs_reldirhint(struct cnode *dcp, directoryhint_t * relhint)
         relhint->dh_desc.cd_flags &= ~CD_HASBUF;
         hfs_free((void*)name);
     }
-    hfs_free(relhint);
+    hfs_zfree(relhint, HFS_DIRHINT_ZONE);
 }
 
 /*
@@ -1880,7 +2137,7 @@ hfs_reldirhints(struct cnode *dcp, int stale_hints_only)
             hfs_free((void *)name);
         }
         TAILQ_REMOVE(&dcp->c_hintlist, hint, dh_link);
-        hfs_free(hint);
+        hfs_zfree(hint, HFS_DIRHINT_ZONE);
         --dcp->c_dirhintcnt;
     }
 }
@@ -53,4 +53,30 @@ int hfs_early_journal_init(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp,
 					   HFSMasterDirectoryBlock *mdbp);
 errno_t hfs_flush(struct hfsmount *hfsmp, hfs_flush_mode_t mode);
 
+/*
+ * Typed pools for the fixed-size objects allocated on every lookup and I/O.
+ * hfs_zalloc does not zero the object, hfs_zallocz does.
+ */
+typedef enum hfs_zone_kind {
+    HFS_CNODE_ZONE,
+    HFS_VNODE_ZONE,
+    HFS_FILEFORK_ZONE,
+    HFS_DIRHINT_ZONE,
+    HFS_GENBUF_ZONE,        // Cached and non-cached GenericLFBuf
+    HFS_NUM_ZONES
+} hfs_zone_kind_t;
+
+typedef struct {
+    uint64_t uElemSize;
+    uint64_t uInUse;        // Objects currently allocated
+    uint64_t uMaxInUse;
+    uint64_t uAllocs;       // hfs_zalloc calls since load
+    uint64_t uSlabs;        // Slabs carved for the zone, never returned to malloc
+} ZoneStats_S;
+
+void*       hfs_zalloc( hfs_zone_kind_t eZone );
+void*       hfs_zallocz( hfs_zone_kind_t eZone );
+void        hfs_zfree( void* ptr, hfs_zone_kind_t eZone );
+void        hfs_zone_get_stats( ZoneStats_S psStats[HFS_NUM_ZONES] );
+
 #endif /* lf_hfs_vfsutils_h */
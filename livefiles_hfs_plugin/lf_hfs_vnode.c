@@ -12,6 +12,8 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_fileops_handler.h"
 #include "lf_hfs_xattr.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_writebehind.h"
 #include <System/sys/decmpfs.h>
 
 int VTtoUVFS_tab[16] =
@@ -51,12 +53,17 @@ errno_t vnode_initialize(uint32_t size, void *data, vnode_t *vpp)
     {
         (*vpp)->sExtraData.sDirData.uDirVersion = 1;
     }
+    else if ((*vpp)->sFSParams.vnfs_vtype == VREG && !(*vpp)->sFSParams.vnfs_marksystem)
+    {
+        lf_hfs_readahead_create(*vpp);
+        lf_hfs_writebehind_create(*vpp);
+    }
     return 0;
 }
 
 errno_t vnode_create(uint32_t size, void  *data, vnode_t *vpp)
 {
-    *vpp = hfs_malloc(sizeof(struct vnode));
+    *vpp = hfs_zalloc(HFS_VNODE_ZONE);
     if (*vpp == NULL)
     {
         return ENOMEM;
@@ -71,7 +78,9 @@ void vnode_rele(vnode_t vp)
         lf_hfs_generic_buf_cache_LockBufCache();
         lf_hfs_generic_buf_cache_remove_vnode(vp);
         lf_hfs_generic_buf_cache_UnLockBufCache();
-        hfs_free(vp);
+        lf_hfs_writebehind_destroy(vp);
+        lf_hfs_readahead_destroy(vp);
+        hfs_zfree(vp, HFS_VNODE_ZONE);
     }
     vp = NULL;
 }
@@ -81,6 +81,9 @@ typedef struct vnode
         DirData_s sDirData;
     } sExtraData;
 
+    struct ReadAhead* psReadAhead;      // Sequential read-ahead state, regular files only
+    struct WriteBehind* psWriteBehind;  // Write-behind coalescing buffer, regular files only
+
     uint32_t uValidNodeMagic2;
 
 } *vnode_t;
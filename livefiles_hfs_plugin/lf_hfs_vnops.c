@@ -28,6 +28,8 @@
 #include "lf_hfs_link.h"
 #include "lf_hfs_journal.h"
 #include "lf_hfs_chash.h"
+#include "lf_hfs_namecache.h"
+#include "lf_hfs_writebehind.h"
 
 #define DOT_DIR_SIZE                (UVFS_DIRENTRY_RECLEN(1))
 #define DOT_X2_DIR_SIZE             (UVFS_DIRENTRY_RECLEN(2))
@@ -976,6 +978,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
             }
             dcp->c_dirchangecnt++;
             hfs_incr_gencount(dcp);
+            hfs_namecache_purge(dcp);
 
             dcp->c_ctime = tv.tv_sec;
             dcp->c_mtime = tv.tv_sec;
@@ -1015,7 +1018,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
              * The resource fork vnode & filefork did not exist.
              * Create a temporary one for use in this function only.
              */
-            temp_rsrc_fork = hfs_mallocz(sizeof(struct filefork));
+            temp_rsrc_fork = hfs_zallocz(HFS_FILEFORK_ZONE);
             temp_rsrc_fork->ff_cp = cp;
             rl_init(&temp_rsrc_fork->ff_invalidranges);
         }
@@ -1028,7 +1031,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
             error = cat_lookup (hfsmp, &desc, 1, (struct cat_desc*) NULL, (struct cat_attr*) NULL, &temp_rsrc_fork->ff_data, NULL);
             if (error)
             {
-                hfs_free(temp_rsrc_fork);
+                hfs_zfree(temp_rsrc_fork, HFS_FILEFORK_ZONE);
                 hfs_systemfile_unlock (hfsmp, lockflags);
                 goto out;
             }
@@ -1040,7 +1043,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
             {
                 if (temp_rsrc_fork)
                 {
-                    hfs_free(temp_rsrc_fork);
+                    hfs_zfree(temp_rsrc_fork, HFS_FILEFORK_ZONE);
                 }
                 hfs_systemfile_unlock(hfsmp, lockflags);
                 goto out;
@@ -1064,6 +1067,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
             }
             dcp->c_dirchangecnt++;
             hfs_incr_gencount(dcp);
+            hfs_namecache_purge(dcp);
 
             dcp->c_ctime = tv.tv_sec;
             dcp->c_mtime = tv.tv_sec;
@@ -1076,7 +1080,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
         {
             if (temp_rsrc_fork)
             {
-                hfs_free(temp_rsrc_fork);
+                hfs_zfree(temp_rsrc_fork, HFS_FILEFORK_ZONE);
             }
             goto out;
         }
@@ -1126,7 +1130,7 @@ hfs_removefile(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
         /* Get rid of the temporary rsrc fork */
         if (temp_rsrc_fork)
         {
-            hfs_free(temp_rsrc_fork);
+            hfs_zfree(temp_rsrc_fork, HFS_FILEFORK_ZONE);
         }
 
         cp->c_flag |= C_NOEXISTS;
@@ -1172,9 +1176,7 @@ out:
         hfs_end_transaction(hfsmp);
     }
     
-    dcp->c_flag &= ~C_DIR_MODIFICATION;
-    //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-    //wakeup((caddr_t)&dcp->c_flag);
+    hfs_dir_modification_end(hfsmp, dcp);
 
     return (error);
 }
@@ -1451,6 +1453,7 @@ hfs_removedir(struct vnode *dvp, struct vnode *vp, struct componentname *cnp, in
         DEC_FOLDERCOUNT(hfsmp, dcp->c_attr);
         dcp->c_dirchangecnt++;
         hfs_incr_gencount(dcp);
+        hfs_namecache_purge(dcp);
 
         dcp->c_touch_chgtime = TRUE;
         dcp->c_touch_modtime = TRUE;
@@ -1472,9 +1475,7 @@ hfs_removedir(struct vnode *dvp, struct vnode *vp, struct componentname *cnp, in
 out:
     dvp->sExtraData.sDirData.uDirVersion++;
 
-    dcp->c_flag &= ~C_DIR_MODIFICATION;
-//TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-//    wakeup((caddr_t)&dcp->c_flag);
+    hfs_dir_modification_end(hfsmp, dcp);
 
     if (started_tr)
     {
@@ -1766,7 +1767,13 @@ hfs_prepare_fork_for_update(filefork_t *ff, const struct cat_fork *cf, struct ca
         cf_buf = &ff->ff_data;
 
     off_t max_size = ff->ff_size;
-   
+
+    // Data still buffered by write-behind is not on the media, keep the EOF before it
+    struct cnode *cp = ff->ff_cp;
+    struct vnode *vp = (cp == NULL) ? NULL : ((ff == cp->c_datafork) ? cp->c_vp : cp->c_rsrc_vp);
+    if (vp != NULL)
+        max_size = lf_hfs_writebehind_durable_size(vp, max_size);
+
     if (!ff->ff_unallocblocks && ff->ff_size <= max_size)
         return cf; // Nothing to do
 
@@ -2067,6 +2074,7 @@ hfs_makenode(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, U
         }
         dcp->c_dirchangecnt++;
         hfs_incr_gencount(dcp);
+        hfs_namecache_purge(dcp);
 
         dcp->c_touch_chgtime = dcp->c_touch_modtime = true;
         dcp->c_flag |= C_MODIFIED;
@@ -2143,10 +2151,7 @@ exit:
      */
     if (dcp)
     {
-        dcp->c_flag &= ~C_DIR_MODIFICATION;
-
-        //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-        //wakeup((caddr_t)&dcp->c_flag);
+        hfs_dir_modification_end(hfsmp, dcp);
         hfs_unlock(dcp);
     }
 
@@ -2906,6 +2911,7 @@ skip_rm:
         tdcp->c_dirchangecnt++;
         tdcp->c_flag |= C_MODIFIED;
         hfs_incr_gencount(tdcp);
+        hfs_namecache_purge(tdcp);
 
         if (fdcp->c_entries > 0)
             fdcp->c_entries--;
@@ -2924,6 +2930,7 @@ skip_rm:
         (void) hfs_update(fdvp, 0);
     }
     hfs_incr_gencount(fdcp);
+    hfs_namecache_purge(fdcp);
 
     tdcp->c_childhint = out_desc.cd_hint;    /* Cache directory's location */
     tdcp->c_touch_chgtime = TRUE;
@@ -2975,16 +2982,12 @@ out:
     }
 
     fdvp->sExtraData.sDirData.uDirVersion++;
-    fdcp->c_flag &= ~C_DIR_MODIFICATION;
-    //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-//    wakeup((caddr_t)&fdcp->c_flag);
+    hfs_dir_modification_end(hfsmp, fdcp);
 
     if (fdvp != tdvp)
     {
         tdvp->sExtraData.sDirData.uDirVersion++;
-        tdcp->c_flag &= ~C_DIR_MODIFICATION;
-        //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-//        wakeup((caddr_t)&tdcp->c_flag);
+        hfs_dir_modification_end(hfsmp, tdcp);
 
     }
 
@@ -3166,6 +3169,7 @@ hfs_vnop_link(vnode_t vp, vnode_t tdvp, struct componentname *cnp)
         tdcp->c_dirchangecnt++;
         tdcp->c_flag |= C_MODIFIED;
         hfs_incr_gencount(tdcp);
+        hfs_namecache_purge(tdcp);
         tdcp->c_touch_chgtime = TRUE;
         tdcp->c_touch_modtime = TRUE;
 
@@ -3195,9 +3199,7 @@ out:
         hfs_end_transaction(hfsmp);
     }
 
-    tdcp->c_flag &= ~C_DIR_MODIFICATION;
-    //TBD - We have wakeup here but can't see anyone who's msleeping on c_flag...
-//    wakeup((caddr_t)&tdcp->c_flag);
+    hfs_dir_modification_end(hfsmp, tdcp);
 
     if (fdcp) {
         hfs_unlockfour(tdcp, cp, fdcp, NULL);
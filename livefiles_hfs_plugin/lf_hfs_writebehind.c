@@ -0,0 +1,418 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_writebehind.c
+ *  livefiles_hfs
+ *
+ */
+
+#include "lf_hfs_writebehind.h"
+#include "lf_hfs.h"
+#include "lf_hfs_utils.h"
+#include "lf_hfs_vfsutils.h"
+#include "lf_hfs_cnode.h"
+#include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_readahead.h"
+#include "lf_hfs_vnops.h"
+
+/*
+ * Write-behind coalescing for regular file vnodes (optional, see LFHFS_FSATTR_WRITE_BEHIND).
+ *
+ * LFHFS_Write still allocates the blocks and moves ff_size for every call; only the data
+ * transfer is deferred.  Small writes that continue the buffered range are appended to a
+ * per-vnode buffer, which is written with a single raw_readwrite_write when:
+ * - a write does not continue the buffered range or is too large to buffer,
+ * - the buffer reaches WRITE_BEHIND_BUF_SIZE,
+ * - LFHFS_Sync is called, the file is truncated or zero filled, or the vnode is reclaimed.
+ * Until then the catalog keeps the EOF the file had before the buffered data (see
+ * lf_hfs_writebehind_durable_size), so a crash never exposes blocks that were not written.
+ *
+ * Vnodes with buffered data are kept on the mount's dirty list so LFHFS_Sync can find them.
+ * Buffered data is only written with the cnode lock held, so the extents can not change
+ * underneath it.  While the sync flushes a vnode it marks it bFlushing, and
+ * lf_hfs_writebehind_destroy waits for that before the vnode and its cnode go away.
+ * Lock order: truncate lock -> cnode lock -> WriteBehind_S.sLock.  hfs_write_behind_mutex
+ * is never held while taking any other lock.
+ */
+typedef struct WriteBehind
+{
+    TAILQ_ENTRY(WriteBehind) sDirtyLink;    // Protected by hfs_write_behind_mutex
+    bool                     bOnDirtyList;  // Protected by hfs_write_behind_mutex
+    uint64_t                 uSyncPass;     // Protected by hfs_write_behind_mutex
+    bool                     bFlushing;     // Protected by hfs_write_behind_mutex, held by the sync
+    bool                     bDying;        // Protected by hfs_write_behind_mutex
+    pthread_cond_t           sIdleCond;     // Signalled when bFlushing is cleared
+    vnode_t                  psVnode;
+    pthread_mutex_t          sLock;
+    void*                    pvBuf;
+    uint64_t                 uOffset;       // File offset of the buffered range
+    uint64_t                 uLength;       // Buffered bytes, 0 when clean
+    uint64_t                 uDurableSize;  // Fork size before the buffered data was written
+    uint64_t                 uFlushGen;     // Bumped whenever buffered data reaches the media
+} WriteBehind_S;
+
+void
+lf_hfs_writebehind_create( vnode_t psVnode )
+{
+    WriteBehind_S* psWB = hfs_mallocz( sizeof(WriteBehind_S) );
+    if ( psWB == NULL )
+    {
+        // Writes simply go to the media directly
+        return;
+    }
+
+    psWB->psVnode = psVnode;
+    lf_lck_mtx_init( &psWB->sLock );
+    lf_cond_init( &psWB->sIdleCond );
+
+    psVnode->psWriteBehind = psWB;
+}
+
+static errno_t
+lf_hfs_writebehind_flush_locked( WriteBehind_S* psWB )
+{
+    uint64_t uActuallyWritten = 0;
+
+    if ( psWB->uLength == 0 )
+    {
+        return 0;
+    }
+
+    errno_t iErr = raw_readwrite_write( psWB->psVnode, psWB->uOffset, psWB->pvBuf, psWB->uLength, &uActuallyWritten );
+    if ( iErr == 0 && uActuallyWritten != psWB->uLength )
+    {
+        iErr = EIO;
+    }
+    if ( iErr != 0 )
+    {
+        // Keep the data, a later flush will retry
+        LFHFS_LOG( LEVEL_ERROR, "lf_hfs_writebehind_flush: raw_readwrite_write failed [%d]\n", iErr );
+        return iErr;
+    }
+
+    // The EOF recorded in the catalog may now move past the durable size
+    if ( psWB->uOffset + psWB->uLength > psWB->uDurableSize )
+    {
+        VTOC(psWB->psVnode)->c_flag |= C_MODIFIED;
+    }
+
+    psWB->uLength = 0;
+    psWB->uFlushGen++;
+
+    // Prefetched data may predate what was just written
+    lf_hfs_readahead_invalidate( psWB->psVnode );
+
+    return 0;
+}
+
+static void
+lf_hfs_writebehind_mark_dirty( WriteBehind_S* psWB )
+{
+    struct hfsmount* hfsmp = VTOHFS(psWB->psVnode);
+
+    lf_lck_mtx_lock( &hfsmp->hfs_write_behind_mutex );
+    if ( !psWB->bOnDirtyList && !psWB->bDying )
+    {
+        TAILQ_INSERT_TAIL( &hfsmp->hfs_write_behind_dirty, psWB, sDirtyLink );
+        psWB->bOnDirtyList = true;
+    }
+    lf_lck_mtx_unlock( &hfsmp->hfs_write_behind_mutex );
+}
+
+/*
+ * Must be called without the vnode locks held, before the cnode of psVnode can be freed,
+ * and only once the buffered data was flushed (hfs_vnop_reclaim keeps the vnode otherwise).
+ */
+void
+lf_hfs_writebehind_destroy( vnode_t psVnode )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+    if ( psWB == NULL )
+    {
+        return;
+    }
+
+    // Wait for a sync still holding this vnode, and make sure it can not queue it again
+    struct hfsmount* hfsmp = VTOHFS(psVnode);
+    lf_lck_mtx_lock( &hfsmp->hfs_write_behind_mutex );
+    psWB->bDying = true;
+    while ( psWB->bFlushing )
+    {
+        pthread_cond_wait( &psWB->sIdleCond, &hfsmp->hfs_write_behind_mutex );
+    }
+    if ( psWB->bOnDirtyList )
+    {
+        TAILQ_REMOVE( &hfsmp->hfs_write_behind_dirty, psWB, sDirtyLink );
+        psWB->bOnDirtyList = false;
+    }
+    lf_lck_mtx_unlock( &hfsmp->hfs_write_behind_mutex );
+
+    hfs_assert( psWB->uLength == 0 );
+
+    psVnode->psWriteBehind = NULL;
+    if ( psWB->pvBuf )
+    {
+        hfs_free( psWB->pvBuf );
+    }
+    lf_cond_destroy( &psWB->sIdleCond );
+    lf_lck_mtx_destroy( &psWB->sLock );
+    hfs_free( psWB );
+}
+
+bool
+lf_hfs_writebehind_enabled( vnode_t psVnode )
+{
+    return ( psVnode->psWriteBehind != NULL && VTOHFS(psVnode)->hfs_write_behind );
+}
+
+/*
+ * Try to buffer a write. Must be called with the cnode lock held, after the blocks
+ * backing [uOffset, uOffset + uLength) have been allocated.
+ * *pbBuffered is false if the caller has to write the data itself; in that case
+ * any previously buffered data has already been flushed.
+ */
+errno_t
+lf_hfs_writebehind_write( vnode_t psVnode, uint64_t uOffset, const void *pvBuf, uint64_t uLength, bool *pbBuffered )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+    bool bEnabled       = lf_hfs_writebehind_enabled( psVnode );
+    errno_t iErr        = 0;
+
+    *pbBuffered = false;
+    if ( psWB == NULL )
+    {
+        return 0;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+
+    bool bBufferable = bEnabled && (uLength <= WRITE_BEHIND_MAX_WRITE);
+    bool bContinues  = (psWB->uLength == 0) || (uOffset == psWB->uOffset + psWB->uLength);
+
+    if ( !bBufferable || !bContinues || (psWB->uLength + uLength > WRITE_BEHIND_BUF_SIZE) )
+    {
+        iErr = lf_hfs_writebehind_flush_locked( psWB );
+        if ( iErr != 0 || !bBufferable )
+        {
+            goto exit;
+        }
+    }
+
+    if ( psWB->pvBuf == NULL )
+    {
+        psWB->pvBuf = hfs_malloc( WRITE_BEHIND_BUF_SIZE );
+        if ( psWB->pvBuf == NULL )
+        {
+            goto exit;
+        }
+    }
+
+    if ( psWB->uLength == 0 )
+    {
+        psWB->uOffset      = uOffset;
+        psWB->uDurableSize = VTOF(psVnode)->ff_size;
+    }
+    memcpy( (uint8_t*)psWB->pvBuf + psWB->uLength, pvBuf, uLength );
+    psWB->uLength += uLength;
+    *pbBuffered = true;
+
+exit:
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    if ( *pbBuffered )
+    {
+        lf_hfs_writebehind_mark_dirty( psWB );
+    }
+
+    return iErr;
+}
+
+/*
+ * Write the buffered data of psVnode. Must be called with the cnode lock held.
+ */
+errno_t
+lf_hfs_writebehind_flush( vnode_t psVnode )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+    errno_t iErr = 0;
+
+    if ( psWB == NULL )
+    {
+        return 0;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+    iErr = lf_hfs_writebehind_flush_locked( psWB );
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    return iErr;
+}
+
+/*
+ * Flush the buffered data of a vnode taken off the mount's dirty list.
+ * *pbSkipped is set if the vnode is being reclaimed; hfs_vnop_reclaim flushes it itself.
+ */
+static errno_t
+lf_hfs_writebehind_flush_vnode( WriteBehind_S* psWB, bool *pbSkipped )
+{
+    vnode_t psVnode = psWB->psVnode;
+    struct cnode* cp = VTOC(psVnode);
+    errno_t iErr = 0;
+
+    *pbSkipped = false;
+
+    // Keep the extents from changing underneath the write, as LFHFS_Write does
+    hfs_lock_truncate( cp, HFS_SHARED_LOCK, HFS_LOCK_DEFAULT );
+    hfs_lock( cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS );
+
+    if ( ISSET(cp->c_hflag, H_TRANSIT) )
+    {
+        *pbSkipped = true;
+        goto exit;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+    iErr = lf_hfs_writebehind_flush_locked( psWB );
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    if ( iErr == 0 )
+    {
+        // Let the catalog EOF cover the data just written
+        iErr = hfs_update( psVnode, 0 );
+    }
+
+exit:
+    hfs_unlock( cp );
+    hfs_unlock_truncate( cp, HFS_LOCK_DEFAULT );
+
+    return iErr;
+}
+
+/*
+ * Flush every vnode of the mount that holds buffered data.
+ * Must be called with the mount's sync_mutex held and no vnode locked.
+ */
+errno_t
+lf_hfs_writebehind_flush_mount( struct hfsmount *hfsmp )
+{
+    errno_t iErr = 0;
+
+    lf_lck_mtx_lock( &hfsmp->hfs_write_behind_mutex );
+    uint64_t uPass = ++hfsmp->hfs_write_behind_sync_pass;
+
+    WriteBehind_S* psWB;
+    while ( (psWB = TAILQ_FIRST(&hfsmp->hfs_write_behind_dirty)) != NULL )
+    {
+        // Entries that failed or were skipped during this pass were requeued at the tail
+        if ( psWB->uSyncPass == uPass )
+        {
+            break;
+        }
+
+        TAILQ_REMOVE( &hfsmp->hfs_write_behind_dirty, psWB, sDirtyLink );
+        psWB->bOnDirtyList = false;
+        psWB->uSyncPass = uPass;
+
+        // Holds off lf_hfs_writebehind_destroy, and with it the reclaim of the vnode
+        psWB->bFlushing = true;
+        lf_lck_mtx_unlock( &hfsmp->hfs_write_behind_mutex );
+
+        bool bSkipped = false;
+        errno_t iFlushErr = lf_hfs_writebehind_flush_vnode( psWB, &bSkipped );
+
+        lf_lck_mtx_lock( &hfsmp->hfs_write_behind_mutex );
+        if ( iFlushErr != 0 )
+        {
+            iErr = iFlushErr;
+        }
+        // Keep data we could not write on the list, unless the vnode is going away
+        if ( (iFlushErr != 0 || bSkipped) && !psWB->bOnDirtyList && !psWB->bDying )
+        {
+            TAILQ_INSERT_TAIL( &hfsmp->hfs_write_behind_dirty, psWB, sDirtyLink );
+            psWB->bOnDirtyList = true;
+        }
+        psWB->bFlushing = false;
+        pthread_cond_broadcast( &psWB->sIdleCond );
+    }
+
+    lf_lck_mtx_unlock( &hfsmp->hfs_write_behind_mutex );
+
+    return iErr;
+}
+
+/*
+ * Size the catalog may record for the fork of psVnode, whose in-memory size is iSize.
+ * Buffered data is not on the media yet, so the EOF stays where it was before it.
+ * Called with the cnode lock held.
+ */
+off_t
+lf_hfs_writebehind_durable_size( vnode_t psVnode, off_t iSize )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+
+    if ( psWB == NULL )
+    {
+        return iSize;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+    if ( psWB->uLength != 0 && (uint64_t)iSize > psWB->uDurableSize )
+    {
+        iSize = (off_t)psWB->uDurableSize;
+    }
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    return iSize;
+}
+
+uint64_t
+lf_hfs_writebehind_generation( vnode_t psVnode )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+    uint64_t uGen = 0;
+
+    if ( psWB == NULL )
+    {
+        return 0;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+    uGen = psWB->uFlushGen;
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    return uGen;
+}
+
+/*
+ * Copy buffered data over [uOffset, uOffset + uLength) of a buffer just read from the media.
+ * Returns false if buffered data was flushed since uGen was sampled, in which case the
+ * media read may have missed it and must be redone.
+ */
+bool
+lf_hfs_writebehind_overlay( vnode_t psVnode, uint64_t uOffset, void *pvBuf, uint64_t uLength, uint64_t uGen )
+{
+    WriteBehind_S* psWB = psVnode->psWriteBehind;
+    bool bValid = true;
+
+    if ( psWB == NULL )
+    {
+        return true;
+    }
+
+    lf_lck_mtx_lock( &psWB->sLock );
+    if ( psWB->uFlushGen != uGen )
+    {
+        bValid = false;
+    }
+    else if ( psWB->uLength != 0 )
+    {
+        uint64_t uStart = MAX( uOffset, psWB->uOffset );
+        uint64_t uEnd   = MIN( uOffset + uLength, psWB->uOffset + psWB->uLength );
+        if ( uStart < uEnd )
+        {
+            memcpy( (uint8_t*)pvBuf + (uStart - uOffset), (uint8_t*)psWB->pvBuf + (uStart - psWB->uOffset), uEnd - uStart );
+        }
+    }
+    lf_lck_mtx_unlock( &psWB->sLock );
+
+    return bValid;
+}
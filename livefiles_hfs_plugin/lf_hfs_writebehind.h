@@ -0,0 +1,28 @@
+/*  Copyright © 2017-2018 Apple Inc. All rights reserved.
+ *
+ *  lf_hfs_writebehind.h
+ *  livefiles_hfs
+ *
+ */
+
+#ifndef lf_hfs_writebehind_h
+#define lf_hfs_writebehind_h
+
+#include "lf_hfs_vnode.h"
+
+#define WRITE_BEHIND_BUF_SIZE       (1024*1024)             // Flush threshold of a vnode
+#define WRITE_BEHIND_MAX_WRITE      (WRITE_BEHIND_BUF_SIZE/4) // Larger writes go directly to the media
+
+void    lf_hfs_writebehind_create( vnode_t psVnode );
+void    lf_hfs_writebehind_destroy( vnode_t psVnode );
+
+bool    lf_hfs_writebehind_enabled( vnode_t psVnode );
+errno_t lf_hfs_writebehind_write( vnode_t psVnode, uint64_t uOffset, const void *pvBuf, uint64_t uLength, bool *pbBuffered );
+errno_t lf_hfs_writebehind_flush( vnode_t psVnode );
+errno_t lf_hfs_writebehind_flush_mount( struct hfsmount *hfsmp );
+off_t   lf_hfs_writebehind_durable_size( vnode_t psVnode, off_t iSize );
+
+uint64_t lf_hfs_writebehind_generation( vnode_t psVnode );
+bool    lf_hfs_writebehind_overlay( vnode_t psVnode, uint64_t uOffset, void *pvBuf, uint64_t uLength, uint64_t uGen );
+
+#endif /* lf_hfs_writebehind_h */
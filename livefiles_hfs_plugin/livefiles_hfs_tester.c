@@ -19,6 +19,11 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_unicode_wrappers.h"
+#include "lf_hfs_btrees_private.h"
+#include "lf_hfs_catalog.h"
+#include "lf_hfs_file_extent_mapping.h"
+#include "lf_hfs_xattr.h"
 
 #define DEFAULT_SYNCER_PERIOD     100 // mS
 #define MAX_UTF8_NAME_LENGTH (NAME_MAX*3+1)
@@ -210,13 +215,32 @@ unistr255ToLowerCase( struct unistr255* psUnistr255 )
 }
 
 void HFSTest_PrintCacheStats(void) {
-    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, max_gen_buf_uncached %u, gen_buf_uncached %u.\n",
-           gCacheStat.buf_cache_size,
-           gCacheStat.max_buf_cache_size,
-           gCacheStat.buf_cache_cleanup,
-           gCacheStat.buf_cache_remove,
-           gCacheStat.max_gen_buf_uncached,
-           gCacheStat.gen_buf_uncached);
+    CacheStats_S sCacheStat;
+    lf_hfs_generic_buf_cache_get_stats(&sCacheStat);
+    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, max_gen_buf_uncached %u, gen_buf_uncached %u, hit %llu, miss %llu, ghost_hit %llu, budget %llu.\n",
+           sCacheStat.buf_cache_size,
+           sCacheStat.max_buf_cache_size,
+           sCacheStat.buf_cache_cleanup,
+           sCacheStat.buf_cache_remove,
+           sCacheStat.max_gen_buf_uncached,
+           sCacheStat.gen_buf_uncached,
+           sCacheStat.buf_cache_hit,
+           sCacheStat.buf_cache_miss,
+           sCacheStat.buf_cache_ghost_hit,
+           sCacheStat.buf_cache_budget);
+
+    static const char *ppcZoneNames[HFS_NUM_ZONES] = { "cnode", "vnode", "filefork", "dirhint", "genbuf" };
+    ZoneStats_S psZoneStats[HFS_NUM_ZONES];
+    hfs_zone_get_stats(psZoneStats);
+    for (uint32_t uZone = 0; uZone < HFS_NUM_ZONES; uZone++) {
+        printf("Zone %s: elem_size %llu, in_use %llu, max_in_use %llu, allocs %llu, slabs %llu.\n",
+               ppcZoneNames[uZone],
+               psZoneStats[uZone].uElemSize,
+               psZoneStats[uZone].uInUse,
+               psZoneStats[uZone].uMaxInUse,
+               psZoneStats[uZone].uAllocs,
+               psZoneStats[uZone].uSlabs);
+    }
 }
 
 __unused static long long int timestamp()
@@ -3654,6 +3678,97 @@ HFSTest_RandomIO( UVFSFileNode RootNode )
     return 0;
 }
 
+static int
+HFSTest_WriteBehind( UVFSFileNode RootNode )
+{
+#define WB_FILENAME     "WriteBehindFile"
+#define WB_CHUNK_SIZE   (3000)                      // Small enough to be buffered
+#define WB_NUM_CHUNKS   (500)                       // Crosses the flush threshold
+#define WB_FILE_SIZE    (WB_CHUNK_SIZE * WB_NUM_CHUNKS)
+#define WB_TRUNC_SIZE   (WB_FILE_SIZE / 3 + 7)
+
+    int iErr                = 0;
+    UVFSFileNode psFile     = NULL;
+    size_t iActuallyWrite   = 0;
+    size_t iActuallyRead    = 0;
+    size_t uRetLen          = 0;
+    UVFSFSAttributeValue sAttrVal;
+    UVFSFSAttributeValue sOutAttrVal;
+    UVFSFileAttributes sFileAttrs;
+    uint8_t* puOutBuf       = malloc(WB_FILE_SIZE);
+    uint8_t* puInBuf        = malloc(WB_FILE_SIZE);
+    assert( puOutBuf != NULL && puInBuf != NULL );
+
+    for ( uint64_t uIdx=0; uIdx<WB_FILE_SIZE; uIdx++ )
+    {
+        puOutBuf[uIdx] = (uint8_t) rand();
+    }
+
+    memset( &sAttrVal, 0, sizeof(sAttrVal) );
+    sAttrVal.fsa_number = 1;
+    assert( HFS_fsOps.fsops_setfsattr( RootNode, LFHFS_FSATTR_WRITE_BEHIND, &sAttrVal, sizeof(sAttrVal), &sOutAttrVal, sizeof(sOutAttrVal) ) == 0 );
+    assert( HFS_fsOps.fsops_getfsattr( RootNode, LFHFS_FSATTR_WRITE_BEHIND, &sOutAttrVal, sizeof(sOutAttrVal), &uRetLen ) == 0 );
+    assert( sOutAttrVal.fsa_number == 1 );
+
+    assert( CreateNewFile( RootNode, &psFile, WB_FILENAME, 0 ) == 0 );
+
+    // Small sequential writes, each one read back through the write-behind buffer
+    for ( uint64_t uChunk=0; uChunk<WB_NUM_CHUNKS; uChunk++ )
+    {
+        uint64_t uOffset = uChunk * WB_CHUNK_SIZE;
+        assert( HFS_fsOps.fsops_write( psFile, uOffset, WB_CHUNK_SIZE, puOutBuf + uOffset, &iActuallyWrite ) == 0 );
+        assert( iActuallyWrite == WB_CHUNK_SIZE );
+
+        memset( puInBuf, 0, WB_CHUNK_SIZE );
+        assert( HFS_fsOps.fsops_read( psFile, uOffset, WB_CHUNK_SIZE, puInBuf, &iActuallyRead ) == 0 );
+        assert( iActuallyRead == WB_CHUNK_SIZE );
+        assert( memcmp( puInBuf, puOutBuf + uOffset, WB_CHUNK_SIZE ) == 0 );
+    }
+
+    assert( HFS_fsOps.fsops_getattr( psFile, &sFileAttrs ) == 0 );
+    assert( sFileAttrs.fa_size == WB_FILE_SIZE );
+
+    // After a sync the data comes from the media
+    assert( HFS_fsOps.fsops_sync( RootNode ) == 0 );
+    memset( puInBuf, 0, WB_FILE_SIZE );
+    assert( HFS_fsOps.fsops_read( psFile, 0, WB_FILE_SIZE, puInBuf, &iActuallyRead ) == 0 );
+    assert( iActuallyRead == WB_FILE_SIZE );
+    assert( memcmp( puInBuf, puOutBuf, WB_FILE_SIZE ) == 0 );
+
+    // Overwrite a range that is still buffered when the file is truncated into it
+    uint64_t uOverwrite = WB_TRUNC_SIZE - WB_CHUNK_SIZE / 2;
+    memset( puOutBuf + uOverwrite, 0xAB, WB_CHUNK_SIZE );
+    assert( HFS_fsOps.fsops_write( psFile, uOverwrite, WB_CHUNK_SIZE, puOutBuf + uOverwrite, &iActuallyWrite ) == 0 );
+    assert( SetAttrChangeSize( psFile, WB_TRUNC_SIZE ) == 0 );
+
+    memset( puInBuf, 0, WB_FILE_SIZE );
+    assert( HFS_fsOps.fsops_read( psFile, 0, WB_FILE_SIZE, puInBuf, &iActuallyRead ) == 0 );
+    assert( iActuallyRead == WB_TRUNC_SIZE );
+    assert( memcmp( puInBuf, puOutBuf, WB_TRUNC_SIZE ) == 0 );
+
+    // Buffered appends must survive reclaiming the file
+    assert( HFS_fsOps.fsops_write( psFile, WB_TRUNC_SIZE, WB_CHUNK_SIZE, puOutBuf + WB_TRUNC_SIZE, &iActuallyWrite ) == 0 );
+    HFS_fsOps.fsops_reclaim( psFile, 0 );
+    psFile = NULL;
+
+    assert( HFS_fsOps.fsops_lookup( RootNode, WB_FILENAME, &psFile ) == 0 );
+    memset( puInBuf, 0, WB_FILE_SIZE );
+    assert( HFS_fsOps.fsops_read( psFile, 0, WB_FILE_SIZE, puInBuf, &iActuallyRead ) == 0 );
+    assert( iActuallyRead == WB_TRUNC_SIZE + WB_CHUNK_SIZE );
+    assert( memcmp( puInBuf, puOutBuf, WB_TRUNC_SIZE + WB_CHUNK_SIZE ) == 0 );
+    HFS_fsOps.fsops_reclaim( psFile, 0 );
+
+    assert( RemoveFile( RootNode, WB_FILENAME ) == 0 );
+
+    sAttrVal.fsa_number = 0;
+    assert( HFS_fsOps.fsops_setfsattr( RootNode, LFHFS_FSATTR_WRITE_BEHIND, &sAttrVal, sizeof(sAttrVal), &sOutAttrVal, sizeof(sOutAttrVal) ) == 0 );
+
+    free(puInBuf);
+    free(puOutBuf);
+
+    return iErr;
+}
+
 static int
 HFSTest_HardLink( UVFSFileNode RootNode )
 {
@@ -3873,6 +3988,428 @@ HFSTest_JustMount( __unused UVFSFileNode RootNode )
     return 0;
 }
 
+static int32_t
+UnicodeBinaryCompareRef( const uint16_t* puStr1, ItemCount uLen1, const uint16_t* puStr2, ItemCount uLen2 )
+{
+    for ( ItemCount uIdx = 0; uIdx < uLen1 && uIdx < uLen2; uIdx++ )
+    {
+        if ( puStr1[uIdx] != puStr2[uIdx] )
+            return (puStr1[uIdx] < puStr2[uIdx]) ? -1 : 1;
+    }
+    return (uLen1 < uLen2) ? -1 : (uLen1 > uLen2) ? 1 : 0;
+}
+
+static bool
+HFSTest_UnicodeCompareOne( const uint16_t* puStr1, ItemCount uLen1, const uint16_t* puStr2, ItemCount uLen2 )
+{
+    return ( FastUnicodeCompare( puStr1, uLen1, puStr2, uLen2 )   == FastUnicodeCompareTable( puStr1, uLen1, puStr2, uLen2 ) &&
+             FastUnicodeCompare( puStr2, uLen2, puStr1, uLen1 )   == FastUnicodeCompareTable( puStr2, uLen2, puStr1, uLen1 ) &&
+             UnicodeBinaryCompare( puStr1, uLen1, puStr2, uLen2 ) == UnicodeBinaryCompareRef( puStr1, uLen1, puStr2, uLen2 ) );
+}
+
+/*
+ * FastUnicodeCompare skips common prefixes a vector at a time; check it against the
+ * plain table walk.  Every code unit is tried against its neighbours, its ASCII case
+ * partner and a set of special units, at each position around the 8 unit blocks.
+ */
+static int
+HFSTest_UnicodeCompare( __unused UVFSFileNode RootNode )
+{
+    static const uint16_t puSpecial[] = {
+        0x0000, 0x0001, 0x0040, 0x0041, 0x005A, 0x005B, 0x0060, 0x0061, 0x007A, 0x007B, 0x007F,
+        0x0080, 0x00C0, 0x00C6, 0x00E0, 0x00E6, 0x00FF, 0x0100, 0x0101, 0x0391, 0x03B1,
+        0x200B, 0x200C, 0x200D, 0xFEFF, 0x7FFF, 0x8000, 0x8041, 0xFFFF,
+    };
+    const uint32_t uSpecial = sizeof(puSpecial) / sizeof(puSpecial[0]);
+    const uint32_t uLen = 24;
+    uint16_t puStr1[32], puStr2[32];
+    uint64_t uMismatches = 0;
+
+    printf("HFSTest_UnicodeCompare\n");
+
+    for ( uint32_t uUnit = 0; uUnit <= 0xFFFF; uUnit++ )
+    {
+        for ( uint32_t uPos = 0; uPos < uLen; uPos++ )
+        {
+            if ( uPos % 8 != 0 && uPos % 8 != 7 )
+                continue;
+
+            for ( uint32_t uOther = 0; uOther < uSpecial + 3; uOther++ )
+            {
+                // Same name in both, one of them upper cased
+                for ( uint32_t uIdx = 0; uIdx < uLen; uIdx++ )
+                {
+                    puStr1[uIdx] = 'a' + (uIdx % 26);
+                    puStr2[uIdx] = (uIdx & 1) ? ('A' + (uIdx % 26)) : ('a' + (uIdx % 26));
+                }
+
+                puStr1[uPos] = uUnit;
+                if ( uOther < uSpecial )
+                    puStr2[uPos] = puSpecial[uOther];
+                else if ( uOther == uSpecial )
+                    puStr2[uPos] = uUnit ^ 0x20;
+                else if ( uOther == uSpecial + 1 )
+                    puStr2[uPos] = uUnit + 1;
+                else
+                    puStr2[uPos] = uUnit - 1;
+
+                if ( !HFSTest_UnicodeCompareOne( puStr1, uLen, puStr2, uLen ) ||
+                     !HFSTest_UnicodeCompareOne( puStr1, uPos + 1, puStr2, uLen ) )
+                {
+                    if ( uMismatches++ < 10 )
+                        printf( "HFSTest_UnicodeCompare: mismatch for unit 0x%04x at %u\n", uUnit, uPos );
+                }
+            }
+        }
+    }
+
+    // Random names over an alphabet that mixes case pairs, Latin-1, ignorables and NUL
+    srandom(0);
+    for ( uint32_t uIter = 0; uIter < 2000000; uIter++ )
+    {
+        ItemCount uLen1 = random() % 32;
+        ItemCount uLen2 = random() % 32;
+
+        for ( ItemCount uIdx = 0; uIdx < uLen1; uIdx++ )
+            puStr1[uIdx] = puSpecial[random() % uSpecial];
+        for ( ItemCount uIdx = 0; uIdx < uLen2; uIdx++ )
+        {
+            if ( uIdx < uLen1 && (random() % 8) != 0 )
+                puStr2[uIdx] = ((random() & 1) && (puStr1[uIdx] | 0x20) >= 'a' && (puStr1[uIdx] | 0x20) <= 'z') ? (puStr1[uIdx] ^ 0x20) : puStr1[uIdx];
+            else
+                puStr2[uIdx] = puSpecial[random() % uSpecial];
+        }
+
+        if ( !HFSTest_UnicodeCompareOne( puStr1, uLen1, puStr2, uLen2 ) && uMismatches++ < 10 )
+            printf( "HFSTest_UnicodeCompare: mismatch on random names (iteration %u)\n", uIter );
+    }
+
+    printf( "HFSTest_UnicodeCompare: %llu mismatches\n", uMismatches );
+    return (uMismatches == 0) ? 0 : EINVAL;
+}
+
+/*
+ * BTSearchRecord benchmark on synthetic B-trees held in memory.  Each tree is
+ * searched once with SearchNode's inlined comparison and once through a wrapper
+ * compare proc, which SearchNode doesn't recognize and so calls for every probe
+ * like it used to.  Both runs must find the same records.
+ */
+typedef enum {
+    BTBENCH_CATALOG,
+    BTBENCH_CATALOG_BINARY,
+    BTBENCH_EXTENTS,
+    BTBENCH_ATTRIBUTES,
+} BTBenchKind_e;
+
+typedef struct BTBenchTree
+{
+    struct vnode        sVnode;         // Must be first, the block procs get the vnode
+    struct cnode        sCnode;
+    struct filefork     sFork;
+    BTreeControlBlock   sBTCB;
+    uint8_t*            puNodes;
+} BTBenchTree_S;
+
+#define BTBENCH_RECORDS     (200000)
+#define BTBENCH_SEARCHES    (4096)
+#define BTBENCH_ROUNDS      (250)
+
+static KeyCompareProcPtr gpfBTBenchCompare;
+
+static int32_t
+BTBench_GenericCompare( void* pvSearchKey, void* pvTrialKey )
+{
+    return gpfBTBenchCompare( pvSearchKey, pvTrialKey );
+}
+
+static OSStatus
+BTBench_GetBlock( FileReference vp, uint64_t blockNum, __unused GetBlockOptions options, BlockDescriptor* psBlock )
+{
+    BTBenchTree_S* psTree = (BTBenchTree_S*) vp;
+
+    psBlock->buffer            = psTree->puNodes + blockNum * psTree->sBTCB.nodeSize;
+    psBlock->blockHeader       = NULL;
+    psBlock->blockNum          = blockNum;
+    psBlock->blockReadFromDisk = false;
+    psBlock->isModified        = 0;
+    return 0;
+}
+
+static OSStatus
+BTBench_ReleaseBlock( __unused FileReference vp, __unused BlockDescPtr psBlock, __unused ReleaseBlockOptions options )
+{
+    return 0;
+}
+
+static u_int16_t
+BTBench_SetName( u_int16_t* puName, const char* pcName )
+{
+    u_int16_t uLen = strlen(pcName);
+    for ( u_int16_t uIdx = 0; uIdx < uLen; uIdx++ )
+        puName[uIdx] = pcName[uIdx];
+    return uLen;
+}
+
+// Keys come out in B-tree order for increasing uRec
+static void
+BTBench_MakeKey( BTBenchKind_e eKind, uint32_t uRec, BTreeKey* psKey )
+{
+    char pcName[64];
+
+    switch ( eKind )
+    {
+        case BTBENCH_CATALOG:
+        case BTBENCH_CATALOG_BINARY:
+        {
+            HFSPlusCatalogKey* psCatKey = (HFSPlusCatalogKey*) psKey;
+            psCatKey->parentID = kHFSFirstUserCatalogNodeID + uRec / 64;
+            snprintf( pcName, sizeof(pcName), "Document_%06u.txt", uRec % 64 );
+            psCatKey->nodeName.length = BTBench_SetName( psCatKey->nodeName.unicode, pcName );
+            psCatKey->keyLength = kHFSPlusCatalogKeyMinimumLength + psCatKey->nodeName.length * sizeof(UniChar);
+            break;
+        }
+        case BTBENCH_EXTENTS:
+        {
+            HFSPlusExtentKey* psExtKey = (HFSPlusExtentKey*) psKey;
+            psExtKey->keyLength  = kHFSPlusExtentKeyMaximumLength;
+            psExtKey->fileID     = kHFSFirstUserCatalogNodeID + uRec / 4;
+            psExtKey->forkType   = (uRec & 2) ? 0xFF : 0;
+            psExtKey->pad        = 0;
+            psExtKey->startBlock = (uRec & 1) * 4096;
+            break;
+        }
+        case BTBENCH_ATTRIBUTES:
+        {
+            HFSPlusAttrKey* psAttrKey = (HFSPlusAttrKey*) psKey;
+            psAttrKey->pad        = 0;
+            psAttrKey->fileID     = kHFSFirstUserCatalogNodeID + uRec / 8;
+            psAttrKey->startBlock = 0;
+            snprintf( pcName, sizeof(pcName), "com.apple.bench.%02u", uRec % 8 );
+            psAttrKey->attrNameLen = BTBench_SetName( psAttrKey->attrName, pcName );
+            psAttrKey->keyLength = kHFSPlusAttrKeyMinimumLength + psAttrKey->attrNameLen * sizeof(UniChar);
+            break;
+        }
+    }
+}
+
+static int
+BTBench_Build( BTBenchKind_e eKind, BTBenchTree_S* psTree )
+{
+    BTreeControlBlock* psBTCB = &psTree->sBTCB;
+    BTreeIterator*     psIterator = &psBTCB->iterator;
+    uint8_t            puRecord[64] = {0};
+    uint16_t           uRecordSize;
+
+    memset( psTree, 0, sizeof(*psTree) );
+    psTree->sVnode.sFSParams.vnfs_fsnode = &psTree->sCnode;
+    psTree->sCnode.c_lockowner = pthread_self();
+    psTree->sFork.fcbBTCBPtr = (void*) psBTCB;
+
+    psBTCB->fileRefNum       = &psTree->sVnode;
+    psBTCB->getBlockProc     = BTBench_GetBlock;
+    psBTCB->releaseBlockProc = BTBench_ReleaseBlock;
+    psBTCB->attributes       = kBTBigKeysMask | kBTVariableIndexKeysMask;
+
+    switch ( eKind )
+    {
+        case BTBENCH_CATALOG:
+        case BTBENCH_CATALOG_BINARY:
+            psTree->sCnode.c_fileid = kHFSCatalogFileID;
+            psBTCB->keyCompareProc  = (eKind == BTBENCH_CATALOG) ? (KeyCompareProcPtr) CompareExtendedCatalogKeys : (KeyCompareProcPtr) cat_binarykeycompare;
+            psBTCB->nodeSize        = 8192;
+            psBTCB->maxKeyLength    = kHFSPlusCatalogKeyMaximumLength;
+            uRecordSize             = 32;
+            break;
+        case BTBENCH_EXTENTS:
+            psTree->sCnode.c_fileid = kHFSExtentsFileID;
+            psBTCB->keyCompareProc  = (KeyCompareProcPtr) CompareExtentKeysPlus;
+            psBTCB->nodeSize        = 4096;
+            psBTCB->maxKeyLength    = kHFSPlusExtentKeyMaximumLength;
+            psBTCB->attributes      = kBTBigKeysMask;
+            uRecordSize             = sizeof(HFSPlusExtentRecord);
+            break;
+        case BTBENCH_ATTRIBUTES:
+        default:
+            psTree->sCnode.c_fileid = kHFSAttributesFileID;
+            psBTCB->keyCompareProc  = (KeyCompareProcPtr) hfs_attrkeycompare;
+            psBTCB->nodeSize        = 8192;
+            psBTCB->maxKeyLength    = kHFSPlusAttrKeyMaximumLength;
+            uRecordSize             = 32;
+            break;
+    }
+
+    // Plenty for the leaves and the index nodes; node 0 stands in for the header node
+    uint32_t uMaxNodes = 2 + 2 * BTBENCH_RECORDS / ((psBTCB->nodeSize - sizeof(BTNodeDescriptor)) / (uRecordSize + 64));
+    psTree->puNodes = calloc( uMaxNodes, psBTCB->nodeSize );
+    uint32_t* puFirstRec = malloc( uMaxNodes * sizeof(uint32_t) );
+    uint32_t* puChild    = malloc( uMaxNodes * sizeof(uint32_t) );
+    if ( psTree->puNodes == NULL || puFirstRec == NULL || puChild == NULL )
+    {
+        free( puFirstRec );
+        free( puChild );
+        free( psTree->puNodes );
+        return ENOMEM;
+    }
+
+    uint32_t uNextNode = 1;
+    uint32_t uItems = BTBENCH_RECORDS;
+    int16_t  iHeight = 1;
+
+    // Fill the leaves in key order, then the index levels above them, until a single root is left
+    while ( true )
+    {
+        NodeDescPtr psNode = NULL;
+        uint32_t uNodes = 0;
+
+        // The level below is consumed as this one is built, so the arrays are reused in place
+        for ( uint32_t uItem = 0; uItem < uItems; uItem++ )
+        {
+            uint32_t  uRec   = (iHeight == 1) ? uItem : puFirstRec[uItem];
+            uint32_t  uChild = (iHeight == 1) ? 0 : puChild[uItem];
+            RecordPtr pvRec  = (iHeight == 1) ? puRecord : (RecordPtr) &uChild;
+            uint16_t  uSize  = (iHeight == 1) ? uRecordSize : sizeof(uint32_t);
+            BTBench_MakeKey( eKind, uRec, &psIterator->key );
+
+            if ( psNode != NULL && InsertKeyRecord( psBTCB, psNode, psNode->numRecords, &psIterator->key, psIterator->key.length16, pvRec, uSize ) )
+                continue;
+
+            // Start a new node at this level
+            assert( uNextNode < uMaxNodes );
+            psNode = (NodeDescPtr) (psTree->puNodes + uNextNode * psBTCB->nodeSize);
+            ClearNode( psBTCB, psNode );
+            *(u_int16_t*) ((uint8_t*) psNode + psBTCB->nodeSize - kOffsetSize) = sizeof(BTNodeDescriptor);
+            psNode->kind   = (iHeight == 1) ? kBTLeafNode : kBTIndexNode;
+            psNode->height = iHeight;
+
+            Boolean bFits = InsertKeyRecord( psBTCB, psNode, 0, &psIterator->key, psIterator->key.length16, pvRec, uSize );
+            assert( bFits );
+
+            puFirstRec[uNodes] = uRec;
+            puChild[uNodes] = uNextNode++;
+            uNodes++;
+        }
+
+        if ( uNodes == 1 )
+            break;
+
+        uItems = uNodes;
+        iHeight++;
+    }
+
+    psBTCB->rootNode   = puChild[0];
+    psBTCB->treeDepth  = iHeight;
+    psBTCB->totalNodes = uNextNode;
+    psBTCB->leafRecords = BTBENCH_RECORDS;
+
+    free( puFirstRec );
+    free( puChild );
+    return 0;
+}
+
+static uint64_t
+BTBench_Search( FCB* psFork, BTreeIterator* psSearch, BTreeIterator* psResult, uint32_t* puFound )
+{
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
+    *puFound = 0;
+    uint64_t uStart = mach_absolute_time();
+    for ( uint32_t uRound = 0; uRound < BTBENCH_ROUNDS; uRound++ )
+    {
+        for ( uint32_t uIdx = 0; uIdx < BTBENCH_SEARCHES; uIdx++ )
+        {
+            if ( BTSearchRecord( psFork, &psSearch[uIdx], NULL, NULL, &psResult[uIdx] ) == noErr )
+                (*puFound)++;
+        }
+    }
+    uint64_t uElapsed = mach_absolute_time() - uStart;
+
+    return uElapsed * sTimebaseInfo.numer / sTimebaseInfo.denom;
+}
+
+static int
+HFSTest_BTSearchBench( __unused UVFSFileNode RootNode )
+{
+    static const char* ppcKindName[] = { "catalog", "catalog (binary)", "extents", "attributes" };
+    int iErr = 0;
+
+    printf("HFSTest_BTSearchBench\n");
+
+    BTBenchTree_S* psTree = malloc( sizeof(BTBenchTree_S) );
+    BTreeIterator* psSearch = malloc( BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+    BTreeIterator* psResult = malloc( BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+    BTreeIterator* psGenericResult = malloc( BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+    if ( psTree == NULL || psSearch == NULL || psResult == NULL || psGenericResult == NULL )
+    {
+        iErr = ENOMEM;
+        goto exit;
+    }
+
+    for ( BTBenchKind_e eKind = BTBENCH_CATALOG; eKind <= BTBENCH_ATTRIBUTES; eKind++ )
+    {
+        iErr = BTBench_Build( eKind, psTree );
+        if ( iErr )
+            goto exit;
+
+        // Mostly existing records, every 8th search key falls between two of them
+        srandom(0);
+        memset( psSearch, 0, BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+        for ( uint32_t uIdx = 0; uIdx < BTBENCH_SEARCHES; uIdx++ )
+        {
+            BTBench_MakeKey( eKind, random() % BTBENCH_RECORDS, &psSearch[uIdx].key );
+            if ( uIdx % 8 == 0 )
+            {
+                if ( eKind == BTBENCH_EXTENTS )
+                    ((HFSPlusExtentKey*) &psSearch[uIdx].key)->startBlock++;
+                else if ( eKind == BTBENCH_ATTRIBUTES )
+                    ((HFSPlusAttrKey*) &psSearch[uIdx].key)->startBlock++;
+                else
+                    ((HFSPlusCatalogKey*) &psSearch[uIdx].key)->nodeName.unicode[0] = 'E';
+            }
+        }
+
+        memset( psResult, 0, BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+        memset( psGenericResult, 0, BTBENCH_SEARCHES * sizeof(BTreeIterator) );
+
+        uint32_t uFound, uGenericFound;
+        uint64_t uNanos = BTBench_Search( &psTree->sFork, psSearch, psResult, &uFound );
+
+        gpfBTBenchCompare = psTree->sBTCB.keyCompareProc;
+        psTree->sBTCB.keyCompareProc = BTBench_GenericCompare;
+        uint64_t uGenericNanos = BTBench_Search( &psTree->sFork, psSearch, psGenericResult, &uGenericFound );
+
+        printf( "HFSTest_BTSearchBench: %-16s depth %u, %u nodes: inlined %llu ns, generic %llu ns per search\n",
+                ppcKindName[eKind], psTree->sBTCB.treeDepth, psTree->sBTCB.totalNodes,
+                uNanos / (BTBENCH_ROUNDS * BTBENCH_SEARCHES), uGenericNanos / (BTBENCH_ROUNDS * BTBENCH_SEARCHES) );
+
+        if ( uFound != uGenericFound || uFound != (BTBENCH_SEARCHES - BTBENCH_SEARCHES / 8) * BTBENCH_ROUNDS )
+        {
+            printf( "HFSTest_BTSearchBench: %s found %u records inlined, %u generic\n", ppcKindName[eKind], uFound, uGenericFound );
+            iErr = EINVAL;
+        }
+        for ( uint32_t uIdx = 0; uIdx < BTBENCH_SEARCHES && !iErr; uIdx++ )
+        {
+            if ( psResult[uIdx].hint.nodeNum != psGenericResult[uIdx].hint.nodeNum ||
+                 psResult[uIdx].hint.index != psGenericResult[uIdx].hint.index )
+            {
+                printf( "HFSTest_BTSearchBench: %s search %u found different records\n", ppcKindName[eKind], uIdx );
+                iErr = EINVAL;
+            }
+        }
+
+        free( psTree->puNodes );
+        if ( iErr )
+            goto exit;
+    }
+
+exit:
+    free( psGenericResult );
+    free( psResult );
+    free( psSearch );
+    free( psTree );
+    return iErr;
+}
+
 static int HFSTest_OpenJournal( __unused UVFSFileNode RootNode ) {
     
     printf("HFSTest_OpenJournal:\n");
@@ -4236,6 +4773,7 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_Rename",                  "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Rename ),
     ADD_TEST( "HFSTest_WriteRead",               "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_WriteRead ),
     ADD_TEST( "HFSTest_RandomIO",                "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_RandomIO ),
+    ADD_TEST( "HFSTest_WriteBehind",             "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_WriteBehind ),
     ADD_TEST( "HFSTest_Create1000Files",         "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Create1000Files ),
     ADD_TEST( "HFSTest_HardLink",                "/Volumes/SSD_Shared/FS_DMGs/HFSHardLink.dmg",      &HFSTest_HardLink ),
     ADD_TEST( "HFSTest_CreateHardLink",          "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_CreateHardLink ),
@@ -4247,6 +4785,8 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_MultiThreadedRW",         CREATE_HFS_DMG,                                     &HFSTest_MultiThreadedRW_wJournal ),
     ADD_TEST_NO_SYNC( "HFSTest_ValidateUnmount", "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_ValidateUnmount ),
     ADD_TEST( "HFSTest_ScanID",                  "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_ScanID ),
+    ADD_TEST( "HFSTest_UnicodeCompare",          "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_UnicodeCompare ),
+    ADD_TEST( "HFSTest_BTSearchBench",           "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_BTSearchBench ),
 #endif
 #if 1 // Enbale journal-tests
     ADD_TEST( "HFSTest_OpenJournal",                 "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_OpenJournal ),
@@ -4267,6 +4807,7 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_Rename_wJournal",             "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_Rename ),
     ADD_TEST( "HFSTest_WriteRead_wJournal",          "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_WriteRead ),
     ADD_TEST( "HFSTest_RandomIO_wJournal",           "/Volumes/SSD_Shared/FS_DMGs/HFSJ-144MB.dmg",           &HFSTest_RandomIO ),
+    ADD_TEST( "HFSTest_WriteBehind_wJournal",        "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_WriteBehind ),
     ADD_TEST( "HFSTest_Create1000Files_wJournal",    "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_Create1000Files ),
     ADD_TEST( "HFSTest_HardLink_wJournal",           "/Volumes/SSD_Shared/FS_DMGs/HFSJ-HardLink.dmg",        &HFSTest_HardLink ),
     ADD_TEST( "HFSTest_CreateHardLink_wJournal",     "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_CreateHardLink ),